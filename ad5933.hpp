@@ -1,5 +1,7 @@
 /*! \file */
 #pragma once
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -7,16 +9,55 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <libusb-1.0/libusb.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <complex>
 #include <bitset>
 #include <vector>
 #include <iostream>
+#include <functional>
 #include <unordered_map>
 #include <sstream>
 
+#include "csv_writer.hpp"
+#include "trace.hpp"
+
+//! Stream for the progress messages of the library, NULL to silence them.
+inline FILE *log_stream = stdout;
+//! Stream for the error messages of the library, NULL to silence them.
+inline FILE *error_stream = stderr;
+
+//! printf() to log_stream.
+inline void log_message(const char *format, ...) __attribute__((format(printf, 1, 2)));
+inline void log_message(const char *format, ...)
+{
+  if (log_stream)
+    {
+      va_list args;
+      va_start(args, format);
+      vfprintf(log_stream, format, args);
+      va_end(args);
+    }
+}
+
+//! printf() to error_stream.
+inline void log_error(const char *format, ...) __attribute__((format(printf, 1, 2)));
+inline void log_error(const char *format, ...)
+{
+  if (error_stream)
+    {
+      va_list args;
+      va_start(args, format);
+      vfprintf(error_stream, format, args);
+      va_end(args);
+    }
+}
+
 //The  VID and PID of the EVAL board.
 //Those are saved in the EEPROM in the FX2LP chip
 
@@ -25,6 +66,11 @@ const uint16_t VID = 0x0456;
 //! USB Product ID
 const uint16_t PID = 0xb203; 
 
+//! Default location of the FX2LP firmware, relative to the working directory.
+const char *const DEFAULT_FIRMWARE = "./AD5933_34FW.hex";
+//! Frequency of the internal clock of the AD5933 in Hz.
+const long double INTERNAL_CLOCK = 16776000l;
+
 //Register List
 //As defined in the datasheet (Table 8). All bits are addressable but not
 //meaningfull.
@@ -57,6 +103,8 @@ const uint8_t INC_NUM_LSB=0x89;
 const uint8_t SETTLE_MSB=0x8A;
 //!Address of the Number of settling time cycles bits 07-00
 const uint8_t SETTLE_LSB=0x8B;
+//! Number of registers from CTRL_MSB to SETTLE_LSB, those AD5933::shadow keeps.
+const uint8_t SHADOW_SIZE=SETTLE_LSB-CTRL_MSB+1;
 
 //!Address of the Status register
 const uint8_t SREG=0x8F;
@@ -127,7 +175,7 @@ const uint8_t SB_MODE=0xb0;
 /** \brief Because class enums can't be typecast to ints, a map is provided so
     that the enums can be matched with the corresponding byte value.
  */
-std::unordered_map<uint8_t,Mode> mode_map =
+inline std::unordered_map<uint8_t,Mode> mode_map =
   {
     {INIT_START_FREQ,Mode::INIT_START_FREQ},
     {START_FREQ_SWEEP,Mode::START_FREQ_SWEEP},
@@ -173,7 +221,7 @@ const uint8_t OUTPUT_1Vpp=0x06;
 /** \brief Because class enums can't be typecast to ints, a map is provided so
     that the enums can be matched with the corresponding byte value.
  */
-std::unordered_map<uint8_t,Voltage> voltage_map=
+inline std::unordered_map<uint8_t,Voltage> voltage_map=
   {
     {OUTPUT_2Vpp,Voltage::OUTPUT_2Vpp},
     {OUTPUT_200mVpp,Voltage::OUTPUT_200mVpp},
@@ -197,7 +245,7 @@ enum class Gain
 const uint8_t PGA_GAIN5x=0x00;
 const uint8_t PGA_GAIN1x=0x01;
 
-std::unordered_map<uint8_t,Gain> gain_map =
+inline std::unordered_map<uint8_t,Gain> gain_map =
   {
     {PGA_GAIN5x,Gain::PGA5x},
     {PGA_GAIN1x,Gain::PGA1x}
@@ -232,7 +280,7 @@ const uint8_t SREG_SWEEP_VALID=0x04;
 \param reg Contents of the status register.
 \return std::string with the description of the status register.
  */
-std::string show_status(uint8_t reg)
+inline std::string show_status(uint8_t reg)
 {
   if (reg == SREG_IMPED_VALID)
     {
@@ -266,14 +314,14 @@ enum class SettlingMultiplier
 //!Byte to set the settling multiplier to x2.
 const uint8_t SETTLING_MUL_2x = 0x02;
 //!Byte to set the settling multiplier to x4.
-const uint8_t SETTLING_MUL_4x = 0x03;
+const uint8_t SETTLING_MUL_4x = 0x06;
 
 //!Describe the multiplier
 /*!
 \param reg The contents of the MSB of the Settling Cycle Register
 \return A std::string with the description
 */
-std::string show_multiplier(uint8_t reg)
+inline std::string show_multiplier(uint8_t reg)
 {
   reg &= MUL_MASK;
   if (reg==SETTLING_MUL_2x)
@@ -299,7 +347,81 @@ std::string show_multiplier(uint8_t reg)
 using std::pair;
 using std::make_pair;
 using std::vector;
-typedef std::complex<long double> complex_t;
+//! Default precision of the processing functions.
+/*! The data are 16 bit ADC values, so double loses nothing. The processing
+  functions are templates on the precision; float is fine for them as well,
+  long double is only slower. */
+typedef double real_t;
+typedef std::complex<real_t> complex_t;
+
+//! Makes a template parameter non-deducible from the argument it types, so
+//! that the precision is always given explicitly or left at real_t.
+template <typename T>
+struct non_deduced
+{
+  typedef T type;
+};
+
+//! Callback invoked by sweep_frequency() for every measured point.
+/*! Receives the index of the point in the sweep, its frequency and the
+  measured admittance. It runs on the acquisition thread, between two points,
+  so it must return quickly. */
+template <typename Real>
+using BasicPointCallback = std::function<void(uint32_t index, Real frequency, const std::complex<Real> &z)>;
+typedef BasicPointCallback<real_t> PointCallback;
+
+//! Parameters of a frequency sweep.
+/*! Groups everything that user_interaction() asks the operator for, so that a
+  sweep can be described once and handed to another thread or stored. The
+  frequency arguments have the same meaning as in sweep_frequency(). */
+struct SweepConfig
+{
+  //! Starting frequency of the sweep in Hz.
+  long double start = 1000;
+  //! Number of frequency increments.
+  uint32_t steps = 10;
+  //! Distance between frequencies in Hz.
+  long double step = 100;
+  //! Excitation voltage range.
+  Voltage voltage = Voltage::OUTPUT_2Vpp;
+  //! Gain of the programmable amplifier.
+  Gain gain = Gain::PGA1x;
+  //! Settling cycles, 0-511.
+  uint32_t settling_cycles = 15;
+  //! Settling cycle multiplier.
+  SettlingMultiplier multiplier = SettlingMultiplier::MUL_1x;
+  //! Clock source.
+  Clk clock = Clk::INT;
+  //! Frequency of the external clock, used only when clock is Clk::EXT.
+  long double ext_clk = 4000000l;
+};
+
+//! Whether a calibration measured with one configuration holds for another.
+/*!
+\param a Configuration of the calibration sweep.
+\param b Configuration of the sweep to calibrate.
+\return True if both use the same excitation voltage, PGA gain, settling
+time and clock, and for an external clock the same frequency. The
+frequencies may differ, see same_frequencies().
+*/
+inline bool same_analog_settings(const SweepConfig &a, const SweepConfig &b)
+{
+  return a.voltage == b.voltage && a.gain == b.gain && a.settling_cycles == b.settling_cycles &&
+    a.multiplier == b.multiplier && a.clock == b.clock && (a.clock != Clk::EXT || a.ext_clk == b.ext_clk);
+}
+
+//! Value of AD5933::deadline when no operation is bounded.
+const int64_t NO_DEADLINE = INT64_MAX;
+//! Value of AD5933::deadline after AD5933::abort_operation().
+const int64_t ABORTED_DEADLINE = INT64_MIN;
+
+//! Time on the clock of AD5933::deadline, steady_clock in nanoseconds.
+inline int64_t deadline_now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //! Struct for the AD5933 device.
 /*! This struct is the interface to the AD5933. All device functions are exposed
   through it. Furthermore communication with the device is initialized in the
@@ -307,7 +429,7 @@ typedef std::complex<long double> complex_t;
   only one instantiation but can be trivially be extended to support multiple.*/
 struct AD5933{
   //!Location of the FX2LP firmware in the filesystem.
-  std::string firmware = "./AD5933_34FW.hex";
+  std::string firmware = DEFAULT_FIRMWARE;
   
   //! Device handle for the libusb struct. Needed for USB communication with libusb.
   libusb_device_handle *h;
@@ -319,19 +441,53 @@ struct AD5933{
   //! External clock frequency
   long double ext_clk=4000000l;
   //! Internal clock frequency 
-  long double int_clk=16776000l;
+  long double int_clk=INTERNAL_CLOCK;
   //! Buffer for the contents of the lower byte of the control register
   uint8_t ctrl_reg1;
   //! Buffer for the contents of the upper byte of the control register
   uint8_t ctrl_reg2; 
+  //! First libusb_error code of a register transfer since this was last set
+  //! to 0. Lets callers check sequences of the setters, which return nothing.
+  int error = 0;
+  //! Position of the device among the boards on the bus, see open().
+  int index = 0;
+  //! Read every register back after writing it. Turning this off halves the
+  //! USB transfers of a write, for tight acquisition loops.
+  bool verify_writes = true;
+  //! Last known contents of the registers CTRL_MSB to SETTLE_LSB, -1 where
+  //! unknown. Kept by write_register() and read_register(), so that a
+  //! SweepPlan can skip the writes the device already has.
+  int16_t shadow[SHADOW_SIZE];
+  //! Longest a single register transfer may take, in milliseconds, 0 to wait
+  //! forever. A transfer that takes longer fails with LIBUSB_ERROR_TIMEOUT.
+  unsigned int transfer_timeout = 1000;
+  //! Time by which the running operation has to finish, see deadline_now()
+  //! and DeadlineScope. Transfers are shortened to end by then, and fail with
+  //! LIBUSB_ERROR_TIMEOUT without touching the bus once it has passed, so
+  //! that every loop polling the status ends. NO_DEADLINE if unbounded.
+  std::atomic<int64_t> deadline{NO_DEADLINE};
+  //! Name of the operation the deadline belongs to, for the Watchdog.
+  std::atomic<const char*> operation{nullptr};
 
   AD5933();
+  explicit AD5933(libusb_context *context);
+  int open(int index = 0);
+  int open_device(libusb_device *device);
+  void close();
+  int reopen();
+  void configure(const SweepConfig &config);
   complex_t read_measurement();
   double measure_temperature();
+  int read_temperature(double &temperature);
   int download_fx2();
   int read_register( uint8_t& buffer, uint8_t reg);
   int write_register( uint8_t command,uint8_t reg);
+  void forget_registers();
+  int transfer_budget(unsigned int &timeout) const;
+  bool abort_operation(int64_t overdue);
   uint8_t get_status();
+  int read_status(uint8_t &sreg);
+  int read_raw(int16_t &real, int16_t &img);
   void choose_clock( Clk setting);
   void increase_frequency();
   void initilize_frequency();
@@ -344,6 +500,7 @@ struct AD5933{
   void set_settling_cycles ( uint32_t cycles );
   void set_settling_multiplier (SettlingMultiplier setting);
   void set_standby();
+  int set_mode(uint8_t mode);
   void set_starting_frequency ( uint32_t start );
   void set_step_number ( uint32_t number );
   void set_voltage_output ( Voltage setting );
@@ -352,6 +509,7 @@ struct AD5933{
   std::string show_mode();
   std::string show_gain();
   std::string show_clock();
+  std::string device_state();
   void print_device_state();
 };
 
@@ -360,7 +518,7 @@ struct AD5933{
 //! Describe the device state
 /*! This method reads the upper byte of the control register, parses
   its contents and returns a string describing the device state.*/
-std::string AD5933::show_mode()
+inline std::string AD5933::show_mode()
 {
   uint8_t reg;
   this->read_register(reg,CTRL_MSB);
@@ -372,7 +530,7 @@ std::string AD5933::show_mode()
     }
   catch (const std::out_of_range &e)
     {
-      std::cout<<"Invalid mode value!!!";
+      log_error("Invalid mode value!!!");
       return "Invalid Mode";
     }
   switch (m)
@@ -416,22 +574,30 @@ std::string AD5933::show_mode()
 /*! Usefull for debugging, this function prints the device mode, the
   excitation voltage, the gain of the programmable amplifier and the
   clock source.*/
-void AD5933::print_device_state()
+inline void AD5933::print_device_state()
 {
   this->print_command_registers();
+  std::cout<<this->device_state()<<std::endl;
+}
+
+//! Describe the device state
+/*! \return A std::string with the device mode, the excitation voltage, the gain
+  of the programmable amplifier and the clock source, one per line.*/
+inline std::string AD5933::device_state()
+{
   std::stringstream s; 
   s<<"Device mode:\t"<<this->show_mode()<<"\n";
   s<<"Voltage Range:\t"<<this->show_voltage()<<"\n";
   s<<"PGA:\t"<<this->show_gain()<<"\n";
   s<<"Clock:\t"<<this->show_clock();
-  std::cout<<s.str()<<std::endl;
+  return s.str();
 }
 
 //! Describe the excitation voltage.
 /*! This method reads the upper byte of the control register, parses
  its contents and returns a string describing the excitation
  voltage.*/
-std::string AD5933::show_voltage()
+inline std::string AD5933::show_voltage()
 {
   uint8_t reg;
   this->read_register(reg,CTRL_MSB);
@@ -443,7 +609,7 @@ std::string AD5933::show_voltage()
     }
   catch (const std::out_of_range &e)
     {
-      std::cout<<"Invalid Voltage Command!!!";
+      log_error("Invalid Voltage Command!!!");
       return "Invalid Voltage";
     }
   switch (v)
@@ -474,7 +640,7 @@ std::string AD5933::show_voltage()
 //! Describe the programmable amplifier gain.
 /*! This method reads the upper byte of the control register, parses its contents
   and returns a string describing the gain of the programmable amplifier.*/
-std::string AD5933::show_gain()
+inline std::string AD5933::show_gain()
 {
   uint8_t reg;
   this->read_register(reg,CTRL_MSB);
@@ -486,7 +652,7 @@ std::string AD5933::show_gain()
     }
   catch (const std::out_of_range &e)
     {
-      std::cout<<"Invalid gain!!!";
+      log_error("Invalid gain!!!");
       return "Invalid gain";
     }
   switch (reg)
@@ -509,7 +675,7 @@ std::string AD5933::show_gain()
 //! Describe clock source
 /*! This method reads the lower byte of the control register, parses its contents
   and returns a string describing the clock source.*/
-std::string AD5933::show_clock()
+inline std::string AD5933::show_clock()
 {
   uint8_t reg=0;
   this->read_register(reg, CTRL_LSB);
@@ -527,7 +693,7 @@ std::string AD5933::show_clock()
 //! Print the contents of the command register.
 /*! Reads both bytes of the command register and print their contents without
   parsing them.*/
-void AD5933::print_command_registers()
+inline void AD5933::print_command_registers()
 {
   uint8_t msb,lsb;
   read_register(msb, CTRL_MSB);
@@ -548,7 +714,7 @@ void AD5933::print_command_registers()
 //! Get content of Start Frequency register
 /*! Reads the content of the Start Frequency register without parsing it and
   returns it as an unsigned integer.*/
-uint32_t AD5933::get_frequency()
+inline uint32_t AD5933::get_frequency()
 {
   uint8_t r0,r1,r2;
   read_register(r0, FREQ_7_0);
@@ -560,7 +726,7 @@ uint32_t AD5933::get_frequency()
 //! Set Settling Cycle Multiplier setting.
 /*! Sets the appropriate bits of the the Settling Cycle register to match the
   setting.*/
-void AD5933::set_settling_multiplier(SettlingMultiplier setting)
+inline void AD5933::set_settling_multiplier(SettlingMultiplier setting)
 {
   uint8_t settling_msb=0;
   read_register(settling_msb, SETTLE_MSB);
@@ -580,32 +746,55 @@ void AD5933::set_settling_multiplier(SettlingMultiplier setting)
 //! Get contents of status register
 /*!\return The contents of the status register
  */
-uint8_t AD5933::get_status()
+inline uint8_t AD5933::get_status()
 {
   uint8_t buf=0;
   auto err = read_register(buf,SREG);
   if (err<0)
     {
-      libusb_strerror(libusb_error(err));
+      log_error("%s\n",libusb_strerror(libusb_error(err)));
       std::abort();
     }
   return buf;
 }
 
+//! Valid bits of the status register. The rest are reserved and read as 0.
+const uint8_t SREG_MASK = SREG_TEMP_VALID | SREG_IMPED_VALID | SREG_SWEEP_VALID;
+
+//! Get contents of status register without aborting on errors.
+/*!
+\param sreg The buffer where the status register will be stored.
+\return 0 on success, a libusb_error code if the transfer failed or
+LIBUSB_ERROR_IO if reserved bits are set, which means the value is garbage.
+*/
+inline int AD5933::read_status(uint8_t &sreg)
+{
+  auto err = read_register(sreg,SREG);
+  if (err<0)
+    {
+      return err;
+    }
+  if (sreg & ~SREG_MASK)
+    {
+      return LIBUSB_ERROR_IO;
+    }
+  return 0;
+}
+
 
 //!Choose clock source
 /*!\param The desired clock source.
  */
-void AD5933::choose_clock( Clk setting)
+inline void AD5933::choose_clock( Clk setting)
 {
   if ( setting == Clk::INT)
   {
     uint8_t mask=0xF7;
-    ctrl_reg1 = ctrl_reg1 && mask;
+    ctrl_reg1 = ctrl_reg1 & mask;
   }
   else
   {
-    printf("Chosen external clock: %Lf Hz\n",ext_clk);
+    log_message("Chosen external clock: %Lf Hz\n",ext_clk);
     ctrl_reg1 = ctrl_reg1 | CLK_EXT;
   }
   this->write_register(ctrl_reg1, CTRL_LSB);
@@ -620,13 +809,13 @@ register are not updated as the sweep progresses, so if you need the current
 excitation frequency, you need to keep track of the increments of the sweep that
 have elapsed.
 */
-void AD5933::set_starting_frequency(uint32_t start)
+inline void AD5933::set_starting_frequency(uint32_t start)
 {
-  printf("start: %d ",start);
+  log_message("start: %d ",start);
   uint8_t r2 = ( start & 0xff0000 ) >>16;
   uint8_t r1 = ( start & 0x00ff00 ) >>8;
   uint8_t r0 = ( start & 0x0000ff );
-  printf("registers: 0x%X%X%X\n",r2,r1,r0);
+  log_message("registers: 0x%X%X%X\n",r2,r1,r0);
   write_register ( r2, FREQ_23_16 );
   write_register ( r1, FREQ_15_8 );
   write_register ( r0, FREQ_7_0 );
@@ -641,7 +830,7 @@ change it, the sweep must be first stopped and a new "Start Frequency" command
 must be issued. The default value upon reset is as follows: D23 to D0 are not
 reset on power-up. After a reset command, the contents of this register are not
 reset. */
-void AD5933::set_frequency_step(uint32_t inc)
+inline void AD5933::set_frequency_step(uint32_t inc)
 {
   uint8_t r2 = ( inc & 0xff0000 ) >>16;
   uint8_t r1 = ( inc & 0x00ff00 ) >>8;
@@ -658,7 +847,7 @@ void AD5933::set_frequency_step(uint32_t inc)
 //register are not reset.This register determines the number of frequency points
 //in the frequency sweep. The number of points is represented by a 9-bit word,
 //D8 to D0. D15 to D9 are don’t care bits.
-void AD5933::set_step_number ( uint32_t number )
+inline void AD5933::set_step_number ( uint32_t number )
 {
   uint8_t r1 = ( number & 0x00ff00 ) >>8;
   uint8_t r0 = ( number & 0x0000ff );
@@ -674,7 +863,7 @@ affected. The register determines the number of output excitation cycles that
 are allowed to pass through the unknown impedance, after receipt of a start
 frequency sweep, increment frequency, or repeat frequency command, before the
 ADC is triggered to perform a conversion of the response signal. */
-void AD5933::set_settling_cycles ( uint32_t cycles )
+inline void AD5933::set_settling_cycles ( uint32_t cycles )
 {
   uint8_t r1 = ( cycles & 0xFF00 ) >>8;
   uint8_t r0 = ( cycles & 0x00FF );
@@ -688,9 +877,9 @@ void AD5933::set_settling_cycles ( uint32_t cycles )
 
 This must be done before the starting sweep frequency initialization.
  */
-void AD5933::set_voltage_output ( Voltage setting)
+inline void AD5933::set_voltage_output ( Voltage setting)
 {
-  ctrl_reg2 &=0x11111001; // Clear bits 8:9
+  ctrl_reg2 &= ~VOLTAGE_MASK; // Clear bits 10:9
   if (setting==Voltage::OUTPUT_1Vpp)
       {
 	ctrl_reg2 |= OUTPUT_1Vpp;
@@ -715,7 +904,7 @@ void AD5933::set_voltage_output ( Voltage setting)
 /*! \param setting The desired gain.
 
 This must be done before the starting sweep frequency initialization.*/
-void AD5933::set_PGA(Gain setting)
+inline void AD5933::set_PGA(Gain setting)
 {
   ctrl_reg2 &= 0xFE; // Clear bit 1
   switch (setting)
@@ -737,13 +926,27 @@ void AD5933::set_PGA(Gain setting)
 //!Sets the AD5933 to standby mode.
 /*!
 In this mode both pins of the unknown impedance are connected to ground.*/
-void AD5933::set_standby()
+inline void AD5933::set_standby()
 {
   ctrl_reg2 &= 0x0F;
   ctrl_reg2 |= SB_MODE;
   write_register(ctrl_reg2, CTRL_MSB);
 }
 
+//!Write a command to the control register.
+/*!
+\param mode One of the mode bytes of table 9, e.g. REPEAT_FREQ.
+\return A libusb_error code.
+
+The mode setters above ignore errors; this is for loops that must not.
+*/
+inline int AD5933::set_mode(uint8_t mode)
+{
+  ctrl_reg2 &= 0x0F;
+  ctrl_reg2 |= mode;
+  return write_register(ctrl_reg2, CTRL_MSB);
+}
+
 //!Sets the AD5933 to initialize frequency mode.
 /*!  
 This command enables the DDS to output the programmed start frequency for
@@ -751,7 +954,7 @@ an indefinite time. It is used to excite the unknown impedance initially. When
 the unknown impedance has settled after a time determined by the user, the user
 must initiate a start frequency sweep command to begin the frequency sweep.
 */
-void AD5933::initilize_frequency()
+inline void AD5933::initilize_frequency()
 {
   
   ctrl_reg2 &= 0x0F;
@@ -764,7 +967,7 @@ void AD5933::initilize_frequency()
 After calling this function ,the ADC starts measuring after the programmed
 number of settling time cycles has elapsed.
 */
-void AD5933::start_sweep()
+inline void AD5933::start_sweep()
 {
   ctrl_reg2 &= 0x0F;
   ctrl_reg2 |= START_FREQ_SWEEP;
@@ -776,7 +979,7 @@ void AD5933::start_sweep()
 /*!
 This function must be called after a valid meausurement is retrieved.
 */
-void AD5933::increase_frequency()
+inline void AD5933::increase_frequency()
 {
   ctrl_reg2 &= 0x0F;
   ctrl_reg2 |= INC_FREQ;
@@ -790,7 +993,7 @@ void AD5933::increase_frequency()
 of the unknown impedance at the same frequency and average them, as a noise
 reduction strategy. Always remember to retrieve the measurement from the
 Imaginary and Real registers before they are overwritten.*/
-void AD5933::repeat_frequency()
+inline void AD5933::repeat_frequency()
 {
   ctrl_reg2 &= 0x0F;
   ctrl_reg2 |= REPEAT_FREQ;
@@ -803,20 +1006,51 @@ void AD5933::repeat_frequency()
  \param reg The address of the register to be written.
  \return A libusb_error code.
 */
-int AD5933::write_register ( uint8_t command, uint8_t reg )
+inline int AD5933::write_register ( uint8_t command, uint8_t reg )
 {
-  auto err = libusb_control_transfer ( h,0x40,0xDE,0x0D, command << 8 | reg,NULL,0,0 );
+  AD5933_TRACE_ARG("write_register", "reg", reg);
+  // Closed, e.g. after the board was unplugged.
+  unsigned int timeout = 0;
+  int err = h ? transfer_budget(timeout) : LIBUSB_ERROR_NO_DEVICE;
+  if (err == 0)
+    {
+      err = libusb_control_transfer ( h,0x40,0xDE,0x0D, command << 8 | reg,NULL,0,timeout );
+    }
   if ( err<0 )
     {
-      printf("Error writing 0x%X to register 0x%X",command,reg);
+      log_error("Error writing 0x%X to register 0x%X",command,reg);
       const char *str = libusb_strerror( libusb_error( err ));
-      fprintf(stderr,"%s\n",str);
+      log_error("%s\n",str);
+      if (error==0)
+	{
+	  error = err;
+	}
+    }
+  if (reg >= CTRL_MSB && reg < CTRL_MSB + SHADOW_SIZE)
+    {
+      shadow[reg - CTRL_MSB] = err < 0 ? -1 : command;
+    }
+  if (!verify_writes || !h)
+    {
+      return err;
     }
   uint8_t data=0;
-  read_register(data,reg);
-  if (command != data){
-    printf("Invalid write!!!\n");
-    printf("Wrote %d, got %d, on reg %d\n",command,data,reg);
+  auto rerr = read_register(data,reg);
+  if (err>=0 && rerr<0)
+    {
+      err = rerr;
+    }
+  else if (rerr>=0 && command != data){
+    log_error("Invalid write!!!\n");
+    log_error("Wrote %d, got %d, on reg %d\n",command,data,reg);
+    if (err>=0)
+      {
+	err = LIBUSB_ERROR_IO;
+      }
+    if (error==0)
+      {
+	error = LIBUSB_ERROR_IO;
+      }
   }
   return err;
 }
@@ -827,18 +1061,167 @@ int AD5933::write_register ( uint8_t command, uint8_t reg )
  \param reg The address of the register to be written.
  \return A libusb_error code.
 */
-int AD5933::read_register ( uint8_t &buffer, uint8_t reg )
+inline int AD5933::read_register ( uint8_t &buffer, uint8_t reg )
 {
-  auto err = libusb_control_transfer ( h,0xc0,0xDE,0x0D,reg,&buffer,1,0 );
+  AD5933_TRACE_ARG("read_register", "reg", reg);
+  unsigned int timeout = 0;
+  int err = h ? transfer_budget(timeout) : LIBUSB_ERROR_NO_DEVICE;
+  if (err == 0)
+    {
+      err = libusb_control_transfer ( h,0xc0,0xDE,0x0D,reg,&buffer,1,timeout );
+    }
   if ( err<0 )
     {
-      printf("Error reading from register 0x%X",reg);
+      log_error("Error reading from register 0x%X",reg);
       const char *str = libusb_strerror( libusb_error( err ));
-      fprintf(stderr,"%s\n",str);
+      log_error("%s\n",str);
+      if (error==0)
+	{
+	  error = err;
+	}
+    }
+  else if (reg >= CTRL_MSB && reg < CTRL_MSB + SHADOW_SIZE)
+    {
+      shadow[reg - CTRL_MSB] = buffer;
     }
   return err;
 }
 
+//!Mark the contents of every register as unknown.
+/*! Needed when something else may have changed them, e.g. a reset. */
+inline void AD5933::forget_registers()
+{
+  for (auto &r: shadow)
+    {
+      r = -1;
+    }
+}
+
+//!Timeout of the next register transfer.
+/*!
+ \param timeout The timeout in milliseconds for libusb: transfer_timeout, or
+ less so that the transfer ends by the deadline.
+ \return 0, or LIBUSB_ERROR_TIMEOUT if the deadline has passed.
+*/
+inline int AD5933::transfer_budget(unsigned int &timeout) const
+{
+  timeout = transfer_timeout;
+  int64_t d = deadline.load(std::memory_order_relaxed);
+  if (d == NO_DEADLINE)
+    {
+      return 0;
+    }
+  int64_t now = deadline_now();
+  if (d <= now)
+    {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+  int64_t left = d - now;
+  // Rounded up: a timeout of 0 would mean forever.
+  int64_t ms = std::min<int64_t>((left + 999999)/1000000, UINT_MAX);
+  if (timeout == 0 || ms < timeout)
+    {
+      timeout = ms;
+    }
+  return 0;
+}
+
+//!Abort the running operation.
+/*!
+ \param overdue The deadline of the operation, as read from deadline.
+ \return false if the operation already ended: the deadline changed.
+
+ Safe to call from any thread. The deadline becomes ABORTED_DEADLINE, so the
+ transfers of the operation fail with LIBUSB_ERROR_TIMEOUT from the next one
+ on, and so do those of the operations it is part of, see DeadlineScope. A
+ transfer in progress is not interrupted; it ends by transfer_timeout.
+*/
+inline bool AD5933::abort_operation(int64_t overdue)
+{
+  return overdue != NO_DEADLINE && overdue != ABORTED_DEADLINE
+    && deadline.compare_exchange_strong(overdue, ABORTED_DEADLINE);
+}
+
+//! Bounds the operations on a device in a block by a deadline.
+/*! Nested scopes can only bring the deadline closer: an operation inside a
+  sweep does not get more time than the sweep has left. The enclosing
+  deadline is restored at the end of the scope, unless the operation was
+  aborted: then the enclosing operations are aborted as well. Use from the
+  thread that owns the device. */
+class DeadlineScope
+{
+public:
+  /*!
+    \param h Handle to the device object.
+    \param budget Time from now that the block may take.
+    \param name Name of the operation, a string literal.
+  */
+  DeadlineScope(AD5933 *h, std::chrono::nanoseconds budget, const char *name)
+    : h(h), previous(h->deadline.load()), previous_operation(h->operation.load())
+  {
+    int64_t now = deadline_now();
+    int64_t d = budget.count() >= NO_DEADLINE - now ? NO_DEADLINE : now + budget.count();
+    if (d < previous)
+      {
+	h->deadline.store(d);
+	h->operation.store(name);
+      }
+  }
+
+  ~DeadlineScope()
+  {
+    bool aborted = h->deadline.exchange(previous) == ABORTED_DEADLINE;
+    if (aborted && previous != NO_DEADLINE)
+      {
+	h->deadline.store(ABORTED_DEADLINE);
+      }
+    h->operation.store(previous_operation);
+  }
+
+  DeadlineScope(const DeadlineScope&) = delete;
+  DeadlineScope& operator=(const DeadlineScope&) = delete;
+
+  //! Time left, negative once the deadline has passed or the operation was
+  //! aborted.
+  std::chrono::nanoseconds remaining() const
+  {
+    int64_t d = h->deadline.load();
+    return std::chrono::nanoseconds(d == NO_DEADLINE ? NO_DEADLINE : d == ABORTED_DEADLINE ? -1 : d - deadline_now());
+  }
+
+  bool expired() const
+  {
+    return remaining().count() <= 0;
+  }
+
+private:
+  AD5933 *h;
+  int64_t previous;
+  const char *previous_operation;
+};
+
+//!Read the raw contents of the Real and Imaginary registers.
+/*!
+ \param real The buffer where the real part will be stored.
+ \param img The buffer where the imaginary part will be stored.
+ \return 0 on success or the libusb_error code of the first failed transfer.
+*/
+inline int AD5933::read_raw(int16_t &real, int16_t &img)
+{
+  uint8_t re1,re0,im1,im0;
+  int err;
+  if ((err = read_register(re1, REAL_MSB)) < 0 ||
+      (err = read_register(re0, REAL_LSB)) < 0 ||
+      (err = read_register(im1, IMG_MSB)) < 0 ||
+      (err = read_register(im0, IMG_LSB)) < 0)
+    {
+      return err;
+    }
+  real = re1<<8 | re0;
+  img = im1<<8 | im0;
+  return 0;
+}
+
 
 //! Reads the contents of the Imaginary and Real registers and returns the
 //! measured admittance.
@@ -847,31 +1230,16 @@ int AD5933::read_register ( uint8_t &buffer, uint8_t reg )
 This should be called after checking whether the valid measurement flag of the
 status register is on.
 */
-complex_t AD5933::read_measurement()
-{
-  uint8_t im1,im0,re1,re0;
-  std::bitset<8> im1b,im0b,re1b,re0b;
-  read_register(re1, REAL_MSB );
-  re1b = re1;
-  read_register(re0, REAL_LSB );
-  re0b = re0;
-  int16_t real = re1<<8 | re0 ;
+inline complex_t AD5933::read_measurement()
+{
+  int16_t real = 0, img = 0;
+  read_raw(real, img);
+  complex_t z(real,img);
+#ifdef DEBUG
   std::bitset<16> realb(real);
-  
-  read_register ( im1, IMG_MSB );
-  im1b=im1;
-  read_register ( im0, IMG_LSB );
-  im0b=im0;
-  int16_t img = im1<<8 | im0;
   std::bitset<16> imb(img);
-  long double dreal = real;
-  long double dimg = img;
-  complex_t z(dreal,dimg);
-#ifdef DEBUG
   std::cout<<"Real:\t\t\tImag:\n";
-  std::cout<<re1b<<re0b<<"\t"<<im1b<<im0b<<"\n";
   std::cout<<realb<<"\t"<<imb<<"\n";
-  std::cout<<dreal<<"\t\t\t"<<dimg<<"\n";
   std::cout<<z.real()<<"\t\t\t"<<z.imag()<<"\n";
 #endif
   return z;
@@ -882,76 +1250,278 @@ complex_t AD5933::read_measurement()
 //!Constructor for the AD5933 device handle.
 /*!
 The constructor initializes the communication of the host with the AD5933
-through the FX2LP chip using the libusb-1.0 library. As implemented only one
-device per host is supported. 
+through the FX2LP chip using the libusb-1.0 library. It opens the first board
+on the bus and terminates the program if that fails.
 */
-AD5933::AD5933()
+inline AD5933::AD5933()
 {
   //  auto err = cyusb_open ( 0x0456, 0xb203 );
   h = NULL;
   ctx= NULL;
-  auto err = libusb_init(&ctx);
-  if (err)
+  forget_registers();
+  auto err = open();
+  if (err == LIBUSB_ERROR_NOT_FOUND || ctx == NULL)
   {
-    fprintf(stderr,"Error in initializing libusb library...\n");
-    const char *str = libusb_strerror( libusb_error( err ));
-    fprintf(stderr,"%s\n",str);
     std::abort();
   }
-  h = libusb_open_device_with_vid_pid(ctx, VID, PID);
-  if (!h)
+  else if (err)
   {
-    fprintf(stderr, "Device not found\n");
-    std::abort();
+    libusb_exit(NULL);
+    std::exit(-1);
   }
-  
+}
+
+//!Constructor that does not open a device.
+/*!
+\param context The libusb context to use, or NULL to create one in open().
+
+For code that must not abort: call open() afterwards and check its result.
+*/
+inline AD5933::AD5933(libusb_context *context)
+{
+  h = NULL;
+  ctx = context;
+  forget_registers();
+  clk = int_clk;
+  ctrl_reg1 = 0;
+  ctrl_reg2 = 0;
+}
+
+//!Count the evaluation boards on the bus.
+/*!
+\param ctx The libusb context.
+\return The number of boards, or a libusb_error code.
+*/
+inline int count_devices(libusb_context *ctx)
+{
+  libusb_device **list;
+  auto n = libusb_get_device_list(ctx, &list);
+  if (n < 0)
+    {
+      return n;
+    }
+  int count = 0;
+  for (ssize_t i = 0; i < n; i++)
+    {
+      libusb_device_descriptor desc;
+      if (libusb_get_device_descriptor(list[i], &desc) == 0 && desc.idVendor == VID && desc.idProduct == PID)
+	{
+	  count++;
+	}
+    }
+  libusb_free_device_list(list, 1);
+  return count;
+}
+
+//!Open the device and download the firmware.
+/*!
+\param index Which of the boards on the bus to open, counting from 0 in bus order.
+\return 0 on success or a libusb_error code.
+
+Initializes libusb if needed, opens the device matching VID and PID,
+claims its interface, downloads the FX2LP firmware and reads back the control
+register. On failure the device handle is left closed.
+*/
+inline int AD5933::open(int index)
+{
+  AD5933_TRACE("open");
+  int err;
+  if (ctx == NULL)
+  {
+    err = libusb_init(&ctx);
+    if (err)
+    {
+      log_error("Error in initializing libusb library...\n");
+      const char *str = libusb_strerror( libusb_error( err ));
+      log_error("%s\n",str);
+      ctx = NULL;
+      return err;
+    }
+  }
+  libusb_device **list;
+  auto n = libusb_get_device_list(ctx, &list);
+  if (n < 0)
+  {
+    return n;
+  }
+  h = NULL;
+  err = LIBUSB_ERROR_NOT_FOUND;
+  for (ssize_t i = 0, match = 0; i < n; i++)
+  {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) == 0 && desc.idVendor == VID && desc.idProduct == PID
+	&& match++ == index)
+    {
+      err = open_device(list[i]);
+      break;
+    }
+  }
+  libusb_free_device_list(list, 1);
+  if (err == LIBUSB_ERROR_NOT_FOUND)
+  {
+    log_error("Device not found\n");
+  }
+  if (!err)
+  {
+    this->index = index;
+  }
+  return err;
+}
+
+//!Open a given board and download the firmware.
+/*!
+\param device The board, e.g. from libusb_get_device_list() or a hot-plug
+event. ctx must be the context it belongs to.
+\return 0 on success or a libusb_error code, see download_fx2() for a
+firmware that cannot be downloaded. On failure the device handle is left
+closed.
+
+Does the work of open() once the board is found. index is left alone.
+*/
+inline int AD5933::open_device(libusb_device *device)
+{
+  AD5933_TRACE("open");
+  h = NULL;
+  int err = libusb_open(device, &h);
+  if (err)
+  {
+    h = NULL;
+    return err;
+  }
+
   err = libusb_kernel_driver_active ( h , 0 );
   if ( err != 0 )
   {
-    fprintf (stderr, "Kernel driver active. Exitting\n" );
+    log_error("Kernel driver active. Exitting\n" );
     libusb_close(h);
-    libusb_exit(NULL);
-    std::exit(-1);
+    h = NULL;
+    return err < 0 ? err : LIBUSB_ERROR_BUSY;
   }
   err = libusb_claim_interface ( h, 0 );
   if ( err != 0 )
   {
-    fprintf (stderr, "Error in claiming interface\n" );
+    log_error("Error in claiming interface\n" );
     libusb_close(h);
-    libusb_exit(NULL);
-    std::exit(-1);
+    h = NULL;
+    return err;
   }
   else
   {
-    printf ( "Successfully claimed interface\n" );
+    log_message( "Successfully claimed interface\n" );
   }
   
   struct stat statbuf;
-  static char filename[] = "./AD5933_34FW.hex";
-  err = stat ( filename, &statbuf );
-  printf ( "File size = %d\n", ( int ) statbuf.st_size );
-  sleep(1);
+  if ( stat ( firmware.c_str(), &statbuf ) != 0 )
+  {
+    log_error( "Cannot find firmware %s: %s\n", firmware.c_str(), strerror(errno) );
+    close();
+    return LIBUSB_ERROR_IO;
+  }
+  log_message( "File size = %d\n", ( int ) statbuf.st_size );
+  {
+    AD5933_TRACE("sleep");
+    sleep(1);
+  }
 
-  auto extension = strtoul ( "0xA0", NULL, 16 );
   err = download_fx2 ();
   if ( err )
   {
-    printf ( "Error downloading firmware: %d\n",err );
+    log_error( "Error downloading firmware: %d\n",err );
+    close();
+    return err;
+  }
+  log_message("reading ctrl\n");
+  {
+    AD5933_TRACE("sleep");
+    sleep(1);
+  }
+  forget_registers();
+  err = read_register(ctrl_reg1,CTRL_LSB);
+  if (err < 0)
+  {
+    close();
+    return err;
+  }
+  err = read_register(ctrl_reg2,CTRL_MSB);
+  if (err < 0)
+  {
+    close();
+    return err;
   }
-  printf("reading ctrl\n");
-  sleep(1);
-  read_register(ctrl_reg1,CTRL_LSB);
-  read_register(ctrl_reg2,CTRL_MSB);
   clk=int_clk;
-  printf("done constr\n");
+  log_message("done constr\n");
+  return 0;
+}
+
+//!Release the interface and close the device handle.
+/*!
+The libusb context is kept, so the device can be opened again with open().
+*/
+inline void AD5933::close()
+{
+  if (h)
+  {
+    libusb_release_interface(h, 0);
+    libusb_close(h);
+    h = NULL;
+  }
+}
+
+//!Close and open the device again.
+/*!
+\return 0 on success or a libusb_error code.
+
+Used to recover a board that stopped answering. The firmware is downloaded
+again, so every register must be programmed again afterwards. The clock
+selection is kept.
+*/
+inline int AD5933::reopen()
+{
+  auto saved_clk = clk;
+  close();
+  auto err = open(index);
+  if (!err)
+  {
+    clk = saved_clk;
+  }
+  return err;
+}
+
+//! Apply the analog settings of a sweep configuration.
+/*! \param config The sweep configuration.
+
+Sets the clock source, excitation voltage, PGA gain and settling cycles. The
+frequency registers are programmed by sweep_frequency() itself.
+*/
+inline void AD5933::configure(const SweepConfig &config)
+{
+  if (config.clock == Clk::EXT)
+    {
+      ext_clk = config.ext_clk;
+      clk = ext_clk;
+    }
+  else
+    {
+      clk = int_clk;
+    }
+  choose_clock(config.clock);
+  set_voltage_output(config.voltage);
+  set_PGA(config.gain);
+  // Settling cycles overwrite the multiplier bits, so they go first.
+  set_settling_cycles(config.settling_cycles);
+  set_settling_multiplier(config.multiplier);
 }
 
 //!Function to load the AD5933 firmware to the FX2LP chip.
 /*! 
+\return 0 on success or a libusb_error code, LIBUSB_ERROR_IO if the firmware
+file cannot be read or is malformed.
+
 This was copied from the FX2 Linux SDK.
 */
-int AD5933::download_fx2()
+inline int AD5933::download_fx2()
 {
+  AD5933_TRACE("download_fx2");
   FILE *fp = NULL;
   char buf[256];
   char tbuf1[3];
@@ -962,128 +1532,311 @@ int AD5933::download_fx2()
   int count = 0;
   unsigned char num_bytes = 0;
   unsigned short address = 0;
-  unsigned char *dbuf = NULL;
+  unsigned char dbuf[255];
   int i;
 
   auto extension = strtoul ( "0xA0", NULL, 16 );
   unsigned char vendor_command=extension;
 
   fp = fopen(firmware.c_str(), "r" );
+  if ( fp == NULL ) {
+    log_error("Cannot open firmware %s: %s\n", firmware.c_str(), strerror(errno));
+    return LIBUSB_ERROR_IO;
+   }
   tbuf1[2] ='\0';
   tbuf2[4] = '\0';
   tbuf3[2] = '\0';
 
   reset = 1;
   r = libusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-  if ( !r ) {
-    printf("Error in control_transfer\n");
+  if ( r < 0 ) {
+    log_error("Error in control_transfer\n");
+    fclose(fp);
     return r;
    }
-  sleep(1);
+  {
+    AD5933_TRACE("sleep");
+    sleep(1);
+  }
 
   count = 0;
 
   while ( fgets(buf, 256, fp) != NULL ) {
+    if ( strlen(buf) < 11 ) {
+      log_error("Malformed firmware line: %s\n", buf);
+      fclose(fp);
+      return LIBUSB_ERROR_IO;
+     }
     if ( buf[8] == '1' )
       break;
     strncpy(tbuf1,buf+1,2);
     num_bytes = strtoul(tbuf1,NULL,16);
+    if ( strlen(buf) < 11 + 2*static_cast<size_t>(num_bytes) ) {
+      log_error("Malformed firmware line: %s\n", buf);
+      fclose(fp);
+      return LIBUSB_ERROR_IO;
+     }
     strncpy(tbuf2,buf+3,4);
     address = strtoul(tbuf2,NULL,16);
-    dbuf = (unsigned char *)malloc(num_bytes);
     for ( i = 0; i < num_bytes; ++i ) {
       strncpy(tbuf3,&buf[9+i*2],2);
       dbuf[i] = strtoul(tbuf3,NULL,16);
      }
     r = libusb_control_transfer(h, 0x40, vendor_command, address, 0x00, dbuf, num_bytes, 1000);
-    if ( !r ) {
-      printf("Error in control_transfer\n");
-      free(dbuf);
+    if ( r < 0 ) {
+      log_error("Error in control_transfer\n");
+      fclose(fp);
       return r;
      }
     count += num_bytes;
-    free(dbuf);
    }
-  printf("Total bytes downloaded = %d\n", count);
-  sleep(1);
+  fclose(fp);
+  log_message("Total bytes downloaded = %d\n", count);
+  {
+    AD5933_TRACE("sleep");
+    sleep(1);
+  }
   reset = 0;
   r = libusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-  fclose(fp);
+  if ( r < 0 ) {
+    log_error("Error in control_transfer\n");
+    return r;
+   }
   return 0;
 }
 
 
-//!Execute frequency sweep.
-/*! 
-\param lower Starting frequency of the sweep.
-\param number_of_samples Frequencies measured in the sweep
-\param step Distance between frequencies meausured in the sweep.
+//!Convert a frequency to the code of the frequency registers.
+/*!
+\param f Frequency in Hz.
+\param clk Frequency of the clock source in Hz.
+\return The 24-bit code, according to equations 1 and 2 in page 14 of the datasheet.
+*/
+inline uint32_t frequency_code(long double f, long double clk)
+{
+  long double code = (f / (clk/4))* (1<<27);
+  return code;
+}
+
+//! Time allowed for everything but the measurements in a sweep: the
+//! register writes and the waits of restart_sweep().
+const std::chrono::milliseconds SWEEP_SETUP_BUDGET{2000};
+//! Time allowed for the USB transfers of one point: the status polls, the
+//! data reads and the increment command.
+const std::chrono::milliseconds POINT_TRANSFER_BUDGET{50};
+//! Time allowed for read_temperature(). The conversion takes 800 us.
+const std::chrono::milliseconds TEMPERATURE_BUDGET{1000};
+
+//!Settling time of the device in excitation periods.
+/*!
 \param h Handle to the device object.
+\return The settling cycles times the multiplier as last written, or the
+longest possible, 511 x 4, if the registers are unknown.
+*/
+inline uint32_t settling_periods(const AD5933 *h)
+{
+  int16_t msb = h->shadow[SETTLE_MSB - CTRL_MSB];
+  int16_t lsb = h->shadow[SETTLE_LSB - CTRL_MSB];
+  if (msb < 0 || lsb < 0)
+    {
+      return 511*4;
+    }
+  uint32_t cycles = (msb & 0x01) << 8 | lsb;
+  uint8_t mul = msb & MUL_MASK;
+  return cycles * (mul == SETTLING_MUL_4x ? 4 : mul == SETTLING_MUL_2x ? 2 : 1);
+}
 
-The function implements the flowchart on page 20 of the data sheet.
+//!Time budget of a sweep.
+/*!
+\param start Start frequency in Hz, the lowest and so slowest point.
+\param increments Number of increments.
+\param clk Frequency of the clock source.
+\param settling Settling time in excitation periods, see settling_periods().
+\return Twice the time the sweep should take: settling and the 1024 sample
+DFT at every point, the transfers and SWEEP_SETUP_BUDGET. Well above the
+normal duration, so that only a stuck board exceeds it.
 */
-std::vector<  std::pair<long double,  complex_t > > sweep_frequency ( uint32_t lower,uint32_t number_of_samples,long double step, AD5933* h )
+inline std::chrono::nanoseconds sweep_budget(long double start, uint32_t increments, long double clk, uint32_t settling)
+{
+  // The lowest frequency the registers can hold, against a division by 0.
+  long double f = std::max(start, (clk/4) / (1<<27));
+  long double point = settling/f + 1024*16/clk
+    + std::chrono::duration<long double>(POINT_TRANSFER_BUDGET).count();
+  long double total = 2*((increments + 1.0l)*point + std::chrono::duration<long double>(SWEEP_SETUP_BUDGET).count());
+  return std::chrono::nanoseconds(static_cast<int64_t>(std::min<long double>(total*1e9l, NO_DEADLINE/2)));
+}
+
+//!Time budget of a sweep described by a configuration.
+/*!
+\param config The sweep configuration.
+\param clk Frequency of the internal clock, used unless config.clock is Clk::EXT.
+*/
+inline std::chrono::nanoseconds sweep_budget(const SweepConfig &config, long double clk)
+{
+  uint32_t mul = config.multiplier == SettlingMultiplier::MUL_4x ? 4 :
+    config.multiplier == SettlingMultiplier::MUL_2x ? 2 : 1;
+  return sweep_budget(config.start, config.steps, config.clock == Clk::EXT ? config.ext_clk : clk,
+		      config.settling_cycles*mul);
+}
+
+//!Start the sweep that is already programmed.
+/*!
+\param h Handle to the device object.
+
+The frequency and settling registers keep their contents between sweeps, so
+repeating a sweep only needs the standby, initialize and start commands.
+*/
+inline void restart_sweep ( AD5933* h )
 {
-  long double clk = h->clk;
-  vector< pair<long double,complex_t>> measurements;
-  long double lowerd= lower;
-  auto startd = (lowerd / (clk/4))* (1<<27);
-  auto incd = (step / (clk/4))*(1<<27);
-  
-  uint32_t start = startd;
-  uint32_t inc = incd;
-  h->set_starting_frequency ( start );
-  h->set_frequency_step ( inc );
-  h->set_step_number ( number_of_samples );
-  
   h->set_standby();
-  usleep ( 5e5 );
+  {
+    AD5933_TRACE("sleep");
+    usleep ( 5e5 );
+  }
 
   h->initilize_frequency();
-  usleep ( 5e5 );
+  {
+    AD5933_TRACE("sleep");
+    usleep ( 5e5 );
+  }
 
   h->start_sweep();
-  usleep( 5e5);
+  {
+    AD5933_TRACE("sleep");
+    usleep( 5e5);
+  }
+}
 
-#ifdef DEBUG
-  std::cout<<"clock "<<clk<<"\n";
-  std::cout<<"lowerd:"<<lowerd<<" "<<lower<<std::endl;
-  printf("lower %d start = 0x%X,inc = 0x%X\n",lower,start,inc);
-  printf("Set frequency: 0x%X\n",h->get_frequency());
-#endif
-  
-  /*Sweep loop*/
-  long double true_freq;
+//!Program the frequency registers and start a sweep.
+/*!
+\param start Start frequency code.
+\param inc Frequency increment code.
+\param number_of_samples Number of increments.
+\param h Handle to the device object.
+
+Implements the programming part of the flowchart on page 20 of the data sheet,
+up to the start frequency sweep command. The first measurement is pending when
+this returns.
+*/
+inline void prepare_sweep ( uint32_t start, uint32_t inc, uint32_t number_of_samples, AD5933* h )
+{
+  h->set_starting_frequency ( start );
+  h->set_frequency_step ( inc );
+  h->set_step_number ( number_of_samples );
+  restart_sweep(h);
+}
+
+//!Measure the points of a sweep that was started.
+/*!
+\param start Start frequency code the sweep was programmed with.
+\param inc Frequency increment code the sweep was programmed with.
+\param number_of_samples Number of increments the sweep was programmed with.
+\param h Handle to the device object.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+
+Implements the measurement loop of the flowchart on page 20 of the data sheet.
+It must follow prepare_sweep() or restart_sweep(). If reading the status or
+a result fails, e.g. because the board was unplugged, or the sweep overruns
+sweep_budget(), the points measured so far are returned and AD5933::error
+tells why, LIBUSB_ERROR_TIMEOUT for the latter.
+*/
+template <typename Real = real_t>
+std::vector<  std::pair<Real,  std::complex<Real> > > acquire_sweep ( uint32_t start, uint32_t inc, uint32_t number_of_samples, AD5933* h,
+								    const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr )
+{
+  vector< pair<Real,std::complex<Real>>> measurements;
+  measurements.reserve(number_of_samples + 1);
+  const Real hz_per_code = (h->clk/4) / (1<<27);
+  DeadlineScope deadline(h, sweep_budget(start*hz_per_code, number_of_samples, h->clk, settling_periods(h)),
+			 "acquire_sweep");
   auto cur_freq = start;
-  int i=0;
   uint8_t sreg;
   for ( ;; )
     {
-      long double ar = ( cur_freq );
-      true_freq = ar/ ( (1<<27)/(clk/4)) ;
+      AD5933_TRACE_ARG("point", "index", measurements.size());
       /*Read SREG for valid impedance meausurement*/
-      uint8_t impedance_valid=0;
-      std::bitset<8> sregB(h->get_status());
-      //      std::cout<<sregB<< "sreg before\n";
-      do
-        {
-	  sreg = h->get_status();
-          impedance_valid = sreg & SREG_IMPED_VALID;
-        }
-      while ( !impedance_valid );
-      sregB = h->get_status();
-      //      std::cout<<sregB<<"sreg after"<<std::endl;
-      auto z = h->read_measurement();
-      measurements.push_back ( make_pair ( true_freq,z ) );
+      {
+	AD5933_TRACE("wait_status");
+	do
+	  {
+	    if (h->read_register(sreg, SREG) < 0)
+	      {
+		return measurements;
+	      }
+	  }
+	while ( !(sreg & SREG_IMPED_VALID) );
+      }
+      int16_t re = 0, im = 0;
+      if (h->read_raw(re, im) < 0)
+	{
+	  break;
+	}
+      std::complex<Real> z(re, im);
+      measurements.push_back ( make_pair ( cur_freq*hz_per_code,z ) );
+      if (on_point)
+	{
+	  on_point(measurements.size() - 1, measurements.back().first, z);
+	}
       cur_freq+=inc;
-      i++;
-      sreg = h->get_status();
+      if (h->read_register(sreg, SREG) < 0)
+	{
+	  break;
+	}
       if ( sreg & SREG_SWEEP_VALID ) break;
       h->increase_frequency();
     }
   return measurements;
 }
 
+//!Execute frequency sweep.
+/*! 
+\param lower Starting frequency of the sweep.
+\param number_of_samples Frequencies measured in the sweep
+\param step Distance between frequencies meausured in the sweep.
+\param h Handle to the device object.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+
+The function implements the flowchart on page 20 of the data sheet. Results are
+in real_t precision unless another is given, e.g. sweep_frequency<float>().
+The sweep is bounded by sweep_budget(), see acquire_sweep().
+*/
+template <typename Real = real_t>
+std::vector<  std::pair<Real,  std::complex<Real> > > sweep_frequency ( typename non_deduced<Real>::type lower,uint32_t number_of_samples,
+								      typename non_deduced<Real>::type step, AD5933* h,
+								      const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr )
+{
+  long double clk = h->clk;
+  uint32_t start = frequency_code(lower, clk);
+  uint32_t inc = frequency_code(step, clk);
+  DeadlineScope deadline(h, sweep_budget(lower, number_of_samples, clk, settling_periods(h)), "sweep_frequency");
+  prepare_sweep(start, inc, number_of_samples, h);
+
+#ifdef DEBUG
+  std::cout<<"clock "<<clk<<"\n";
+  printf("lower %Lf start = 0x%X,inc = 0x%X\n",(long double)lower,start,inc);
+  printf("Set frequency: 0x%X\n",h->get_frequency());
+#endif
+  
+  auto measurements = acquire_sweep<Real>(start, inc, number_of_samples, h, on_point);
+  return measurements;
+}
+
+//!Execute frequency sweep described by a configuration.
+/*!
+\param config The sweep configuration.
+\param h Handle to the device object.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+
+Applies the configuration to the device and then runs sweep_frequency().
+*/
+template <typename Real = real_t>
+std::vector<  std::pair<Real,  std::complex<Real> > > sweep_frequency ( const SweepConfig &config, AD5933* h,
+								      const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr )
+{
+  h->configure(config);
+  return sweep_frequency<Real>(config.start, config.steps, config.step, h, on_point);
+}
+
 
 /*!
 \brief Measure temperature.
@@ -1092,32 +1845,69 @@ This method sends the command for measuring the temperature, waits for a valid
 measurement, reads the meausrements from the appropriate registers and then
 returns a double with the temperature in Celsius.
 */
-double AD5933::measure_temperature()
+inline double AD5933::measure_temperature()
 {
-  uint8_t mask=0x0F;
-  ctrl_reg2 &= mask;
-  ctrl_reg2 |= MEAS_TEMP;
-  write_register(ctrl_reg2, CTRL_MSB);
-  uint8_t hi,lo;
-  int temp_valid=0;
   double temperature;
-  do
+  auto err = read_temperature(temperature);
+  if (err<0)
     {
-      auto sreg =get_status();
-      temp_valid = sreg & SREG_TEMP_VALID;
+      log_error("%s\n",libusb_strerror(libusb_error(err)));
+      std::abort();
     }
-  while ( temp_valid == 0 );
-  read_register(hi, TEMPERATURE_MSB);
-  read_register(lo, TEMPERATURE_LSB);
+  return temperature;
+}
+
+//! Convert the temperature registers to Celsius.
+/*!
+\param hi Contents of TEMPERATURE_MSB.
+\param lo Contents of TEMPERATURE_LSB.
+*/
+inline double temperature_celsius(uint8_t hi, uint8_t lo)
+{
   if ( hi >> 5 )
     {
-      temperature = ( ( ( ( hi&0xff ) <<8 ) | ( lo&0xff ) ) - 16384 ) / 32.0;
+      return ( ( ( ( hi&0xff ) <<8 ) | ( lo&0xff ) ) - 16384 ) / 32.0;
     }
   else
     {
-      temperature = ( ( ( hi&0xff ) <<8 ) | ( lo&0xff ) ) /32.0;
+      return ( ( ( hi&0xff ) <<8 ) | ( lo&0xff ) ) /32.0;
     }
-  return temperature;
+}
+
+//! Measure the temperature without aborting on errors.
+/*!
+\param temperature The temperature in Celsius.
+\return 0 on success or a libusb_error code, LIBUSB_ERROR_TIMEOUT if no
+result came within TEMPERATURE_BUDGET.
+*/
+inline int AD5933::read_temperature(double &temperature)
+{
+  AD5933_TRACE("temperature");
+  DeadlineScope deadline(this, TEMPERATURE_BUDGET, "read_temperature");
+  auto err = set_mode(MEAS_TEMP);
+  if (err<0)
+    {
+      return err;
+    }
+  uint8_t sreg = 0;
+  {
+    AD5933_TRACE("wait_status");
+    do
+      {
+	if ((err = read_status(sreg))<0)
+	  {
+	    return err;
+	  }
+      }
+    while ( !(sreg & SREG_TEMP_VALID) );
+  }
+  uint8_t hi,lo;
+  if ((err = read_register(hi, TEMPERATURE_MSB))<0 || (err = read_register(lo, TEMPERATURE_LSB))<0)
+    {
+      return err;
+    }
+  temperature = temperature_celsius(hi, lo);
+  return 0;
 }
 
 
@@ -1133,14 +1923,19 @@ gain calculation to be meaningful.
 \returns A vector of pairs, which each contains the frequency and the
 corresponding gain factor.
 */
-std::vector<std::pair<long double,long double>>
-calibrate_gain(const std::vector<std::pair<long double,complex_t>> &measurements,
-	       const long double &calibration_resistance)
+template <typename Real>
+std::vector<std::pair<Real,Real>>
+calibrate_gain(const std::vector<std::pair<Real,std::complex<Real>>> &measurements,
+	       const typename non_deduced<Real>::type &calibration_resistance)
 {
-  std::vector<std::pair<long double,long double>> gains;
+  AD5933_TRACE("calibrate_gain");
+  std::vector<std::pair<Real,Real>> gains;
+  gains.reserve(measurements.size());
   for (const auto& i: measurements)
   {
-    auto temp = std::abs( i.second)*calibration_resistance;
+    // The DFT values are small integers, so the plain square root of the
+    // norm is exact enough and cheaper than std::abs().
+    auto temp = std::sqrt(std::norm( i.second))*calibration_resistance;
     gains.push_back(std::make_pair(i.first,1/temp));
   }
   return gains;
@@ -1154,14 +1949,17 @@ calibrate_gain(const std::vector<std::pair<long double,complex_t>> &measurements
 known calibration resistance.
 \return A vector of pairs, each containing the frequency of the measurement and the
 impedance measured at that frequency.*/
-std::vector<std::pair<long double, long double>>
-calculate_magnitude(const std::vector<std::pair<long double,complex_t>> &measurements,
-		    const std::vector<std::pair<long double,long double>> &gains)
+template <typename Real>
+std::vector<std::pair<Real, Real>>
+calculate_magnitude(const std::vector<std::pair<Real,std::complex<Real>>> &measurements,
+		    const std::vector<std::pair<Real,Real>> &gains)
 {
-  std::vector<std::pair<long double, long double>> magnitude;
-  for (int i=0;i<measurements.size();++i)
+  AD5933_TRACE("calculate_magnitude");
+  std::vector<std::pair<Real, Real>> magnitude;
+  magnitude.reserve(measurements.size());
+  for (size_t i=0;i<measurements.size();++i)
   {
-    auto temp = std::abs(measurements[i].second)*gains[i].second;
+    auto temp = std::sqrt(std::norm(measurements[i].second))*gains[i].second;
     magnitude.push_back(std::make_pair(measurements[i].first,1/temp));
   }
   return magnitude;
@@ -1174,11 +1972,12 @@ calculate_magnitude(const std::vector<std::pair<long double,complex_t>> &measure
 \param g1 The second existing data point.
 \returns The interpolated value.
 */
-long double interpolate(long double f,
-			const std::pair<long double, long double> &g0,
-			const std::pair<long double, long double> &g1)
+template <typename Real>
+Real interpolate(typename non_deduced<Real>::type f,
+		 const std::pair<Real, Real> &g0,
+		 const std::pair<Real, Real> &g1)
 {
-  long double new_gain = 0;
+  Real new_gain = 0;
   if (std::abs(g0.first-f)<0.1)
     {
       new_gain = g0.second;
@@ -1195,18 +1994,48 @@ long double interpolate(long double f,
   return new_gain;
 }
 
+//!Whether two sets of points have the same frequencies.
+/*!
+\param a Frequency, value pairs.
+\param b Frequency, value pairs.
+\return True if both have as many points and every frequency is within 0.1 Hz
+of the one with the same index, the tolerance of interpolate().
+
+Tells whether a calibration can be used as it is, or has to be interpolated
+with calc_multigains(); the same number of points alone does not mean the
+same grid.
+*/
+template <typename Real, typename T, typename U>
+bool same_frequencies(const std::vector<std::pair<Real, T>> &a, const std::vector<std::pair<Real, U>> &b)
+{
+  if (a.size() != b.size())
+    {
+      return false;
+    }
+  for (size_t i = 0; i < a.size(); i++)
+    {
+      if (!(std::abs(a[i].first - b[i].first) < 0.1))
+	{
+	  return false;
+	}
+    }
+  return true;
+}
+
 //!Interpolate the gain factors based on the calibration data.
 /*!
  \param adm Reference to the vector containing the frequency, gain pairs to be calculated.
  \param cal Reference to the vector containing to the known frequency, gain
  pairs.
 */
-template <typename T>
-std::vector<std::pair<long double, long double>>
-calc_multigains(const std::vector<std::pair<long double, T>> &adm,
-		const std::vector<std::pair<long double, long double>> &cal)
+template <typename Real, typename T>
+std::vector<std::pair<Real, Real>>
+calc_multigains(const std::vector<std::pair<Real, T>> &adm,
+		const std::vector<std::pair<Real, Real>> &cal)
 {
-  std::vector< std::pair<long double, long double>> new_g;
+  AD5933_TRACE("calc_multigains");
+  std::vector< std::pair<Real, Real>> new_g;
+  new_g.reserve(adm.size());
   // Gains were calibrated at higher frequencies, use the gain calibrated at the lowest frequency
   size_t k=0;
   while (k<adm.size() && adm[k].first<cal[0].first)
@@ -1239,37 +2068,27 @@ calc_multigains(const std::vector<std::pair<long double, T>> &adm,
 \param mag Frequency, Impedance magnitude pairs
 \param phase Frequency, Impedance phase pairs
 \param adm Frequency, Admittance pairs
+\param path Name of the output file.
+\return 0, or -1 with errno set; EINVAL if the vectors differ in size.
 
 This function saves the measurement data to a .csv file using the same format as
 the one used by the Windows utility provided by Analog Devices. The output file
-is called */
-void write_to_file(const std::vector<std::pair<long double, long double>> &mag,
-		   const std::vector<std::pair<long double, long double>> &phase,
-		   const std::vector<std::pair<long double, complex_t>> &adm)
+is called output.csv unless another path is given. See CsvWriter for naming
+files after the sweep and for appending. */
+template <typename Real>
+int write_to_file(const std::vector<std::pair<Real, Real>> &mag,
+		  const std::vector<std::pair<Real, Real>> &phase,
+		  const std::vector<std::pair<Real, std::complex<Real>>> &adm,
+		  const char *path = "output.csv")
 {
-  if (mag.size()!=phase.size() || phase.size() !=adm.size())
-    {
-      fprintf(stderr, "write_to_file: Argument size not equal");
-      std::abort();
-    }
-  std::string header = "Frequency,Impedance,Phase,Real,Imaginary,Magnitutude\n";
-  FILE *fp =  fopen("output.csv","w");
-  if (fp==NULL)
+  AD5933_TRACE("write_to_file");
+  thread_local std::string buffer;
+  if (write_sweep_csv(path, mag, phase, adm, false, buffer) < 0)
     {
-      perror(NULL);
-      return;
+      int saved = errno;
+      log_error("write_to_file: %s: %s\n", path, strerror(saved));
+      errno = saved;
+      return -1;
     }
-  fprintf(fp, "%s", header.c_str());
-  for (size_t i = 0; i<mag.size();++i)
-    {
-      auto err= fprintf(fp,"%Lf,%Lf,%Lf,%Lf,%Lf,%Lf\n",
-			mag[i].first,mag[i].second,phase[i].second,
-			adm[i].second.real(),adm[i].second.imag(),std::abs(adm[i].second));
-      if (err<0)
-	{
-	  perror(NULL);
-	  return;
-	}
-    }
-  fclose(fp);
+  return 0;
 }
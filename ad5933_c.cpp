@@ -0,0 +1,446 @@
+//C interface of the AD5933 library, see ad5933_c.h. Built into libad5933.so
+//and libad5933.a; nothing in here is used by the ad5933 program.
+#include <math.h>
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "ad5933_c.h"
+
+struct ad5933_device
+{
+  AD5933 dev;
+  SweepConfig config;
+  //! Gain factor per point of the configured sweep, empty if not calibrated.
+  std::vector<double> gains;
+  //! System phase in degrees per point of the configured sweep.
+  std::vector<double> system_phase;
+
+  explicit ad5933_device(libusb_context *ctx) : dev(ctx) {}
+};
+
+namespace
+{
+  std::once_flag silence_once;
+  std::mutex context_mutex;
+  libusb_context *context = NULL;
+  //! Open devices and calls in progress that use the context.
+  unsigned context_users = 0;
+
+  //! The library is silent until ad5933_set_log() is called.
+  void silence()
+  {
+    std::call_once(silence_once, []()
+      {
+	log_stream = NULL;
+	error_stream = NULL;
+      });
+  }
+
+  //! Take a reference to the library context, created on first use.
+  int acquire_context(libusb_context *&ctx)
+  {
+    silence();
+    std::lock_guard<std::mutex> lock(context_mutex);
+    if (context_users == 0)
+      {
+	int err = libusb_init(&context);
+	if (err)
+	  {
+	    return err;
+	  }
+      }
+    context_users++;
+    ctx = context;
+    return 0;
+  }
+
+  //! Drop a reference taken by acquire_context(). The last one exits libusb.
+  void release_context()
+  {
+    std::lock_guard<std::mutex> lock(context_mutex);
+    if (--context_users == 0)
+      {
+	libusb_exit(context);
+	context = NULL;
+      }
+  }
+
+  //! Releases the context at the end of a scope unless kept.
+  struct ContextReference
+  {
+    bool kept = false;
+    ~ContextReference()
+    {
+      if (!kept)
+	{
+	  release_context();
+	}
+    }
+  };
+
+  //! Run the body of an API function, turning exceptions into error codes.
+  template <typename F>
+  int guarded(F &&body)
+  {
+    try
+      {
+	return body();
+      }
+    catch (const std::bad_alloc&)
+      {
+	return LIBUSB_ERROR_NO_MEM;
+      }
+    catch (...)
+      {
+	return AD5933_ERROR_INTERNAL;
+      }
+  }
+
+  //! Program the configured sweep and measure it, passing every point to sink.
+  /*! sink(index, point) returns 0 to go on or an error code to stop. Like
+    acquire_sweep() the sweep is bounded by sweep_budget(), and fails with
+    LIBUSB_ERROR_TIMEOUT once it is overrun. */
+  template <typename Sink>
+  int run_sweep(ad5933_device *d, Sink &&sink)
+  {
+    AD5933 &h = d->dev;
+    const SweepConfig &c = d->config;
+    uint32_t start = frequency_code(c.start, h.clk);
+    uint32_t inc = frequency_code(c.step, h.clk);
+    const long double hz_per_code = (h.clk/4) / (1<<27);
+    h.error = 0;
+    DeadlineScope deadline(&h, sweep_budget(c, h.int_clk), "ad5933_sweep");
+    prepare_sweep(start, inc, c.steps, &h);
+    if (h.error)
+      {
+	return h.error;
+      }
+    bool calibrated = d->gains.size() == c.steps + 1;
+    for (uint32_t index = 0; ; index++)
+      {
+	uint8_t sreg = 0;
+	int err;
+	do
+	  {
+	    if ((err = h.read_status(sreg)) < 0)
+	      {
+		return err;
+	      }
+	  }
+	while ( !(sreg & SREG_IMPED_VALID) );
+	int16_t re, im;
+	if ((err = h.read_raw(re, im)) < 0)
+	  {
+	    return err;
+	  }
+	ad5933_point p;
+	p.frequency = (start + static_cast<uint64_t>(index)*inc) * hz_per_code;
+	p.re = re;
+	p.im = im;
+	if (calibrated && index <= c.steps)
+	  {
+	    p.magnitude = 1/(hypot(p.re, p.im)*d->gains[index]);
+	    p.phase = atan2(p.im, p.re)*(180/M_PI) - d->system_phase[index];
+	  }
+	else
+	  {
+	    p.magnitude = NAN;
+	    p.phase = NAN;
+	  }
+	if ((err = sink(index, p)) != 0)
+	  {
+	    h.set_standby();
+	    return err;
+	  }
+	if ((err = h.read_status(sreg)) < 0)
+	  {
+	    return err;
+	  }
+	if ( sreg & SREG_SWEEP_VALID )
+	  {
+	    return 0;
+	  }
+	if ((err = h.set_mode(INC_FREQ)) < 0)
+	  {
+	    return err;
+	  }
+      }
+  }
+}
+
+extern "C" {
+
+int ad5933_count(void)
+{
+  return guarded([&]()
+    {
+      libusb_context *ctx;
+      int err = acquire_context(ctx);
+      if (err)
+	{
+	  return err;
+	}
+      ContextReference reference;
+      return count_devices(ctx);
+    });
+}
+
+int ad5933_open(int index, const char *firmware, ad5933_device **device)
+{
+  if (device == NULL || index < 0)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  *device = NULL;
+  return guarded([&]()
+    {
+      libusb_context *ctx;
+      int err = acquire_context(ctx);
+      if (err)
+	{
+	  return err;
+	}
+      // The device keeps the reference until ad5933_close().
+      ContextReference reference;
+      auto d = new ad5933_device(ctx);
+      if (firmware)
+	{
+	  d->dev.firmware = firmware;
+	}
+      if ((err = d->dev.open(index)) != 0)
+	{
+	  delete d;
+	  return err;
+	}
+      d->dev.configure(d->config);
+      if ((err = d->dev.error) != 0)
+	{
+	  d->dev.close();
+	  delete d;
+	  return err;
+	}
+      *device = d;
+      reference.kept = true;
+      return 0;
+    });
+}
+
+void ad5933_close(ad5933_device *device)
+{
+  if (device)
+    {
+      device->dev.set_standby();
+      device->dev.close();
+      delete device;
+      release_context();
+    }
+}
+
+void ad5933_default_config(ad5933_config *config)
+{
+  SweepConfig c;
+  config->start = c.start;
+  config->steps = c.steps;
+  config->step = c.step;
+  config->voltage = AD5933_OUTPUT_2VPP;
+  config->gain = 1;
+  config->settling_cycles = c.settling_cycles;
+  config->settling_multiplier = 1;
+  config->external_clock = 0;
+  config->external_clock_frequency = c.ext_clk;
+}
+
+int ad5933_configure(ad5933_device *device, const ad5933_config *config)
+{
+  if (device == NULL || config == NULL)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  const Voltage voltages[] = {Voltage::OUTPUT_2Vpp, Voltage::OUTPUT_200mVpp,
+			      Voltage::OUTPUT_400mVpp, Voltage::OUTPUT_1Vpp};
+  SweepConfig c;
+  c.start = config->start;
+  c.steps = config->steps;
+  c.step = config->step;
+  c.settling_cycles = config->settling_cycles;
+  c.clock = config->external_clock ? Clk::EXT : Clk::INT;
+  c.ext_clk = config->external_clock_frequency;
+  long double clk = config->external_clock ? c.ext_clk : device->dev.int_clk;
+  if (config->voltage < 0 || config->voltage > 3 || (config->gain != 1 && config->gain != 5)
+      || (config->settling_multiplier != 1 && config->settling_multiplier != 2 && config->settling_multiplier != 4)
+      || c.steps > 511 || c.settling_cycles > 511 || !(c.start > 0) || !(c.step >= 0) || !(clk > 0)
+      || c.start + c.steps*c.step >= clk/4)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  c.voltage = voltages[config->voltage];
+  c.gain = config->gain == 5 ? Gain::PGA5x : Gain::PGA1x;
+  c.multiplier = config->settling_multiplier == 4 ? SettlingMultiplier::MUL_4x :
+    config->settling_multiplier == 2 ? SettlingMultiplier::MUL_2x : SettlingMultiplier::MUL_1x;
+  return guarded([&]()
+    {
+      device->dev.error = 0;
+      device->dev.configure(c);
+      int err = device->dev.error;
+      const SweepConfig &old = device->config;
+      if (err)
+	{
+	  // Some registers and the clock of the handle may already be the new
+	  // ones. Put the old configuration back, sweeps keep using it.
+	  device->dev.configure(old);
+	  return err;
+	}
+      if (old.start != c.start || old.steps != c.steps || old.step != c.step || old.clock != c.clock
+	  || old.ext_clk != c.ext_clk)
+	{
+	  device->gains.clear();
+	  device->system_phase.clear();
+	}
+      device->config = c;
+      return 0;
+    });
+}
+
+size_t ad5933_sweep_points(const ad5933_device *device)
+{
+  return device ? device->config.steps + 1 : 0;
+}
+
+int ad5933_sweep(ad5933_device *device, ad5933_point *points, size_t capacity, size_t *count)
+{
+  if (device == NULL || points == NULL || count == NULL)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  *count = 0;
+  if (capacity < ad5933_sweep_points(device))
+    {
+      return AD5933_ERROR_BUFFER_TOO_SMALL;
+    }
+  return guarded([&]()
+    {
+      return run_sweep(device, [&](uint32_t index, const ad5933_point &p)
+	{
+	  if (index >= capacity)
+	    {
+	      return AD5933_ERROR_BUFFER_TOO_SMALL;
+	    }
+	  points[index] = p;
+	  *count = index + 1;
+	  return 0;
+	});
+    });
+}
+
+int ad5933_sweep_alloc(ad5933_device *device, ad5933_result **result)
+{
+  if (device == NULL || result == NULL)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  *result = NULL;
+  size_t n = ad5933_sweep_points(device);
+  // The points follow the header in the same allocation.
+  auto r = static_cast<ad5933_result*>(malloc(sizeof(ad5933_result) + n*sizeof(ad5933_point)));
+  if (r == NULL)
+    {
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  r->points = reinterpret_cast<ad5933_point*>(r + 1);
+  int err = ad5933_sweep(device, r->points, n, &r->count);
+  if (err)
+    {
+      free(r);
+      return err;
+    }
+  *result = r;
+  return 0;
+}
+
+void ad5933_result_free(ad5933_result *result)
+{
+  free(result);
+}
+
+int ad5933_sweep_stream(ad5933_device *device, ad5933_point_fn callback, void *user)
+{
+  if (device == NULL || callback == NULL)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  return guarded([&]()
+    {
+      return run_sweep(device, [&](uint32_t index, const ad5933_point &p)
+	{
+	  return callback(user, index, &p) ? AD5933_ERROR_STOPPED : 0;
+	});
+    });
+}
+
+int ad5933_calibrate(ad5933_device *device, double resistance)
+{
+  if (device == NULL || !(resistance > 0))
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  return guarded([&]()
+    {
+      device->gains.clear();
+      device->system_phase.clear();
+      std::vector<double> gains, phase;
+      gains.reserve(ad5933_sweep_points(device));
+      phase.reserve(ad5933_sweep_points(device));
+      int err = run_sweep(device, [&](uint32_t, const ad5933_point &p)
+	{
+	  gains.push_back(1/(hypot(p.re, p.im)*resistance));
+	  phase.push_back(atan2(p.im, p.re)*(180/M_PI));
+	  return 0;
+	});
+      if (err)
+	{
+	  return err;
+	}
+      device->gains.swap(gains);
+      device->system_phase.swap(phase);
+      return 0;
+    });
+}
+
+int ad5933_temperature(ad5933_device *device, double *celsius)
+{
+  if (device == NULL || celsius == NULL)
+    {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  return guarded([&]()
+    {
+      return device->dev.read_temperature(*celsius);
+    });
+}
+
+const char *ad5933_strerror(int error)
+{
+  switch (error)
+    {
+    case AD5933_ERROR_BUFFER_TOO_SMALL:
+      return "Result buffer too small";
+    case AD5933_ERROR_STOPPED:
+      return "Stopped by the callback";
+    case AD5933_ERROR_INTERNAL:
+      return "Internal error";
+    default:
+      return libusb_strerror(libusb_error(error));
+    }
+}
+
+void ad5933_set_log(FILE *messages, FILE *errors)
+{
+  silence();
+  log_stream = messages;
+  error_stream = errors;
+}
+
+}
@@ -0,0 +1,157 @@
+/*! \file
+  C interface of the AD5933 library (libad5933).
+
+  Every function returns 0 or a positive count on success and a negative error
+  code on failure; ad5933_strerror() describes the codes. The library never
+  prints and never terminates the process. A device may be used by one thread
+  at a time; different devices may be used concurrently.
+*/
+#ifndef AD5933_C_H
+#define AD5933_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The library is built with hidden visibility; only these are exported. */
+#if defined(__GNUC__)
+#define AD5933_API __attribute__((visibility("default")))
+#else
+#define AD5933_API
+#endif
+
+/*! Version of this interface. Changes only when existing declarations change. */
+#define AD5933_API_VERSION 1
+
+/* Error codes. -1 to -99 are the libusb error codes (LIBUSB_ERROR_IO etc.),
+   the following are the library's own. */
+/*! Too small a result buffer. */
+#define AD5933_ERROR_BUFFER_TOO_SMALL (-100)
+/*! The stream callback asked to stop. */
+#define AD5933_ERROR_STOPPED (-101)
+/*! An unexpected internal failure. */
+#define AD5933_ERROR_INTERNAL (-102)
+
+/*! Excitation voltages. */
+enum ad5933_voltage
+{
+  AD5933_OUTPUT_2VPP = 0,
+  AD5933_OUTPUT_200MVPP = 1,
+  AD5933_OUTPUT_400MVPP = 2,
+  AD5933_OUTPUT_1VPP = 3
+};
+
+/*! An open evaluation board. */
+typedef struct ad5933_device ad5933_device;
+
+/*! Settings of a sweep. Fill with ad5933_default_config() first. */
+typedef struct ad5933_config
+{
+  /*! First frequency in Hz. */
+  double start;
+  /*! Number of increments; a sweep has steps + 1 points. At most 511. */
+  uint32_t steps;
+  /*! Frequency increment in Hz. */
+  double step;
+  /*! An ad5933_voltage. */
+  int voltage;
+  /*! PGA gain, 1 or 5. */
+  int gain;
+  /*! Settling cycles before every point, at most 511. */
+  uint32_t settling_cycles;
+  /*! Settling cycle multiplier, 1, 2 or 4. */
+  int settling_multiplier;
+  /*! Nonzero to use the external clock. */
+  int external_clock;
+  /*! Frequency of the external clock in Hz. */
+  double external_clock_frequency;
+} ad5933_config;
+
+/*! One measured point. */
+typedef struct ad5933_point
+{
+  /*! Frequency in Hz. */
+  double frequency;
+  /*! Real part of the DFT. */
+  double re;
+  /*! Imaginary part of the DFT. */
+  double im;
+  /*! Impedance magnitude in Ohm, NAN if the device is not calibrated. */
+  double magnitude;
+  /*! Impedance phase in degrees, NAN if the device is not calibrated. */
+  double phase;
+} ad5933_point;
+
+/*! Points of a sweep in one allocation. Free with ad5933_result_free(). */
+typedef struct ad5933_result
+{
+  size_t count;
+  ad5933_point *points;
+} ad5933_result;
+
+/*! Called for every point of a streamed sweep, in order. Return nonzero to
+  stop the sweep, which then fails with AD5933_ERROR_STOPPED. */
+typedef int (*ad5933_point_fn)(void *user, uint32_t index, const ad5933_point *point);
+
+/*! Number of evaluation boards on the bus, or an error code. */
+AD5933_API int ad5933_count(void);
+
+/*! Open a board, download its firmware and apply the default configuration.
+  \param index Which board, from 0 to ad5933_count() - 1.
+  \param firmware Path of the FX2LP firmware, NULL for ./AD5933_34FW.hex.
+  \param device Receives the device. */
+AD5933_API int ad5933_open(int index, const char *firmware, ad5933_device **device);
+
+/*! Close a device. NULL is ignored. libusb is shut down with the last open
+  device. */
+AD5933_API void ad5933_close(ad5933_device *device);
+
+/*! Fill a configuration with the defaults. */
+AD5933_API void ad5933_default_config(ad5933_config *config);
+
+/*! Check and apply a configuration. It stays in effect for all later sweeps
+  and clears the calibration if the frequencies change. If it cannot be
+  applied, the previous configuration and calibration are kept. */
+AD5933_API int ad5933_configure(ad5933_device *device, const ad5933_config *config);
+
+/*! Number of points of a sweep with the current configuration. */
+AD5933_API size_t ad5933_sweep_points(const ad5933_device *device);
+
+/*! Sweep into a caller-provided buffer.
+  \param points At least ad5933_sweep_points() entries.
+  \param capacity Size of points.
+  \param count Receives the number of points written. */
+AD5933_API int ad5933_sweep(ad5933_device *device, ad5933_point *points, size_t capacity, size_t *count);
+
+/*! Sweep into a buffer allocated by the library. */
+AD5933_API int ad5933_sweep_alloc(ad5933_device *device, ad5933_result **result);
+
+/*! Free a result of ad5933_sweep_alloc(). NULL is ignored. */
+AD5933_API void ad5933_result_free(ad5933_result *result);
+
+/*! Sweep and hand every point to a callback as soon as it is measured. */
+AD5933_API int ad5933_sweep_stream(ad5933_device *device, ad5933_point_fn callback, void *user);
+
+/*! Calibrate with a known resistor on the current configuration. Later
+  sweeps fill in magnitude and phase. */
+AD5933_API int ad5933_calibrate(ad5933_device *device, double resistance);
+
+/*! Measure the temperature of the chip in Celsius. */
+AD5933_API int ad5933_temperature(ad5933_device *device, double *celsius);
+
+/*! Description of an error code. */
+AD5933_API const char *ad5933_strerror(int error);
+
+/*! Send the library's progress and error messages to streams. Both are NULL,
+  i.e. silent, by default. */
+AD5933_API void ad5933_set_log(FILE *messages, FILE *errors);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,188 @@
+/*! \file */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+
+//! Settings of an adaptive sweep.
+struct AdaptiveOptions
+{
+  //! Points of the initial, evenly spaced grid, 2 to 512.
+  uint32_t coarse_points = 32;
+  //! Total number of points that may be measured, the coarse grid included.
+  //! At least the 2 points of the coarse grid are measured.
+  uint32_t budget = 200;
+  //! Largest phase change between neighbouring points, in degrees.
+  double phase_tolerance = 2;
+  //! Largest relative magnitude change between neighbouring points.
+  double magnitude_tolerance = 0.02;
+  //! Intervals narrower than this are never split, in Hz.
+  double min_step = 1;
+  //! Most points added to one interval in one round.
+  uint32_t max_split = 8;
+  //! Time the excitation is given to settle before every segment.
+  std::chrono::microseconds settle{10000};
+};
+
+//! What an adaptive sweep did.
+struct AdaptiveReport
+{
+  //! Points measured.
+  uint32_t points = 0;
+  //! Sweeps programmed, the coarse one included.
+  uint32_t segments = 0;
+  //! Refinement rounds.
+  uint32_t rounds = 0;
+  //! Every interval met the tolerances (or reached min_step) before the
+  //! budget ran out.
+  bool converged = false;
+  //! 0, or the libusb_error code of the segment that ended the sweep early.
+  //! converged is false then.
+  int error = 0;
+};
+
+//!Measure a short linear segment.
+/*!
+\param lower First frequency.
+\param increments Number of increments; the segment has increments + 1 points.
+\param step Frequency increment.
+\param h Handle to the device object.
+\param settle Time the excitation is given to settle after the initialize command.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+
+Like sweep_frequency(), but with a short settling wait instead of the fixed
+sleeps, so that many small segments are cheap.
+*/
+template <typename Real = real_t>
+std::vector<std::pair<Real, std::complex<Real>>> sweep_segment ( typename non_deduced<Real>::type lower, uint32_t increments,
+								 typename non_deduced<Real>::type step, AD5933* h,
+								 std::chrono::microseconds settle,
+								 const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr )
+{
+  uint32_t start = frequency_code(lower, h->clk);
+  uint32_t inc = frequency_code(step, h->clk);
+  h->set_starting_frequency(start);
+  h->set_frequency_step(inc);
+  h->set_step_number(increments);
+  h->set_standby();
+  h->initilize_frequency();
+  {
+    AD5933_TRACE("sleep");
+    std::this_thread::sleep_for(settle);
+  }
+  h->start_sweep();
+  return acquire_sweep<Real>(start, inc, increments, h, on_point);
+}
+
+//!Execute an adaptive frequency sweep.
+/*!
+\param lower Lowest frequency.
+\param upper Highest frequency.
+\param h Handle to the device object.
+\param options Grid, budget and tolerances.
+\param report Receives what the sweep did, may be NULL.
+\return Frequency, admittance pairs sorted by frequency.
+
+Starts from a coarse grid and then, round by round, splits the intervals in
+which the phase or the magnitude changes by more than the tolerance, the
+fastest changing first, until every interval is within tolerance or the point
+budget is spent. The added points of an interval are measured as one short
+linear segment. Magnitude and phase are those of the raw admittance; the
+system response is smooth, so they change where the impedance does.
+
+A segment that returns fewer points than it was programmed for, because a
+transfer failed or it overran its budget, ends the sweep: the points measured
+so far are returned and report->error tells why.
+*/
+template <typename Real = real_t>
+std::vector<std::pair<Real, std::complex<Real>>> sweep_adaptive ( typename non_deduced<Real>::type lower,
+								  typename non_deduced<Real>::type upper, AD5933* h,
+								  const AdaptiveOptions &options = AdaptiveOptions(),
+								  AdaptiveReport *report = NULL )
+{
+  AdaptiveReport r;
+  // The coarse grid needs both ends, and one sweep has at most 511 increments.
+  const uint32_t budget = std::max<uint32_t>(2, options.budget);
+  uint32_t coarse = std::max<uint32_t>(2, std::min({options.coarse_points, budget, 512u}));
+  h->error = 0;
+  auto points = sweep_segment<Real>(lower, coarse - 1, (upper - lower)/(coarse - 1), h, options.settle);
+  r.segments = 1;
+  if (points.size() < coarse)
+    {
+      r.error = h->error ? h->error : LIBUSB_ERROR_IO;
+    }
+
+  struct Interval
+  {
+    size_t left;
+    double score;
+  };
+  std::vector<Interval> wide;
+  while (r.error == 0)
+    {
+      wide.clear();
+      for (size_t i = 0; i + 1 < points.size(); i++)
+	{
+	  const auto &a = points[i];
+	  const auto &b = points[i + 1];
+	  if (b.first - a.first < 2*options.min_step)
+	    {
+	      continue;
+	    }
+	  double dphi = std::abs(std::arg(b.second/a.second))*(180/M_PI);
+	  double ma = std::abs(a.second), mb = std::abs(b.second);
+	  double dmag = std::abs(mb - ma)/std::max(std::min(ma, mb), 1e-30);
+	  double score = std::max(dphi/options.phase_tolerance, dmag/options.magnitude_tolerance);
+	  if (score > 1)
+	    {
+	      wide.push_back(Interval{i, score});
+	    }
+	}
+      uint32_t left = points.size() < budget ? budget - points.size() : 0;
+      if (wide.empty() || left == 0)
+	{
+	  r.converged = wide.empty();
+	  break;
+	}
+      std::sort(wide.begin(), wide.end(), [](const Interval &a, const Interval &b) { return a.score > b.score; });
+      std::vector<std::pair<Real, std::complex<Real>>> added;
+      for (const auto &w: wide)
+	{
+	  if (left == 0)
+	    {
+	      break;
+	    }
+	  // Enough points to bring the interval within tolerance if the change is
+	  // even, but no closer than min_step.
+	  Real a = points[w.left].first, b = points[w.left + 1].first;
+	  uint32_t n = std::min<double>({std::ceil(w.score) - 1, double(options.max_split), double(left),
+				       std::floor((b - a)/options.min_step) - 1});
+	  n = std::max<uint32_t>(n, 1);
+	  Real step = (b - a)/(n + 1);
+	  auto seg = sweep_segment<Real>(a + step, n - 1, step, h, options.settle);
+	  added.insert(added.end(), seg.begin(), seg.end());
+	  r.segments++;
+	  if (seg.size() < n)
+	    {
+	      r.error = h->error ? h->error : LIBUSB_ERROR_IO;
+	      break;
+	    }
+	  left -= n;
+	}
+      points.insert(points.end(), added.begin(), added.end());
+      std::sort(points.begin(), points.end(),
+		[](const std::pair<Real, std::complex<Real>> &a, const std::pair<Real, std::complex<Real>> &b)
+		{ return a.first < b.first; });
+      r.rounds++;
+    }
+  r.points = points.size();
+  if (report)
+    {
+      *report = r;
+    }
+  return points;
+}
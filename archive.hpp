@@ -0,0 +1,870 @@
+/*! \file
+  Compressed long-term archive of raw sweeps.
+
+  An archive is a file header followed by records. A CONFIG record holds the
+  frequency grid of a sweep configuration, the start and increment codes and
+  the clock, once. A SWEEP record refers to its configuration and holds the
+  raw Real and Imaginary register values as residuals: each value minus its
+  prediction, zigzag mapped to an unsigned number and Golomb-Rice coded with
+  a parameter chosen per sweep and channel. The prediction of a point is the
+  same point of the previous sweep of the configuration, so that a slowly
+  changing sample costs a few bits per value. Key sweeps, the first of a
+  configuration and then every ArchiveOptions::key_interval, predict from the
+  previous point of the same sweep instead and decode on their own, which is
+  what random access starts from.
+
+  All fields are little-endian. A record cut short by a crash ends the
+  archive; everything before it stays readable.
+
+  File header:  u32 magic, u16 version, u16 reserved
+  Record:       u8 type, u32 body length, body
+  CONFIG body:  u16 id, u32 start, u32 inc, f64 clk
+  SWEEP body:   u16 config, u8 flags, u8 k_re, u8 k_im, i64 time, u32 points,
+                Rice coded re, im residuals of every point, LSB first
+*/
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "raw_sweep.hpp"
+
+//! Magic number at the start of an archive ("A5Z1").
+const uint32_t ARCHIVE_MAGIC = 0x315A3541;
+const uint16_t ARCHIVE_VERSION = 1;
+//! Bytes of the file header.
+const size_t ARCHIVE_HEADER_SIZE = 8;
+//! Bytes of a record header.
+const size_t ARCHIVE_RECORD_HEADER_SIZE = 5;
+//! Bytes of a SWEEP body before the coded residuals.
+const size_t ARCHIVE_SWEEP_HEADER_SIZE = 17;
+//! Quotients from this on are written as an escape and the 17 bit value.
+const int RICE_ESCAPE = 24;
+//! Flag of a SWEEP record that decodes on its own.
+const uint8_t ARCHIVE_KEY = 1;
+
+//! Record types of an archive.
+enum class ArchiveRecord : uint8_t
+{
+  CONFIG = 1,  /*!< Frequency grid of a configuration. */
+  SWEEP = 2    /*!< One sweep. */
+};
+
+//! Settings of an ArchiveWriter.
+struct ArchiveOptions
+{
+  //! Every this many sweeps of a configuration is a key sweep. Random access
+  //! decodes at most this many sweeps; larger values compress slightly better.
+  uint32_t key_interval = 32;
+};
+
+//! Map a residual to an unsigned number, small magnitudes to small numbers.
+inline uint32_t zigzag(int32_t v)
+{
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t v)
+{
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+//! Bits Golomb-Rice coding v takes with parameter k.
+inline uint32_t rice_bits(uint32_t v, int k)
+{
+  uint32_t q = v >> k;
+  return q < RICE_ESCAPE ? q + 1 + k : RICE_ESCAPE + 17;
+}
+
+//! The Rice parameter that codes values in the fewest bits.
+/*! Starts from the estimate of the mean and checks its neighbours. */
+inline int rice_parameter(const std::vector<uint32_t> &values)
+{
+  if (values.empty())
+    {
+      return 0;
+    }
+  uint64_t sum = 0;
+  for (uint32_t v: values)
+    {
+      sum += v;
+    }
+  uint64_t mean = sum/values.size();
+  int guess = 0;
+  while (guess < 16 && (2ull << guess) <= mean)
+    {
+      guess++;
+    }
+  int best = guess;
+  uint64_t best_bits = UINT64_MAX;
+  for (int k = std::max(guess - 1, 0); k <= std::min(guess + 1, 16); k++)
+    {
+      uint64_t bits = 0;
+      for (uint32_t v: values)
+	{
+	  bits += rice_bits(v, k);
+	}
+      if (bits < best_bits)
+	{
+	  best_bits = bits;
+	  best = k;
+	}
+    }
+  return best;
+}
+
+//! Packs Rice codes LSB first.
+class BitWriter
+{
+public:
+  std::vector<uint8_t> bytes;
+
+  //! Append a value of up to 17 bits with parameter k <= 16.
+  void put_rice(uint32_t v, int k)
+  {
+    uint32_t q = v >> k;
+    if (q < RICE_ESCAPE)
+      {
+	// q ones, the terminating zero, then the k low bits.
+	put(((1ull << q) - 1) | static_cast<uint64_t>(v & ((1u << k) - 1)) << (q + 1), q + 1 + k);
+      }
+    else
+      {
+	put(((1ull << RICE_ESCAPE) - 1) | static_cast<uint64_t>(v) << RICE_ESCAPE, RICE_ESCAPE + 17);
+      }
+  }
+
+  //! Write out the last partial byte.
+  void flush()
+  {
+    if (fill > 0)
+      {
+	bytes.push_back(acc);
+      }
+    acc = 0;
+    fill = 0;
+  }
+
+private:
+  void put(uint64_t bits, int n)
+  {
+    acc |= bits << fill;
+    fill += n;
+    while (fill >= 8)
+      {
+	bytes.push_back(acc);
+	acc >>= 8;
+	fill -= 8;
+      }
+  }
+
+  uint64_t acc = 0;
+  int fill = 0;
+};
+
+//! Reads what BitWriter wrote.
+class BitReader
+{
+public:
+  BitReader(const uint8_t *data, size_t size) : p(data), end(data + size)
+  {
+  }
+
+  uint32_t get_rice(int k)
+  {
+    if (fill < RICE_ESCAPE + 17)
+      {
+	refill();
+      }
+    int q = __builtin_ctzll(~acc | (1ull << RICE_ESCAPE));
+    uint32_t v;
+    if (q == RICE_ESCAPE)
+      {
+	v = (acc >> RICE_ESCAPE) & 0x1ffff;
+	skip(RICE_ESCAPE + 17);
+      }
+    else
+      {
+	v = (static_cast<uint32_t>(q) << k) | ((acc >> (q + 1)) & ((1u << k) - 1));
+	skip(q + 1 + k);
+      }
+    return v;
+  }
+
+  //! False if more bits were read than there are.
+  bool ok() const
+  {
+    return padding*8 <= fill;
+  }
+
+private:
+  void refill()
+  {
+    while (fill <= 56)
+      {
+	uint64_t b = 0;
+	if (p < end)
+	  {
+	    b = *p++;
+	  }
+	else
+	  {
+	    padding++;
+	  }
+	acc |= b << fill;
+	fill += 8;
+      }
+  }
+
+  void skip(int n)
+  {
+    acc >>= n;
+    fill -= n;
+  }
+
+  const uint8_t *p;
+  const uint8_t *end;
+  uint64_t acc = 0;
+  int fill = 0;
+  //! Zero bytes fed in past the end.
+  int padding = 0;
+};
+
+inline void put_le(std::vector<uint8_t> &out, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+    {
+      out.push_back(v >> 8*i);
+    }
+}
+
+inline uint64_t get_le(const uint8_t *p, int bytes)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++)
+    {
+      v |= static_cast<uint64_t>(p[i]) << 8*i;
+    }
+  return v;
+}
+
+//! Prediction of point i of a sweep; see the file description.
+inline int32_t archive_prediction(const std::vector<int16_t> &previous, const std::vector<int16_t> &current,
+				  size_t i, bool key)
+{
+  if (!key && i < previous.size())
+    {
+      return previous[i];
+    }
+  return i > 0 ? current[i - 1] : 0;
+}
+
+//! Frequency grid of a configuration in an archive.
+struct ArchiveConfig
+{
+  uint32_t start = 0;
+  uint32_t inc = 0;
+  double clk = 0;
+  //! False for ids no CONFIG record has defined.
+  bool defined = false;
+};
+
+//! Where a sweep is in an archive.
+struct ArchiveEntry
+{
+  //! File offset of the record.
+  uint64_t offset;
+  uint16_t config;
+  bool key;
+  int64_t time;
+  uint32_t points;
+};
+
+//! Writes raw sweeps to an archive.
+class ArchiveWriter
+{
+public:
+  explicit ArchiveWriter(const ArchiveOptions &options = ArchiveOptions()) : options(options)
+  {
+  }
+
+  ~ArchiveWriter()
+  {
+    close();
+  }
+
+  //! Create an archive, or continue an existing one.
+  /*!
+    \param path The file.
+    \param append Add to the archive at path if there is one. Its
+    configurations are reused and a cut off last record is dropped.
+    \return 0, or -1 with errno set; EINVAL if the file is not an archive.
+  */
+  int open(const char *path, bool append = false);
+
+  //! Append a sweep.
+  /*!
+    \param sweep The sweep. Point i must have index i, as sweep_frequency_raw()
+    returns them.
+    \param time Any time stamp the reader should get back, e.g. nanoseconds
+    since the epoch.
+    \return 0, or -1 with errno set.
+  */
+  int append(const RawSweep &sweep, int64_t time);
+
+  //! Flush and close the file.
+  /*! \return 0, or -1 with errno set. */
+  int close()
+  {
+    if (fp == NULL)
+      {
+	return 0;
+      }
+    int err = fclose(fp);
+    fp = NULL;
+    return err == 0 ? 0 : -1;
+  }
+
+  //! Bytes in the archive.
+  uint64_t size() const
+  {
+    return written;
+  }
+
+private:
+  typedef std::tuple<uint32_t, uint32_t, double> Grid;
+
+  //! Encoder state of a configuration.
+  struct State
+  {
+    uint16_t id;
+    //! Sweeps since the last key sweep.
+    uint32_t since_key = 0;
+    std::vector<int16_t> re;
+    std::vector<int16_t> im;
+  };
+
+  int write_record(ArchiveRecord type, const std::vector<uint8_t> &body)
+  {
+    uint8_t header[ARCHIVE_RECORD_HEADER_SIZE] = {static_cast<uint8_t>(type)};
+    for (int i = 0; i < 4; i++)
+      {
+	header[1 + i] = body.size() >> 8*i;
+      }
+    if (fwrite(header, sizeof(header), 1, fp) != 1 || fwrite(body.data(), body.size(), 1, fp) != 1)
+      {
+	return -1;
+      }
+    written += sizeof(header) + body.size();
+    return 0;
+  }
+
+  ArchiveOptions options;
+  FILE *fp = NULL;
+  uint64_t written = 0;
+  std::map<Grid, State> configs;
+  //! Reused between sweeps.
+  std::vector<uint32_t> residual_re, residual_im;
+  std::vector<uint8_t> body;
+};
+
+//! Reads an archive, sequentially or by sweep number.
+class ArchiveReader
+{
+public:
+  ~ArchiveReader()
+  {
+    close();
+  }
+
+  //! Open an archive.
+  /*! Only the file header is read; sweeps are found as they are needed.
+    \return 0, or -1 with errno set; EINVAL if the file is not an archive. */
+  int open(const char *path)
+  {
+    close();
+    if ((fp = fopen(path, "rb")) == NULL)
+      {
+	return -1;
+      }
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, fp) != 1 || get_le(header, 4) != ARCHIVE_MAGIC
+	|| get_le(header + 4, 2) != ARCHIVE_VERSION)
+      {
+	close();
+	errno = EINVAL;
+	return -1;
+      }
+    rewind();
+    scanned = ARCHIVE_HEADER_SIZE;
+    return 0;
+  }
+
+  void close()
+  {
+    if (fp != NULL)
+      {
+	fclose(fp);
+	fp = NULL;
+      }
+    configs.clear();
+    entries.clear();
+    complete = false;
+  }
+
+  //! Decode the next sweep.
+  /*!
+    \param sweep The sweep.
+    \param time Its time stamp, if not NULL.
+    \return 1 if a sweep was read, 0 at the end of the archive, or -1 with
+    errno set; EINVAL if the archive is corrupt.
+  */
+  int next(RawSweep &sweep, int64_t *time = nullptr)
+  {
+    for (;;)
+      {
+	ArchiveRecord type;
+	int err = read_record(position, type, body);
+	if (err <= 0)
+	  {
+	    return err;
+	  }
+	uint64_t offset = position;
+	position += ARCHIVE_RECORD_HEADER_SIZE + body.size();
+	if (type == ArchiveRecord::SWEEP)
+	  {
+	    ArchiveEntry entry;
+	    if (parse_sweep(offset, body, entry) < 0)
+	      {
+		return -1;
+	      }
+	    if (offset >= scanned)
+	      {
+		entries.push_back(entry);
+		scanned = position;
+	      }
+	    if (decode(entry, body, streams[entry.config], sweep) < 0)
+	      {
+		return -1;
+	      }
+	    if (time)
+	      {
+		*time = entry.time;
+	      }
+	    return 1;
+	  }
+	if (offset >= scanned)
+	  {
+	    scanned = position;
+	  }
+      }
+  }
+
+  //! Start next() from the first sweep again.
+  void rewind()
+  {
+    position = ARCHIVE_HEADER_SIZE;
+    streams.clear();
+  }
+
+  //! Number of sweeps. Reads the record headers of the sweeps not seen yet.
+  /*! \return The count, or -1 with errno set. */
+  ssize_t size()
+  {
+    if (scan() < 0)
+      {
+	return -1;
+      }
+    return entries.size();
+  }
+
+  //! Where sweep n is; n < size().
+  const ArchiveEntry& entry(size_t n) const
+  {
+    return entries[n];
+  }
+
+  //! Frequency grid of a configuration.
+  const ArchiveConfig& config(uint16_t id) const
+  {
+    return configs[id];
+  }
+
+  //! Decode sweep n.
+  /*! Decodes from the key sweep before it, at most
+    ArchiveOptions::key_interval sweeps. Does not move next().
+    \return 0, or -1 with errno set; EINVAL if n is out of range or the
+    archive is corrupt.
+  */
+  int read(size_t n, RawSweep &sweep, int64_t *time = nullptr)
+  {
+    if (scan() < 0)
+      {
+	return -1;
+      }
+    if (n >= entries.size())
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    const uint16_t id = entries[n].config;
+    size_t key = n;
+    while (!entries[key].key)
+      {
+	do
+	  {
+	    if (key == 0)
+	      {
+		errno = EINVAL;
+		return -1;
+	      }
+	    key--;
+	  }
+	while (entries[key].config != id);
+      }
+    Stream stream;
+    for (size_t i = key; i <= n; i++)
+      {
+	if (entries[i].config != id)
+	  {
+	    continue;
+	  }
+	ArchiveRecord type;
+	int err = read_record(entries[i].offset, type, body);
+	if (err == 0)
+	  {
+	    errno = EINVAL;
+	  }
+	if (err <= 0 || decode(entries[i], body, stream, sweep) < 0)
+	  {
+	    return -1;
+	  }
+      }
+    if (time)
+      {
+	*time = entries[n].time;
+      }
+    return 0;
+  }
+
+private:
+  friend class ArchiveWriter;
+
+  //! Decoder state of a configuration.
+  struct Stream
+  {
+    std::vector<int16_t> re;
+    std::vector<int16_t> im;
+  };
+
+  //! Read the record at offset into body.
+  /*! \return 1, 0 at the end or at a cut off record, -1 with errno set. */
+  int read_record(uint64_t offset, ArchiveRecord &type, std::vector<uint8_t> &body)
+  {
+    uint8_t header[ARCHIVE_RECORD_HEADER_SIZE];
+    if (fseeko(fp, offset, SEEK_SET) < 0)
+      {
+	return -1;
+      }
+    if (fread(header, sizeof(header), 1, fp) != 1)
+      {
+	return ferror(fp) ? -1 : 0;
+      }
+    type = static_cast<ArchiveRecord>(header[0]);
+    body.resize(get_le(header + 1, 4));
+    if (!body.empty() && fread(body.data(), body.size(), 1, fp) != 1)
+      {
+	return ferror(fp) ? -1 : 0;
+      }
+    if (type == ArchiveRecord::CONFIG)
+      {
+	return parse_config(body) < 0 ? -1 : 1;
+      }
+    if (type != ArchiveRecord::SWEEP)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    return 1;
+  }
+
+  int parse_config(const std::vector<uint8_t> &body)
+  {
+    if (body.size() < 18)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    ArchiveConfig c;
+    uint16_t id = get_le(&body[0], 2);
+    c.start = get_le(&body[2], 4);
+    c.inc = get_le(&body[6], 4);
+    uint64_t bits = get_le(&body[10], 8);
+    memcpy(&c.clk, &bits, sizeof(c.clk));
+    c.defined = true;
+    if (configs.size() <= id)
+      {
+	configs.resize(id + 1);
+      }
+    configs[id] = c;
+    return 0;
+  }
+
+  int parse_sweep(uint64_t offset, const std::vector<uint8_t> &body, ArchiveEntry &entry)
+  {
+    if (body.size() < ARCHIVE_SWEEP_HEADER_SIZE)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    entry.offset = offset;
+    entry.config = get_le(&body[0], 2);
+    entry.key = body[2] & ARCHIVE_KEY;
+    entry.time = get_le(&body[5], 8);
+    entry.points = get_le(&body[13], 4);
+    if (entry.config >= configs.size() || !configs[entry.config].defined || body[3] > 16 || body[4] > 16)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    return 0;
+  }
+
+  //! Index the sweeps after the last one seen.
+  int scan()
+  {
+    if (complete)
+      {
+	return 0;
+      }
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0)
+      {
+	return -1;
+      }
+    std::vector<uint8_t> sweep_header;
+    for (;;)
+      {
+	uint8_t header[ARCHIVE_RECORD_HEADER_SIZE];
+	if (fseeko(fp, scanned, SEEK_SET) < 0)
+	  {
+	    return -1;
+	  }
+	if (fread(header, sizeof(header), 1, fp) != 1)
+	  {
+	    break;
+	  }
+	uint32_t length = get_le(header + 1, 4);
+	if (scanned + ARCHIVE_RECORD_HEADER_SIZE + length > static_cast<uint64_t>(st.st_size))
+	  {
+	    // Cut off.
+	    break;
+	  }
+	if (static_cast<ArchiveRecord>(header[0]) == ArchiveRecord::SWEEP)
+	  {
+	    // Only the fixed part, the residuals are skipped.
+	    sweep_header.resize(ARCHIVE_SWEEP_HEADER_SIZE);
+	    ArchiveEntry entry;
+	    if (length < ARCHIVE_SWEEP_HEADER_SIZE || fread(sweep_header.data(), sweep_header.size(), 1, fp) != 1)
+	      {
+		break;
+	      }
+	    if (parse_sweep(scanned, sweep_header, entry) < 0)
+	      {
+		return -1;
+	      }
+	    entries.push_back(entry);
+	  }
+	else
+	  {
+	    ArchiveRecord type;
+	    int err = read_record(scanned, type, body);
+	    if (err <= 0)
+	      {
+		if (err < 0)
+		  {
+		    return -1;
+		  }
+		break;
+	      }
+	  }
+	scanned += ARCHIVE_RECORD_HEADER_SIZE + length;
+      }
+    complete = true;
+    return 0;
+  }
+
+  int decode(const ArchiveEntry &entry, const std::vector<uint8_t> &body, Stream &stream, RawSweep &sweep)
+  {
+    const ArchiveConfig &c = configs[entry.config];
+    const int k_re = body[3], k_im = body[4];
+    // Every value takes at least its stop bit and k remainder bits, which
+    // bounds the points a corrupt count can make us allocate.
+    const uint64_t bits_left = 8*static_cast<uint64_t>(body.size() - ARCHIVE_SWEEP_HEADER_SIZE);
+    if (entry.points > 1u<<16 || entry.points*static_cast<uint64_t>(2 + k_re + k_im) > bits_left)
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    sweep.start = c.start;
+    sweep.inc = c.inc;
+    sweep.clk = c.clk;
+    sweep.points.resize(entry.points);
+    current_re.resize(entry.points);
+    current_im.resize(entry.points);
+    BitReader bits(body.data() + ARCHIVE_SWEEP_HEADER_SIZE, body.size() - ARCHIVE_SWEEP_HEADER_SIZE);
+    for (size_t i = 0; i < entry.points; i++)
+      {
+	int32_t re = archive_prediction(stream.re, current_re, i, entry.key) + unzigzag(bits.get_rice(k_re));
+	int32_t im = archive_prediction(stream.im, current_im, i, entry.key) + unzigzag(bits.get_rice(k_im));
+	current_re[i] = re;
+	current_im[i] = im;
+	sweep.points[i] = RawPoint{static_cast<uint16_t>(i), current_re[i], current_im[i]};
+      }
+    if (!bits.ok())
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    stream.re.swap(current_re);
+    stream.im.swap(current_im);
+    return 0;
+  }
+
+  FILE *fp = NULL;
+  //! Indexed by id.
+  std::vector<ArchiveConfig> configs;
+  std::vector<ArchiveEntry> entries;
+  //! Offset up to which the records are indexed.
+  uint64_t scanned = 0;
+  //! True once scan() reached the end.
+  bool complete = false;
+  //! Offset of the record next() reads.
+  uint64_t position = 0;
+  std::map<uint16_t, Stream> streams;
+  //! Reused between sweeps.
+  std::vector<uint8_t> body;
+  std::vector<int16_t> current_re, current_im;
+};
+
+inline int ArchiveWriter::open(const char *path, bool append)
+{
+  close();
+  configs.clear();
+  written = 0;
+  if (append && access(path, F_OK) == 0)
+    {
+      ArchiveReader reader;
+      if (reader.open(path) < 0 || reader.scan() < 0)
+	{
+	  return -1;
+	}
+      for (size_t id = 0; id < reader.configs.size(); id++)
+	{
+	  const ArchiveConfig &c = reader.configs[id];
+	  if (c.defined)
+	    {
+	      State state;
+	      state.id = id;
+	      // No previous sweep is decoded, the next one is a key sweep.
+	      configs.emplace(Grid(c.start, c.inc, c.clk), state);
+	    }
+	}
+      written = reader.scanned;
+      reader.close();
+      if (truncate(path, written) < 0 || (fp = fopen(path, "ab")) == NULL)
+	{
+	  return -1;
+	}
+      return 0;
+    }
+  if ((fp = fopen(path, "wb")) == NULL)
+    {
+      return -1;
+    }
+  std::vector<uint8_t> header;
+  put_le(header, ARCHIVE_MAGIC, 4);
+  put_le(header, ARCHIVE_VERSION, 2);
+  put_le(header, 0, 2);
+  if (fwrite(header.data(), header.size(), 1, fp) != 1)
+    {
+      return -1;
+    }
+  written = header.size();
+  return 0;
+}
+
+inline int ArchiveWriter::append(const RawSweep &sweep, int64_t time)
+{
+  AD5933_TRACE("archive_append");
+  if (fp == NULL)
+    {
+      errno = EBADF;
+      return -1;
+    }
+  Grid grid(sweep.start, sweep.inc, static_cast<double>(sweep.clk));
+  auto it = configs.find(grid);
+  if (it == configs.end())
+    {
+      State state;
+      state.id = configs.size();
+      body.clear();
+      put_le(body, state.id, 2);
+      put_le(body, sweep.start, 4);
+      put_le(body, sweep.inc, 4);
+      uint64_t bits;
+      double clk = std::get<2>(grid);
+      memcpy(&bits, &clk, sizeof(bits));
+      put_le(body, bits, 8);
+      if (write_record(ArchiveRecord::CONFIG, body) < 0)
+	{
+	  return -1;
+	}
+      it = configs.emplace(grid, state).first;
+    }
+  State &state = it->second;
+  const bool key = state.re.empty() || state.since_key + 1 >= options.key_interval;
+  const size_t n = sweep.points.size();
+  std::vector<int16_t> re(n), im(n);
+  residual_re.resize(n);
+  residual_im.resize(n);
+  for (size_t i = 0; i < n; i++)
+    {
+      re[i] = sweep.points[i].re;
+      im[i] = sweep.points[i].im;
+      residual_re[i] = zigzag(re[i] - archive_prediction(state.re, re, i, key));
+      residual_im[i] = zigzag(im[i] - archive_prediction(state.im, im, i, key));
+    }
+  const int k_re = rice_parameter(residual_re);
+  const int k_im = rice_parameter(residual_im);
+  BitWriter bits;
+  bits.bytes.swap(body);
+  bits.bytes.clear();
+  put_le(bits.bytes, state.id, 2);
+  bits.bytes.push_back(key ? ARCHIVE_KEY : 0);
+  bits.bytes.push_back(k_re);
+  bits.bytes.push_back(k_im);
+  put_le(bits.bytes, time, 8);
+  put_le(bits.bytes, n, 4);
+  for (size_t i = 0; i < n; i++)
+    {
+      bits.put_rice(residual_re[i], k_re);
+      bits.put_rice(residual_im[i], k_im);
+    }
+  bits.flush();
+  body.swap(bits.bytes);
+  if (write_record(ArchiveRecord::SWEEP, body) < 0)
+    {
+      return -1;
+    }
+  state.since_key = key ? 0 : state.since_key + 1;
+  state.re.swap(re);
+  state.im.swap(im);
+  return 0;
+}
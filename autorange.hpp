@@ -0,0 +1,468 @@
+/*! \file */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "adaptive.hpp"
+
+//! An excitation voltage and PGA gain pair.
+struct Range
+{
+  Voltage voltage;
+  Gain gain;
+};
+
+//! Number of ranges.
+const int RANGE_COUNT = 8;
+
+//! The ranges, from the smallest to the largest response. Of two ranges with
+//! the same response the one with the higher excitation voltage comes later,
+//! so that it is preferred.
+const Range RANGES[RANGE_COUNT] =
+  {
+    {Voltage::OUTPUT_200mVpp, Gain::PGA1x},
+    {Voltage::OUTPUT_400mVpp, Gain::PGA1x},
+    {Voltage::OUTPUT_200mVpp, Gain::PGA5x},
+    {Voltage::OUTPUT_1Vpp, Gain::PGA1x},
+    {Voltage::OUTPUT_400mVpp, Gain::PGA5x},
+    {Voltage::OUTPUT_2Vpp, Gain::PGA1x},
+    {Voltage::OUTPUT_1Vpp, Gain::PGA5x},
+    {Voltage::OUTPUT_2Vpp, Gain::PGA5x}
+  };
+
+//! Nominal response of a range: excitation voltage times PGA gain, in Vp-p.
+inline double range_amplitude(int range)
+{
+  double v = 2;
+  switch (RANGES[range].voltage)
+    {
+    case Voltage::OUTPUT_200mVpp:
+      v = 0.2;
+      break;
+    case Voltage::OUTPUT_400mVpp:
+      v = 0.4;
+      break;
+    case Voltage::OUTPUT_1Vpp:
+      v = 1;
+      break;
+    case Voltage::OUTPUT_2Vpp:
+      v = 2;
+      break;
+    }
+  return RANGES[range].gain == Gain::PGA5x ? 5*v : v;
+}
+
+//! Human readable name of a range, e.g. "2Vpp/x5".
+inline std::string range_name(int range)
+{
+  const char *v = "2Vpp";
+  switch (RANGES[range].voltage)
+    {
+    case Voltage::OUTPUT_200mVpp:
+      v = "200mVpp";
+      break;
+    case Voltage::OUTPUT_400mVpp:
+      v = "400mVpp";
+      break;
+    case Voltage::OUTPUT_1Vpp:
+      v = "1Vpp";
+      break;
+    case Voltage::OUTPUT_2Vpp:
+      break;
+    }
+  return std::string(v) + (RANGES[range].gain == Gain::PGA5x ? "/x5" : "/x1");
+}
+
+//! Program the voltage and gain of a range.
+inline void set_range(AD5933 *h, int range)
+{
+  h->set_voltage_output(RANGES[range].voltage);
+  h->set_PGA(RANGES[range].gain);
+}
+
+//! Settings of automatic ranging.
+struct AutorangeOptions
+{
+  //! Full scale of the real and imaginary registers.
+  double full_scale = 32767;
+  //! A real or imaginary value above this fraction of full scale counts as
+  //! saturated.
+  double saturation = 0.9;
+  //! Fraction of full scale the largest response of a segment should reach.
+  double target = 0.5;
+  //! Responses below this fraction of full scale are flagged as low signal.
+  double low_signal = 0.02;
+  //! Points per segment; every segment gets its own range.
+  uint32_t segment_points = 64;
+  //! Time the excitation is given to settle before every probe and segment.
+  std::chrono::microseconds settle{10000};
+};
+
+//! A part of a sweep measured in one range.
+struct RangeSegment
+{
+  //! Index of the first point.
+  uint32_t first;
+  //! Number of points.
+  uint32_t count;
+  //! Index into RANGES.
+  int range;
+  //! Even the smallest range saturated.
+  bool saturated;
+  //! Even the largest range stayed below AutorangeOptions::low_signal.
+  bool low_signal;
+};
+
+//! An autoranged sweep.
+template <typename Real = real_t>
+struct RangedSweep
+{
+  //! Frequency, admittance pairs.
+  std::vector<std::pair<Real, std::complex<Real>>> points;
+  //! Range of every point.
+  std::vector<int> ranges;
+  std::vector<RangeSegment> segments;
+  //! 0, or the libusb_error code of the probe or segment that ended the
+  //! sweep early. The points measured until then are kept.
+  int error = 0;
+};
+
+//! Largest real or imaginary value of a measurement.
+template <typename Real>
+Real peak(const std::complex<Real> &z)
+{
+  return std::max(std::abs(z.real()), std::abs(z.imag()));
+}
+
+//!Pick the range for a set of frequencies.
+/*!
+\param frequencies The frequencies to probe, usually the ends of a segment.
+\param h Handle to the device object.
+\param options Limits.
+\param saturated Set if even the smallest range saturates.
+\return Index into RANGES, or a libusb_error code if a probe failed.
+
+Probes in the smallest range and predicts the response of the others from
+their nominal amplitudes, then confirms the pick with a second probe and steps
+down while it saturates. The device is left in the returned range.
+*/
+template <typename Real = real_t>
+int choose_range(const std::vector<Real> &frequencies, AD5933 *h, const AutorangeOptions &options,
+		 bool &saturated)
+{
+  int err = 0;
+  auto probe = [&](int range)
+    {
+      set_range(h, range);
+      Real p = 0;
+      for (auto f: frequencies)
+	{
+	  auto z = sweep_segment<Real>(f, 0, 0, h, options.settle);
+	  if (z.empty())
+	    {
+	      err = h->error ? h->error : LIBUSB_ERROR_IO;
+	      break;
+	    }
+	  p = std::max(p, peak(z[0].second));
+	}
+      return p;
+    };
+  const Real limit = options.saturation*options.full_scale;
+  Real p = probe(0);
+  if (err)
+    {
+      return err;
+    }
+  saturated = p >= limit;
+  int range = 0;
+  for (int r = 1; r < RANGE_COUNT && !saturated; r++)
+    {
+      if (p*range_amplitude(r)/range_amplitude(0) <= options.target*options.full_scale)
+	{
+	  range = r;
+	}
+    }
+  while (range > 0)
+    {
+      Real q = probe(range);
+      if (err)
+	{
+	  return err;
+	}
+      if (q < limit)
+	{
+	  break;
+	}
+      range--;
+    }
+  if (range == 0)
+    {
+      set_range(h, 0);
+    }
+  return range;
+}
+
+//!Execute a frequency sweep with automatic ranging.
+/*!
+\param lower Starting frequency of the sweep.
+\param number_of_samples Number of increments.
+\param step Distance between frequencies.
+\param h Handle to the device object.
+\param options Limits and segment length.
+
+Splits the sweep into segments of AutorangeOptions::segment_points points and
+measures each in the range chosen by choose_range() from probes at its ends.
+The frequencies are those of sweep_frequency() with the same arguments, give or
+take the rounding of the frequency codes. If a probe or a segment fails, the
+sweep ends with the points measured so far and RangedSweep::error set.
+*/
+template <typename Real = real_t>
+RangedSweep<Real> sweep_autorange ( typename non_deduced<Real>::type lower, uint32_t number_of_samples,
+				    typename non_deduced<Real>::type step, AD5933* h,
+				    const AutorangeOptions &options = AutorangeOptions() )
+{
+  RangedSweep<Real> result;
+  result.points.reserve(number_of_samples + 1);
+  result.ranges.reserve(number_of_samples + 1);
+  h->error = 0;
+  uint32_t per_segment = std::max<uint32_t>(options.segment_points, 1);
+  for (uint32_t first = 0; first <= number_of_samples; first += per_segment)
+    {
+      uint32_t count = std::min(per_segment, number_of_samples + 1 - first);
+      Real a = lower + first*step;
+      Real b = lower + (first + count - 1)*step;
+      RangeSegment seg;
+      seg.first = first;
+      seg.range = choose_range<Real>({a, b}, h, options, seg.saturated);
+      if (seg.range < 0)
+	{
+	  result.error = seg.range;
+	  break;
+	}
+      auto points = sweep_segment<Real>(a, count - 1, step, h, options.settle);
+      seg.count = points.size();
+      Real smallest = options.full_scale;
+      for (const auto &p: points)
+	{
+	  smallest = std::min(smallest, std::abs(p.second));
+	}
+      seg.low_signal = seg.range == RANGE_COUNT - 1 && smallest < options.low_signal*options.full_scale;
+      result.points.insert(result.points.end(), points.begin(), points.end());
+      result.ranges.insert(result.ranges.end(), points.size(), seg.range);
+      result.segments.push_back(seg);
+      if (points.size() < count)
+	{
+	  result.error = h->error ? h->error : LIBUSB_ERROR_IO;
+	  break;
+	}
+    }
+  return result;
+}
+
+//! Gain factors and system phase of every range.
+/*! A resistor can't be measured in every range: with a small one the large
+  ranges saturate and with a large one the small ranges have little signal.
+  Those ranges take the calibration of the nearest measured range, scaled by
+  the nominal amplitudes. A resistor in the middle of the expected impedances
+  gives the most measured ranges. */
+template <typename Real = real_t>
+class RangeCalibration
+{
+public:
+  //!Calibrate every range with a known resistor.
+  /*!
+    \param lower Starting frequency of the sweep.
+    \param number_of_samples Number of increments.
+    \param step Distance between frequencies.
+    \param h Handle to the device object.
+    \param resistance The value in Ohms of the calibration resistor.
+    \param options Limits.
+    \return Number of ranges measured directly; 0 if none could be, in which
+    case the calibration is unusable. A libusb_error code if a calibration
+    sweep failed or came back short, which leaves no range calibrated.
+  */
+  int calibrate(typename non_deduced<Real>::type lower, uint32_t number_of_samples,
+		typename non_deduced<Real>::type step, AD5933 *h, typename non_deduced<Real>::type resistance,
+		const AutorangeOptions &options = AutorangeOptions())
+  {
+    int usable = 0;
+    h->error = 0;
+    for (int r = 0; r < RANGE_COUNT; r++)
+      {
+	set_range(h, r);
+	auto adm = sweep_segment<Real>(lower, number_of_samples, step, h, options.settle);
+	if (adm.size() != number_of_samples + 1)
+	  {
+	    for (int k = 0; k < RANGE_COUNT; k++)
+	      {
+		measured[k] = false;
+		gain[k].clear();
+		phase[k].clear();
+	      }
+	    return h->error ? h->error : LIBUSB_ERROR_IO;
+	  }
+	measured[r] = true;
+	for (const auto &p: adm)
+	  {
+	    if (peak(p.second) >= options.saturation*options.full_scale
+		|| std::abs(p.second) < options.low_signal*options.full_scale)
+	      {
+		measured[r] = false;
+	      }
+	  }
+	gain[r] = calibrate_gain(adm, resistance);
+	phase[r].clear();
+	for (const auto &p: adm)
+	  {
+	    phase[r].push_back(std::make_pair(p.first, std::arg(p.second)*Real(180/M_PI)));
+	  }
+	usable += measured[r];
+      }
+    for (int r = 0; r < RANGE_COUNT && usable; r++)
+      {
+	if (measured[r])
+	  {
+	    continue;
+	  }
+	int nearest = -1;
+	for (int k = 0; k < RANGE_COUNT; k++)
+	  {
+	    if (measured[k] && (nearest < 0 || std::abs(std::log(range_amplitude(k)/range_amplitude(r)))
+				< std::abs(std::log(range_amplitude(nearest)/range_amplitude(r)))))
+	      {
+		nearest = k;
+	      }
+	  }
+	// The gain factor is inversely proportional to the response.
+	Real scale = range_amplitude(nearest)/range_amplitude(r);
+	gain[r] = gain[nearest];
+	for (auto &g: gain[r])
+	  {
+	    g.second *= scale;
+	  }
+	phase[r] = phase[nearest];
+      }
+    return usable;
+  }
+
+  //! True if the range was measured rather than derived.
+  bool is_measured(int range) const
+  {
+    return measured[range];
+  }
+
+  //! Gain factors of a range.
+  const std::vector<std::pair<Real, Real>>& gains(int range) const
+  {
+    return gain[range];
+  }
+
+  //! System phase of a range in degrees.
+  const std::vector<std::pair<Real, Real>>& system_phase(int range) const
+  {
+    return phase[range];
+  }
+
+  //!Impedance magnitude and phase of an autoranged sweep.
+  /*! Every point is corrected with the calibration of the range it was
+    measured in. The sweep must use the frequencies of the calibration; a
+    sweep that ended early is corrected as far as it goes.
+    \return 0, or -1 with errno EINVAL if a point is not within 1 Hz of the
+    calibration point with the same index, or there is none. */
+  int apply(const RangedSweep<Real> &sweep, std::vector<std::pair<Real, Real>> &magnitude,
+	    std::vector<std::pair<Real, Real>> &impedance_phase) const
+  {
+    magnitude.clear();
+    impedance_phase.clear();
+    if (sweep.ranges.size() != sweep.points.size())
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    for (size_t i = 0; i < sweep.points.size(); i++)
+      {
+	const auto &p = sweep.points[i];
+	int r = sweep.ranges[i];
+	if (r < 0 || r >= RANGE_COUNT || i >= gain[r].size() || std::abs(p.first - gain[r][i].first) > 1)
+	  {
+	    magnitude.clear();
+	    impedance_phase.clear();
+	    errno = EINVAL;
+	    return -1;
+	  }
+	magnitude.push_back(std::make_pair(p.first, 1/(std::sqrt(std::norm(p.second))*gain[r][i].second)));
+	impedance_phase.push_back(std::make_pair(p.first, std::arg(p.second)*Real(180/M_PI) - phase[r][i].second));
+      }
+    return 0;
+  }
+
+private:
+  std::vector<std::pair<Real, Real>> gain[RANGE_COUNT];
+  std::vector<std::pair<Real, Real>> phase[RANGE_COUNT];
+  bool measured[RANGE_COUNT] = {};
+};
+
+//! Header line of write_ranged_file().
+const char RANGED_CSV_HEADER[] = "Frequency,Impedance,Phase,Real,Imaginary,Magnitutude,Range\n";
+
+//!Record an autoranged sweep.
+/*!
+\param mag Frequency, Impedance magnitude pairs
+\param phase Frequency, Impedance phase pairs
+\param sweep The sweep.
+\param path Name of the output file.
+\return 0, or -1 with errno set; EINVAL if the vectors differ in size or a
+range is invalid.
+
+Same format as write_to_file() with the range of every point in an extra
+column, written the same way, see write_sweep_csv().
+*/
+template <typename Real>
+int write_ranged_file(const std::vector<std::pair<Real, Real>> &mag,
+		      const std::vector<std::pair<Real, Real>> &phase,
+		      const RangedSweep<Real> &sweep,
+		      const char *path = "output.csv")
+{
+  AD5933_TRACE("write_ranged_file");
+  thread_local std::string buffer;
+  buffer.clear();
+  int err = 0;
+  if (mag.size()!=phase.size() || phase.size()!=sweep.points.size() || sweep.ranges.size()!=sweep.points.size())
+    {
+      errno = EINVAL;
+      err = -1;
+    }
+  for (size_t i = 0; i<mag.size() && err==0; ++i)
+    {
+      if (sweep.ranges[i] < 0 || sweep.ranges[i] >= RANGE_COUNT)
+	{
+	  errno = EINVAL;
+	  err = -1;
+	  break;
+	}
+      const auto &adm = sweep.points[i].second;
+      csv_append_number(buffer, mag[i].first, ',');
+      csv_append_number(buffer, mag[i].second, ',');
+      csv_append_number(buffer, phase[i].second, ',');
+      csv_append_number(buffer, adm.real(), ',');
+      csv_append_number(buffer, adm.imag(), ',');
+      csv_append_number(buffer, std::abs(adm), ',');
+      buffer += range_name(sweep.ranges[i]);
+      buffer += '\n';
+    }
+  if (err==0)
+    {
+      err = write_csv_text(path, RANGED_CSV_HEADER, buffer, false);
+    }
+  if (err<0)
+    {
+      int saved = errno;
+      log_error("write_ranged_file: %s: %s\n", path, strerror(saved));
+      errno = saved;
+    }
+  return err;
+}
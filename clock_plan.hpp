@@ -0,0 +1,229 @@
+/*! \file */
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+#include "ad5933.hpp"
+#include "gpio.hpp"
+
+//! A clock the AD5933 can run from.
+struct ClockOption
+{
+  //! Clock source.
+  Clk source;
+  //! Ratio of the external divider, 0 for the internal clock.
+  int ratio;
+  //! Resulting clock frequency in Hz.
+  long double frequency;
+};
+
+//! Lowest frequency that can be measured accurately with a clock.
+/*!
+\param clk Clock frequency in Hz.
+
+The ADC samples at clk/16 and the DFT uses 1024 samples. Below one period per
+DFT window the measurement leaks badly, which is why the internal clock is not
+usable below about 1 kHz.
+*/
+inline long double lowest_frequency(long double clk)
+{
+  return clk / (16*1024);
+}
+
+//! Fraction of the Nyquist frequency of the ADC that is used.
+/*! The ADC samples at clk/16, so clk/32 is the Nyquist frequency. At that
+  limit the excitation is sampled twice per period and the DFT result depends
+  on the phase of the samples, so the planner stays below it. */
+const long double NYQUIST_MARGIN = 0.8;
+
+//! Highest frequency that can be measured with a clock.
+/*!
+\param clk Clock frequency in Hz.
+
+Limited by NYQUIST_MARGIN times the Nyquist frequency of the ADC and by the
+100 kHz specification.
+*/
+inline long double highest_frequency(long double clk)
+{
+  return std::min<long double>(100000, NYQUIST_MARGIN * clk / 32);
+}
+
+//! One sweep of a plan.
+struct PlannedSweep
+{
+  //! Clock the sweep needs.
+  ClockOption clock;
+  //! Sweep parameters. clock and ext_clk already match the clock option.
+  SweepConfig config;
+};
+
+//! Chooses clock source and divider ratio for a frequency range.
+struct ClockPlanner
+{
+  //! Frequency of the internal clock.
+  long double int_clk = INTERNAL_CLOCK;
+  //! Frequency of the oscillator in front of the external divider.
+  long double oscillator = 16000000l;
+  //! Whether the external divider is fitted. Only a build with wiringPi can
+  //! drive it, see ClockDivider.
+#ifdef HAVE_WIRINGPI
+  bool has_divider = true;
+#else
+  bool has_divider = false;
+#endif
+  //! Most increments in one sweep. The increment register has 9 bits.
+  uint32_t max_steps = 511;
+
+  //! All clocks available, fastest first.
+  std::vector<ClockOption> options() const
+  {
+    std::vector<ClockOption> opts;
+    opts.push_back(ClockOption{Clk::INT, 0, int_clk});
+    if (has_divider)
+      {
+	for (int r = ClockDivider::MIN_RATIO; r <= ClockDivider::MAX_RATIO; r++)
+	  {
+	    opts.push_back(ClockOption{Clk::EXT, r, oscillator / r});
+	  }
+      }
+    std::sort(opts.begin(), opts.end(),
+	      [](const ClockOption &a, const ClockOption &b) { return a.frequency > b.frequency; });
+    return opts;
+  }
+
+  //! Plan the sweeps that cover a frequency range.
+  /*!
+    \param lower Lowest frequency in Hz.
+    \param upper Highest frequency in Hz.
+    \param resolution Largest acceptable distance between points in Hz.
+    \param base Analog settings copied to every sweep.
+    \return The sweeps, in increasing frequency. Empty if part of the range
+    cannot be measured with any clock.
+
+    The range is split into segments, each measured with the fastest clock
+    that is accurate at the start of the segment. Faster clocks reach higher,
+    so this gives the fewest segments. Each segment is then split into sweeps
+    of at most max_steps increments with the same point spacing.
+  */
+  std::vector<PlannedSweep> plan(long double lower, long double upper, long double resolution,
+				 const SweepConfig &base = SweepConfig()) const
+  {
+    std::vector<PlannedSweep> sweeps;
+    auto opts = options();
+    long double from = lower;
+    while (from <= upper)
+      {
+	auto opt = std::find_if(opts.begin(), opts.end(), [&](const ClockOption &o) {
+	    return lowest_frequency(o.frequency) <= from && from < highest_frequency(o.frequency)
+	      && resolution >= (o.frequency/4) / (1<<27);
+	  });
+	if (opt == opts.end())
+	  {
+	    return std::vector<PlannedSweep>();
+	  }
+	long double to = std::min(upper, highest_frequency(opt->frequency));
+	// Split [from,to] in intervals no wider than the resolution.
+	uint32_t intervals = std::ceil((to - from) / resolution);
+	long double step = intervals ? (to - from) / intervals : 0;
+	for (uint32_t first = 0; first <= intervals; first += max_steps + 1)
+	  {
+	    PlannedSweep s;
+	    s.clock = *opt;
+	    s.config = base;
+	    s.config.clock = opt->source;
+	    if (opt->source == Clk::EXT)
+	      {
+		s.config.ext_clk = opt->frequency;
+	      }
+	    s.config.start = from + first*step;
+	    s.config.steps = std::min(max_steps, intervals - first);
+	    s.config.step = step;
+	    sweeps.push_back(s);
+	  }
+	if (to >= upper)
+	  {
+	    break;
+	  }
+	from = to + step;
+      }
+    return sweeps;
+  }
+};
+
+//!Switch the clock for a planned sweep.
+/*!
+\param sweep The planned sweep.
+\param h Handle to the device object.
+\param divider The external clock divider.
+\return 0 on success, -1 if the divider could not be set.
+
+Sets the divider ratio, then ext_clk, clk and the clock source bit. The analog
+settings of the device are left alone.
+*/
+inline int apply_clock(const PlannedSweep &sweep, AD5933 *h, ClockDivider &divider)
+{
+  if (sweep.clock.source == Clk::EXT)
+    {
+      if (divider.ratio != sweep.clock.ratio && divider.set(sweep.clock.ratio) == -1)
+	{
+	  return -1;
+	}
+      h->ext_clk = sweep.clock.frequency;
+      h->clk = h->ext_clk;
+    }
+  else
+    {
+      h->clk = h->int_clk;
+    }
+  h->choose_clock(sweep.clock.source);
+  return 0;
+}
+
+//!Execute every sweep of a plan.
+/*!
+\param plan Sweeps planned with ClockPlanner::plan().
+\param h Handle to the device object.
+\param divider The external clock divider.
+\param on_point Optional callback for every point. The index counts across sweeps.
+\return The measurements of all sweeps, in increasing frequency.
+
+Only the clock is switched between sweeps; excitation voltage, gain and
+settling cycles are used as currently programmed. If the clock of a sweep
+cannot be set or a sweep comes back short, the later sweeps are not measured
+and AD5933::error tells why, LIBUSB_ERROR_INVALID_PARAM for the divider.
+*/
+inline std::vector<std::pair<real_t, complex_t>>
+sweep_plan(const std::vector<PlannedSweep> &plan, AD5933 *h, ClockDivider &divider,
+	   const PointCallback &on_point = nullptr)
+{
+  std::vector<std::pair<real_t, complex_t>> measurements;
+  h->error = 0;
+  for (const auto &s: plan)
+    {
+      if (apply_clock(s, h, divider) == -1)
+	{
+	  log_error("sweep_plan: Invalid divider ratio %d\n", s.clock.ratio);
+	  h->error = LIBUSB_ERROR_INVALID_PARAM;
+	  break;
+	}
+      PointCallback offset_point;
+      if (on_point)
+	{
+	  uint32_t offset = measurements.size();
+	  offset_point = [&on_point, offset](uint32_t index, real_t f, const complex_t &z) {
+	    on_point(offset + index, f, z);
+	  };
+	}
+      auto m = sweep_frequency(s.config.start, s.config.steps, s.config.step, h, offset_point);
+      measurements.insert(measurements.end(), m.begin(), m.end());
+      if (m.size() != s.config.steps + 1)
+	{
+	  if (h->error == 0)
+	    {
+	      h->error = LIBUSB_ERROR_IO;
+	    }
+	  break;
+	}
+    }
+  return measurements;
+}
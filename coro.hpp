@@ -0,0 +1,559 @@
+/*! \file
+  Cooperative scheduling of many boards on one thread.
+
+  The sweep, temperature and calibration flows are C++20 coroutines. Every
+  register access is an asynchronous libusb control transfer, and the
+  coroutine suspends until it completes; waits for a status bit or a delay
+  suspend as well. A Scheduler interleaves the coroutines of any number of
+  boards on one thread, so the transfers of different boards overlap as they
+  do with a thread per board. Only this header needs -std=c++20, the rest of
+  the library stays C++17.
+*/
+#pragma once
+#if !defined(__cpp_impl_coroutine)
+#error "coro.hpp needs C++20 coroutines, build with -std=c++20"
+#endif
+#include <chrono>
+#include <complex>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+
+//! The waits of restart_sweep().
+const std::chrono::milliseconds RESTART_DELAY{500};
+
+//! A coroutine returning a T.
+/*! Tasks start suspended. Run them by Scheduler::spawn() or by co_await from
+  another task, which then resumes when this one finishes. T must not be
+  void. */
+template <typename T>
+class Task
+{
+public:
+  struct promise_type
+  {
+    std::optional<T> value;
+    std::exception_ptr error;
+    //! The task awaiting this one.
+    std::coroutine_handle<> continuation;
+
+    Task get_return_object()
+    {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept
+    {
+      return {};
+    }
+
+    //! Hands control to the awaiting task, if any.
+    struct FinalAwaiter
+    {
+      bool await_ready() noexcept
+      {
+	return false;
+      }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+      {
+	auto c = h.promise().continuation;
+	return c ? c : std::noop_coroutine();
+      }
+
+      void await_resume() noexcept
+      {
+      }
+    };
+
+    FinalAwaiter final_suspend() noexcept
+    {
+      return {};
+    }
+
+    void return_value(T v)
+    {
+      value = std::move(v);
+    }
+
+    void unhandled_exception()
+    {
+      error = std::current_exception();
+    }
+  };
+
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h)
+  {
+  }
+
+  Task(Task &&other) noexcept : handle(other.handle)
+  {
+    other.handle = nullptr;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task()
+  {
+    if (handle)
+      {
+	handle.destroy();
+      }
+  }
+
+  //! True once the task has returned.
+  bool done() const
+  {
+    return handle && handle.done();
+  }
+
+  //! The returned value; rethrows what the task threw. Only valid when done().
+  T& get()
+  {
+    if (handle.promise().error)
+      {
+	std::rethrow_exception(handle.promise().error);
+      }
+    return *handle.promise().value;
+  }
+
+  bool await_ready() const
+  {
+    return done();
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+  {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+
+  T await_resume()
+  {
+    return std::move(get());
+  }
+
+private:
+  friend class Scheduler;
+  std::coroutine_handle<promise_type> handle;
+};
+
+//! Runs tasks of many boards on the calling thread.
+class Scheduler
+{
+public:
+  //! Pause between two status polls of a board waiting for a conversion.
+  std::chrono::microseconds poll_interval{100};
+
+  //! Register transfers.
+  uint64_t transfers = 0;
+  //! Times a task was resumed.
+  uint64_t resumes = 0;
+
+  //! \param ctx The libusb context of the boards.
+  explicit Scheduler(libusb_context *ctx) : ctx(ctx)
+  {
+  }
+
+  //! Queue a task. It must outlive run().
+  template <typename T>
+  void spawn(Task<T> &task)
+  {
+    ready.push_back(task.handle);
+  }
+
+  //! Run until every spawned task has finished.
+  void run()
+  {
+    while (!ready.empty() || !timers.empty() || in_flight)
+      {
+	while (!ready.empty())
+	  {
+	    auto c = ready.front();
+	    ready.pop_front();
+	    resumes++;
+	    c.resume();
+	  }
+	auto now = std::chrono::steady_clock::now();
+	while (!timers.empty() && timers.top().at <= now)
+	  {
+	    ready.push_back(timers.top().task);
+	    timers.pop();
+	  }
+	if (!ready.empty())
+	  {
+	    continue;
+	  }
+	if (in_flight)
+	  {
+	    // Completed transfers queue their tasks from the callback.
+	    std::chrono::microseconds wait(100000);
+	    if (!timers.empty())
+	      {
+		wait = std::min(wait, std::chrono::duration_cast<std::chrono::microseconds>(timers.top().at - now));
+	      }
+	    timeval tv;
+	    tv.tv_sec = wait.count()/1000000;
+	    tv.tv_usec = wait.count()%1000000;
+	    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	  }
+	else if (!timers.empty())
+	  {
+	    std::this_thread::sleep_until(timers.top().at);
+	  }
+      }
+  }
+
+  //! Awaitable that resumes the task after a delay.
+  struct Sleep
+  {
+    Scheduler &s;
+    std::chrono::steady_clock::time_point at;
+
+    bool await_ready() const
+    {
+      return at <= std::chrono::steady_clock::now();
+    }
+
+    void await_suspend(std::coroutine_handle<> task)
+    {
+      s.timers.push(Timer{at, task});
+    }
+
+    void await_resume()
+    {
+    }
+  };
+
+  //! Suspend the task for a while.
+  template <typename Rep, typename Period>
+  Sleep sleep_for(std::chrono::duration<Rep, Period> d)
+  {
+    return Sleep{*this, std::chrono::steady_clock::now()
+	+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(d)};
+  }
+
+  //! Awaitable register transfer; the same control transfers as
+  //! AD5933::write_register() and AD5933::read_register().
+  class Transfer
+  {
+  public:
+    Transfer(Scheduler &s, AD5933 *h, uint8_t request_type, uint16_t index, uint16_t length)
+      : s(s), h(h), request_type(request_type), index(index), length(length)
+    {
+    }
+
+    bool await_ready() const
+    {
+      return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> t)
+    {
+      task = t;
+      unsigned int timeout;
+      if ((result = h->h ? h->transfer_budget(timeout) : LIBUSB_ERROR_NO_DEVICE) < 0)
+	{
+	  return false;
+	}
+      libusb_transfer *x = libusb_alloc_transfer(0);
+      if (x == NULL)
+	{
+	  result = LIBUSB_ERROR_NO_MEM;
+	  return false;
+	}
+      libusb_fill_control_setup(buffer, request_type, 0xDE, 0x0D, index, length);
+      libusb_fill_control_transfer(x, h->h, buffer, &Transfer::done, this, timeout);
+      s.transfers++;
+#ifdef AD5933_TRACING
+      begin = trace_now();
+#endif
+      if ((result = libusb_submit_transfer(x)) < 0)
+	{
+	  libusb_free_transfer(x);
+	  return false;
+	}
+      s.in_flight++;
+      return true;
+    }
+
+    //! The byte read, 0 for a write, or a libusb_error code. Errors are
+    //! recorded in AD5933::error.
+    int await_resume()
+    {
+      if (result < 0)
+	{
+	  log_error("Transfer to register 0x%X: %s\n", index & 0xff, libusb_strerror(libusb_error(result)));
+	  if (h->error == 0)
+	    {
+	      h->error = result;
+	    }
+	}
+      return result;
+    }
+
+  private:
+    static void LIBUSB_CALL done(libusb_transfer *x)
+    {
+      auto self = static_cast<Transfer*>(x->user_data);
+      switch (x->status)
+	{
+	case LIBUSB_TRANSFER_COMPLETED:
+	  self->result = self->length ? libusb_control_transfer_get_data(x)[0] : 0;
+	  break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	  self->result = LIBUSB_ERROR_TIMEOUT;
+	  break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	  self->result = LIBUSB_ERROR_NO_DEVICE;
+	  break;
+	case LIBUSB_TRANSFER_STALL:
+	  self->result = LIBUSB_ERROR_PIPE;
+	  break;
+	default:
+	  self->result = LIBUSB_ERROR_IO;
+	}
+      libusb_free_transfer(x);
+#ifdef AD5933_TRACING
+      // Transfers of many boards overlap on one thread, so they go on the
+      // tracks of the boards.
+      trace_event(self->length ? "read_register" : "write_register", self->begin, trace_now(),
+		  TRACE_BOARD_TRACK + self->h->index, "reg", self->index & 0xff);
+#endif
+      self->s.in_flight--;
+      self->s.ready.push_back(self->task);
+    }
+
+    Scheduler &s;
+    AD5933 *h;
+    uint8_t request_type;
+    uint16_t index;
+    uint16_t length;
+    int result = 0;
+    std::coroutine_handle<> task;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 1];
+#ifdef AD5933_TRACING
+    int64_t begin = 0;
+#endif
+  };
+
+  //! Write a register without verifying it; see co_write_register().
+  Transfer write(AD5933 *h, uint8_t value, uint8_t reg)
+  {
+    return Transfer(*this, h, 0x40, value<<8 | reg, 0);
+  }
+
+  //! Read a register.
+  Transfer read(AD5933 *h, uint8_t reg)
+  {
+    return Transfer(*this, h, 0xc0, reg, 1);
+  }
+
+private:
+  struct Timer
+  {
+    std::chrono::steady_clock::time_point at;
+    std::coroutine_handle<> task;
+
+    bool operator>(const Timer &other) const
+    {
+      return at > other.at;
+    }
+  };
+
+  libusb_context *ctx;
+  std::deque<std::coroutine_handle<>> ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+  //! Submitted transfers that have not completed.
+  int in_flight = 0;
+};
+
+// co_await stays out of conditions below: GCC 12 evaluates it out of order
+// in || chains.
+
+//! Write a register as a task, reading it back if AD5933::verify_writes is set.
+/*! \return 0 or a libusb_error code. */
+inline Task<int> co_write_register(Scheduler &s, AD5933 *h, uint8_t value, uint8_t reg)
+{
+  int err = co_await s.write(h, value, reg);
+  if (reg >= CTRL_MSB && reg < CTRL_MSB + SHADOW_SIZE)
+    {
+      h->shadow[reg - CTRL_MSB] = err < 0 ? -1 : value;
+    }
+  if (err < 0 || !h->verify_writes)
+    {
+      co_return err < 0 ? err : 0;
+    }
+  int back = co_await s.read(h, reg);
+  if (back >= 0 && reg >= CTRL_MSB && reg < CTRL_MSB + SHADOW_SIZE)
+    {
+      h->shadow[reg - CTRL_MSB] = back;
+    }
+  if (back >= 0 && back != value)
+    {
+      log_error("Wrote %d, got %d, on reg %d\n", value, back, reg);
+      if (h->error == 0)
+	{
+	  h->error = LIBUSB_ERROR_IO;
+	}
+      co_return LIBUSB_ERROR_IO;
+    }
+  co_return back < 0 ? back : 0;
+}
+
+//! AD5933::set_mode() as a task.
+inline Task<int> co_set_mode(Scheduler &s, AD5933 *h, uint8_t mode)
+{
+  h->ctrl_reg2 &= 0x0F;
+  h->ctrl_reg2 |= mode;
+  co_return co_await co_write_register(s, h, h->ctrl_reg2, CTRL_MSB);
+}
+
+//! Wait until one of the bits of mask is set in the status register.
+/*! \return The status register or a libusb_error code. */
+inline Task<int> co_wait_status(Scheduler &s, AD5933 *h, uint8_t mask)
+{
+  for (;;)
+    {
+      int sreg = co_await s.read(h, SREG);
+      if (sreg < 0 || (sreg & mask))
+	{
+	  co_return sreg;
+	}
+      co_await s.sleep_for(s.poll_interval);
+    }
+}
+
+//!Execute a frequency sweep as a task.
+/*!
+\param s The scheduler.
+\param lower Starting frequency of the sweep.
+\param number_of_samples Number of increments.
+\param step Distance between frequencies.
+\param h Handle to the device object.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+\return The points of sweep_frequency(). On a transfer error the points so far;
+AD5933::error tells. Bounded by sweep_budget() like sweep_frequency().
+*/
+template <typename Real = real_t>
+Task<std::vector<std::pair<Real, std::complex<Real>>>>
+co_sweep_frequency ( Scheduler &s, typename non_deduced<Real>::type lower, uint32_t number_of_samples,
+		     typename non_deduced<Real>::type step, AD5933* h, BasicPointCallback<Real> on_point = nullptr )
+{
+  std::vector<std::pair<Real, std::complex<Real>>> measurements;
+  measurements.reserve(number_of_samples + 1);
+  DeadlineScope deadline(h, sweep_budget(lower, number_of_samples, h->clk, settling_periods(h)), "co_sweep_frequency");
+  uint32_t start = frequency_code(lower, h->clk);
+  uint32_t inc = frequency_code(step, h->clk);
+  const Real hz_per_code = (h->clk/4) / (1<<27);
+  const uint8_t setup[][2] = {
+    {uint8_t(start >> 16), FREQ_23_16}, {uint8_t(start >> 8), FREQ_15_8}, {uint8_t(start), FREQ_7_0},
+    {uint8_t(inc >> 16), STEP_23_16}, {uint8_t(inc >> 8), STEP_15_8}, {uint8_t(inc), STEP_7_0},
+    {uint8_t(number_of_samples >> 8), INC_NUM_MSB}, {uint8_t(number_of_samples), INC_NUM_LSB}};
+  for (const auto &reg: setup)
+    {
+      int err = co_await co_write_register(s, h, reg[0], reg[1]);
+      if (err < 0)
+	{
+	  co_return measurements;
+	}
+    }
+  // The steps of restart_sweep().
+  for (uint8_t mode: {SB_MODE, INIT_START_FREQ, START_FREQ_SWEEP})
+    {
+      int err = co_await co_set_mode(s, h, mode);
+      if (err < 0)
+	{
+	  co_return measurements;
+	}
+      co_await s.sleep_for(RESTART_DELAY);
+    }
+  for (uint32_t index = 0; ; index++)
+    {
+      int sreg = co_await co_wait_status(s, h, SREG_IMPED_VALID);
+      if (sreg < 0)
+	{
+	  break;
+	}
+      uint8_t data[4];
+      int err = 0;
+      for (int i = 0; i < 4 && err >= 0; i++)
+	{
+	  err = co_await s.read(h, REAL_MSB + i);
+	  data[i] = err;
+	}
+      if (err < 0)
+	{
+	  break;
+	}
+      int16_t re = data[0] << 8 | data[1];
+      int16_t im = data[2] << 8 | data[3];
+      measurements.push_back(std::make_pair((start + static_cast<uint64_t>(index)*inc)*hz_per_code,
+					    std::complex<Real>(re, im)));
+      if (on_point)
+	{
+	  on_point(index, measurements.back().first, measurements.back().second);
+	}
+      sreg = co_await s.read(h, SREG);
+      if (sreg < 0 || (sreg & SREG_SWEEP_VALID))
+	{
+	  break;
+	}
+      err = co_await co_set_mode(s, h, INC_FREQ);
+      if (err < 0)
+	{
+	  break;
+	}
+    }
+  co_return measurements;
+}
+
+//!Measure the temperature as a task.
+/*! \return The temperature in Celsius, NAN on a transfer error. */
+inline Task<double> co_measure_temperature(Scheduler &s, AD5933 *h)
+{
+  DeadlineScope deadline(h, TEMPERATURE_BUDGET, "co_measure_temperature");
+  int err = co_await co_set_mode(s, h, MEAS_TEMP);
+  if (err < 0)
+    {
+      co_return NAN;
+    }
+  err = co_await co_wait_status(s, h, SREG_TEMP_VALID);
+  if (err < 0)
+    {
+      co_return NAN;
+    }
+  int hi = co_await s.read(h, TEMPERATURE_MSB);
+  int lo = co_await s.read(h, TEMPERATURE_LSB);
+  if (hi < 0 || lo < 0)
+    {
+      co_return NAN;
+    }
+  co_return temperature_celsius(hi, lo);
+}
+
+//!Calibrate with a known resistor as a task.
+/*!
+\return The gain factors of calibrate_gain(), empty on a transfer error.
+*/
+template <typename Real = real_t>
+Task<std::vector<std::pair<Real, Real>>>
+co_calibrate ( Scheduler &s, typename non_deduced<Real>::type lower, uint32_t number_of_samples,
+	       typename non_deduced<Real>::type step, AD5933* h, typename non_deduced<Real>::type resistance )
+{
+  h->error = 0;
+  auto measurements = co_await co_sweep_frequency<Real>(s, lower, number_of_samples, step, h);
+  if (h->error)
+    {
+      co_return std::vector<std::pair<Real, Real>>();
+    }
+  co_return calibrate_gain(measurements, resistance);
+}
@@ -0,0 +1,173 @@
+/*! \file
+  Reading back the CSV files of write_to_file().
+
+  The file is memory-mapped and parsed in place with std::from_chars, so
+  reading a sweep makes no copy of the text and, when the caller passes the
+  same vector again, no allocation either.
+*/
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <complex>
+#include <utility>
+#include <vector>
+
+//! A file mapped read-only into memory.
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile()
+  {
+    close();
+  }
+
+  //! Map a file.
+  /*! \return 0, or -1 with errno set. An empty file maps to no data. */
+  int open(const char *path)
+  {
+    close();
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      {
+	return -1;
+      }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+      {
+	int saved = errno;
+	::close(fd);
+	errno = saved;
+	return -1;
+      }
+    length = st.st_size;
+    if (length > 0)
+      {
+	void *mem = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mem == MAP_FAILED)
+	  {
+	    int saved = errno;
+	    ::close(fd);
+	    length = 0;
+	    errno = saved;
+	    return -1;
+	  }
+	madvise(mem, length, MADV_SEQUENTIAL);
+	bytes = static_cast<const char*>(mem);
+      }
+    ::close(fd);
+    return 0;
+  }
+
+  void close()
+  {
+    if (bytes)
+      {
+	munmap(const_cast<char*>(bytes), length);
+      }
+    bytes = nullptr;
+    length = 0;
+  }
+
+  const char* data() const
+  {
+    return bytes;
+  }
+
+  size_t size() const
+  {
+    return length;
+  }
+
+private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+};
+
+//! Parse the text of a write_to_file() CSV.
+/*!
+\param begin Start of the text.
+\param end End of the text.
+\param adm Receives the frequency, admittance pairs from the Frequency, Real
+and Imaginary columns. Cleared first; its capacity is reused.
+\return The number of points, or -1 with errno EINVAL if a line does not
+have the six numeric fields.
+
+The header line, if present, is skipped; the magnitude and phase columns
+are checked for being numbers but not returned, since they are recomputed
+from the admittance.
+*/
+template <typename Real>
+int parse_sweep_csv(const char *begin, const char *end, std::vector<std::pair<Real, std::complex<Real>>> &adm)
+{
+  adm.clear();
+  const char *p = begin;
+  if (p != end && !(*p >= '0' && *p <= '9') && *p != '-' && *p != '.')
+    {
+      while (p != end && *p != '\n')
+	{
+	  p++;
+	}
+    }
+  while (p != end)
+    {
+      if (*p == '\n' || *p == '\r')
+	{
+	  p++;
+	  continue;
+	}
+      double field[6];
+      for (int i = 0; i < 6; i++)
+	{
+	  auto r = std::from_chars(p, end, field[i]);
+	  if (r.ec != std::errc())
+	    {
+	      errno = EINVAL;
+	      return -1;
+	    }
+	  p = r.ptr;
+	  char expected = i < 5 ? ',' : '\n';
+	  if (p != end && *p == '\r' && i == 5)
+	    {
+	      p++;
+	    }
+	  if (p != end && *p != expected)
+	    {
+	      errno = EINVAL;
+	      return -1;
+	    }
+	  if (p != end)
+	    {
+	      p++;
+	    }
+	  else if (i < 5)
+	    {
+	      errno = EINVAL;
+	      return -1;
+	    }
+	}
+      adm.push_back(std::make_pair(Real(field[0]), std::complex<Real>(field[3], field[4])));
+    }
+  return adm.size();
+}
+
+//! Read a write_to_file() CSV, see parse_sweep_csv().
+/*! \return The number of points, or -1 with errno set. */
+template <typename Real>
+int read_sweep_csv(const char *path, std::vector<std::pair<Real, std::complex<Real>>> &adm)
+{
+  MappedFile file;
+  if (file.open(path) < 0)
+    {
+      return -1;
+    }
+  return parse_sweep_csv(file.data(), file.data() + file.size(), adm);
+}
@@ -0,0 +1,284 @@
+/*! \file
+  Writing sweeps in the CSV format of the Analog Devices evaluation software.
+
+  The text of a whole sweep is formatted with std::to_chars into a buffer
+  that is kept between sweeps and written with a single write(). The
+  output is the same, byte for byte, as fprintf("%Lf") gives.
+*/
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <complex>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! Header line of the format.
+const char CSV_HEADER[] = "Frequency,Impedance,Phase,Real,Imaginary,Magnitutude\n";
+
+//! Append a number as fprintf("%.6f") does, then a separator.
+template <typename T>
+void csv_append_number(std::string &out, T value, char separator)
+{
+  char text[64];
+  auto r = std::to_chars(text, text + sizeof(text) - 1, value, std::chars_format::fixed, 6);
+  if (r.ec == std::errc())
+    {
+      *r.ptr++ = separator;
+      out.append(text, r.ptr);
+      return;
+    }
+  // Too long for the buffer: more than 56 integer digits.
+  size_t n = snprintf(nullptr, 0, "%.6Lf", static_cast<long double>(value));
+  size_t at = out.size();
+  out.resize(at + n + 1);
+  snprintf(&out[at], n + 1, "%.6Lf", static_cast<long double>(value));
+  out[at + n] = separator;
+}
+
+//! Format the rows of a sweep, see write_to_file() for the columns.
+/*! \return 0, or -1 with errno EINVAL if the vectors differ in size. */
+template <typename Real>
+int format_sweep_csv(std::string &out,
+		     const std::vector<std::pair<Real, Real>> &mag,
+		     const std::vector<std::pair<Real, Real>> &phase,
+		     const std::vector<std::pair<Real, std::complex<Real>>> &adm)
+{
+  if (mag.size() != phase.size() || phase.size() != adm.size())
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  out.reserve(out.size() + mag.size()*6*16);
+  for (size_t i = 0; i < mag.size(); i++)
+    {
+      csv_append_number(out, mag[i].first, ',');
+      csv_append_number(out, mag[i].second, ',');
+      csv_append_number(out, phase[i].second, ',');
+      csv_append_number(out, adm[i].second.real(), ',');
+      csv_append_number(out, adm[i].second.imag(), ',');
+      csv_append_number(out, std::abs(adm[i].second), '\n');
+    }
+  return 0;
+}
+
+//! Write a buffer completely.
+/*! \return 0, or -1 with errno set. */
+inline int csv_write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t n = ::write(fd, data, size);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  return -1;
+	}
+      data += n;
+      size -= n;
+    }
+  return 0;
+}
+
+//! Write formatted rows to a file.
+/*!
+\param path The file.
+\param header Header line, written only to a new or empty file.
+\param text The rows. The header is inserted in front of them.
+\param append Add the rows to the end of the file instead of replacing it.
+\return 0, or -1 with errno set.
+*/
+inline int write_csv_text(const char *path, const char *header, std::string &text, bool append)
+{
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+  if (fd < 0)
+    {
+      return -1;
+    }
+  struct stat st;
+  int err = append ? fstat(fd, &st) : 0;
+  if (err == 0 && (!append || st.st_size == 0))
+    {
+      text.insert(0, header);
+    }
+  if (err == 0)
+    {
+      err = csv_write_all(fd, text.data(), text.size());
+    }
+  int saved = errno;
+  if (::close(fd) < 0 && err == 0)
+    {
+      return -1;
+    }
+  errno = saved;
+  return err;
+}
+
+//! Write a sweep to a file.
+/*!
+\param path The file.
+\param mag Frequency, impedance magnitude pairs.
+\param phase Frequency, impedance phase pairs.
+\param adm Frequency, admittance pairs.
+\param append Add the rows to the end of the file instead of replacing it. The
+header is only written to a new or empty file.
+\param buffer Buffer to format into, kept by the caller to reuse its memory.
+\return 0, or -1 with errno set.
+*/
+template <typename Real>
+int write_sweep_csv(const char *path,
+		    const std::vector<std::pair<Real, Real>> &mag,
+		    const std::vector<std::pair<Real, Real>> &phase,
+		    const std::vector<std::pair<Real, std::complex<Real>>> &adm,
+		    bool append, std::string &buffer)
+{
+  buffer.clear();
+  if (format_sweep_csv(buffer, mag, phase, adm) < 0)
+    {
+      return -1;
+    }
+  return write_csv_text(path, CSV_HEADER, buffer, append);
+}
+
+//! What CsvWriter does with a file that exists.
+enum class CsvMode
+{
+  //! Replace it, one sweep per file.
+  TRUNCATE,
+  //! Add the sweep to the end.
+  APPEND,
+  //! Add the sweep to the end until the file reaches
+  //! CsvWriterOptions::rotate_bytes, then rename it to <path>.1 (the older
+  //! ones to .2, .3, ...) and start a new one.
+  ROTATE
+};
+
+//! Settings of a CsvWriter.
+struct CsvWriterOptions
+{
+  //! Path of the files. {device}, {time} and {sweep} are replaced by the
+  //! device index, the local time as YYYYMMDD-HHMMSS and the sweep number.
+  std::string path_template = "output.csv";
+  CsvMode mode = CsvMode::TRUNCATE;
+  //! Size from which ROTATE starts a new file.
+  uint64_t rotate_bytes = 64 << 20;
+  //! Rotated files kept besides the current one.
+  unsigned rotate_keep = 4;
+  //! Value of {device}.
+  int device = 0;
+};
+
+//! Writes sweeps to files named after a template.
+/*! Not safe to share between threads: every thread should have its own. */
+class CsvWriter
+{
+public:
+  explicit CsvWriter(const CsvWriterOptions &options = CsvWriterOptions()) : options(options)
+  {
+  }
+
+  //! Path of a sweep.
+  std::string path(uint32_t sweep, time_t when) const
+  {
+    std::string p;
+    const std::string &t = options.path_template;
+    for (size_t i = 0; i < t.size(); i++)
+      {
+	if (t.compare(i, 8, "{device}") == 0)
+	  {
+	    p += std::to_string(options.device);
+	    i += 7;
+	  }
+	else if (t.compare(i, 6, "{time}") == 0)
+	  {
+	    char text[32];
+	    struct tm tm;
+	    localtime_r(&when, &tm);
+	    strftime(text, sizeof(text), "%Y%m%d-%H%M%S", &tm);
+	    p += text;
+	    i += 5;
+	  }
+	else if (t.compare(i, 7, "{sweep}") == 0)
+	  {
+	    p += std::to_string(sweep);
+	    i += 6;
+	  }
+	else
+	  {
+	    p += t[i];
+	  }
+      }
+    return p;
+  }
+
+  //! Write a sweep.
+  /*!
+    \param mag Frequency, impedance magnitude pairs.
+    \param phase Frequency, impedance phase pairs.
+    \param adm Frequency, admittance pairs.
+    \param sweep Value of {sweep}.
+    \param when Value of {time}, the current time if 0.
+    \return 0, or -1 with errno set; EINVAL if the vectors differ in size.
+  */
+  template <typename Real>
+  int write(const std::vector<std::pair<Real, Real>> &mag,
+	    const std::vector<std::pair<Real, Real>> &phase,
+	    const std::vector<std::pair<Real, std::complex<Real>>> &adm,
+	    uint32_t sweep = 0, time_t when = 0)
+  {
+    last = path(sweep, when ? when : time(nullptr));
+    if (options.mode == CsvMode::ROTATE && rotate() < 0)
+      {
+	return -1;
+      }
+    return write_sweep_csv(last.c_str(), mag, phase, adm, options.mode != CsvMode::TRUNCATE, buffer);
+  }
+
+  //! Path of the last write().
+  const std::string& last_path() const
+  {
+    return last;
+  }
+
+  const CsvWriterOptions options;
+
+private:
+  //! Rotate last if it is full.
+  int rotate()
+  {
+    struct stat st;
+    if (stat(last.c_str(), &st) < 0)
+      {
+	return errno == ENOENT ? 0 : -1;
+      }
+    if (static_cast<uint64_t>(st.st_size) < options.rotate_bytes)
+      {
+	return 0;
+      }
+    for (unsigned k = options.rotate_keep; k > 1; k--)
+      {
+	std::string older = last + "." + std::to_string(k - 1);
+	if (rename(older.c_str(), (last + "." + std::to_string(k)).c_str()) < 0 && errno != ENOENT)
+	  {
+	    return -1;
+	  }
+      }
+    if (options.rotate_keep == 0)
+      {
+	return unlink(last.c_str());
+      }
+    return rename(last.c_str(), (last + ".1").c_str());
+  }
+
+  std::string last;
+  std::string buffer;
+};
@@ -0,0 +1,786 @@
+/*! \file
+  The acquisition daemon.
+
+  An AcquisitionDaemon keeps the boards of a HotplugManager open, configured
+  and calibrated for as long as it runs, and lets any number of local clients
+  use them over a Unix domain socket, see daemon_protocol.hpp. A session no
+  longer pays for libusb_init(), the firmware download and a calibration: it
+  connects and submits jobs.
+
+  Every board has a queue of jobs per client and runs one job at a time,
+  taking the next one from the clients in turn, so a client that queues many
+  sweeps delays the others by one sweep at most. Jobs wait while their board
+  is being opened; those still waiting when the board leaves the bus fail.
+  The points and the end of every job go to the client that submitted it and
+  to the clients that subscribed to the board.
+
+  A calibration job keeps the gains and the system phase with the Board, and
+  its configuration, which is applied again whenever the board comes back.
+  Sweeps of a calibrated board report impedance magnitude and phase as well,
+  if they use the voltage, gain, settling time and clock of the calibration.
+  Every job runs under the deadline of its sweep, and the watchdog aborts
+  those that overrun it.
+*/
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "daemon_protocol.hpp"
+#include "hotplug.hpp"
+#include "sweep_plan.hpp"
+#include "watchdog.hpp"
+
+//! Convert the payload of a SWEEP or CALIBRATE request.
+/*!
+\param r The request.
+\param config The sweep configuration.
+\return 0, or EINVAL if a field is out of range.
+*/
+inline int sweep_config_from(const SweepRequest &r, SweepConfig &config)
+{
+  if (r.steps > 511 || r.settling_cycles > 511 || r.multiplier > 2 || r.gain > 1 || r.voltage > 3 || r.clock > 1
+      || !(r.start > 0) || !(r.step >= 0) || (r.clock == 0 && !(r.ext_clk > 0)))
+    {
+      return EINVAL;
+    }
+  config.start = r.start;
+  config.step = r.step;
+  config.steps = r.steps;
+  config.settling_cycles = r.settling_cycles;
+  config.multiplier = static_cast<SettlingMultiplier>(r.multiplier);
+  config.gain = static_cast<Gain>(r.gain);
+  config.voltage = static_cast<Voltage>(r.voltage);
+  config.clock = static_cast<Clk>(r.clock);
+  config.ext_clk = r.ext_clk;
+  // The last frequency has to fit the 24 bit frequency registers.
+  long double clk = config.clock == Clk::EXT ? config.ext_clk : INTERNAL_CLOCK;
+  if (!(config.start + config.steps*config.step < (clk/4) / (1<<27) * (1<<24)))
+    {
+      return EINVAL;
+    }
+  return 0;
+}
+
+//! Serves the boards of a HotplugManager to local clients.
+/*! The daemon installs HotplugManager::on_attach and on_detach, so it has
+  to be constructed before the manager is started, and the manager has to
+  be stopped before the daemon is destroyed. */
+class AcquisitionDaemon
+{
+public:
+  //! Bytes queued for one client before it is dropped.
+  size_t max_pending = 1 << 20;
+  //! Jobs one client may have waiting for one board.
+  unsigned max_queued = 64;
+  //! Aborts jobs that overrun their deadline.
+  Watchdog watchdog;
+
+  explicit AcquisitionDaemon(HotplugManager &manager) : manager(manager)
+  {
+    manager.on_attach = [this](const std::shared_ptr<Board> &board)
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	dispatch(board->number);
+      };
+    manager.on_detach = [this](const std::shared_ptr<Board> &board)
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	fail_waiting(board->number, LIBUSB_ERROR_NO_DEVICE);
+      };
+  }
+
+  AcquisitionDaemon(const AcquisitionDaemon&) = delete;
+  AcquisitionDaemon& operator=(const AcquisitionDaemon&) = delete;
+
+  ~AcquisitionDaemon()
+  {
+    stop();
+  }
+
+  //! Listen on a Unix domain socket.
+  /*! \param path Filesystem path of the socket. An existing file is replaced.
+    \return 0 on success, -1 on failure with errno set. */
+  int listen_unix(const std::string &path)
+  {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      {
+	errno = ENAMETOOLONG;
+	return -1;
+      }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || listen(fd, 16) == -1)
+      {
+	int saved = errno;
+	::close(fd);
+	errno = saved;
+	return -1;
+      }
+    listener = fd;
+    unix_path = path;
+    return 0;
+  }
+
+  //! Start serving clients.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int start()
+  {
+    if (pipe(wake_pipe) == -1)
+      {
+	return -1;
+      }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    running.store(true);
+    worker = std::thread(&AcquisitionDaemon::run, this);
+    return 0;
+  }
+
+  //! Disconnect the clients, drop the jobs waiting and wait for those running.
+  void stop()
+  {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      stopping = true;
+      for (auto &q: queues)
+	{
+	  q.second.waiting.clear();
+	}
+      // Jobs end by their deadline, so this does not hang on a stuck board.
+      // They publish through the server thread and wake(), so both stay
+      // until the last one finished.
+      idle.wait(guard, [this] { return in_flight == 0; });
+    }
+    if (running.exchange(false))
+      {
+	wake();
+	worker.join();
+	::close(wake_pipe[0]);
+	::close(wake_pipe[1]);
+	wake_pipe[0] = wake_pipe[1] = -1;
+      }
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &c: clients)
+      {
+	::close(c.second.fd);
+      }
+    clients.clear();
+    if (listener != -1)
+      {
+	::close(listener);
+	listener = -1;
+      }
+    if (!unix_path.empty())
+      {
+	unlink(unix_path.c_str());
+	unix_path.clear();
+      }
+  }
+
+  //! Number of connected clients.
+  size_t client_count()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return clients.size();
+  }
+
+  //! Jobs finished so far.
+  uint64_t jobs_done() const
+  {
+    return done_count.load();
+  }
+
+  //! Clients dropped for being too slow or sending garbage.
+  uint64_t dropped() const
+  {
+    return dropped_count.load();
+  }
+
+private:
+  struct Subscription
+  {
+    int32_t board;
+    uint32_t flags;
+    uint64_t tag;
+  };
+
+  struct Client
+  {
+    int fd;
+    //! Bytes received that do not make a whole message yet.
+    std::string in;
+    //! Bytes not yet accepted by the socket.
+    std::string pending;
+    std::vector<Subscription> subscriptions;
+  };
+
+  struct Job
+  {
+    uint64_t id;
+    uint64_t client;
+    uint64_t tag;
+    RpcType type;
+    int32_t board;
+    uint32_t flags;
+    SweepConfig config;
+    real_t rcal;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  //! The jobs of one board.
+  struct BoardQueue
+  {
+    //! Waiting jobs by client, in the order they were submitted.
+    std::map<uint64_t, std::deque<Job>> waiting;
+    //! Client whose job ran last, to take the next client's now.
+    uint64_t last = 0;
+    bool busy = false;
+  };
+
+  std::shared_ptr<Board> find_board(int32_t number) const
+  {
+    for (auto &b: manager.boards())
+      {
+	if (b->number == number)
+	  {
+	    return b;
+	  }
+      }
+    return nullptr;
+  }
+
+  //! Start the next job of a board if it is free. Call with the lock held.
+  void dispatch(int32_t number)
+  {
+    auto &q = queues[number];
+    if (q.busy || q.waiting.empty() || stopping)
+      {
+	return;
+      }
+    auto board = find_board(number);
+    auto device = board ? board->device() : nullptr;
+    if (!device)
+      {
+	// Not attached yet: on_attach dispatches again.
+	return;
+      }
+    auto next = q.waiting.upper_bound(q.last);
+    if (next == q.waiting.end())
+      {
+	next = q.waiting.begin();
+      }
+    Job job = std::move(next->second.front());
+    next->second.pop_front();
+    q.last = next->first;
+    if (next->second.empty())
+      {
+	q.waiting.erase(next);
+      }
+    q.busy = true;
+    in_flight++;
+    // Commands queued on a DeviceThread always run, even after a detach, so
+    // every job reaches finish().
+    device->submit([this, board, job](AD5933 &dev) { execute(board, job, dev); });
+  }
+
+  //! Run a job on the owner thread of its board.
+  void execute(const std::shared_ptr<Board> &board, const Job &job, AD5933 &dev)
+  {
+    // Frees the board even if the job throws, e.g. std::bad_alloc, so that
+    // stop() does not wait for it forever.
+    struct Finish
+    {
+      AcquisitionDaemon *daemon;
+      AD5933 *dev;
+      int32_t board;
+      ~Finish()
+      {
+	daemon->watchdog.unwatch(dev);
+	std::lock_guard<std::mutex> guard(daemon->lock);
+	daemon->queues[board].busy = false;
+	daemon->dispatch(board);
+	if (--daemon->in_flight == 0)
+	  {
+	    daemon->idle.notify_all();
+	  }
+      }
+    } finish{this, &dev, job.board};
+    auto started = std::chrono::steady_clock::now();
+    watchdog.watch(&dev);
+    dev.error = 0;
+    SweepPlan plan(job.config, &dev);
+    std::vector<std::pair<real_t, real_t>> gains, system_phase;
+    SweepConfig calibrated_with;
+    bool calibrated = job.type == RpcType::SWEEP && board->calibration(gains, system_phase, calibrated_with) &&
+      same_analog_settings(calibrated_with, job.config);
+    std::vector<std::pair<real_t, real_t>> grid;
+    for (real_t f: plan.frequencies())
+      {
+	grid.push_back(std::make_pair(f, 0));
+      }
+    if (calibrated && !same_frequencies(grid, gains))
+      {
+	// Calibrated on another grid: interpolate.
+	gains = calc_multigains(grid, gains);
+	system_phase = calc_multigains(grid, system_phase);
+      }
+    auto adm = plan.run(&dev, [&](uint32_t index, real_t f, const complex_t &z)
+      {
+	ResultPoint p;
+	memset(&p, 0, sizeof(p));
+	p.job = job.id;
+	p.index = index;
+	p.frequency = f;
+	p.re = z.real();
+	p.im = z.imag();
+	p.magnitude = p.phase = NAN;
+	if (calibrated && index < gains.size())
+	  {
+	    p.magnitude = 1/(std::abs(z)*gains[index].second);
+	    p.phase = std::arg(z)*(180.0/M_PI) - system_phase[index].second;
+	  }
+	std::lock_guard<std::mutex> guard(lock);
+	publish(job, RpcType::POINT, &p, sizeof(p));
+      });
+    int err = dev.error;
+    if (job.type == RpcType::CALIBRATE && err == 0)
+      {
+	if (adm.size() != job.config.steps + 1)
+	  {
+	    err = LIBUSB_ERROR_IO;
+	  }
+	else
+	  {
+	    for (const auto &p: adm)
+	      {
+		system_phase.push_back(std::make_pair(p.first, std::arg(p.second)*(180.0/M_PI)));
+	      }
+	    board->set_calibration(calibrate_gain(adm, job.rcal), system_phase, job.config);
+	    board->set_configuration(job.config);
+	    log_message("Board %d calibrated with %g Ohm\n", board->number, static_cast<double>(job.rcal));
+	  }
+      }
+    auto now = std::chrono::steady_clock::now();
+    JobEnd end;
+    memset(&end, 0, sizeof(end));
+    end.job = job.id;
+    end.board = job.board;
+    end.error = err;
+    end.points = adm.size();
+    end.type = static_cast<uint32_t>(job.type);
+    end.wait = std::chrono::duration<double>(started - job.queued).count();
+    end.duration = std::chrono::duration<double>(now - started).count();
+    std::lock_guard<std::mutex> guard(lock);
+    publish(job, RpcType::JOB_END, &end, sizeof(end));
+    done_count++;
+  }
+
+  //! End the waiting jobs of a board. Call with the lock held.
+  void fail_waiting(int32_t number, int error)
+  {
+    auto &q = queues[number];
+    for (auto &c: q.waiting)
+      {
+	for (auto &job: c.second)
+	  {
+	    JobEnd end;
+	    memset(&end, 0, sizeof(end));
+	    end.job = job.id;
+	    end.board = job.board;
+	    end.error = error;
+	    end.type = static_cast<uint32_t>(job.type);
+	    end.wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.queued).count();
+	    publish(job, RpcType::JOB_END, &end, sizeof(end));
+	  }
+      }
+    q.waiting.clear();
+  }
+
+  //! Send an event of a job to its client and the subscribers of its board.
+  //! Call with the lock held.
+  void publish(const Job &job, RpcType type, const void *payload, uint16_t length)
+  {
+    std::vector<uint64_t> slow;
+    for (auto &c: clients)
+      {
+	if (c.first == job.client && (type != RpcType::POINT || (job.flags & RPC_STREAM_POINTS)))
+	  {
+	    if (send_message(c.second, type, job.tag, payload, length) < 0)
+	      {
+		slow.push_back(c.first);
+		continue;
+	      }
+	  }
+	for (const auto &s: c.second.subscriptions)
+	  {
+	    if ((s.board == -1 || s.board == job.board) && (type != RpcType::POINT || (s.flags & RPC_STREAM_POINTS))
+		&& send_message(c.second, type, s.tag, payload, length) < 0)
+	      {
+		slow.push_back(c.first);
+		break;
+	      }
+	  }
+      }
+    for (uint64_t id: slow)
+      {
+	dropped_count++;
+	drop(id);
+      }
+  }
+
+  //! Send a message without blocking, queuing what the socket does not take.
+  /*! \return 0, or -1 if the client has to be dropped. */
+  int send_message(Client &c, RpcType type, uint64_t tag, const void *payload, uint16_t length)
+  {
+    char buf[RPC_MAX_MESSAGE];
+    size_t n = encode_message(buf, type, tag, payload, length);
+    if (c.pending.empty())
+      {
+	ssize_t sent = send(c.fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	  {
+	    return -1;
+	  }
+	if (sent < static_cast<ssize_t>(n))
+	  {
+	    c.pending.append(buf + std::max<ssize_t>(sent, 0), buf + n);
+	    wake();
+	  }
+      }
+    else
+      {
+	c.pending.append(buf, n);
+      }
+    return c.pending.size() > max_pending ? -1 : 0;
+  }
+
+  //! Close a client and drop its waiting jobs. Call with the lock held.
+  void drop(uint64_t id)
+  {
+    auto it = clients.find(id);
+    if (it == clients.end())
+      {
+	return;
+      }
+    ::close(it->second.fd);
+    clients.erase(it);
+    for (auto &q: queues)
+      {
+	q.second.waiting.erase(id);
+      }
+  }
+
+  //! Jobs of a client waiting for a board. Call with the lock held.
+  size_t waiting(int32_t number, uint64_t client) const
+  {
+    auto q = queues.find(number);
+    if (q == queues.end())
+      {
+	return 0;
+      }
+    auto w = q->second.waiting.find(client);
+    return w == q->second.waiting.end() ? 0 : w->second.size();
+  }
+
+  //! Answer a request. Call with the lock held.
+  void handle(uint64_t id, const RpcMessage &m)
+  {
+    Client &c = clients[id];
+    const uint64_t tag = m.header.tag;
+    auto refuse = [&](int error)
+      {
+	ErrorReply e;
+	e.error = error;
+	e.reserved = 0;
+	return send_message(c, RpcType::ERROR, tag, &e, sizeof(e));
+      };
+    auto accept = [&](uint64_t job)
+      {
+	JobRef r;
+	r.job = job;
+	return send_message(c, RpcType::ACCEPTED, tag, &r, sizeof(r));
+      };
+    int err = 0;
+    switch (static_cast<RpcType>(m.header.type))
+      {
+      case RpcType::LIST:
+	for (auto &b: manager.boards())
+	  {
+	    BoardInfo info;
+	    memset(&info, 0, sizeof(info));
+	    info.number = b->number;
+	    std::vector<std::pair<real_t, real_t>> gains, phase;
+	    SweepConfig calibrated;
+	    info.flags = (b->attached() ? BOARD_ATTACHED : 0) |
+	      (b->calibration(gains, phase, calibrated) ? BOARD_CALIBRATED : 0);
+	    auto q = queues.find(b->number);
+	    if (q != queues.end())
+	      {
+		for (const auto &w: q->second.waiting)
+		  {
+		    info.queued += w.second.size();
+		  }
+	      }
+	    info.attachments = b->attachments();
+	    strncpy(info.location, b->location.c_str(), sizeof(info.location) - 1);
+	    if ((err = send_message(c, RpcType::BOARD, tag, &info, sizeof(info))) < 0)
+	      {
+		break;
+	      }
+	  }
+	if (err == 0)
+	  {
+	    err = send_message(c, RpcType::DONE, tag, NULL, 0);
+	  }
+	break;
+      case RpcType::SWEEP:
+      case RpcType::CALIBRATE:
+	{
+	  Job job;
+	  int reason = m.header.length != sizeof(SweepRequest) ? EINVAL : sweep_config_from(m.sweep, job.config);
+	  if (reason == 0 && static_cast<RpcType>(m.header.type) == RpcType::CALIBRATE && !(m.sweep.rcal > 0))
+	    {
+	      reason = EINVAL;
+	    }
+	  if (reason == 0 && !find_board(m.sweep.board))
+	    {
+	      reason = ENODEV;
+	    }
+	  if (reason == 0 && waiting(m.sweep.board, id) >= max_queued)
+	    {
+	      reason = EBUSY;
+	    }
+	  if (reason)
+	    {
+	      err = refuse(reason);
+	      break;
+	    }
+	  job.id = ++last_job;
+	  job.client = id;
+	  job.tag = tag;
+	  job.type = static_cast<RpcType>(m.header.type);
+	  job.board = m.sweep.board;
+	  job.flags = m.sweep.flags;
+	  job.rcal = m.sweep.rcal;
+	  job.queued = std::chrono::steady_clock::now();
+	  queues[job.board].waiting[id].push_back(job);
+	  err = accept(job.id);
+	  dispatch(job.board);
+	  break;
+	}
+      case RpcType::SUBSCRIBE:
+	if (m.header.length != sizeof(SubscribeRequest)
+	    || (m.subscribe.board != -1 && !find_board(m.subscribe.board)))
+	  {
+	    err = refuse(m.header.length != sizeof(SubscribeRequest) ? EINVAL : ENODEV);
+	    break;
+	  }
+	c.subscriptions.push_back(Subscription{m.subscribe.board, m.subscribe.flags, tag});
+	err = accept(0);
+	break;
+      case RpcType::CANCEL:
+	{
+	  if (m.header.length != sizeof(JobRef))
+	    {
+	      err = refuse(EINVAL);
+	      break;
+	    }
+	  bool found = false;
+	  for (auto &q: queues)
+	    {
+	      auto w = q.second.waiting.find(id);
+	      if (w == q.second.waiting.end())
+		{
+		  continue;
+		}
+	      auto &jobs = w->second;
+	      auto j = std::find_if(jobs.begin(), jobs.end(), [&](const Job &job) { return job.id == m.job.job; });
+	      if (j != jobs.end())
+		{
+		  jobs.erase(j);
+		  if (jobs.empty())
+		    {
+		      q.second.waiting.erase(w);
+		    }
+		  found = true;
+		  break;
+		}
+	    }
+	  err = found ? accept(m.job.job) : refuse(ENOENT);
+	  break;
+	}
+      default:
+	err = refuse(EINVAL);
+      }
+    if (err < 0)
+      {
+	dropped_count++;
+	drop(id);
+      }
+  }
+
+  //! Take the whole messages out of a client's input. Call with the lock held.
+  /*! \return 0, or -1 if the client sent garbage and was dropped. */
+  int receive(uint64_t id)
+  {
+    RpcMessage m;
+    size_t at = 0;
+    for (;;)
+      {
+	auto c = clients.find(id);
+	if (c == clients.end())
+	  {
+	    // Dropped while answering.
+	    return -1;
+	  }
+	std::string &in = c->second.in;
+	if (in.size() - at < sizeof(RpcHeader))
+	  {
+	    in.erase(0, at);
+	    return 0;
+	  }
+	memcpy(&m.header, in.data() + at, sizeof(m.header));
+	if (m.header.magic != RPC_MAGIC || m.header.length > RPC_MAX_PAYLOAD)
+	  {
+	    dropped_count++;
+	    drop(id);
+	    return -1;
+	  }
+	if (in.size() - at < sizeof(RpcHeader) + m.header.length)
+	  {
+	    in.erase(0, at);
+	    return 0;
+	  }
+	memset(&m.sweep, 0, RPC_MAX_PAYLOAD);
+	memcpy(&m.sweep, in.data() + at + sizeof(RpcHeader), m.header.length);
+	at += sizeof(RpcHeader) + m.header.length;
+	handle(id, m);
+      }
+  }
+
+  void wake()
+  {
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) == -1)
+      {
+	// The pipe is full, so the server is awake anyway.
+      }
+  }
+
+  //! Accept clients, read their requests and flush queued messages.
+  void run()
+  {
+    AD5933_TRACE_THREAD("daemon");
+    std::vector<pollfd> fds;
+    std::vector<uint64_t> ids;
+    char buf[4096];
+    while (running.load())
+      {
+	fds.clear();
+	ids.clear();
+	fds.push_back(pollfd{wake_pipe[0], POLLIN, 0});
+	fds.push_back(pollfd{listener, POLLIN, 0});
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  for (const auto &c: clients)
+	    {
+	      fds.push_back(pollfd{c.second.fd, static_cast<short>(POLLIN | (c.second.pending.empty() ? 0 : POLLOUT)), 0});
+	      ids.push_back(c.first);
+	    }
+	}
+	if (poll(fds.data(), fds.size(), 1000) <= 0)
+	  {
+	    continue;
+	  }
+	while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+	  ;
+	std::lock_guard<std::mutex> guard(lock);
+	if (fds[1].revents & POLLIN)
+	  {
+	    int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	    if (fd != -1)
+	      {
+		clients[++last_client] = Client{fd, std::string(), std::string(), {}};
+	      }
+	  }
+	for (size_t i = 2; i < fds.size(); i++)
+	  {
+	    auto c = clients.find(ids[i - 2]);
+	    if (c == clients.end() || !(fds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+	      {
+		continue;
+	      }
+	    if ((fds[i].revents & POLLOUT) && !c->second.pending.empty())
+	      {
+		ssize_t sent = send(c->second.fd, c->second.pending.data(), c->second.pending.size(),
+				    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent > 0)
+		  {
+		    c->second.pending.erase(0, sent);
+		  }
+		else if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		  {
+		    drop(c->first);
+		    continue;
+		  }
+	      }
+	    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+	      {
+		ssize_t r = recv(c->second.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+		  {
+		    drop(c->first);
+		    continue;
+		  }
+		if (r > 0)
+		  {
+		    c->second.in.append(buf, r);
+		    receive(c->first);
+		  }
+	      }
+	  }
+      }
+  }
+
+  HotplugManager &manager;
+  //! Guards everything below but the atomics.
+  std::mutex lock;
+  std::condition_variable idle;
+  std::map<uint64_t, Client> clients;
+  std::map<int32_t, BoardQueue> queues;
+  uint64_t last_client = 0;
+  uint64_t last_job = 0;
+  unsigned in_flight = 0;
+  bool stopping = false;
+  int listener = -1;
+  std::string unix_path;
+  std::atomic<uint64_t> done_count{0};
+  std::atomic<uint64_t> dropped_count{0};
+  std::atomic<bool> running{false};
+  int wake_pipe[2] = {-1, -1};
+  std::thread worker;
+};
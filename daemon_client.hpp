@@ -0,0 +1,198 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+#include "ad5933.hpp"
+#include "daemon_protocol.hpp"
+
+//! Payload of a SWEEP or CALIBRATE request.
+/*!
+\param board Board::number of the board.
+\param config The sweep configuration.
+\param flags RPC_STREAM_POINTS or 0.
+\param rcal Calibration resistance, for CALIBRATE.
+*/
+inline SweepRequest sweep_request(int32_t board, const SweepConfig &config, uint32_t flags = 0, real_t rcal = 0)
+{
+  SweepRequest r;
+  memset(&r, 0, sizeof(r));
+  r.board = board;
+  r.steps = config.steps;
+  r.start = config.start;
+  r.step = config.step;
+  r.settling_cycles = config.settling_cycles;
+  r.multiplier = static_cast<uint8_t>(config.multiplier);
+  r.gain = static_cast<uint8_t>(config.gain);
+  r.voltage = static_cast<uint8_t>(config.voltage);
+  r.clock = static_cast<uint8_t>(config.clock);
+  r.ext_clk = config.ext_clk;
+  r.rcal = rcal;
+  r.flags = flags;
+  return r;
+}
+
+//! Client of an AcquisitionDaemon.
+/*! Requests are sent with the methods named after them; answers and events
+  are read with next(), in the order the daemon sent them. */
+class DaemonClient
+{
+public:
+  DaemonClient() = default;
+  DaemonClient(const DaemonClient&) = delete;
+  DaemonClient& operator=(const DaemonClient&) = delete;
+
+  ~DaemonClient()
+  {
+    close();
+  }
+
+  //! Connect to the socket of the daemon.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int connect_unix(const std::string &path)
+  {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      {
+	errno = ENAMETOOLONG;
+	return -1;
+      }
+    strcpy(addr.sun_path, path.c_str());
+    close();
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+      {
+	int saved = errno;
+	close();
+	errno = saved;
+	return -1;
+      }
+    return 0;
+  }
+
+  //! Ask for the boards, answered by BOARD messages and DONE.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int list(uint64_t tag)
+  {
+    return request(RpcType::LIST, tag, NULL, 0);
+  }
+
+  //! Queue a sweep, answered by ACCEPTED with the job or ERROR.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int sweep(uint64_t tag, const SweepRequest &r)
+  {
+    return request(RpcType::SWEEP, tag, &r, sizeof(r));
+  }
+
+  //! Queue a calibration sweep of the resistor r.rcal.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int calibrate(uint64_t tag, const SweepRequest &r)
+  {
+    return request(RpcType::CALIBRATE, tag, &r, sizeof(r));
+  }
+
+  //! Receive the events of every job of a board, -1 for all boards.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int subscribe(uint64_t tag, int32_t board, uint32_t flags = 0)
+  {
+    SubscribeRequest r;
+    r.board = board;
+    r.flags = flags;
+    return request(RpcType::SUBSCRIBE, tag, &r, sizeof(r));
+  }
+
+  //! Drop a job that has not started yet.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int cancel(uint64_t tag, uint64_t job)
+  {
+    JobRef r;
+    r.job = job;
+    return request(RpcType::CANCEL, tag, &r, sizeof(r));
+  }
+
+  //! Wait for the next message.
+  /*! \param m The received message.
+    \return 0 on success, -1 if the connection was closed or the stream is
+    corrupt. */
+  int next(RpcMessage &m)
+  {
+    if (read_fully(&m.header, sizeof(m.header)) == -1)
+      {
+	return -1;
+      }
+    if (m.header.magic != RPC_MAGIC || m.header.length > RPC_MAX_PAYLOAD)
+      {
+	errno = EPROTO;
+	return -1;
+      }
+    return read_fully(&m.sweep, m.header.length);
+  }
+
+  void close()
+  {
+    if (fd != -1)
+      {
+	::close(fd);
+	fd = -1;
+      }
+  }
+
+private:
+  int request(RpcType type, uint64_t tag, const void *payload, uint16_t length)
+  {
+    char buf[RPC_MAX_MESSAGE];
+    size_t n = encode_message(buf, type, tag, payload, length);
+    const char *p = buf;
+    while (n > 0)
+      {
+	ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+	if (w == -1)
+	  {
+	    if (errno == EINTR)
+	      {
+		continue;
+	      }
+	    return -1;
+	  }
+	p += w;
+	n -= w;
+      }
+    return 0;
+  }
+
+  int read_fully(void *buf, size_t n)
+  {
+    char *p = static_cast<char*>(buf);
+    while (n > 0)
+      {
+	ssize_t r = recv(fd, p, n, 0);
+	if (r == 0)
+	  {
+	    return -1;
+	  }
+	if (r == -1)
+	  {
+	    if (errno == EINTR)
+	      {
+		continue;
+	      }
+	    return -1;
+	  }
+	p += r;
+	n -= r;
+      }
+    return 0;
+  }
+
+  int fd = -1;
+};
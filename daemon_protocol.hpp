@@ -0,0 +1,211 @@
+/*! \file */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+//Binary messages between the acquisition daemon and its clients, over a Unix
+//domain socket. Every message is an RpcHeader followed by a payload of
+//header.length bytes. Fields are in host byte order, since both ends are on
+//the same machine.
+//
+//Requests go from the client to the daemon. The daemon answers every request
+//with ACCEPTED, ERROR or, for LIST, BOARD messages ended by DONE; the answer
+//carries the tag of the request. Jobs then report POINT and JOB_END events
+//with the tag of the request that submitted them, or of the SUBSCRIBE request
+//they are delivered for.
+
+//! Magic number at the start of every message ("A5R1").
+const uint32_t RPC_MAGIC = 0x31523541;
+
+//! Message types.
+enum class RpcType : uint16_t
+{
+  LIST = 1,       /*!< Request: the boards, no payload. */
+  SWEEP = 2,      /*!< Request: queue a sweep, payload SweepRequest. */
+  CALIBRATE = 3,  /*!< Request: queue a calibration sweep, payload SweepRequest. */
+  SUBSCRIBE = 4,  /*!< Request: receive the events of all jobs of a board, payload SubscribeRequest. */
+  CANCEL = 5,     /*!< Request: drop a queued job of this client, payload JobRef. */
+  BOARD = 16,     /*!< Answer to LIST, payload BoardInfo. */
+  DONE = 17,      /*!< End of the answer to LIST, no payload. */
+  ACCEPTED = 18,  /*!< Request done, payload JobRef: the new job, or 0. */
+  ERROR = 19,     /*!< Request refused, payload ErrorReply. */
+  POINT = 20,     /*!< Event: a point was measured, payload ResultPoint. */
+  JOB_END = 21    /*!< Event: a job finished, payload JobEnd. */
+};
+
+//! Header of every message.
+struct RpcHeader
+{
+  uint32_t magic;
+  //! An RpcType.
+  uint16_t type;
+  //! Length of the payload in bytes.
+  uint16_t length;
+  //! Chosen by the client for a request and copied to what answers it.
+  uint64_t tag;
+};
+static_assert(sizeof(RpcHeader) == 16, "RpcHeader layout");
+
+//! Send the POINT events of a job, not only JOB_END.
+const uint32_t RPC_STREAM_POINTS = 0x01;
+
+//! Payload of SWEEP and CALIBRATE: a SweepConfig and where to run it.
+struct SweepRequest
+{
+  //! Board::number of the board.
+  int32_t board;
+  //! Number of increments.
+  uint32_t steps;
+  //! Start frequency in Hz.
+  double start;
+  //! Frequency increment in Hz.
+  double step;
+  uint32_t settling_cycles;
+  //! A SettlingMultiplier.
+  uint8_t multiplier;
+  //! A Gain.
+  uint8_t gain;
+  //! A Voltage.
+  uint8_t voltage;
+  //! A Clk.
+  uint8_t clock;
+  //! Frequency of the external clock.
+  double ext_clk;
+  //! Calibration resistance in Ohm, for CALIBRATE.
+  double rcal;
+  //! RPC_STREAM_POINTS or 0.
+  uint32_t flags;
+  uint32_t reserved;
+};
+static_assert(sizeof(SweepRequest) == 56, "SweepRequest layout");
+
+//! Payload of SUBSCRIBE.
+struct SubscribeRequest
+{
+  //! Board::number of the board, -1 for all boards.
+  int32_t board;
+  //! RPC_STREAM_POINTS or 0.
+  uint32_t flags;
+};
+static_assert(sizeof(SubscribeRequest) == 8, "SubscribeRequest layout");
+
+//! Payload of CANCEL and ACCEPTED.
+struct JobRef
+{
+  uint64_t job;
+};
+static_assert(sizeof(JobRef) == 8, "JobRef layout");
+
+//! Payload of ERROR.
+struct ErrorReply
+{
+  //! An errno value: EINVAL for a malformed request, ENODEV for an unknown
+  //! board, EBUSY if too many jobs are queued, ENOENT for a job not queued.
+  int32_t error;
+  uint32_t reserved;
+};
+static_assert(sizeof(ErrorReply) == 8, "ErrorReply layout");
+
+//! BoardInfo::flags: the board is attached.
+const uint32_t BOARD_ATTACHED = 0x01;
+//! BoardInfo::flags: the board has a calibration.
+const uint32_t BOARD_CALIBRATED = 0x02;
+
+//! Payload of BOARD.
+struct BoardInfo
+{
+  //! Board::number.
+  int32_t number;
+  //! BOARD_ATTACHED, BOARD_CALIBRATED.
+  uint32_t flags;
+  //! Jobs waiting for the board.
+  uint32_t queued;
+  //! Board::attachments().
+  uint32_t attachments;
+  //! Board::location, NUL terminated.
+  char location[32];
+};
+static_assert(sizeof(BoardInfo) == 48, "BoardInfo layout");
+
+//! Payload of POINT.
+struct ResultPoint
+{
+  uint64_t job;
+  //! Index of the point in the sweep.
+  uint32_t index;
+  uint32_t reserved;
+  //! Frequency in Hz.
+  double frequency;
+  //! Raw DFT value of the admittance.
+  double re;
+  double im;
+  //! Impedance magnitude in Ohm and phase in degrees, NaN if the board has
+  //! no calibration or was calibrated with another voltage, gain, settling
+  //! time or clock.
+  double magnitude;
+  double phase;
+};
+static_assert(sizeof(ResultPoint) == 56, "ResultPoint layout");
+
+//! Payload of JOB_END.
+struct JobEnd
+{
+  uint64_t job;
+  int32_t board;
+  //! 0, or the libusb_error code that ended the job early.
+  int32_t error;
+  //! Points measured.
+  uint32_t points;
+  //! RpcType of the request, SWEEP or CALIBRATE.
+  uint32_t type;
+  //! Seconds the job waited in the queue.
+  double wait;
+  //! Seconds the job ran.
+  double duration;
+};
+static_assert(sizeof(JobEnd) == 40, "JobEnd layout");
+
+//! Largest payload of any message.
+const size_t RPC_MAX_PAYLOAD = 56;
+//! Largest message on the wire.
+const size_t RPC_MAX_MESSAGE = sizeof(RpcHeader) + RPC_MAX_PAYLOAD;
+
+//! A decoded message.
+struct RpcMessage
+{
+  RpcHeader header;
+  union
+  {
+    SweepRequest sweep;
+    SubscribeRequest subscribe;
+    JobRef job;
+    ErrorReply error;
+    BoardInfo board;
+    ResultPoint point;
+    JobEnd end;
+  };
+};
+
+//!Encode a message.
+/*!
+\param buf Buffer of at least RPC_MAX_MESSAGE bytes.
+\param type Message type.
+\param tag Tag of the request.
+\param payload The payload.
+\param length Size of the payload.
+\return The size of the encoded message.
+*/
+inline size_t encode_message(char *buf, RpcType type, uint64_t tag, const void *payload, uint16_t length)
+{
+  RpcHeader h;
+  h.magic = RPC_MAGIC;
+  h.type = static_cast<uint16_t>(type);
+  h.length = length;
+  h.tag = tag;
+  memcpy(buf, &h, sizeof(h));
+  if (length)
+    {
+      memcpy(buf + sizeof(h), payload, length);
+    }
+  return sizeof(h) + length;
+}
@@ -0,0 +1,210 @@
+/*! \file */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#include "ad5933.hpp"
+#include "lockfree.hpp"
+#include "sweep_plan.hpp"
+
+//! Owner thread for one AD5933.
+/*! The AD5933 struct keeps the control register in ctrl_reg1/ctrl_reg2 and is
+  not safe to use from more than one thread. A DeviceThread owns the device and
+  is the only thread that ever touches it. Other threads submit commands through
+  a lock-free MPSC queue and receive the results through std::futures, so a UI,
+  a scheduler and a monitor can share the same board. Commands run in the order
+  they were submitted.
+
+  The device itself is constructed by the owner thread, so creating a
+  DeviceThread returns immediately while the firmware is downloaded in the
+  background. Commands submitted in the meantime are queued. If the device
+  cannot be opened the commands still run, on a closed device: their
+  transfers fail with LIBUSB_ERROR_NO_DEVICE, and open_error() tells why.
+*/
+class DeviceThread
+{
+public:
+  //! Factory used to open the device from the owner thread.
+  typedef std::function<std::unique_ptr<AD5933>()> Opener;
+
+  //! Start the owner thread.
+  /*! \param open Factory that opens the device. It may return a closed
+    device or NULL, or throw, if that fails. By default the first board on
+    the bus is opened, see open_first_board(). */
+  explicit DeviceThread(Opener open = open_first_board)
+    : opener(std::move(open))
+  {
+    worker = std::thread(&DeviceThread::run, this);
+  }
+
+  //! Open the first board on the bus with a context of its own.
+  /*! \return The device, closed if it could not be opened. */
+  static std::unique_ptr<AD5933> open_first_board()
+  {
+    auto dev = std::make_unique<AD5933>(static_cast<libusb_context*>(NULL));
+    dev->open();
+    return dev;
+  }
+
+  //! Stop the owner thread. Commands already queued are still executed.
+  ~DeviceThread()
+  {
+    stopping.store(true);
+    wake();
+    worker.join();
+  }
+
+  DeviceThread(const DeviceThread&) = delete;
+  DeviceThread& operator=(const DeviceThread&) = delete;
+
+  //! Run an arbitrary function on the owner thread.
+  /*! \param f Callable taking an AD5933&.
+    \return A future with the result of f. Exceptions thrown by f are stored
+    in the future. */
+  template <typename F>
+  auto submit(F &&f) -> std::future<std::invoke_result_t<F, AD5933&>>
+  {
+    typedef std::invoke_result_t<F, AD5933&> R;
+    auto task = std::make_shared<std::packaged_task<R(AD5933&)>>(std::forward<F>(f));
+    auto result = task->get_future();
+    commands.push([task](AD5933 &dev) { (*task)(dev); });
+    wake();
+    return result;
+  }
+
+  //! Apply the analog settings of a sweep configuration.
+  std::future<void> configure(const SweepConfig &config)
+  {
+    return submit([config](AD5933 &dev) { dev.configure(config); });
+  }
+
+  //! Configure the device and run a sweep.
+  /*! Registers that already hold the values of the configuration are not
+    written again, see SweepPlan. */
+  std::future<std::vector<std::pair<real_t, complex_t>>> sweep(const SweepConfig &config)
+  {
+    return submit([config](AD5933 &dev) { return SweepPlan(config, &dev).run(&dev); });
+  }
+
+  //! Measure the temperature of the AD5933.
+  /*! The result is NaN if a transfer failed, e.g. on an unplugged board. */
+  std::future<double> temperature()
+  {
+    return submit([](AD5933 &dev)
+      {
+	double t;
+	return dev.read_temperature(t) < 0 ? NAN : t;
+      });
+  }
+
+  //! Describe the device state and the status register.
+  std::future<std::string> diagnostics()
+  {
+    return submit([](AD5933 &dev) {
+	uint8_t sreg = 0;
+	int err = dev.read_status(sreg);
+	return dev.device_state() + "\nStatus:\t" + (err < 0 ? libusb_strerror(libusb_error(err)) : show_status(sreg));
+      });
+  }
+
+  //! Why the device could not be opened.
+  /*! \return 0 if it was opened, LIBUSB_ERROR_NO_DEVICE if the opener
+    returned a closed device, LIBUSB_ERROR_OTHER if it returned NULL or
+    threw. Final once a command submitted to the thread has completed. */
+  int open_error() const
+  {
+    return open_status.load();
+  }
+
+private:
+  //! Wake the owner if it is parked waiting for commands.
+  void wake()
+  {
+    // Pairs with the fence in run(): the push (or the store of stopping)
+    // cannot be ordered after the load of parked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load())
+      {
+	std::lock_guard<std::mutex> lock(park_mutex);
+	park_cv.notify_one();
+      }
+  }
+
+  //! Body of the owner thread.
+  void run()
+  {
+    std::unique_ptr<AD5933> dev;
+    try
+      {
+	dev = opener();
+      }
+    catch (const std::exception &e)
+      {
+	log_error("DeviceThread: Opening the device failed: %s\n", e.what());
+      }
+    catch (...)
+      {
+	log_error("DeviceThread: Opening the device failed\n");
+      }
+    if (!dev)
+      {
+	open_status.store(LIBUSB_ERROR_OTHER);
+	dev = std::make_unique<AD5933>(static_cast<libusb_context*>(NULL));
+      }
+    else if (!dev->h)
+      {
+	open_status.store(LIBUSB_ERROR_NO_DEVICE);
+      }
+#ifdef AD5933_TRACING
+    char name[32];
+    snprintf(name, sizeof(name), "board %d", dev->index);
+    AD5933_TRACE_THREAD(name);
+#endif
+    std::function<void(AD5933&)> cmd;
+    for (;;)
+      {
+	while (commands.pop(cmd))
+	  {
+	    cmd(*dev);
+	  }
+	if (stopping.load())
+	  {
+	    // Drain whatever arrived while the last command was running.
+	    if (commands.empty())
+	      {
+		break;
+	      }
+	    continue;
+	  }
+	// Nothing to do. Park until a producer pushes. The producer pushes and
+	// then loads the flag, we store the flag and then check the queue. The
+	// queue only uses release/acquire, which would let either side read the
+	// old value, so both sides separate their store from their load with a
+	// seq_cst fence: then the producer sees parked, or we see the command.
+	// The timeout is only a safety net.
+	parked.store(true);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	std::unique_lock<std::mutex> lock(park_mutex);
+	park_cv.wait_for(lock, std::chrono::milliseconds(100),
+			 [this] { return !commands.empty() || stopping.load(); });
+	parked.store(false);
+      }
+  }
+
+  Opener opener;
+  MPSCQueue<std::function<void(AD5933&)>> commands;
+  std::atomic<bool> stopping{false};
+  std::atomic<bool> parked{false};
+  std::atomic<int> open_status{0};
+  std::mutex park_mutex;
+  std::condition_variable park_cv;
+  std::thread worker;
+};
@@ -1,29 +1,21 @@
 #include <iostream>
 #include <bitset>
-#include <wiringPi.h>
-#include <array>
+#include "../gpio.hpp"
 int main()
 {
-  int err = wiringPiSetup();
-  if (err==-1)
+  WiringPiGpio gpio;
+  ClockDivider divider(gpio);
+  if (divider.setup()==-1)
     {
-      perror("Setting up wiringPi failed:");
       std::abort();
     }
-  std::array<int,4> pins = {21,22,23,24};
-  for (int i=0;i<4;i++)
-    {
-      pinMode(pins[i],OUTPUT);
-    }
-  pinMode(30,OUTPUT);
-  digitalWrite(30,1);
   std::bitset<4> inbits;
   int input;
   for (;;)
     {
       std::cout<<"Set divider [2-15]: ";
       std::cin>>input;
-      if (input<2 || input>15)
+      if (divider.set(input)==-1)
 	{
 	  std::cout<<"Invalid input.\n";
 	}
@@ -31,10 +23,6 @@ int main()
 	{
 	  inbits = input;
 	  std::cout<<"Writing "<<inbits<<"\n";
-	  for (int i =0; i<4;i++)
-	    {
-	      digitalWrite(pins[i],inbits[i]);
-	    }
 	}
     }
   
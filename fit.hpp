@@ -0,0 +1,593 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ad5933.hpp"
+
+//! Complex impedance used by the fitting code.
+typedef std::complex<double> impedance_t;
+
+//! Kinds of nodes of an equivalent circuit.
+enum class Element
+{
+  R,        /*!< Resistor. Parameter: R. */
+  C,        /*!< Capacitor. Parameter: C. */
+  CPE,      /*!< Constant phase element. Parameters: Q, n. */
+  W,        /*!< Semi-infinite Warburg element. Parameter: sigma. */
+  SERIES,   /*!< Children in series. */
+  PARALLEL  /*!< Children in parallel. */
+};
+
+//! Node of an equivalent circuit.
+struct CircuitNode
+{
+  Element kind;
+  //! Index of the first parameter of the element in the parameter vector.
+  size_t param = 0;
+  //! Children of SERIES and PARALLEL nodes.
+  std::vector<CircuitNode> children;
+};
+
+//! Equivalent circuit model with analytic derivatives.
+/*! Models are described with a small language: the elements R, C, Q (a
+  constant phase element) and W (Warburg), joined in series with '-' and in
+  parallel with p(a,b,...). The Randles circuit is "R-p(R-W,C)" and a
+  Randles circuit with a CPE double layer is "R-p(R-W,Q)". Parameters are
+  numbered in the order the elements appear, two for each Q (Q and n). */
+struct CircuitModel
+{
+  //! Root of the circuit.
+  CircuitNode root;
+  //! Number of parameters.
+  size_t parameters = 0;
+  //! Whether a parameter is the exponent of a CPE. All others must be positive.
+  std::vector<bool> exponent;
+  //! The description the model was parsed from.
+  std::string description;
+
+  //! Parse a model description.
+  /*!
+    \param text The description, e.g. "R-p(R,C)".
+    \param model The parsed model.
+    \return 0 on success, -1 if the description is invalid.
+  */
+  static int parse(const std::string &text, CircuitModel &model)
+  {
+    model = CircuitModel();
+    model.description = text;
+    size_t pos = 0;
+    if (model.parse_series(text, pos, model.root) || pos != text.size())
+      {
+	log_error("CircuitModel: Invalid model \"%s\" at position %zu\n", text.c_str(), pos);
+	return -1;
+      }
+    return 0;
+  }
+
+  //! Whether parameter values suit the model: one per parameter, and all
+  //! but the CPE exponents positive, since they are fitted in log space.
+  bool accepts(const std::vector<double> &p) const
+  {
+    if (p.size() != parameters)
+      {
+	return false;
+      }
+    for (size_t k = 0; k < parameters; k++)
+      {
+	if (!exponent[k] && !(p[k] > 0))
+	  {
+	    return false;
+	  }
+      }
+    return true;
+  }
+
+  //! Impedance of the circuit and its derivatives.
+  /*!
+    \param omega Angular frequency.
+    \param p Parameter values.
+    \param dz If not null, receives dZ/dp for every parameter.
+    \return The impedance.
+  */
+  impedance_t impedance(double omega, const std::vector<double> &p, impedance_t *dz) const
+  {
+    return evaluate(root, omega, p, dz);
+  }
+
+private:
+  int parse_series(const std::string &t, size_t &pos, CircuitNode &node)
+  {
+    CircuitNode series;
+    series.kind = Element::SERIES;
+    for (;;)
+      {
+	CircuitNode child;
+	if (parse_term(t, pos, child))
+	  {
+	    return -1;
+	  }
+	series.children.push_back(std::move(child));
+	if (pos < t.size() && t[pos] == '-')
+	  {
+	    pos++;
+	    continue;
+	  }
+	break;
+      }
+    node = series.children.size() == 1 ? std::move(series.children[0]) : std::move(series);
+    return 0;
+  }
+
+  int parse_term(const std::string &t, size_t &pos, CircuitNode &node)
+  {
+    if (pos >= t.size())
+      {
+	return -1;
+      }
+    char c = t[pos++];
+    node.param = parameters;
+    switch (c)
+      {
+      case 'R':
+	node.kind = Element::R;
+	add_parameter(false);
+	return 0;
+      case 'C':
+	node.kind = Element::C;
+	add_parameter(false);
+	return 0;
+      case 'Q':
+	node.kind = Element::CPE;
+	add_parameter(false);
+	add_parameter(true);
+	return 0;
+      case 'W':
+	node.kind = Element::W;
+	add_parameter(false);
+	return 0;
+      case 'p':
+	{
+	  if (pos >= t.size() || t[pos++] != '(')
+	    {
+	      return -1;
+	    }
+	  node.kind = Element::PARALLEL;
+	  for (;;)
+	    {
+	      CircuitNode child;
+	      if (parse_series(t, pos, child))
+		{
+		  return -1;
+		}
+	      node.children.push_back(std::move(child));
+	      if (pos < t.size() && t[pos] == ',')
+		{
+		  pos++;
+		  continue;
+		}
+	      break;
+	    }
+	  if (pos >= t.size() || t[pos++] != ')' || node.children.size() < 2)
+	    {
+	      return -1;
+	    }
+	  return 0;
+	}
+      default:
+	pos--;
+	return -1;
+      }
+  }
+
+  void add_parameter(bool is_exponent)
+  {
+    exponent.push_back(is_exponent);
+    parameters++;
+  }
+
+  impedance_t evaluate(const CircuitNode &node, double omega, const std::vector<double> &p,
+		       impedance_t *dz) const
+  {
+    const impedance_t j(0, 1);
+    switch (node.kind)
+      {
+      case Element::R:
+	{
+	  if (dz)
+	    {
+	      dz[node.param] = 1;
+	    }
+	  return p[node.param];
+	}
+      case Element::C:
+	{
+	  double c = p[node.param];
+	  impedance_t z = 1.0 / (j*omega*c);
+	  if (dz)
+	    {
+	      dz[node.param] = -z / c;
+	    }
+	  return z;
+	}
+      case Element::CPE:
+	{
+	  double q = p[node.param];
+	  double n = p[node.param + 1];
+	  // (j w)^n = w^n e^(j n pi/2)
+	  impedance_t z = 1.0 / (q * std::polar(std::pow(omega, n), n*M_PI/2));
+	  if (dz)
+	    {
+	      dz[node.param] = -z / q;
+	      dz[node.param + 1] = -z * impedance_t(std::log(omega), M_PI/2);
+	    }
+	  return z;
+	}
+      case Element::W:
+	{
+	  impedance_t unit = impedance_t(1, -1) / std::sqrt(omega);
+	  if (dz)
+	    {
+	      dz[node.param] = unit;
+	    }
+	  return p[node.param] * unit;
+	}
+      case Element::SERIES:
+	{
+	  impedance_t z = 0;
+	  for (const auto &c: node.children)
+	    {
+	      z += evaluate(c, omega, p, dz);
+	    }
+	  return z;
+	}
+      case Element::PARALLEL:
+	{
+	  // Evaluate every child into its own slice of the gradient first,
+	  // because dZ/dZi needs the total Z.
+	  std::vector<impedance_t> zs;
+	  impedance_t y = 0;
+	  for (const auto &c: node.children)
+	    {
+	      zs.push_back(evaluate(c, omega, p, dz));
+	      y += 1.0 / zs.back();
+	    }
+	  impedance_t z = 1.0 / y;
+	  if (dz)
+	    {
+	      for (size_t i = 0; i < node.children.size(); i++)
+		{
+		  impedance_t chain = (z*z) / (zs[i]*zs[i]);
+		  size_t first = first_parameter(node.children[i]);
+		  size_t last = first + count_parameters(node.children[i]);
+		  for (size_t k = first; k < last; k++)
+		    {
+		      dz[k] *= chain;
+		    }
+		}
+	    }
+	  return z;
+	}
+      }
+    return 0;
+  }
+
+  static size_t first_parameter(const CircuitNode &node)
+  {
+    if (node.kind == Element::SERIES || node.kind == Element::PARALLEL)
+      {
+	return first_parameter(node.children.front());
+      }
+    return node.param;
+  }
+
+  static size_t count_parameters(const CircuitNode &node)
+  {
+    switch (node.kind)
+      {
+      case Element::CPE:
+	return 2;
+      case Element::SERIES:
+      case Element::PARALLEL:
+	{
+	  size_t n = 0;
+	  for (const auto &c: node.children)
+	    {
+	      n += count_parameters(c);
+	    }
+	  return n;
+	}
+      default:
+	return 1;
+      }
+  }
+};
+
+//! Result of one fit.
+struct FitResult
+{
+  //! Fitted parameters.
+  std::vector<double> params;
+  //! Sum of squared relative residuals.
+  double chi2 = 0;
+  //! Levenberg-Marquardt iterations used.
+  int iterations = 0;
+  //! Whether the fit converged within the iteration limit.
+  bool converged = false;
+  //! 0, or EINVAL if the initial values do not suit the model.
+  int error = 0;
+};
+
+//! Settings of the Levenberg-Marquardt solver.
+struct FitOptions
+{
+  int max_iterations = 200;
+  //! Stop when the relative improvement of chi2 is below this.
+  double tolerance = 1e-10;
+  //! Initial damping.
+  double lambda = 1e-3;
+};
+
+//! Levenberg-Marquardt fit of a circuit model to an impedance spectrum.
+/*!
+\param model The circuit model.
+\param data Frequency (Hz), impedance pairs.
+\param initial Initial parameter values, one per model parameter. All but the
+CPE exponents must be positive.
+\param options Solver settings.
+\return The fitted parameters. If initial has the wrong size or a value that
+must be positive is not, the result has error EINVAL and the initial values.
+
+Residuals are weighted by 1/|Z| so every point counts the same regardless of
+its magnitude. Positive parameters are fitted in log space, CPE exponents are
+fitted directly and kept in [0,1]. The Jacobian is analytic.
+*/
+inline FitResult fit_circuit(const CircuitModel &model,
+		      const std::vector<std::pair<double, impedance_t>> &data,
+		      const std::vector<double> &initial,
+		      const FitOptions &options = FitOptions())
+{
+  const size_t np = model.parameters;
+  const size_t nr = 2*data.size();
+  FitResult result;
+  result.params = initial;
+  if (!model.accepts(initial))
+    {
+      log_error("fit_circuit: Invalid initial values for \"%s\"\n", model.description.c_str());
+      result.error = EINVAL;
+      return result;
+    }
+  std::vector<double> &p = result.params;
+  std::vector<double> trial(np), residual(nr), jac(nr*np), jtj(np*np), jtr(np), delta(np);
+  std::vector<impedance_t> dz(np);
+
+  // Residuals and Jacobian with respect to the fitted variables.
+  auto evaluate = [&](const std::vector<double> &params, bool with_jacobian) {
+    double chi2 = 0;
+    for (size_t i = 0; i < data.size(); i++)
+      {
+	double omega = 2*M_PI*data[i].first;
+	impedance_t z = model.impedance(omega, params, with_jacobian ? dz.data() : nullptr);
+	double w = 1.0 / std::abs(data[i].second);
+	impedance_t r = (z - data[i].second) * w;
+	residual[2*i] = r.real();
+	residual[2*i+1] = r.imag();
+	chi2 += std::norm(r);
+	if (with_jacobian)
+	  {
+	    for (size_t k = 0; k < np; k++)
+	      {
+		// d/d(log p) = p d/dp
+		impedance_t d = dz[k] * w * (model.exponent[k] ? 1.0 : params[k]);
+		jac[(2*i)*np + k] = d.real();
+		jac[(2*i+1)*np + k] = d.imag();
+	      }
+	  }
+      }
+    return chi2;
+  };
+
+  double lambda = options.lambda;
+  result.chi2 = evaluate(p, true);
+  for (result.iterations = 0; result.iterations < options.max_iterations; result.iterations++)
+    {
+      std::fill(jtj.begin(), jtj.end(), 0.0);
+      std::fill(jtr.begin(), jtr.end(), 0.0);
+      for (size_t r = 0; r < nr; r++)
+	{
+	  const double *row = &jac[r*np];
+	  for (size_t a = 0; a < np; a++)
+	    {
+	      jtr[a] += row[a]*residual[r];
+	      for (size_t b = 0; b <= a; b++)
+		{
+		  jtj[a*np + b] += row[a]*row[b];
+		}
+	    }
+	}
+      bool improved = false;
+      while (lambda < 1e12)
+	{
+	  // Solve (JtJ + lambda diag(JtJ)) delta = -Jtr with Cholesky.
+	  std::vector<double> m(jtj);
+	  for (size_t a = 0; a < np; a++)
+	    {
+	      m[a*np + a] *= 1 + lambda;
+	      m[a*np + a] += 1e-30;
+	    }
+	  bool ok = true;
+	  for (size_t a = 0; a < np && ok; a++)
+	    {
+	      for (size_t b = 0; b <= a; b++)
+		{
+		  double sum = m[a*np + b];
+		  for (size_t k = 0; k < b; k++)
+		    {
+		      sum -= m[a*np + k]*m[b*np + k];
+		    }
+		  if (a == b)
+		    {
+		      if (sum <= 0)
+			{
+			  ok = false;
+			  break;
+			}
+		      m[a*np + a] = std::sqrt(sum);
+		    }
+		  else
+		    {
+		      m[a*np + b] = sum / m[b*np + b];
+		    }
+		}
+	    }
+	  if (!ok)
+	    {
+	      lambda *= 10;
+	      continue;
+	    }
+	  for (size_t a = 0; a < np; a++)
+	    {
+	      double sum = -jtr[a];
+	      for (size_t k = 0; k < a; k++)
+		{
+		  sum -= m[a*np + k]*delta[k];
+		}
+	      delta[a] = sum / m[a*np + a];
+	    }
+	  for (size_t a = np; a-- > 0;)
+	    {
+	      double sum = delta[a];
+	      for (size_t k = a + 1; k < np; k++)
+		{
+		  sum -= m[k*np + a]*delta[k];
+		}
+	      delta[a] = sum / m[a*np + a];
+	    }
+	  for (size_t k = 0; k < np; k++)
+	    {
+	      trial[k] = model.exponent[k] ? std::min(1.0, std::max(0.0, p[k] + delta[k]))
+		: p[k]*std::exp(std::max(-20.0, std::min(20.0, delta[k])));
+	    }
+	  double chi2 = evaluate(trial, false);
+	  if (chi2 < result.chi2)
+	    {
+	      double gain = (result.chi2 - chi2) / std::max(result.chi2, 1e-300);
+	      p.swap(trial);
+	      result.chi2 = evaluate(p, true);
+	      lambda = std::max(lambda / 10, 1e-12);
+	      improved = true;
+	      if (gain < options.tolerance)
+		{
+		  result.converged = true;
+		}
+	      break;
+	    }
+	  lambda *= 10;
+	}
+      if (!improved)
+	{
+	  // No step reduces chi2: we are at a minimum.
+	  result.converged = true;
+	}
+      if (result.converged)
+	{
+	  break;
+	}
+    }
+  return result;
+}
+
+//!Build an impedance spectrum from the magnitude and phase of a measurement.
+/*!
+\param mag Frequency, impedance magnitude pairs, as calculate_magnitude() returns.
+\param phase Frequency, impedance phase pairs in degrees.
+\return Frequency, complex impedance pairs for fit_circuit().
+*/
+template <typename F, typename T>
+std::vector<std::pair<double, impedance_t>>
+impedance_spectrum(const std::vector<std::pair<F, T>> &mag,
+		   const std::vector<std::pair<F, T>> &phase)
+{
+  std::vector<std::pair<double, impedance_t>> z;
+  z.reserve(mag.size());
+  for (size_t i = 0; i < mag.size() && i < phase.size(); i++)
+    {
+      z.push_back(std::make_pair(static_cast<double>(mag[i].first),
+				 std::polar<double>(mag[i].second, phase[i].second*M_PI/180)));
+    }
+  return z;
+}
+
+//! Throughput of a batch of fits.
+struct FitStatistics
+{
+  size_t fits = 0;
+  size_t converged = 0;
+  double seconds = 0;
+  double fits_per_second = 0;
+};
+
+//! Fit many spectra in parallel.
+/*!
+\param model The circuit model.
+\param spectra The spectra, in acquisition order.
+\param initial Initial parameters for the first spectrum of every thread.
+\param stats Receives the throughput.
+\param threads Worker threads, 0 for one per core.
+\param options Solver settings.
+\return One result per spectrum.
+
+The spectra are split into contiguous blocks, one per thread. Inside a block
+each fit starts from the result of the previous one, which converges in a few
+iterations when consecutive sweeps are of the same sample.
+*/
+inline std::vector<FitResult>
+fit_many(const CircuitModel &model,
+	 const std::vector<std::vector<std::pair<double, impedance_t>>> &spectra,
+	 const std::vector<double> &initial, FitStatistics &stats,
+	 unsigned threads = 0, const FitOptions &options = FitOptions())
+{
+  auto t0 = std::chrono::steady_clock::now();
+  std::vector<FitResult> results(spectra.size());
+  if (threads == 0)
+    {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+  threads = std::max<size_t>(1, std::min<size_t>(threads, spectra.size()));
+  size_t block = spectra.size() / threads + (spectra.size() % threads != 0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++)
+    {
+      size_t first = t*block;
+      size_t last = std::min(spectra.size(), first + block);
+      workers.emplace_back([&, first, last] {
+	  std::vector<double> guess = initial;
+	  for (size_t i = first; i < last; i++)
+	    {
+	      results[i] = fit_circuit(model, spectra[i], guess, options);
+	      if (results[i].converged)
+		{
+		  guess = results[i].params;
+		}
+	    }
+	});
+    }
+  for (auto &w: workers)
+    {
+      w.join();
+    }
+  stats.fits = results.size();
+  stats.converged = std::count_if(results.begin(), results.end(),
+				  [](const FitResult &r) { return r.converged; });
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  stats.fits_per_second = stats.seconds > 0 ? stats.fits / stats.seconds : 0;
+  return results;
+}
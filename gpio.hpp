@@ -0,0 +1,128 @@
+/*! \file */
+#pragma once
+#include <stdio.h>
+#include <array>
+#include <bitset>
+#include <map>
+#include <utility>
+#include <vector>
+
+#ifdef HAVE_WIRINGPI
+#include <wiringPi.h>
+#endif
+
+//! Interface to the GPIO pins that drive the external clock divider.
+/*! The divider is set from a Raspberry Pi through wiringPi. Going through
+  this interface lets the clock planner and the acquisition code run on a
+  machine without GPIOs, using StubGpio. */
+struct GpioBackend
+{
+  virtual ~GpioBackend() = default;
+  //! Initialize the backend. \return 0 on success, -1 on failure.
+  virtual int setup() = 0;
+  //! Configure a pin as an output.
+  virtual void output(int pin) = 0;
+  //! Drive an output pin low (0) or high (1).
+  virtual void write(int pin, int value) = 0;
+};
+
+#ifdef HAVE_WIRINGPI
+//! GPIO backend using wiringPi pin numbering.
+struct WiringPiGpio : GpioBackend
+{
+  int setup() override
+  {
+    return wiringPiSetup();
+  }
+  void output(int pin) override
+  {
+    pinMode(pin, OUTPUT);
+  }
+  void write(int pin, int value) override
+  {
+    digitalWrite(pin, value);
+  }
+};
+#endif
+
+//! GPIO backend that only records what was written.
+struct StubGpio : GpioBackend
+{
+  //! Current level of every pin that was written.
+  std::map<int,int> levels;
+  //! Every write, in order.
+  std::vector<std::pair<int,int>> writes;
+
+  int setup() override
+  {
+    return 0;
+  }
+  void output(int pin) override
+  {
+    levels[pin] = 0;
+  }
+  void write(int pin, int value) override
+  {
+    levels[pin] = value;
+    writes.push_back(std::make_pair(pin, value));
+  }
+};
+
+//! The 4-bit external clock divider.
+/*! The division ratio is written in binary to four GPIO pins, least significant
+  bit first. A fifth pin enables the divider output. */
+struct ClockDivider
+{
+  //! Smallest division ratio.
+  static const int MIN_RATIO = 2;
+  //! Largest division ratio.
+  static const int MAX_RATIO = 15;
+
+  //! Pins of the ratio bits, least significant first.
+  std::array<int,4> pins = {21,22,23,24};
+  //! Pin that enables the divider.
+  int enable_pin = 30;
+  //! Ratio written last, 0 if none.
+  int ratio = 0;
+
+  explicit ClockDivider(GpioBackend &gpio) : gpio(gpio) {}
+
+  //! Set up the backend and the pins and enable the divider.
+  /*! \return 0 on success, -1 if the backend failed. */
+  int setup()
+  {
+    if (gpio.setup() == -1)
+      {
+	perror("Setting up GPIO failed:");
+	return -1;
+      }
+    for (auto pin: pins)
+      {
+	gpio.output(pin);
+      }
+    gpio.output(enable_pin);
+    gpio.write(enable_pin, 1);
+    return 0;
+  }
+
+  //! Set the division ratio.
+  /*! \param r Ratio in [MIN_RATIO, MAX_RATIO].
+    \return 0 on success, -1 if the ratio is out of range. */
+  int set(int r)
+  {
+    if (r < MIN_RATIO || r > MAX_RATIO)
+      {
+	return -1;
+      }
+    std::bitset<4> bits(r);
+    for (size_t i = 0; i < pins.size(); i++)
+      {
+	gpio.write(pins[i], bits[i]);
+      }
+    ratio = r;
+    return 0;
+  }
+
+private:
+  GpioBackend &gpio;
+};
@@ -0,0 +1,471 @@
+/*! \file
+  Boards that come and go while the program runs.
+
+  A HotplugManager watches the bus for evaluation boards. A board that
+  appears is opened, firmware and all, on the owner thread of a new
+  DeviceThread and handed over through HotplugManager::on_attach. A board
+  that disappears is closed: the command it was running fails with
+  LIBUSB_ERROR_NO_DEVICE on its next transfer, sweeps stop early, and
+  commands queued after it fail at once instead of waiting on a dead
+  device.
+
+  Boards are known by the USB port they are plugged into. One that comes
+  back on the same port is the same Board: the configuration and
+  calibration stored with it are kept, and the configuration is applied
+  again before the board is handed over.
+
+  libusb hot-plug events trigger a rescan of the bus. Where libusb has no
+  hot-plug support the bus is scanned every HotplugManager::poll_interval.
+*/
+#pragma once
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "device_thread.hpp"
+
+//! Bus and port path of a device, e.g. "1-2.4" as in /sys/bus/usb/devices.
+inline std::string usb_location(libusb_device *device)
+{
+  uint8_t ports[8];
+  int n = libusb_get_port_numbers(device, ports, sizeof(ports));
+  std::string location = std::to_string(libusb_get_bus_number(device));
+  for (int i = 0; i < n; i++)
+    {
+      location += (i ? "." : "-") + std::to_string(ports[i]);
+    }
+  return location;
+}
+
+//! A board seen by a HotplugManager, attached or not.
+class Board
+{
+public:
+  Board(const std::string &location, int number) : location(location), number(number)
+  {
+  }
+
+  //! See usb_location().
+  const std::string location;
+  //! Number in the order the boards were first seen, used as AD5933::index.
+  const int number;
+
+  //! The owner thread of the board, NULL while it is detached or being opened.
+  std::shared_ptr<DeviceThread> device() const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return ready ? thread : nullptr;
+  }
+
+  bool attached() const
+  {
+    return device() != nullptr;
+  }
+
+  //! How often the board was attached.
+  unsigned attachments() const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return attach_count;
+  }
+
+  //! Set the configuration, applied now if attached and after every attach.
+  void set_configuration(const SweepConfig &config)
+  {
+    std::shared_ptr<DeviceThread> d;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stored_config = config;
+      configured = true;
+      d = ready ? thread : nullptr;
+    }
+    if (d)
+      {
+	d->configure(config);
+      }
+  }
+
+  //! The stored configuration.
+  /*! \return false if none was set. */
+  bool configuration(SweepConfig &config) const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    config = stored_config;
+    return configured;
+  }
+
+  //! Keep the calibration of the board, e.g. from calibrate_gain().
+  /*! \param config The configuration the calibration was measured with. */
+  void set_calibration(const std::vector<std::pair<real_t, real_t>> &gains,
+		       const std::vector<std::pair<real_t, real_t>> &system_phase,
+		       const SweepConfig &config)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    this->gains = gains;
+    this->system_phase = system_phase;
+    calibration_config = config;
+  }
+
+  //! The stored calibration and the configuration it was measured with.
+  /*! \return false if none was set. */
+  bool calibration(std::vector<std::pair<real_t, real_t>> &gains,
+		   std::vector<std::pair<real_t, real_t>> &system_phase,
+		   SweepConfig &config) const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    gains = this->gains;
+    system_phase = this->system_phase;
+    config = calibration_config;
+    return !gains.empty();
+  }
+
+private:
+  friend class HotplugManager;
+
+  //! Where the board is in its life.
+  enum class State
+  {
+    DETACHED,
+    OPENING,
+    ATTACHED,
+    //! Opening failed. Retried once the board left the bus.
+    FAILED
+  };
+
+  mutable std::mutex lock;
+  //! Changed only by the manager thread.
+  State state = State::DETACHED;
+  std::shared_ptr<DeviceThread> thread;
+  bool ready = false;
+  //! Counts attaches, so that a late open result of an earlier one is ignored.
+  unsigned generation = 0;
+  unsigned attach_count = 0;
+  SweepConfig stored_config;
+  bool configured = false;
+  std::vector<std::pair<real_t, real_t>> gains;
+  std::vector<std::pair<real_t, real_t>> system_phase;
+  SweepConfig calibration_config;
+};
+
+//! Attaches and detaches boards as they are plugged in and out.
+/*! on_attach and on_detach run on the thread of the manager, one at a time.
+  They should return quickly; on_detach is the place to drop the references
+  to Board::device() of the board. */
+class HotplugManager
+{
+public:
+  typedef std::function<void(const std::shared_ptr<Board>&)> Callback;
+
+  //! \param context The libusb context, or NULL to create one in start().
+  explicit HotplugManager(libusb_context *context = NULL) : ctx(context)
+  {
+  }
+
+  HotplugManager(const HotplugManager&) = delete;
+  HotplugManager& operator=(const HotplugManager&) = delete;
+
+  //! Stop watching and close the boards.
+  ~HotplugManager()
+  {
+    stop();
+    for (auto &b: boards())
+      {
+	close(b);
+      }
+    if (own_context)
+      {
+	libusb_exit(ctx);
+      }
+  }
+
+  //! Open boards already on the bus and start watching.
+  /*! \return 0 or a libusb_error code. */
+  int start()
+  {
+    if (ctx == NULL)
+      {
+	int err = libusb_init(&ctx);
+	if (err)
+	  {
+	    ctx = NULL;
+	    return err;
+	  }
+	own_context = true;
+      }
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+      {
+	// Casts for the libusb versions that declare these parameters as enums.
+	auto events = static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+							LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+	int err = libusb_hotplug_register_callback(ctx, events, static_cast<libusb_hotplug_flag>(0), VID, PID,
+						   LIBUSB_HOTPLUG_MATCH_ANY, &HotplugManager::on_event, this,
+						   &callback);
+	if (err)
+	  {
+	    return err;
+	  }
+	hotplug = true;
+      }
+    stopping.store(false);
+    rescan.store(true);
+    worker = std::thread(&HotplugManager::run, this);
+    return 0;
+  }
+
+  //! Stop watching. Attached boards stay attached.
+  void stop()
+  {
+    if (!worker.joinable())
+      {
+	return;
+      }
+    stopping.store(true);
+    worker.join();
+    if (hotplug)
+      {
+	libusb_hotplug_deregister_callback(ctx, callback);
+	hotplug = false;
+      }
+  }
+
+  //! Every board seen so far, attached or not.
+  std::vector<std::shared_ptr<Board>> boards() const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::shared_ptr<Board>> all;
+    for (const auto &b: known)
+      {
+	all.push_back(b.second);
+      }
+    return all;
+  }
+
+  //! Called when a board was opened and configured.
+  Callback on_attach;
+  //! Called when a board left the bus.
+  Callback on_detach;
+  //! Firmware downloaded to new boards.
+  std::string firmware = DEFAULT_FIRMWARE;
+  //! Time between scans of the bus. With hot-plug support the bus is also
+  //! scanned right after every event.
+  std::chrono::milliseconds poll_interval{1000};
+
+private:
+  //! Hot-plug callback, called by libusb from the manager thread.
+  static int on_event(libusb_context*, libusb_device*, libusb_hotplug_event, void *self)
+  {
+    // Opening takes seconds and libusb must not be reentered here, so
+    // only note that the bus changed.
+    static_cast<HotplugManager*>(self)->rescan.store(true);
+    return 0;
+  }
+
+  void run()
+  {
+    AD5933_TRACE_THREAD("hotplug");
+    auto next_scan = std::chrono::steady_clock::now();
+    while (!stopping.load())
+      {
+	if (hotplug)
+	  {
+	    timeval tv{0, 100000};
+	    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	  }
+	else
+	  {
+	    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	  }
+	auto now = std::chrono::steady_clock::now();
+	if (rescan.exchange(false) || now >= next_scan)
+	  {
+	    scan();
+	    next_scan = now + poll_interval;
+	  }
+	finish_opens();
+      }
+  }
+
+  //! Compare the boards on the bus with the known ones.
+  void scan()
+  {
+    AD5933_TRACE("scan");
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(ctx, &list);
+    if (n < 0)
+      {
+	return;
+      }
+    std::set<std::string> present;
+    for (ssize_t i = 0; i < n; i++)
+      {
+	libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(list[i], &desc) || desc.idVendor != VID || desc.idProduct != PID)
+	  {
+	    continue;
+	  }
+	std::string location = usb_location(list[i]);
+	present.insert(location);
+	std::shared_ptr<Board> board;
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  auto &b = known[location];
+	  if (!b)
+	    {
+	      b = std::make_shared<Board>(location, known.size() - 1);
+	    }
+	  board = b;
+	}
+	if (board->state == Board::State::DETACHED)
+	  {
+	    attach(board, list[i]);
+	  }
+      }
+    libusb_free_device_list(list, 1);
+    for (auto &b: boards())
+      {
+	if (b->state != Board::State::DETACHED && !present.count(b->location))
+	  {
+	    detach(b);
+	  }
+      }
+  }
+
+  //! Open a board on a new owner thread. A board whose open fails, e.g. because
+  //! the firmware cannot be downloaded, is not attached.
+  void attach(const std::shared_ptr<Board> &board, libusb_device *device)
+  {
+    log_message("Board %d at %s arrived\n", board->number, board->location.c_str());
+    libusb_ref_device(device);
+    std::lock_guard<std::mutex> guard(board->lock);
+    board->state = Board::State::OPENING;
+    board->ready = false;
+    unsigned generation = ++board->generation;
+    SweepConfig config = board->stored_config;
+    bool configured = board->configured;
+    std::string path = firmware;
+    libusb_context *context = ctx;
+    board->thread = std::make_shared<DeviceThread>([this, board, device, generation, config, configured, path, context]()
+      {
+	auto dev = std::make_unique<AD5933>(context);
+	dev->firmware = path;
+	dev->index = board->number;
+	int err = dev->open_device(device);
+	libusb_unref_device(device);
+	if (!err && configured)
+	  {
+	    dev->error = 0;
+	    dev->configure(config);
+	    err = dev->error;
+	  }
+	std::lock_guard<std::mutex> guard(lock);
+	opened.push_back(Opened{board, generation, err});
+	return dev;
+      });
+  }
+
+  //! Hand over the boards whose open finished.
+  void finish_opens()
+  {
+    std::deque<Opened> done;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      done.swap(opened);
+    }
+    for (auto &o: done)
+      {
+	auto &b = *o.board;
+	{
+	  std::lock_guard<std::mutex> guard(b.lock);
+	  if (o.generation != b.generation || b.state != Board::State::OPENING)
+	    {
+	      continue;
+	    }
+	  if (o.error)
+	    {
+	      b.state = Board::State::FAILED;
+	    }
+	  else
+	    {
+	      b.state = Board::State::ATTACHED;
+	      b.ready = true;
+	      b.attach_count++;
+	    }
+	}
+	if (o.error)
+	  {
+	    log_error("Board %d at %s: %s\n", b.number, b.location.c_str(),
+		      libusb_strerror(libusb_error(o.error)));
+	    close(o.board);
+	  }
+	else if (on_attach)
+	  {
+	    on_attach(o.board);
+	  }
+      }
+  }
+
+  //! Forget the device of a board that left the bus.
+  void detach(const std::shared_ptr<Board> &board)
+  {
+    log_message("Board %d at %s left\n", board->number, board->location.c_str());
+    bool was_attached;
+    {
+      std::lock_guard<std::mutex> guard(board->lock);
+      was_attached = board->state == Board::State::ATTACHED;
+      board->state = Board::State::DETACHED;
+      board->ready = false;
+    }
+    if (was_attached && on_detach)
+      {
+	on_detach(board);
+      }
+    close(board);
+  }
+
+  //! Close the device after the command it runs. Commands queued later fail
+  //! at once. The owner thread ends when the last reference is dropped.
+  void close(const std::shared_ptr<Board> &board)
+  {
+    std::shared_ptr<DeviceThread> thread;
+    {
+      std::lock_guard<std::mutex> guard(board->lock);
+      thread.swap(board->thread);
+      board->ready = false;
+    }
+    if (thread)
+      {
+	thread->submit([](AD5933 &dev) { dev.close(); });
+      }
+  }
+
+  //! Result of opening a board, from its owner thread.
+  struct Opened
+  {
+    std::shared_ptr<Board> board;
+    unsigned generation;
+    int error;
+  };
+
+  libusb_context *ctx;
+  bool own_context = false;
+  bool hotplug = false;
+  libusb_hotplug_callback_handle callback;
+  std::thread worker;
+  std::atomic<bool> stopping{false};
+  std::atomic<bool> rescan{false};
+  //! Guards known and opened.
+  mutable std::mutex lock;
+  std::map<std::string, std::shared_ptr<Board>> known;
+  std::deque<Opened> opened;
+};
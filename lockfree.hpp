@@ -0,0 +1,151 @@
+/*! \file */
+#pragma once
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+//! Lock-free multiple-producer single-consumer queue.
+/*! This is the node based queue by Dmitry Vyukov. Any number of threads may
+  call push() concurrently, but only one thread (the owner) may call pop(). Push
+  is wait-free (a single atomic exchange), pop is lock-free. The queue is
+  unbounded; every push allocates a node. */
+template <typename T>
+class MPSCQueue
+{
+  struct Node
+  {
+    std::atomic<Node*> next{nullptr};
+    T value;
+    Node() = default;
+    explicit Node(T &&v) : value(std::move(v)) {}
+  };
+
+  //! Producers exchange the new node into the head.
+  alignas(64) std::atomic<Node*> head;
+  //! The consumer owns the tail. It always points to a dummy node.
+  alignas(64) Node *tail;
+
+public:
+  MPSCQueue()
+  {
+    Node *stub = new Node();
+    head.store(stub, std::memory_order_relaxed);
+    tail = stub;
+  }
+
+  ~MPSCQueue()
+  {
+    T ignored;
+    while (pop(ignored))
+      ;
+    delete tail;
+  }
+
+  MPSCQueue(const MPSCQueue&) = delete;
+  MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+  //! Enqueue a value. Safe to call from any thread.
+  void push(T value)
+  {
+    Node *n = new Node(std::move(value));
+    Node *prev = head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  //! Dequeue a value. Only the consumer thread may call this.
+  /*! \return false if the queue is empty. A push that is still in progress
+    is also reported as empty; it will be visible on the next call. */
+  bool pop(T &value)
+  {
+    Node *next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+      {
+	return false;
+      }
+    value = std::move(next->value);
+    delete tail;
+    tail = next;
+    return true;
+  }
+
+  //! Check whether there is nothing to pop. Only meaningful for the consumer.
+  bool empty() const
+  {
+    return tail->next.load(std::memory_order_acquire) == nullptr;
+  }
+};
+
+//! Bounded lock-free single-producer single-consumer ring.
+/*! One thread calls try_push(), another try_pop(). Neither ever blocks or
+  allocates; the capacity is rounded up to a power of two. */
+template <typename T>
+class SPSCRing
+{
+public:
+  explicit SPSCRing(size_t capacity)
+  {
+    size_t cap = 1;
+    while (cap < capacity)
+      {
+	cap <<= 1;
+      }
+    slots.resize(cap);
+    mask = cap - 1;
+  }
+
+  SPSCRing(const SPSCRing&) = delete;
+  SPSCRing& operator=(const SPSCRing&) = delete;
+
+  //! Enqueue a value. Only the producer thread may call this.
+  /*! \return false if the ring is full. */
+  bool try_push(const T &value)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail_cache > mask)
+      {
+	tail_cache = tail.load(std::memory_order_acquire);
+	if (h - tail_cache > mask)
+	  {
+	    return false;
+	  }
+      }
+    slots[h & mask] = value;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  //! Dequeue a value. Only the consumer thread may call this.
+  /*! \return false if the ring is empty. */
+  bool try_pop(T &value)
+  {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head_cache)
+      {
+	head_cache = head.load(std::memory_order_acquire);
+	if (t == head_cache)
+	  {
+	    return false;
+	  }
+      }
+    value = slots[t & mask];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const
+  {
+    return mask + 1;
+  }
+
+private:
+  std::vector<T> slots;
+  size_t mask;
+  //! Written by the producer, which keeps its last view of tail in tail_cache.
+  alignas(64) std::atomic<size_t> head{0};
+  size_t tail_cache = 0;
+  //! Written by the consumer, which keeps its last view of head in head_cache.
+  alignas(64) std::atomic<size_t> tail{0};
+  size_t head_cache = 0;
+};
@@ -4,11 +4,98 @@
 #include <vector>
 #include <utility>
 #include <getopt.h>
+#include <signal.h>
 #include <cmath>
+#include <atomic>
+#include <algorithm>
 #include "ad5933.hpp"
+#include "adaptive.hpp"
+#include "autorange.hpp"
+#include "clock_plan.hpp"
+#include "monitor.hpp"
+#include "pipeline.hpp"
+#include "settling.hpp"
+#include "stream_server.hpp"
+#include "shm_ring.hpp"
+#include "watchdog.hpp"
 
+#ifdef HAVE_WIRINGPI
+WiringPiGpio gpio;
+#else
+StubGpio gpio;
+#endif
+ClockDivider divider(gpio);
+//! Live data server, enabled with -s and -p.
+StreamServer server;
+//! Shared-memory ring for local readers, enabled with -m.
+ShmRingWriter ring;
+//! Number of the next sweep, for the live data stream.
+uint32_t sweep_number = 0;
+//! Timeline trace file, set with -t in a build with tracing.
+const char *trace_path = NULL;
+//! Set by SIGINT to end continuous monitoring.
+std::atomic<bool> stop_monitor(false);
 
 
+//! Calibration and measurement with automatic ranging. Returns to repeat the
+//! calibration.
+void autorange_interaction(AD5933 &h, real_t starting_frequency, uint32_t steps, real_t interval, real_t rcal)
+{
+  RangeCalibration<real_t> calibration;
+  int measured = calibration.calibrate(starting_frequency, steps, interval, &h, rcal);
+  if (measured<0)
+    {
+      printf("Calibration failed: %s\n", libusb_strerror(libusb_error(measured)));
+      return;
+    }
+  if (measured==0)
+    {
+      std::cout<<"The calibration resistor saturates or is too weak in every range\n";
+      return;
+    }
+  for (int r = 0; r < RANGE_COUNT; r++)
+    {
+      printf("Range %s: %s\n", range_name(r).c_str(), calibration.is_measured(r) ? "calibrated" : "derived");
+    }
+  int choice;
+  for (;;)
+    {
+      printf("1. Repeat calibration\n2. Measure unknown impendance\n");
+      std::cin>>choice;
+      if (choice==1)
+	{
+	  return;
+	}
+      else if (choice==2)
+	{
+	  std::cout<<"Please insert unknown impedance"<<std::endl;
+	  int nouse;
+	  std::cin>>nouse;
+	  auto sweep = sweep_autorange<real_t>(starting_frequency, steps, interval, &h);
+	  for (const auto &seg: sweep.segments)
+	    {
+	      printf("Points %u-%u: %s%s%s\n", seg.first, seg.first + seg.count - 1, range_name(seg.range).c_str(),
+		     seg.saturated ? ", saturated" : "", seg.low_signal ? ", low signal" : "");
+	    }
+	  if (sweep.error)
+	    {
+	      printf("Sweep stopped after %zu points: %s\n", sweep.points.size(),
+		     libusb_strerror(libusb_error(sweep.error)));
+	    }
+	  std::vector<std::pair<real_t,real_t>> mag, phase;
+	  if (calibration.apply(sweep, mag, phase) < 0)
+	    {
+	      std::cout<<"The sweep does not match the calibration\n";
+	      continue;
+	    }
+	  if (write_ranged_file(mag, phase, sweep) < 0)
+	    {
+	      exit(1);
+	    }
+	}
+    }
+}
+
 void user_interaction(AD5933 &h)
 {
   long double starting_frequency,ending_frequency;
@@ -16,7 +103,7 @@ void user_interaction(AD5933 &h)
   char clk;
   do 
     {
-      std::cout<<"Internal clk? (y/n)";
+      std::cout<<"Internal clk? (y/n/a for automatic)";
       std::cin>>clk;
       if (clk=='y')
 	{
@@ -32,43 +119,75 @@ void user_interaction(AD5933 &h)
 	  h.choose_clock(Clk::EXT);
 	  printf("Chose internal clock (%Lf)\n",h.clk);
 	}
-    } while (clk!='y' &&  clk!='n');
-  std::cout<<"Starting Frequency: ";
-  std::cin>>starting_frequency;
-  std::cout<<"Ending Frequency (0 for steps+interval): ";
-  std::cin>>ending_frequency;
+    } while (clk!='y' &&  clk!='n' && clk!='a');
   long double steps,interval;
-  if (ending_frequency > 0.5)
+  std::vector<PlannedSweep> plan;
+  if (clk=='a')
     {
-      while (ending_frequency<starting_frequency)
+      long double resolution;
+      do
 	{
-	  std::cout<<"Invalid frequency! Pick a new ending frequency: ";
+	  std::cout<<"Starting Frequency: ";
+	  std::cin>>starting_frequency;
+	  std::cout<<"Ending Frequency: ";
 	  std::cin>>ending_frequency;
+	  std::cout<<"Resolution: ";
+	  std::cin>>resolution;
+	  plan = ClockPlanner().plan(starting_frequency, ending_frequency, resolution);
+	  if (plan.empty())
+	    {
+	      std::cout<<"Range can't be covered by the available clocks!\n";
+	    }
+	} while (plan.empty());
+      for (const auto& s: plan)
+	{
+	  printf("Sweep %Lf Hz + %u x %Lf Hz, clock %Lf Hz (divider %d)\n",
+		 s.config.start, s.config.steps, s.config.step, s.clock.frequency, s.clock.ratio);
 	}
-      if (ending_frequency - starting_frequency < 512)
+    }
+  else
+    {
+      std::cout<<"Starting Frequency: ";
+      std::cin>>starting_frequency;
+      std::cout<<"Ending Frequency (0 for steps+interval): ";
+      std::cin>>ending_frequency;
+      if (ending_frequency > 0.5)
 	{
-	  steps = ending_frequency - starting_frequency;
-	  interval = 1;
+	  while (ending_frequency<starting_frequency)
+	    {
+	      std::cout<<"Invalid frequency! Pick a new ending frequency: ";
+	      std::cin>>ending_frequency;
+	    }
+	  if (ending_frequency - starting_frequency < 512)
+	    {
+	      steps = ending_frequency - starting_frequency;
+	      interval = 1;
+	    }
+	  else
+	    {
+	      interval = (ending_frequency - starting_frequency)/512;
+	      steps = 511;
+	    }
 	}
       else
 	{
-	  interval = (ending_frequency - starting_frequency)/512;
-	  steps = 511;
+	  std::cout<<"Sweep interval: ";
+	  std::cin>>interval;
+	  std::cout<<"Steps: ";
+	  std::cin>>steps;
 	}
+      h.set_starting_frequency(starting_frequency);
+      h.set_frequency_step(interval);
+      h.set_step_number(steps);
     }
-  else
-    {
-      std::cout<<"Sweep interval: ";
-      std::cin>>interval;
-      std::cout<<"Steps: ";
-      std::cin>>steps;
-    }
-  h.set_starting_frequency(starting_frequency);
-  h.set_frequency_step(interval);
-  h.set_step_number(steps);
   int choice;
   std::cout<<"Pick excitation voltage range:\n1. 2 Vp-p\n2. 200 mVp-p\n3. 400 mVp-p\n4. 1 Vp-p\n";
+  if (plan.empty())
+    {
+      std::cout<<"5. Automatic, voltage and PGA per segment\n";
+    }
   std::cin>>choice;
+  bool autorange = choice==5 && plan.empty();
   std::cout<<"Picked "<<choice<<std::endl;
   switch (choice)
     {
@@ -84,18 +203,28 @@ void user_interaction(AD5933 &h)
     case 4:
       h.set_voltage_output(Voltage::OUTPUT_1Vpp);
       break;
+    case 5:
+      if (autorange)
+	{
+	  // Picked per segment when measuring.
+	  break;
+	}
+      [[fallthrough]];
     default:
       std::cout<<"Fell through to default\n";
       h.set_voltage_output(Voltage::OUTPUT_2Vpp);
     }
   std::cout<<"Value in register:"<<h.show_voltage()<<std::endl;
-  int pga;
-  do
+  int pga = 1;
+  if (!autorange)
     {
-      std::cout<<"PGA (1/5)x:";
-      std::cin>>pga;
+      do
+	{
+	  std::cout<<"PGA (1/5)x:";
+	  std::cin>>pga;
+	}
+      while (pga!=1 && pga!=5);
     }
-  while (pga!=1 && pga!=5);
   if (pga==5)
     {
       h.set_PGA(Gain::PGA5x);
@@ -109,7 +238,9 @@ void user_interaction(AD5933 &h)
     {
       std::cout<<"Settling cycles: ";
       std::cin>>settling_cycles;
-    }while (settling_cycles<0 && settling_cycles>511);
+    }while (settling_cycles<0 || settling_cycles>511);
+  // The cycles overwrite the multiplier bits, so they go first.
+  h.set_settling_cycles(settling_cycles);
   int multiplier;
   do
     {
@@ -132,20 +263,88 @@ void user_interaction(AD5933 &h)
   printf("Initial Calibration:\nCalibration Resistor Value: ");
   int rcal;
   std::cin>>rcal;
-  auto adm = sweep_frequency(starting_frequency, steps, interval, &h);
+  if (autorange)
+    {
+      autorange_interaction(h, starting_frequency, steps, interval, rcal);
+      return;
+    }
+  auto on_point = [&](uint32_t index, real_t f, const complex_t &z)
+    {
+      server.publish_point(sweep_number, index, f, z);
+      if (ring.is_open())
+	{
+	  ring.publish_point(sweep_number, index, f, z);
+	}
+    };
+  auto on_sweep_end = [&](uint32_t, uint32_t points)
+    {
+      server.publish_sweep_end(sweep_number, points);
+      if (ring.is_open())
+	{
+	  ring.publish_sweep_end(sweep_number, points);
+	}
+      sweep_number++;
+    };
+  // Settling per band, used by run_sweep() once tuned or loaded.
+  SettlingProfile profile;
+  // Empty if the sweep failed or came back short, after saying why.
+  auto run_sweep = [&]()
+    {
+      std::vector<std::pair<real_t, complex_t>> result;
+      size_t expected = steps + 1;
+      h.error = 0;
+      if (!plan.empty())
+	{
+	  expected = 0;
+	  for (const auto &s: plan)
+	    {
+	      expected += s.config.steps + 1;
+	    }
+	  result = sweep_plan(plan, &h, divider, on_point);
+	}
+      else if (!profile.bands.empty())
+	{
+	  SettlingReport report;
+	  result = sweep_profiled<real_t>(starting_frequency, steps, interval, &h, profile,
+					  settling_cycles*multiplier, &report, on_point);
+	  printf("Settling \"%s\": %.3f s instead of %.3f s, %.3f s saved\n", profile.name.c_str(),
+		 report.settling_time, report.baseline_time, report.saved());
+	}
+      else
+	{
+	  result = sweep_frequency(starting_frequency, steps, interval, &h, on_point);
+	}
+      on_sweep_end(sweep_number, result.size());
+      if (h.error || result.size() != expected)
+	{
+	  printf("Sweep failed after %zu of %zu points: %s\n", result.size(), expected,
+		 libusb_strerror(libusb_error(h.error ? h.error : LIBUSB_ERROR_IO)));
+	  result.clear();
+	}
+      return result;
+    };
+  auto adm = run_sweep();
+  if (adm.empty())
+    {
+      printf("Calibration failed\n");
+      return;
+    }
   printf("Full point calculation\n");
   auto gains = calibrate_gain(adm, rcal);
-  std::vector<std::pair<long double,long double>> system_phase;   
+  std::vector<std::pair<real_t,real_t>> system_phase;   
   for (const auto& i: adm)
     {
-      long double phi = std::arg(i.second);
-      phi = phi * (180.0l/M_PIl);
+      real_t phi = std::arg(i.second);
+      phi = phi * (180.0/M_PI);
       system_phase.push_back(std::make_pair(i.first,phi));
     }
   
   for (;;)
     {
-      printf("1. Repeat calibration\n2. Measure unknown impendance\n");
+      printf("1. Repeat calibration\n2. Measure unknown impendance\n3. Monitor unknown impedance continuously\n"
+	     "4. Measure unknown impedance adaptively\n"
+	     "5. Tune settling with the load connected\n6. Use a stored settling profile\n"
+	     "7. Measure repeatedly through the processing pipeline\n");
       std::cin>>choice;
       if (choice==1)
 	{
@@ -156,30 +355,249 @@ void user_interaction(AD5933 &h)
 	  std::cout<<"Please insert unknown impedance"<<std::endl;
 	  int nouse;
 	  std::cin>>nouse;
-	  auto newZ = sweep_frequency(starting_frequency, steps, interval, &h);
+	  auto newZ = run_sweep();
+	  if (newZ.empty())
+	    {
+	      continue;
+	    }
 	  auto mag = calculate_magnitude(newZ, gains);
-	  std::vector<std::pair<long double,long double>> new_phase;
-	  std::vector<long double> new_arg;
+	  std::vector<std::pair<real_t,real_t>> new_phase;
+	  std::vector<real_t> new_arg;
 	  for (size_t i = 0; i < newZ.size(); ++i)
 	    {
 	      auto phiZ = std::arg(newZ[i].second);
-	      phiZ = phiZ * (180.0l/M_PIl);
+	      phiZ = phiZ * (180.0/M_PI);
 	      auto phi0 = phiZ - system_phase[i].second;
 	      new_phase.push_back( make_pair(newZ[i].first, phi0));
 	    }
-	  write_to_file(mag, new_phase, newZ);
+	  if (write_to_file(mag, new_phase, newZ) < 0)
+	    {
+	      exit(1);
+	    }
+	}
+      else if (choice==3)
+	{
+	  if (!plan.empty())
+	    {
+	      std::cout<<"Monitoring needs a single clock, pick one by hand\n";
+	      continue;
+	    }
+	  uint32_t sweeps;
+	  std::cout<<"Number of sweeps (0 until Ctrl-C): ";
+	  std::cin>>sweeps;
+	  SweepConfig config;
+	  config.start = starting_frequency;
+	  config.steps = steps;
+	  config.step = interval;
+	  Monitor monitor(config, &h, MonitorOptions(), gains, system_phase);
+	  monitor.apply_config = false;
+	  monitor.on_point = on_point;
+	  monitor.on_sweep_end = on_sweep_end;
+	  monitor.on_event = [](const ChangeEvent &e)
+	    {
+	      printf("Sweep %u, %Lf Hz: %s %s %g (reference %g)\n", e.sweep, (long double)e.frequency,
+		     e.quantity == Quantity::PHASE ? "phase" : "magnitude",
+		     e.kind == ChangeKind::DRIFT ? "drift/h" : "deviation", e.value, e.reference);
+	    };
+	  stop_monitor.store(false);
+	  auto previous = signal(SIGINT, [](int) { stop_monitor.store(true); });
+	  auto done = monitor.run(sweeps, &stop_monitor);
+	  signal(SIGINT, previous);
+	  if (monitor.last_error())
+	    {
+	      printf("Monitoring stopped: %s\n", libusb_strerror(libusb_error(monitor.last_error())));
+	    }
+	  printf("Monitored %u sweeps, summary in monitor_summary.csv\n", done);
+	}
+      else if (choice==4)
+	{
+	  if (!plan.empty())
+	    {
+	      std::cout<<"Adaptive sweeps need a single clock, pick one by hand\n";
+	      continue;
+	    }
+	  std::cout<<"Please insert unknown impedance"<<std::endl;
+	  int nouse;
+	  std::cin>>nouse;
+	  AdaptiveOptions options;
+	  std::cout<<"Point budget: ";
+	  std::cin>>options.budget;
+	  AdaptiveReport report;
+	  auto newZ = sweep_adaptive(starting_frequency, starting_frequency + steps*interval, &h, options, &report);
+	  if (report.error)
+	    {
+	      printf("Adaptive sweep stopped after %u points: %s\n", report.points,
+		     libusb_strerror(libusb_error(report.error)));
+	      continue;
+	    }
+	  // The calibration grid is coarser, interpolate its gains and phases.
+	  auto new_gains = calc_multigains(newZ, gains);
+	  auto new_system_phase = calc_multigains(newZ, system_phase);
+	  auto mag = calculate_magnitude(newZ, new_gains);
+	  std::vector<std::pair<real_t,real_t>> new_phase;
+	  for (size_t i = 0; i < newZ.size(); ++i)
+	    {
+	      auto phiZ = std::arg(newZ[i].second) * (180.0/M_PI);
+	      new_phase.push_back( make_pair(newZ[i].first, phiZ - new_system_phase[i].second));
+	    }
+	  if (write_to_file(mag, new_phase, newZ) < 0)
+	    {
+	      exit(1);
+	    }
+	  printf("%u points in %u segments, %u rounds%s\n", report.points, report.segments, report.rounds,
+		 report.converged ? "" : ", budget exhausted");
+	}
+      else if (choice==7)
+	{
+	  uint32_t sweeps;
+	  std::cout<<"Number of sweeps (0 until Ctrl-C): ";
+	  std::cin>>sweeps;
+	  PipelineConfig config;
+	  std::string stages;
+	  std::cout<<"Stages (e.g. calibrate,phase,fit,output): ";
+	  std::cin>>stages;
+	  config.parse_stages(stages);
+	  if (std::find(config.stages.begin(), config.stages.end(), "fit") != config.stages.end())
+	    {
+	      std::cout<<"Circuit model: ";
+	      std::cin>>config.fit_model;
+	      CircuitModel model;
+	      if (CircuitModel::parse(config.fit_model, model))
+		{
+		  std::cout<<"Invalid circuit model\n";
+		  continue;
+		}
+	      config.fit_initial.resize(model.parameters);
+	      std::cout<<"Initial values of the "<<model.parameters<<" parameters: ";
+	      for (auto &p: config.fit_initial)
+		{
+		  std::cin>>p;
+		}
+	    }
+	  Pipeline pipeline(config.queue_capacity);
+	  if (add_standard_stages(pipeline, config, gains, system_phase))
+	    {
+	      perror("Pipeline stages");
+	      continue;
+	    }
+	  stop_monitor.store(false);
+	  pipeline.set_source("acquire", [&](SweepFrame &f)
+	    {
+	      if ((sweeps && f.sweep == sweeps) || stop_monitor.load())
+		{
+		  return false;
+		}
+	      f.adm = run_sweep();
+	      return !f.adm.empty();
+	    });
+	  auto previous = signal(SIGINT, [](int) { stop_monitor.store(true); });
+	  pipeline.start();
+	  pipeline.join();
+	  signal(SIGINT, previous);
+	  pipeline.print_statistics();
+	}
+      else if (choice==5 || choice==6)
+	{
+	  if (!plan.empty())
+	    {
+	      std::cout<<"Settling profiles need a single clock, pick one by hand\n";
+	      continue;
+	    }
+	  std::string load;
+	  std::cout<<"Load type: ";
+	  std::cin>>load;
+	  auto path = profile_path(load);
+	  if (choice==5)
+	    {
+	      profile = tune_settling<real_t>(starting_frequency, steps, interval, &h, load);
+	      if (profile.bands.empty())
+		{
+		  printf("Tuning failed: %s\n", libusb_strerror(libusb_error(h.error)));
+		  continue;
+		}
+	      if (profile.save(path.c_str()))
+		{
+		  perror(path.c_str());
+		}
+	    }
+	  else if (profile.load(path.c_str()))
+	    {
+	      perror(path.c_str());
+	      continue;
+	    }
+	  for (const auto &b: profile.bands)
+	    {
+	      printf("%Lf - %Lf Hz: %u settling cycles\n", b.lower, b.upper, b.cycles);
+	    }
 	}
     }
 }
 
 int main ( int argc, char **argv )
 {
+  int opt;
+  bool serve = false;
+  while ((opt = getopt(argc, argv, "s:p:m:t:")) != -1)
+    {
+      int err = 0;
+      switch (opt)
+	{
+	case 's':
+	  err = server.listen_unix(optarg);
+	  serve = true;
+	  break;
+	case 'p':
+	  err = server.listen_tcp(atoi(optarg));
+	  serve = true;
+	  break;
+	case 'm':
+	  err = ring.create(optarg);
+	  break;
+	case 't':
+#ifdef AD5933_TRACING
+	  trace_path = optarg;
+#else
+	  fprintf(stderr, "Built without tracing, see make TRACE=1\n");
+#endif
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-s socket_path] [-p tcp_port] [-m shm_name] [-t trace.json]\n", argv[0]);
+	  return 1;
+	}
+      if (err)
+	{
+	  perror(optarg);
+	  return 1;
+	}
+    }
+  if (serve && server.start())
+    {
+      perror("Starting live data server");
+      return 1;
+    }
+  if (divider.setup()==-1)
+    {
+      std::abort();
+    }
   AD5933 analyzer;
-  auto temperature = analyzer.measure_temperature();
+  Watchdog watchdog;
+  watchdog.watch(&analyzer);
+  double temperature;
+  int err = analyzer.read_temperature(temperature);
+  if (err < 0)
+    {
+      printf("Reading the temperature failed: %s\n", libusb_strerror(libusb_error(err)));
+      return 1;
+    }
   printf ( "Temperature= %f C\n",temperature );
   for (;;)
     {
       user_interaction(analyzer);
+      // Rewritten after every operation, the program only ends by a signal.
+      if (trace_path && AD5933_TRACE_WRITE(trace_path))
+	{
+	  perror(trace_path);
+	}
     }
 }
 
@@ -0,0 +1,490 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "sweep_plan.hpp"
+
+//Continuous monitoring of one sample. The same sweep is repeated back to back
+//and every point updates online statistics of its frequency in constant time,
+//so memory, storage and CPU stay flat however long the run is. Only summaries
+//and the sweeps that crossed a threshold are written to disk.
+
+//! Online statistics of one quantity.
+/*! Running mean and variance use Welford's update, the drift is the least
+  squares slope against time with the co-moment updated the same way. */
+struct OnlineStats
+{
+  //! Samples seen.
+  uint64_t n = 0;
+  //! Exponentially weighted moving average.
+  double ewma = 0;
+  double mean = 0;
+  double min = 0;
+  double max = 0;
+
+  //! Add a sample.
+  /*!
+    \param t Time of the sample in seconds.
+    \param x The sample.
+    \param alpha Weight of the sample in the moving average.
+  */
+  void add(double t, double x, double alpha)
+  {
+    n++;
+    if (n == 1)
+      {
+	ewma = min = max = x;
+      }
+    else
+      {
+	ewma += alpha*(x - ewma);
+	min = std::min(min, x);
+	max = std::max(max, x);
+      }
+    double dx = x - mean;
+    double dt = t - t_mean;
+    mean += dx/n;
+    t_mean += dt/n;
+    m2 += dx*(x - mean);
+    s_tt += dt*(t - t_mean);
+    s_tx += dt*(x - mean);
+  }
+
+  //! Sample variance.
+  double variance() const
+  {
+    return n > 1 ? m2/(n - 1) : 0;
+  }
+
+  //! Drift in units per second.
+  double slope() const
+  {
+    return s_tt > 0 ? s_tx/s_tt : 0;
+  }
+
+private:
+  double m2 = 0;
+  double t_mean = 0;
+  double s_tt = 0;
+  double s_tx = 0;
+};
+
+//! Statistics of one frequency of the monitored sweep.
+struct FrequencyStats
+{
+  real_t frequency = 0;
+  //! Impedance magnitude, or |DFT| if the monitor has no gain factors.
+  OnlineStats magnitude;
+  //! Phase in degrees.
+  OnlineStats phase;
+  //! A drift event was raised and has not cleared yet.
+  bool magnitude_drifting = false;
+  bool phase_drifting = false;
+};
+
+//! Thresholds and bookkeeping of a Monitor.
+struct MonitorOptions
+{
+  //! Weight of a new sweep in the moving averages.
+  double alpha = 0.1;
+  //! Sweeps before events are raised.
+  uint32_t warmup = 5;
+  //! Relative deviation of the magnitude from its moving average.
+  double magnitude_deviation = 0.05;
+  //! Deviation of the phase from its moving average, in degrees.
+  double phase_deviation = 2;
+  //! Relative magnitude drift per hour.
+  double magnitude_drift = 0.02;
+  //! Phase drift in degrees per hour.
+  double phase_drift = 1;
+  //! Sweeps between rewrites of the summary file.
+  uint32_t summary_interval = 10;
+  //! Prefix of the files written: <prefix>_summary.csv, <prefix>_events.csv
+  //! and <prefix>_<sweep>.csv for flagged sweeps. Empty for no files.
+  std::string prefix = "monitor";
+};
+
+//! Kinds of change events.
+enum class ChangeKind
+{
+  DEVIATION, /*!< A point is far from the moving average. */
+  DRIFT      /*!< The drift slope crossed its threshold. */
+};
+
+//! Quantities of a change event.
+enum class Quantity
+{
+  MAGNITUDE,
+  PHASE
+};
+
+//! A threshold crossing.
+struct ChangeEvent
+{
+  uint32_t sweep;
+  //! Index of the point in the sweep.
+  uint32_t index;
+  real_t frequency;
+  //! Seconds since the monitor started.
+  double time;
+  ChangeKind kind;
+  Quantity quantity;
+  //! The sample for DEVIATION, the slope per hour for DRIFT.
+  double value;
+  //! The moving average for DEVIATION, the mean for DRIFT.
+  double reference;
+};
+
+//! Repeats a sweep and keeps statistics of every frequency.
+class Monitor
+{
+public:
+  //! Called for every event, in addition to the events file.
+  std::function<void(const ChangeEvent&)> on_event;
+  //! Called for every measured point, e.g. to stream it.
+  PointCallback on_point;
+  //! Called after every sweep with its number and size.
+  std::function<void(uint32_t sweep, uint32_t points)> on_sweep_end;
+
+  //! Prepare a monitor.
+  /*!
+    \param config The sweep to repeat.
+    \param h Handle to the device object.
+    \param options Thresholds and files.
+    \param gains Gain factors from calibrate_gain(). Without them magnitudes are |DFT|.
+    \param system_phase System phase in degrees per frequency, subtracted from the phase.
+  */
+  Monitor(const SweepConfig &config, AD5933 *h, const MonitorOptions &options = MonitorOptions(),
+	  const std::vector<std::pair<real_t,real_t>> &gains = {},
+	  const std::vector<std::pair<real_t,real_t>> &system_phase = {})
+    : config(config), h(h), options(options), gains(gains), system_phase(system_phase)
+  {
+  }
+
+  Monitor(const Monitor&) = delete;
+  Monitor& operator=(const Monitor&) = delete;
+
+  ~Monitor()
+  {
+    if (events != NULL)
+      {
+	fclose(events);
+      }
+  }
+
+  //! Apply the analog settings of the configuration before the first sweep.
+  /*! Turn off when the device was set up by hand and only the frequencies
+    of the configuration are to be used. */
+  bool apply_config = true;
+
+  //! Run sweeps.
+  /*!
+    \param sweeps Number of sweeps, 0 to run until stop is set.
+    \param stop Checked between sweeps.
+    \return The number of sweeps done. A sweep that fails ends the run, see
+    last_error().
+  */
+  uint32_t run(uint32_t sweeps, const std::atomic<bool> *stop = nullptr)
+  {
+    uint32_t done = 0;
+    while ((sweeps == 0 || done < sweeps) && !(stop && stop->load()))
+      {
+	if (sweep_once() < 0)
+	  {
+	    break;
+	  }
+	done++;
+	if (options.summary_interval && sweep % options.summary_interval == 0)
+	  {
+	    write_summary();
+	  }
+      }
+    write_summary();
+    return done;
+  }
+
+  //! Do one sweep and update the statistics.
+  /*! \return The number of events raised by the sweep, or a libusb_error
+    code if programming the sweep failed, in which case nothing is measured,
+    or the sweep ended early. LIBUSB_ERROR_IO with errno set if a flagged
+    sweep could not be saved. */
+  int sweep_once()
+  {
+    error = 0;
+    h->error = 0;
+    if (apply_config)
+      {
+	// The registers are only written the first time, the plan finds them
+	// unchanged afterwards.
+	if (!plan)
+	  {
+	    plan.emplace(config, h);
+	    start_code = plan->start();
+	    inc_code = plan->inc();
+	  }
+	int err = plan->apply(h);
+	if (err < 0)
+	  {
+	    error = err;
+	    return err;
+	  }
+      }
+    else if (!programmed)
+      {
+	start_code = frequency_code(config.start, h->clk);
+	inc_code = frequency_code(config.step, h->clk);
+	prepare_sweep(start_code, inc_code, config.steps, h);
+	programmed = true;
+      }
+    else
+      {
+	// Nothing but the sweep state changed since the last sweep.
+	restart_sweep(h);
+      }
+    size_t raised = 0;
+    auto adm = acquire_sweep(start_code, inc_code, config.steps, h,
+			     [&](uint32_t index, real_t f, const complex_t &z)
+			     {
+			       raised += update(index, f, z);
+			       if (on_point)
+				 {
+				   on_point(index, f, z);
+				 }
+			     });
+    int saved = 0;
+    if (raised && !options.prefix.empty())
+      {
+	saved = save_sweep(adm);
+      }
+    if (on_sweep_end)
+      {
+	on_sweep_end(sweep, adm.size());
+      }
+    sweep++;
+    if (adm.size() < config.steps + 1)
+      {
+	error = h->error ? h->error : LIBUSB_ERROR_IO;
+	return error;
+      }
+    if (saved < 0)
+      {
+	error = LIBUSB_ERROR_IO;
+	return error;
+      }
+    return static_cast<int>(raised);
+  }
+
+  //! 0, or the libusb_error code of the last sweep_once() if it failed.
+  int last_error() const
+  {
+    return error;
+  }
+
+  //! Statistics per frequency.
+  const std::vector<FrequencyStats>& statistics() const
+  {
+    return stats;
+  }
+
+  //! Number of sweeps done.
+  uint32_t sweeps() const
+  {
+    return sweep;
+  }
+
+  //! Rewrite the summary file.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int write_summary() const
+  {
+    if (options.prefix.empty())
+      {
+	return 0;
+      }
+    std::string path = options.prefix + "_summary.csv";
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == NULL)
+      {
+	return -1;
+      }
+    fprintf(fp, "Sweeps,%u,Elapsed,%f\n", sweep, elapsed());
+    fprintf(fp, "Frequency,Samples,Magnitude EWMA,Magnitude Mean,Magnitude Std,Magnitude Min,Magnitude Max,"
+	    "Magnitude Drift/h,Phase EWMA,Phase Mean,Phase Std,Phase Min,Phase Max,Phase Drift/h\n");
+    for (const auto &s: stats)
+      {
+	fprintf(fp, "%Lf,%lu", (long double)s.frequency, static_cast<unsigned long>(s.magnitude.n));
+	for (const OnlineStats *q: {&s.magnitude, &s.phase})
+	  {
+	    fprintf(fp, ",%g,%g,%g,%g,%g,%g", q->ewma, q->mean, std::sqrt(q->variance()),
+		    q->min, q->max, q->slope()*3600);
+	  }
+	fprintf(fp, "\n");
+      }
+    return fclose(fp) == 0 ? 0 : -1;
+  }
+
+private:
+  //! Seconds since the first sweep.
+  double elapsed() const
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  }
+
+  //! Update the statistics of one point. Returns the number of events.
+  size_t update(uint32_t index, real_t f, const complex_t &z)
+  {
+    if (index >= stats.size())
+      {
+	stats.resize(index + 1);
+	stats[index].frequency = f;
+      }
+    if (sweep == 0 && index == 0)
+      {
+	started = std::chrono::steady_clock::now();
+      }
+    double t = elapsed();
+    double mag = std::abs(z);
+    if (index < gains.size())
+      {
+	mag = 1/(mag*gains[index].second);
+      }
+    double phi = std::arg(z)*(180.0/M_PI);
+    if (index < system_phase.size())
+      {
+	phi -= system_phase[index].second;
+      }
+    auto &s = stats[index];
+    size_t raised = 0;
+    if (sweep >= options.warmup)
+      {
+	if (std::abs(mag - s.magnitude.ewma) > options.magnitude_deviation*std::abs(s.magnitude.ewma))
+	  {
+	    raise({sweep, index, f, t, ChangeKind::DEVIATION, Quantity::MAGNITUDE, mag, s.magnitude.ewma});
+	    raised++;
+	  }
+	if (std::abs(phi - s.phase.ewma) > options.phase_deviation)
+	  {
+	    raise({sweep, index, f, t, ChangeKind::DEVIATION, Quantity::PHASE, phi, s.phase.ewma});
+	    raised++;
+	  }
+      }
+    s.magnitude.add(t, mag, options.alpha);
+    s.phase.add(t, phi, options.alpha);
+    if (sweep >= options.warmup)
+      {
+	raised += drift(s, index, t, Quantity::MAGNITUDE, s.magnitude, s.magnitude_drifting,
+			options.magnitude_drift*std::abs(s.magnitude.mean));
+	raised += drift(s, index, t, Quantity::PHASE, s.phase, s.phase_drifting, options.phase_drift);
+      }
+    return raised;
+  }
+
+  //! Raise a drift event when the slope crosses the threshold. It clears
+  //! again below half the threshold, so a slope near it does not flood.
+  size_t drift(const FrequencyStats &s, uint32_t index, double t, Quantity q,
+	       const OnlineStats &o, bool &drifting, double threshold)
+  {
+    double per_hour = o.slope()*3600;
+    if (!drifting && std::abs(per_hour) > threshold)
+      {
+	drifting = true;
+	raise({sweep, index, s.frequency, t, ChangeKind::DRIFT, q, per_hour, o.mean});
+	return 1;
+      }
+    if (drifting && std::abs(per_hour) < threshold/2)
+      {
+	drifting = false;
+      }
+    return 0;
+  }
+
+  void raise(const ChangeEvent &e)
+  {
+    if (on_event)
+      {
+	on_event(e);
+      }
+    if (options.prefix.empty())
+      {
+	return;
+      }
+    if (events == NULL)
+      {
+	if (events_failed)
+	  {
+	    return;
+	  }
+	// Opened with the first event and kept open, a burst of events must
+	// not cost an open and a close each.
+	std::string path = options.prefix + "_events.csv";
+	events = fopen(path.c_str(), "a");
+	if (events == NULL)
+	  {
+	    log_error("Monitor: %s: %s\n", path.c_str(), strerror(errno));
+	    events_failed = true;
+	    return;
+	  }
+      }
+    fprintf(events, "%u,%u,%Lf,%f,%s,%s,%g,%g\n", e.sweep, e.index, (long double)e.frequency, e.time,
+	    e.kind == ChangeKind::DRIFT ? "drift" : "deviation",
+	    e.quantity == Quantity::PHASE ? "phase" : "magnitude", e.value, e.reference);
+    // Flushed per event so that the file is complete while the monitor runs.
+    fflush(events);
+  }
+
+  //! Write a flagged sweep in the usual output format.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int save_sweep(const std::vector<std::pair<real_t,complex_t>> &adm)
+  {
+    AD5933_TRACE("save_sweep");
+    std::vector<std::pair<real_t,real_t>> mag, phase;
+    mag.reserve(adm.size());
+    phase.reserve(adm.size());
+    for (size_t i = 0; i < adm.size(); i++)
+      {
+	real_t m = std::abs(adm[i].second);
+	if (i < gains.size())
+	  {
+	    m = 1/(m*gains[i].second);
+	  }
+	real_t phi = std::arg(adm[i].second)*(180.0/M_PI);
+	if (i < system_phase.size())
+	  {
+	    phi -= system_phase[i].second;
+	  }
+	mag.push_back(std::make_pair(adm[i].first, m));
+	phase.push_back(std::make_pair(adm[i].first, phi));
+      }
+    std::string path = options.prefix + "_" + std::to_string(sweep) + ".csv";
+    return write_to_file(mag, phase, adm, path.c_str());
+  }
+
+  SweepConfig config;
+  AD5933 *h;
+  MonitorOptions options;
+  std::vector<std::pair<real_t,real_t>> gains;
+  std::vector<std::pair<real_t,real_t>> system_phase;
+  std::vector<FrequencyStats> stats;
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+  bool programmed = false;
+  //! Used when apply_config is set.
+  std::optional<SweepPlan> plan;
+  uint32_t start_code = 0;
+  uint32_t inc_code = 0;
+  uint32_t sweep = 0;
+  int error = 0;
+  //! The events file, open after the first event.
+  FILE *events = NULL;
+  //! Set when the events file could not be opened, it is not tried again.
+  bool events_failed = false;
+};
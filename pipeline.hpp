@@ -0,0 +1,589 @@
+/*! \file
+  Sweep processing as a pipeline of stages on their own threads.
+
+  A source stage acquires sweeps; the stages after it, e.g. calibration,
+  phase correction, fitting and output, each take a SweepFrame from the
+  queue before them, work on it and pass it on. The queues are bounded: a
+  stage that falls behind fills its queue and then holds up the stage
+  before it, back to the acquisition, rather than letting frames pile up.
+  As long as every stage keeps up on average, processing never delays the
+  next sweep.
+*/
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "fit.hpp"
+
+//! Blocking FIFO queue with a fixed capacity.
+/*! push() waits while the queue is full, which is the backpressure on the
+  producer. close() ends the stream: pop() returns what is left and then
+  false. */
+template <typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1))
+  {
+  }
+
+  //! Enqueue a value, waiting for room.
+  /*! \return false if the queue was closed; the value is dropped. */
+  bool push(T value)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+    if (closed)
+      {
+	return false;
+      }
+    items.push_back(std::move(value));
+    not_empty.notify_one();
+    return true;
+  }
+
+  //! Dequeue a value, waiting for one.
+  /*!
+    \param value The value.
+    \param depth If not NULL, receives the number of values queued before
+    this one was taken.
+    \return false once the queue is closed and empty.
+  */
+  bool pop(T &value, size_t *depth = nullptr)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty())
+      {
+	return false;
+      }
+    if (depth)
+      {
+	*depth = items.size();
+      }
+    value = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  //! End the stream. Waiting producers give up, consumers drain the rest.
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+  const size_t capacity;
+
+private:
+  mutable std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::deque<T> items;
+  bool closed = false;
+};
+
+//! One sweep travelling through a Pipeline.
+/*! Stages fill in what they compute; what a stage did not run for stays
+  empty. */
+struct SweepFrame
+{
+  //! Number of the sweep, counting from 0.
+  uint32_t sweep = 0;
+  //! When the source finished the sweep.
+  std::chrono::steady_clock::time_point acquired;
+  //! Frequency, admittance pairs.
+  std::vector<std::pair<real_t, complex_t>> adm;
+  //! Frequency, impedance magnitude pairs.
+  std::vector<std::pair<real_t, real_t>> mag;
+  //! Frequency, impedance phase pairs in degrees.
+  std::vector<std::pair<real_t, real_t>> phase;
+  //! Set by the fit stage when fitted is.
+  FitResult fit;
+  bool fitted = false;
+};
+
+//! Metrics of one stage.
+struct StageStats
+{
+  std::string name;
+  //! Frames the stage finished.
+  uint64_t frames = 0;
+  //! Frames the stage dropped by returning false.
+  uint64_t dropped = 0;
+  //! Time spent working on frames, in seconds.
+  double busy = 0;
+  //! Longest time spent on one frame, in seconds.
+  double max_latency = 0;
+  //! Time spent waiting for a frame, in seconds.
+  double waiting = 0;
+  //! Time spent waiting for room in the next queue, in seconds. Large values
+  //! mean a later stage is the bottleneck.
+  double blocked = 0;
+  //! Frames queued before the stage when it took one, summed and largest.
+  uint64_t depth_sum = 0;
+  size_t max_depth = 0;
+  //! Longest time from acquisition to the end of this stage, in seconds.
+  double max_age = 0;
+
+  //! Mean time spent on one frame, in seconds.
+  double mean_latency() const
+  {
+    return frames + dropped ? busy/(frames + dropped) : 0;
+  }
+
+  //! Mean depth of the queue before the stage.
+  double mean_depth() const
+  {
+    return frames + dropped ? static_cast<double>(depth_sum)/(frames + dropped) : 0;
+  }
+};
+
+//! Stages joined by bounded queues, one thread per stage.
+/*! Set the source and add the stages, then start() and join(). Stage
+  functions return false to drop a frame; the source returns false when
+  there are no more sweeps. They must not throw. */
+class Pipeline
+{
+public:
+  typedef std::function<bool(SweepFrame&)> StageFunction;
+
+  //! \param queue_capacity Frames each queue holds.
+  explicit Pipeline(size_t queue_capacity = 4) : queue_capacity(queue_capacity)
+  {
+  }
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  ~Pipeline()
+  {
+    stop();
+    join();
+  }
+
+  //! Set the stage that produces the frames, usually the acquisition.
+  void set_source(const std::string &name, StageFunction produce)
+  {
+    source.name = name;
+    source.stats.name = name;
+    source.function = std::move(produce);
+  }
+
+  //! Append a stage. Only before start().
+  void add_stage(const std::string &name, StageFunction process)
+  {
+    stages.emplace_back(new Stage);
+    stages.back()->name = name;
+    stages.back()->stats.name = name;
+    stages.back()->function = std::move(process);
+    stages.back()->input.reset(new BoundedQueue<SweepFrame>(queue_capacity));
+  }
+
+  //! Names of the stages after the source.
+  std::vector<std::string> stage_names() const
+  {
+    std::vector<std::string> names;
+    for (const auto &s: stages)
+      {
+	names.push_back(s->name);
+      }
+    return names;
+  }
+
+  //! Start the threads.
+  void start()
+  {
+    stopping.store(false);
+    source.thread = std::thread(&Pipeline::run_source, this);
+    for (size_t i = 0; i < stages.size(); i++)
+      {
+	stages[i]->thread = std::thread(&Pipeline::run_stage, this, i);
+      }
+  }
+
+  //! Ask the source to end after the sweep it is doing.
+  void stop()
+  {
+    stopping.store(true);
+  }
+
+  //! Wait until the source ended and every frame went through all stages.
+  void join()
+  {
+    if (source.thread.joinable())
+      {
+	source.thread.join();
+      }
+    for (auto &s: stages)
+      {
+	if (s->thread.joinable())
+	  {
+	    s->thread.join();
+	  }
+      }
+  }
+
+  //! Metrics of the source and the stages, in pipeline order.
+  std::vector<StageStats> statistics() const
+  {
+    std::vector<StageStats> stats;
+    {
+      std::lock_guard<std::mutex> lock(source.mutex);
+      stats.push_back(source.stats);
+    }
+    for (const auto &s: stages)
+      {
+	std::lock_guard<std::mutex> lock(s->mutex);
+	stats.push_back(s->stats);
+      }
+    return stats;
+  }
+
+  //! Print statistics() as a table.
+  void print_statistics(FILE *fp = stdout) const
+  {
+    fprintf(fp, "%-12s %8s %8s %9s %9s %9s %9s %7s %7s %9s\n", "Stage", "Frames", "Dropped", "Mean ms",
+	    "Max ms", "Waiting s", "Blocked s", "Depth", "Max", "Age ms");
+    for (const auto &s: statistics())
+      {
+	fprintf(fp, "%-12s %8lu %8lu %9.3f %9.3f %9.3f %9.3f %7.2f %7zu %9.3f\n", s.name.c_str(),
+		static_cast<unsigned long>(s.frames), static_cast<unsigned long>(s.dropped),
+		s.mean_latency()*1e3, s.max_latency*1e3, s.waiting, s.blocked, s.mean_depth(), s.max_depth,
+		s.max_age*1e3);
+      }
+  }
+
+private:
+  struct Stage
+  {
+    std::string name;
+    StageFunction function;
+    //! Queue before the stage; NULL for the source.
+    std::unique_ptr<BoundedQueue<SweepFrame>> input;
+    std::thread thread;
+    mutable std::mutex mutex;
+    StageStats stats;
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  static double seconds(Clock::duration d)
+  {
+    return std::chrono::duration<double>(d).count();
+  }
+
+  //! Queue after stage i, the source being -1; NULL after the last stage.
+  BoundedQueue<SweepFrame>* output(ssize_t i)
+  {
+    return i + 1 < static_cast<ssize_t>(stages.size()) ? stages[i + 1]->input.get() : nullptr;
+  }
+
+  void record(Stage &stage, bool kept, size_t depth, Clock::time_point t0, Clock::time_point t1,
+	      Clock::time_point t2, Clock::time_point t3, Clock::time_point acquired)
+  {
+    std::lock_guard<std::mutex> lock(stage.mutex);
+    StageStats &s = stage.stats;
+    (kept ? s.frames : s.dropped)++;
+    s.waiting += seconds(t1 - t0);
+    s.busy += seconds(t2 - t1);
+    s.max_latency = std::max(s.max_latency, seconds(t2 - t1));
+    s.blocked += seconds(t3 - t2);
+    s.depth_sum += depth;
+    s.max_depth = std::max(s.max_depth, depth);
+    if (kept)
+      {
+	s.max_age = std::max(s.max_age, seconds(t2 - acquired));
+      }
+  }
+
+  void run_source()
+  {
+    AD5933_TRACE_THREAD(source.name.c_str());
+    auto out = output(-1);
+    for (uint32_t n = 0; !stopping.load(); n++)
+      {
+	SweepFrame frame;
+	frame.sweep = n;
+	auto t1 = Clock::now();
+	if (!source.function(frame))
+	  {
+	    break;
+	  }
+	auto t2 = frame.acquired = Clock::now();
+	if (out)
+	  {
+	    out->push(std::move(frame));
+	  }
+	record(source, true, 0, t1, t1, t2, Clock::now(), t2);
+      }
+    if (out)
+      {
+	out->close();
+      }
+  }
+
+  void run_stage(size_t i)
+  {
+    Stage &stage = *stages[i];
+    AD5933_TRACE_THREAD(stage.name.c_str());
+    auto out = output(i);
+    SweepFrame frame;
+    size_t depth;
+    for (;;)
+      {
+	auto t0 = Clock::now();
+	if (!stage.input->pop(frame, &depth))
+	  {
+	    break;
+	  }
+	auto t1 = Clock::now();
+	bool kept = stage.function(frame);
+	auto t2 = Clock::now();
+	if (kept && out)
+	  {
+	    out->push(std::move(frame));
+	  }
+	record(stage, kept, depth, t0, t1, t2, Clock::now(), frame.acquired);
+      }
+    if (out)
+      {
+	out->close();
+      }
+  }
+
+  size_t queue_capacity;
+  Stage source;
+  std::vector<std::unique_ptr<Stage>> stages;
+  std::atomic<bool> stopping{false};
+};
+
+//! Which of the standard stages a pipeline runs, see add_standard_stages().
+struct PipelineConfig
+{
+  //! Stage names in order: "calibrate", "phase", "fit", "output".
+  std::vector<std::string> stages{"calibrate", "phase", "output"};
+  //! Frames each queue holds.
+  size_t queue_capacity = 4;
+  //! Circuit model of the fit stage, see CircuitModel.
+  std::string fit_model = "R-p(R,C)";
+  //! Initial parameters of the first fit, one per model parameter. Later
+  //! fits start from the last converged one.
+  std::vector<double> fit_initial;
+  //! Files of the output stage.
+  CsvWriterOptions output;
+  //! File the output stage writes the fits to when there is a fit stage.
+  std::string fit_path = "sweep_fit.csv";
+
+  PipelineConfig()
+  {
+    output.path_template = "sweep_{sweep}.csv";
+  }
+
+  //! Set the stages from a comma separated list, e.g. "calibrate,phase,output".
+  void parse_stages(const std::string &list)
+  {
+    stages.clear();
+    std::stringstream ss(list);
+    std::string name;
+    while (std::getline(ss, name, ','))
+      {
+	if (!name.empty())
+	  {
+	    stages.push_back(name);
+	  }
+      }
+  }
+};
+
+//! Gains or phases for the frequencies of a sweep.
+/*! The calibration is used as it is when it has the same frequencies, see
+  same_frequencies(), and is interpolated otherwise.
+  \param adm The sweep.
+  \param calibration Frequency, gain or phase pairs.
+  \param values Receives one value per point of the sweep.
+  \return 0, or -1 with errno EINVAL if the calibration is empty or does not
+  reach the first or the last frequency of the sweep, e.g. because the
+  calibration sweep ended early. */
+inline int calibration_for(const std::vector<std::pair<real_t, complex_t>> &adm,
+			   const std::vector<std::pair<real_t, real_t>> &calibration,
+			   std::vector<std::pair<real_t, real_t>> &values)
+{
+  if (same_frequencies(adm, calibration))
+    {
+      values = calibration;
+      return 0;
+    }
+  // 0.1 Hz, the tolerance of same_frequencies().
+  if (calibration.empty() || (!adm.empty() && (adm.front().first < calibration.front().first - 0.1
+					       || adm.back().first > calibration.back().first + 0.1)))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  values = calc_multigains(adm, calibration);
+  return 0;
+}
+
+//! Add the stages of a configuration to a pipeline.
+/*!
+\param pipeline The pipeline, before start().
+\param config The stages and their settings.
+\param gains Gain factors from calibrate_gain(), used by "calibrate".
+\param system_phase System phase in degrees per frequency, used by "phase".
+\return 0, or -1 with errno EINVAL for an unknown stage, an invalid fit
+model, fit_initial the model does not accept, see CircuitModel::accepts(), or
+an empty calibration for "calibrate" or "phase".
+
+Without "calibrate" magnitudes are |DFT|, without "phase" phases are
+uncorrected, as Monitor does. "fit" needs both before it. Those two drop
+the sweeps their calibration does not cover, see calibration_for().
+*/
+inline int add_standard_stages(Pipeline &pipeline, const PipelineConfig &config,
+			       const std::vector<std::pair<real_t, real_t>> &gains,
+			       const std::vector<std::pair<real_t, real_t>> &system_phase)
+{
+  for (const auto &name: config.stages)
+    {
+      if ((name == "calibrate" && gains.empty()) || (name == "phase" && system_phase.empty()))
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+      if (name == "calibrate")
+	{
+	  pipeline.add_stage(name, [gains](SweepFrame &f)
+	    {
+	      std::vector<std::pair<real_t, real_t>> g;
+	      if (calibration_for(f.adm, gains, g) < 0)
+		{
+		  return false;
+		}
+	      f.mag = calculate_magnitude(f.adm, g);
+	      return true;
+	    });
+	}
+      else if (name == "phase")
+	{
+	  pipeline.add_stage(name, [system_phase](SweepFrame &f)
+	    {
+	      std::vector<std::pair<real_t, real_t>> system;
+	      if (calibration_for(f.adm, system_phase, system) < 0)
+		{
+		  return false;
+		}
+	      f.phase.clear();
+	      for (size_t i = 0; i < f.adm.size(); i++)
+		{
+		  f.phase.push_back(std::make_pair(f.adm[i].first,
+						   std::arg(f.adm[i].second)*(180.0/M_PI) - system[i].second));
+		}
+	      return true;
+	    });
+	}
+      else if (name == "fit")
+	{
+	  CircuitModel model;
+	  if (CircuitModel::parse(config.fit_model, model) < 0 || !model.accepts(config.fit_initial))
+	    {
+	      errno = EINVAL;
+	      return -1;
+	    }
+	  auto guess = std::make_shared<std::vector<double>>(config.fit_initial);
+	  pipeline.add_stage(name, [model, guess](SweepFrame &f)
+	    {
+	      if (f.mag.empty() || f.phase.empty())
+		{
+		  return true;
+		}
+	      f.fit = fit_circuit(model, impedance_spectrum(f.mag, f.phase), *guess);
+	      f.fitted = true;
+	      if (f.fit.converged)
+		{
+		  *guess = f.fit.params;
+		}
+	      return true;
+	    });
+	}
+      else if (name == "output")
+	{
+	  auto writer = std::make_shared<CsvWriter>(config.output);
+	  std::shared_ptr<FILE> fits;
+	  for (const auto &s: config.stages)
+	    {
+	      if (s == "fit")
+		{
+		  fits.reset(fopen(config.fit_path.c_str(), "w"), [](FILE *fp) { if (fp) fclose(fp); });
+		  if (!fits)
+		    {
+		      return -1;
+		    }
+		  fprintf(fits.get(), "Sweep,Converged,Chi2,Parameters\n");
+		}
+	    }
+	  pipeline.add_stage(name, [writer, fits](SweepFrame &f)
+	    {
+	      if (f.mag.empty())
+		{
+		  for (const auto &p: f.adm)
+		    {
+		      f.mag.push_back(std::make_pair(p.first, std::abs(p.second)));
+		    }
+		}
+	      if (f.phase.empty())
+		{
+		  for (const auto &p: f.adm)
+		    {
+		      f.phase.push_back(std::make_pair(p.first, std::arg(p.second)*(180.0/M_PI)));
+		    }
+		}
+	      if (writer->write(f.mag, f.phase, f.adm, f.sweep) < 0)
+		{
+		  log_error("Pipeline: %s: %s\n", writer->last_path().c_str(), strerror(errno));
+		  return false;
+		}
+	      if (fits && f.fitted)
+		{
+		  fprintf(fits.get(), "%u,%d,%g", f.sweep, f.fit.converged, f.fit.chi2);
+		  for (double p: f.fit.params)
+		    {
+		      fprintf(fits.get(), ",%g", p);
+		    }
+		  fprintf(fits.get(), "\n");
+		  fflush(fits.get());
+		}
+	      return true;
+	    });
+	}
+      else
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+    }
+  return 0;
+}
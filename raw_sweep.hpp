@@ -0,0 +1,140 @@
+/*! \file */
+#pragma once
+#include <future>
+
+#include "ad5933.hpp"
+
+//! One raw measurement as read from the Real and Imaginary registers.
+/*! No floating point work is done when these are acquired. The frequency is
+  implied by the index and the codes of the RawSweep that holds them. */
+struct RawPoint
+{
+  //! Position of the point in the sweep.
+  uint16_t index;
+  //! Contents of the Real data register.
+  int16_t re;
+  //! Contents of the Imaginary data register.
+  int16_t im;
+};
+static_assert(sizeof(RawPoint) == 6, "RawPoint must be packed");
+
+//! A sweep in raw form.
+/*! Holds everything needed to convert the points later: the frequency
+  register codes and the clock the sweep ran with. */
+struct RawSweep
+{
+  //! Start frequency code.
+  uint32_t start;
+  //! Frequency increment code.
+  uint32_t inc;
+  //! Clock source frequency during the sweep.
+  long double clk;
+  //! The measurements, in sweep order.
+  std::vector<RawPoint> points;
+
+  //! Frequency in Hz of the point with the given index.
+  long double frequency(uint16_t index) const
+  {
+    return (start + static_cast<uint64_t>(index)*inc) * ((clk/4) / (1<<27));
+  }
+};
+
+//!Execute frequency sweep and keep the raw register values.
+/*!
+\param lower Starting frequency of the sweep.
+\param number_of_samples Frequencies measured in the sweep
+\param step Distance between frequencies meausured in the sweep.
+\param h Handle to the device object.
+\return The raw sweep, to be converted with convert_raw().
+
+Same flowchart as sweep_frequency(), but the sweep loop only moves integers:
+the status polls, four register reads and one store per point. Like
+acquire_sweep() it stops early if reading the status or a data register fails
+or the sweep overruns sweep_budget(), and AD5933::error tells why.
+*/
+inline RawSweep sweep_frequency_raw ( long double lower, uint32_t number_of_samples, long double step, AD5933* h )
+{
+  RawSweep sweep;
+  sweep.clk = h->clk;
+  sweep.start = frequency_code(lower, sweep.clk);
+  sweep.inc = frequency_code(step, sweep.clk);
+  sweep.points.reserve(number_of_samples + 1);
+  DeadlineScope deadline(h, sweep_budget(lower, number_of_samples, sweep.clk, settling_periods(h)), "sweep_frequency_raw");
+  prepare_sweep(sweep.start, sweep.inc, number_of_samples, h);
+
+  uint16_t index = 0;
+  uint8_t sreg;
+  for ( ;; )
+    {
+      AD5933_TRACE_ARG("point", "index", index);
+      {
+	AD5933_TRACE("wait_status");
+	do
+	  {
+	    if (h->read_register(sreg, SREG) < 0)
+	      {
+		return sweep;
+	      }
+	  }
+	while ( !(sreg & SREG_IMPED_VALID) );
+      }
+      RawPoint p = {index++, 0, 0};
+      if (h->read_raw(p.re, p.im) < 0)
+	{
+	  break;
+	}
+      sweep.points.push_back(p);
+      if (h->read_register(sreg, SREG) < 0 || (sreg & SREG_SWEEP_VALID))
+	{
+	  break;
+	}
+      h->increase_frequency();
+    }
+  return sweep;
+}
+
+//!Convert a raw sweep to frequency, admittance pairs.
+/*!
+\param raw The raw sweep.
+\return The same data sweep_frequency() would have returned.
+
+This is the batch conversion stage of the raw acquisition path. It can run long
+after the acquisition or on another thread, see convert_raw_async().
+*/
+template <typename Real = real_t>
+std::vector<std::pair<Real, std::complex<Real>>> convert_raw(const RawSweep &raw)
+{
+  std::vector<std::pair<Real, std::complex<Real>>> measurements;
+  measurements.reserve(raw.points.size());
+  const Real hz_per_code = (raw.clk/4) / (1<<27);
+  for (const auto &p: raw.points)
+    {
+      Real code = raw.start + static_cast<uint64_t>(p.index)*raw.inc;
+      measurements.push_back(std::make_pair(code*hz_per_code, std::complex<Real>(p.re, p.im)));
+    }
+  return measurements;
+}
+
+//!Convert a raw sweep to frequency, impedance magnitude pairs.
+/*!
+\param raw The raw sweep.
+\param gains Gain factors as calculated with calibrate_gain(), one per point.
+\return The same data calculate_magnitude() returns.
+*/
+template <typename Real>
+std::vector<std::pair<Real, Real>>
+convert_raw_magnitude(const RawSweep &raw,
+		      const std::vector<std::pair<Real,Real>> &gains)
+{
+  return calculate_magnitude(convert_raw<Real>(raw), gains);
+}
+
+//!Convert a raw sweep on another thread.
+/*!
+\param raw The raw sweep. It is moved to the conversion thread.
+\return A future with the result of convert_raw().
+*/
+inline std::future<std::vector<std::pair<real_t, complex_t>>> convert_raw_async(RawSweep raw)
+{
+  return std::async(std::launch::async, [raw = std::move(raw)] { return convert_raw(raw); });
+}
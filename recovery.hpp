@@ -0,0 +1,341 @@
+/*! \file */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "ad5933.hpp"
+
+//! Limits for the recovery of a failed sweep.
+struct RetryPolicy
+{
+  //! Attempts of a single register transaction before the sweep is restarted.
+  int max_retries = 5;
+  //! Backoff before the first retry. It is doubled on every retry.
+  std::chrono::milliseconds initial_backoff{10};
+  //! Upper bound for the backoff.
+  std::chrono::milliseconds max_backoff{1000};
+  //! Attempts to restart the sweep at the failed point before reopening the device.
+  int max_resyncs = 3;
+  //! Attempts to reopen the device before giving up.
+  int max_reopens = 3;
+  //! Status polls without a valid measurement before the point is considered
+  //! stuck. Each attempt is also bounded by sweep_budget().
+  long max_polls = 1000000;
+};
+
+//! Kinds of recovery events.
+enum class RecoveryAction
+{
+  RETRY,   /*!< A register transaction was repeated. */
+  RESYNC,  /*!< The sweep was reprogrammed to resume at the failed point. */
+  REOPEN,  /*!< The device was reopened and reconfigured. */
+  ABANDON  /*!< Recovery failed and the sweep was stopped. */
+};
+
+//! A single recovery event.
+struct RecoveryEvent
+{
+  //! What was done.
+  RecoveryAction action;
+  //! Index of the sweep point that was being measured.
+  uint32_t point;
+  //! The libusb_error code that triggered the event.
+  int error;
+  //! Time spent on the recovery.
+  std::chrono::nanoseconds lost;
+};
+
+//! Summary of the recovery of a sweep.
+struct RecoveryReport
+{
+  std::vector<RecoveryEvent> events;
+  //! Total time spent on backoff, resynchronization and reopening.
+  std::chrono::nanoseconds time_lost{0};
+  //! True if all points of the sweep were measured.
+  bool completed = false;
+
+  //! Number of events of one kind.
+  size_t count(RecoveryAction action) const
+  {
+    return std::count_if(events.begin(), events.end(),
+			 [action](const RecoveryEvent &e) { return e.action == action; });
+  }
+
+  //! Describe the report in one line.
+  std::string describe() const
+  {
+    std::stringstream s;
+    s<<(completed ? "Sweep completed" : "Sweep abandoned")
+     <<", retries: "<<count(RecoveryAction::RETRY)
+     <<", resyncs: "<<count(RecoveryAction::RESYNC)
+     <<", reopens: "<<count(RecoveryAction::REOPEN)
+     <<", time lost: "<<std::chrono::duration<double>(time_lost).count()<<" s";
+    return s.str();
+  }
+};
+
+//! Helper that runs one sweep and recovers from transfer failures.
+/*! Register reads are repeated with exponential backoff. A failure that cannot
+  be repeated safely, such as an increment frequency command, or a read that
+  keeps failing, restarts the sweep at the first point that was not measured by
+  reprogramming the start frequency and the number of increments. If that fails
+  too, the device is reopened and reconfigured before the sweep is resumed. A
+  configuration that fails counts as a failed attempt. Every attempt runs under
+  the sweep_budget() of the points it has left; an attempt aborted by
+  AD5933::abort_operation() ends the sweep. */
+class ResilientSweep
+{
+public:
+  ResilientSweep(const SweepConfig &config, AD5933 *h, const RetryPolicy &policy,
+		 RecoveryReport &report)
+    : config(config), h(h), policy(policy), report(report) {}
+
+  std::vector<std::pair<real_t, complex_t>> run()
+  {
+    typedef std::chrono::steady_clock clock;
+    std::vector<std::pair<real_t, complex_t>> measurements;
+    const uint32_t total = config.steps + 1;
+    measurements.reserve(total);
+    const long double clk = config.clock == Clk::EXT ? config.ext_clk : h->int_clk;
+    const uint32_t start = frequency_code(config.start, clk);
+    const uint32_t inc = frequency_code(config.step, clk);
+    const real_t hz_per_code = (clk/4) / (1<<27);
+    int resyncs = 0;
+    int reopens = 0;
+    size_t failed_at = 0;
+    bool configured = false;
+    bool program = true;
+    while (measurements.size() < total)
+      {
+	uint32_t done = measurements.size();
+	int err = 0;
+	bool aborted;
+	{
+	  // Every attempt is bounded by the budget of the points it has left,
+	  // so that a stuck board fails it and the Watchdog can abort it.
+	  SweepConfig rest = config;
+	  rest.start = (start + done*inc)*hz_per_code;
+	  rest.steps = total - 1 - done;
+	  DeadlineScope deadline(h, sweep_budget(rest, h->int_clk), "sweep_frequency_resilient");
+	  if (!configured)
+	    {
+	      h->error = 0;
+	      h->configure(config);
+	      err = h->error;
+	      configured = !err;
+	    }
+	  if (!err && program)
+	    {
+	      err = start_segment(start + done*inc, inc, total - 1 - done);
+	      program = false;
+	    }
+	  if (!err)
+	    {
+	      err = acquire(measurements, start, inc, hz_per_code);
+	    }
+	  aborted = h->deadline.load() == ABORTED_DEADLINE;
+	}
+	if (!err)
+	  {
+	    continue;
+	  }
+	// The sweep failed at measurements.size(). Resume there.
+	auto t0 = clock::now();
+	program = true;
+	if (aborted)
+	  {
+	    // Stopped by abort_operation(), not by a fault: do not try again.
+	    record(RecoveryAction::ABANDON, measurements.size(), err, clock::now() - t0);
+	    return measurements;
+	  }
+	if (measurements.size() > failed_at)
+	  {
+	    // Progress since the last failure, so this is a new fault.
+	    resyncs = 0;
+	  }
+	failed_at = measurements.size();
+	if (resyncs < policy.max_resyncs && err != LIBUSB_ERROR_NO_DEVICE)
+	  {
+	    resyncs++;
+	    backoff(resyncs);
+	    record(RecoveryAction::RESYNC, measurements.size(), err, clock::now() - t0);
+	    continue;
+	  }
+	int open_err = LIBUSB_ERROR_NO_DEVICE;
+	while (reopens < policy.max_reopens)
+	  {
+	    reopens++;
+	    backoff(reopens);
+	    open_err = h->reopen();
+	    if (!open_err)
+	      {
+		break;
+	      }
+	  }
+	if (open_err)
+	  {
+	    record(RecoveryAction::ABANDON, measurements.size(), err, clock::now() - t0);
+	    return measurements;
+	  }
+	// Configured again by the next attempt.
+	configured = false;
+	resyncs = 0;
+	record(RecoveryAction::REOPEN, measurements.size(), err, clock::now() - t0);
+      }
+    report.completed = true;
+    return measurements;
+  }
+
+private:
+  //! Program the registers for the remaining points and start the sweep.
+  int start_segment(uint32_t start, uint32_t inc, uint32_t count)
+  {
+    const std::pair<uint8_t, uint8_t> writes[] = {
+      {( start & 0xff0000 ) >>16, FREQ_23_16},
+      {( start & 0x00ff00 ) >>8, FREQ_15_8},
+      {( start & 0x0000ff ), FREQ_7_0},
+      {( inc & 0xff0000 ) >>16, STEP_23_16},
+      {( inc & 0x00ff00 ) >>8, STEP_15_8},
+      {( inc & 0x0000ff ), STEP_7_0},
+      {( count & 0x00ff00 ) >>8, INC_NUM_MSB},
+      {( count & 0x0000ff ), INC_NUM_LSB}};
+    for (const auto &w: writes)
+      {
+	auto err = h->write_register(w.first, w.second);
+	if (err < 0)
+	  {
+	    return err;
+	  }
+      }
+    const uint8_t modes[] = {SB_MODE, INIT_START_FREQ, START_FREQ_SWEEP};
+    for (auto mode: modes)
+      {
+	h->ctrl_reg2 = (h->ctrl_reg2 & 0x0F) | mode;
+	auto err = h->write_register(h->ctrl_reg2, CTRL_MSB);
+	if (err < 0)
+	  {
+	    return err;
+	  }
+	usleep ( 5e5 );
+      }
+    return 0;
+  }
+
+  //! Measure points until the sweep ends or a transfer fails.
+  int acquire(std::vector<std::pair<real_t, complex_t>> &measurements,
+	      uint32_t start, uint32_t inc, real_t hz_per_code)
+  {
+    const uint32_t total = config.steps + 1;
+    for ( ;; )
+      {
+	point = measurements.size();
+	uint8_t sreg = 0;
+	long polls = 0;
+	do
+	  {
+	    auto err = retry([&] { return h->read_status(sreg); });
+	    if (err)
+	      {
+		return err;
+	      }
+	    if (++polls > policy.max_polls)
+	      {
+		return LIBUSB_ERROR_TIMEOUT;
+	      }
+	  }
+	while ( !(sreg & SREG_IMPED_VALID) );
+	int16_t real,img;
+	auto err = retry([&] { return h->read_raw(real, img); });
+	if (err)
+	  {
+	    return err;
+	  }
+	uint32_t code = start + measurements.size()*inc;
+	measurements.push_back(std::make_pair(code*hz_per_code, complex_t(real, img)));
+	if (measurements.size() >= total)
+	  {
+	    return 0;
+	  }
+	err = retry([&] { return h->read_status(sreg); });
+	if (err)
+	  {
+	    return err;
+	  }
+	if ( sreg & SREG_SWEEP_VALID )
+	  {
+	    // The device finished early, e.g. after a resync. Restart for the rest.
+	    return LIBUSB_ERROR_OVERFLOW;
+	  }
+	// Incrementing is not idempotent, so a failure here is never retried.
+	h->ctrl_reg2 = (h->ctrl_reg2 & 0x0F) | INC_FREQ;
+	err = h->write_register(h->ctrl_reg2, CTRL_MSB);
+	if (err < 0)
+	  {
+	    return err;
+	  }
+      }
+  }
+
+  //! Repeat an idempotent transaction with exponential backoff.
+  template <typename F>
+  int retry(F &&transaction)
+  {
+    auto err = transaction();
+    for (int attempt = 1; err < 0 && attempt < policy.max_retries; ++attempt)
+      {
+	if (err == LIBUSB_ERROR_NO_DEVICE)
+	  {
+	    break;
+	  }
+	auto t0 = std::chrono::steady_clock::now();
+	backoff(attempt);
+	err = transaction();
+	record(RecoveryAction::RETRY, point, err, std::chrono::steady_clock::now() - t0);
+      }
+    return err < 0 ? err : 0;
+  }
+
+  void backoff(int attempt)
+  {
+    auto delay = policy.initial_backoff * (1 << std::min(attempt - 1, 16));
+    std::this_thread::sleep_for(std::min<std::chrono::milliseconds>(delay, policy.max_backoff));
+  }
+
+  void record(RecoveryAction action, uint32_t point, int error, std::chrono::nanoseconds lost)
+  {
+    report.events.push_back(RecoveryEvent{action, point, error, lost});
+    report.time_lost += lost;
+  }
+
+  const SweepConfig &config;
+  AD5933 *h;
+  const RetryPolicy &policy;
+  RecoveryReport &report;
+  //! Index of the point being measured, for the events.
+  uint32_t point = 0;
+};
+
+//!Execute frequency sweep that survives transfer failures.
+/*!
+\param config The sweep configuration.
+\param h Handle to the device object.
+\param report Receives the recovery events and the time lost.
+\param policy Limits for retries, resynchronizations and reopening.
+\return The measured points. If recovery fails the points measured so far are
+returned and report.completed is false.
+
+Unlike sweep_frequency(), a USB error or an invalid status register does not
+abort the program or corrupt the data. The frequencies of the returned points
+are calculated from the register codes, so they are exact even when the sweep
+was resumed in the middle.
+*/
+inline std::vector<std::pair<real_t, complex_t>>
+sweep_frequency_resilient(const SweepConfig &config, AD5933 *h, RecoveryReport &report,
+			  const RetryPolicy &policy = RetryPolicy())
+{
+  report = RecoveryReport();
+  ResilientSweep sweep(config, h, policy, report);
+  return sweep.run();
+}
@@ -0,0 +1,389 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "adaptive.hpp"
+
+//! Largest effective number of settling cycles: 511 with the 4x multiplier.
+const uint32_t MAX_SETTLING = 511*4;
+
+//!Split effective settling cycles into the register count and multiplier.
+/*! The smallest multiplier that fits is used, rounding the count up. */
+inline void split_settling(uint32_t total, uint32_t &cycles, SettlingMultiplier &multiplier)
+{
+  total = std::min(total, MAX_SETTLING);
+  if (total <= 511)
+    {
+      cycles = total;
+      multiplier = SettlingMultiplier::MUL_1x;
+    }
+  else if (total <= 2*511)
+    {
+      cycles = (total + 1)/2;
+      multiplier = SettlingMultiplier::MUL_2x;
+    }
+  else
+    {
+      cycles = (total + 3)/4;
+      multiplier = SettlingMultiplier::MUL_4x;
+    }
+}
+
+//! Program effective settling cycles, register count times multiplier.
+inline void set_settling(AD5933 *h, uint32_t total)
+{
+  uint32_t cycles;
+  SettlingMultiplier multiplier;
+  split_settling(total, cycles, multiplier);
+  // Settling cycles overwrite the multiplier bits, so they go first.
+  h->set_settling_cycles(cycles);
+  h->set_settling_multiplier(multiplier);
+}
+
+//! Settling of one frequency band.
+struct SettlingBand
+{
+  long double lower;
+  long double upper;
+  //! Effective settling cycles.
+  uint32_t cycles;
+};
+
+//! Settling per frequency band for one type of load.
+struct SettlingProfile
+{
+  //! Load type the profile was tuned with.
+  std::string name;
+  //! Bands in ascending, contiguous order.
+  std::vector<SettlingBand> bands;
+
+  //! Effective settling cycles at a frequency, those of the nearest band
+  //! outside the profile, MAX_SETTLING if the profile is empty.
+  uint32_t cycles_at(long double f) const
+  {
+    if (bands.empty())
+      {
+	return MAX_SETTLING;
+      }
+    for (const auto &b: bands)
+      {
+	if (f <= b.upper)
+	  {
+	    return b.cycles;
+	  }
+      }
+    return bands.back().cycles;
+  }
+
+  //! Write the profile to a file.
+  /*! \return 0, or -1 with errno set. */
+  int save(const char *path) const
+  {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+      {
+	return -1;
+      }
+    fprintf(fp, "# load %s\nLower,Upper,Cycles\n", name.c_str());
+    for (const auto &b: bands)
+      {
+	fprintf(fp, "%Lf,%Lf,%u\n", b.lower, b.upper, b.cycles);
+      }
+    return fclose(fp) == 0 ? 0 : -1;
+  }
+
+  //! Read a profile written by save().
+  /*! \return 0, or -1 with errno set if the file can't be opened, EINVAL if
+    it is malformed. */
+  int load(const char *path)
+  {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+      {
+	return -1;
+      }
+    char buf[256];
+    std::vector<SettlingBand> read;
+    std::string read_name;
+    bool ok = fgets(buf, sizeof(buf), fp) != NULL && strncmp(buf, "# load ", 7) == 0;
+    if (ok)
+      {
+	read_name = buf + 7;
+	read_name.erase(read_name.find_last_not_of("\r\n") + 1);
+	ok = fgets(buf, sizeof(buf), fp) != NULL;
+      }
+    SettlingBand b;
+    while (ok && fgets(buf, sizeof(buf), fp) != NULL)
+      {
+	ok = sscanf(buf, "%Lf,%Lf,%u", &b.lower, &b.upper, &b.cycles) == 3 && b.cycles <= MAX_SETTLING
+	  && (read.empty() || read.back().upper <= b.lower);
+	read.push_back(b);
+      }
+    fclose(fp);
+    if (!ok || read.empty())
+      {
+	errno = EINVAL;
+	return -1;
+      }
+    name = read_name;
+    bands.swap(read);
+    return 0;
+  }
+};
+
+//! Name of the profile file of a load type.
+inline std::string profile_path(const std::string &load)
+{
+  return "settling_" + load + ".csv";
+}
+
+//! Settings of the settling tuning.
+struct SettlingTuneOptions
+{
+  //! Number of bands, spaced logarithmically.
+  uint32_t bands = 8;
+  //! Measurements averaged per settling count.
+  uint32_t repeats = 4;
+  //! Largest relative difference from the fully settled value.
+  double tolerance = 1e-3;
+  //! Settling of the reference measurement, effective cycles.
+  uint32_t max_cycles = MAX_SETTLING;
+  //! Time the excitation is given to settle before every measurement.
+  std::chrono::microseconds settle{10000};
+};
+
+//!Average of repeated measurements at a frequency, taken one sweep step after
+//!the previous frequency.
+/*!
+\param f The frequency.
+\param step The sweep step that leads to it.
+\param cycles Effective settling cycles.
+\param h Handle to the device object.
+\param options Repeats and settling wait.
+\param average Receives the average.
+\return 0, or the libusb_error code of a measurement that failed.
+
+Every measurement follows an increment command, so the excitation settles the
+way it does within a sweep.
+*/
+template <typename Real = real_t>
+int measure_stepped(Real f, Real step, uint32_t cycles, AD5933 *h, const SettlingTuneOptions &options,
+		    std::complex<Real> &average)
+{
+  set_settling(h, cycles);
+  std::complex<Real> sum = 0;
+  for (uint32_t i = 0; i < options.repeats; i++)
+    {
+      auto points = sweep_segment<Real>(f - step, 1, step, h, options.settle);
+      if (points.size() < 2)
+	{
+	  return h->error ? h->error : LIBUSB_ERROR_IO;
+	}
+      sum += points[1].second;
+    }
+  average = sum/Real(std::max<uint32_t>(options.repeats, 1));
+  return 0;
+}
+
+//!Find the settling a load needs, band by band.
+/*!
+\param lower Starting frequency of the sweep the profile is for.
+\param number_of_samples Number of increments of the sweep.
+\param step Distance between frequencies of the sweep.
+\param h Handle to the device object.
+\param name Load type the profile is recorded under.
+\param options Bands, repeats and tolerance.
+\return The profile. The settling registers are left as they were. If a
+measurement fails the profile has no bands and AD5933::error tells why,
+LIBUSB_ERROR_INVALID_PARAM if lower or step is not positive.
+
+The settling of a band is measured at its upper edge, where a load transient
+of a given duration spans the most cycles. The count is doubled from one
+until the averaged measurement is within the tolerance of the one with
+max_cycles, then narrowed down by bisection to within an eighth.
+*/
+template <typename Real = real_t>
+SettlingProfile tune_settling ( typename non_deduced<Real>::type lower, uint32_t number_of_samples,
+				typename non_deduced<Real>::type step, AD5933* h, const std::string &name,
+				const SettlingTuneOptions &options = SettlingTuneOptions() )
+{
+  SettlingProfile profile;
+  profile.name = name;
+  // The bands are spaced logarithmically from lower.
+  if (!(lower > 0) || !(step > 0))
+    {
+      log_error("tune_settling: Invalid range %Lf + %u x %Lf Hz\n", static_cast<long double>(lower),
+		number_of_samples, static_cast<long double>(step));
+      h->error = LIBUSB_ERROR_INVALID_PARAM;
+      return profile;
+    }
+  uint8_t msb = 0, lsb = 0;
+  h->error = 0;
+  h->read_register(msb, SETTLE_MSB);
+  h->read_register(lsb, SETTLE_LSB);
+
+  int err = h->error;
+  // Registers that could not be read are not written back.
+  bool restore = err == 0;
+  Real upper = lower + number_of_samples*step;
+  uint32_t n = std::max<uint32_t>(options.bands, 1);
+  for (uint32_t k = 0; k < n && err == 0; k++)
+    {
+      SettlingBand band;
+      band.lower = lower*std::pow(upper/lower, Real(k)/n);
+      band.upper = k + 1 == n ? upper : lower*std::pow(upper/lower, Real(k + 1)/n);
+      Real f = std::max<Real>(band.upper, lower + step);
+      std::complex<Real> reference;
+      err = measure_stepped<Real>(f, step, options.max_cycles, h, options, reference);
+      // Counts as settled after a failure, which ends both searches.
+      auto settled = [&](uint32_t cycles)
+	{
+	  std::complex<Real> z;
+	  err = measure_stepped<Real>(f, step, cycles, h, options, z);
+	  return err != 0 || std::abs(z - reference) <= options.tolerance*std::abs(reference);
+	};
+      uint32_t good = 1, bad = 0;
+      while (err == 0 && good < options.max_cycles && !settled(good))
+	{
+	  bad = good;
+	  good = std::min(2*good, options.max_cycles);
+	}
+      while (err == 0 && bad > 0 && good - bad > std::max<uint32_t>(1, bad/8))
+	{
+	  uint32_t mid = (good + bad)/2;
+	  if (settled(mid))
+	    {
+	      good = mid;
+	    }
+	  else
+	    {
+	      bad = mid;
+	    }
+	}
+      band.cycles = good;
+      profile.bands.push_back(band);
+    }
+  if (err)
+    {
+      profile.bands.clear();
+    }
+
+  if (restore)
+    {
+      h->write_register(msb, SETTLE_MSB);
+      h->write_register(lsb, SETTLE_LSB);
+    }
+  if (err)
+    {
+      h->error = err;
+    }
+  return profile;
+}
+
+//! Settling time of a profiled sweep.
+struct SettlingReport
+{
+  //! Sweeps programmed, one per run of points with the same settling.
+  uint32_t segments = 0;
+  //! Seconds spent settling with the profile.
+  double settling_time = 0;
+  //! Seconds the baseline settling would have taken.
+  double baseline_time = 0;
+
+  //! Seconds saved against the baseline.
+  double saved() const
+  {
+    return baseline_time - settling_time;
+  }
+};
+
+//!Execute a frequency sweep with the settling of a profile.
+/*!
+\param lower Starting frequency of the sweep.
+\param number_of_samples Number of increments.
+\param step Distance between frequencies.
+\param h Handle to the device object.
+\param profile Settling per band.
+\param baseline Effective settling cycles the time saved is compared with.
+\param report Receives the settling times, may be NULL.
+\param on_point Optional callback, invoked for every point as soon as it is measured.
+\param settle Time the excitation is given to settle before every segment.
+
+The points of the sweep are grouped into runs of equal settling, each measured
+as one segment. The frequencies are those of sweep_frequency() with the same
+arguments, give or take the rounding of the frequency codes. The settling
+registers are left as they were; if they cannot be read no point is
+measured. A segment that comes back short ends the sweep with the points
+measured so far. AD5933::error tells why in both cases.
+*/
+template <typename Real = real_t>
+std::vector<std::pair<Real, std::complex<Real>>> sweep_profiled ( typename non_deduced<Real>::type lower,
+								  uint32_t number_of_samples,
+								  typename non_deduced<Real>::type step, AD5933* h,
+								  const SettlingProfile &profile, uint32_t baseline,
+								  SettlingReport *report = NULL,
+								  const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr,
+								  std::chrono::microseconds settle = std::chrono::microseconds(10000) )
+{
+  SettlingReport r;
+  std::vector<std::pair<Real, std::complex<Real>>> result;
+  uint8_t msb = 0, lsb = 0;
+  h->error = 0;
+  h->read_register(msb, SETTLE_MSB);
+  h->read_register(lsb, SETTLE_LSB);
+  if (h->error)
+    {
+      // Registers that could not be read cannot be restored.
+      if (report)
+	{
+	  *report = r;
+	}
+      return result;
+    }
+  result.reserve(number_of_samples + 1);
+  uint32_t first = 0;
+  while (first <= number_of_samples)
+    {
+      uint32_t cycles = profile.cycles_at(lower + first*step);
+      uint32_t last = first;
+      while (last < number_of_samples && profile.cycles_at(lower + (last + 1)*step) == cycles)
+	{
+	  last++;
+	}
+      set_settling(h, cycles);
+      BasicPointCallback<Real> forward;
+      if (on_point)
+	{
+	  forward = [&](uint32_t index, Real f, const std::complex<Real> &z) { on_point(first + index, f, z); };
+	}
+      auto points = sweep_segment<Real>(lower + first*step, last - first, step, h, settle, forward);
+      for (const auto &p: points)
+	{
+	  r.settling_time += cycles/p.first;
+	  r.baseline_time += baseline/p.first;
+	}
+      result.insert(result.end(), points.begin(), points.end());
+      r.segments++;
+      if (points.size() < last - first + 1)
+	{
+	  break;
+	}
+      first = last + 1;
+    }
+  h->write_register(msb, SETTLE_MSB);
+  h->write_register(lsb, SETTLE_LSB);
+  if (report)
+    {
+      *report = r;
+    }
+  return result;
+}
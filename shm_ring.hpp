@@ -0,0 +1,391 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <complex>
+#include <string>
+
+//Shared-memory ring buffer of sweep points. One acquisition process writes,
+//any number of processes read. The layout is fixed so that readers do not need
+//this header to be compiled with the same options as the writer:
+//
+//  ShmRingHeader (64 bytes), then capacity ShmRecords (48 bytes each).
+//
+//Every record carries a sequence word. The writer makes it odd while it
+//updates the record and sets it to 2*n+2 when record n is complete. Readers
+//read the record in place and check the sequence word before and after.
+//
+//A writer always creates a new object under the name, so a reader attached to
+//a ring whose writer went away keeps the old, dead object mapped. The writer
+//marks the ring closed when it stops and ShmRingReader::stale() also notices
+//a ring recreated after a crash, the reader then attaches again.
+
+//! Magic number of the ring ("A5RB").
+const uint32_t SHM_RING_MAGIC = 0x42523541;
+//! Version of the layout.
+const uint32_t SHM_RING_VERSION = 3;
+
+//! Flag of the record written at the end of a sweep.
+const uint32_t SHM_SWEEP_END = 0x0001;
+
+//! Header at the start of the shared memory object.
+struct ShmRingHeader
+{
+  //! SHM_RING_MAGIC once the ring is initialized.
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  //! sizeof(ShmRecord) of the writer.
+  uint32_t record_size;
+  //! Number of records, a power of two.
+  uint32_t capacity;
+  //! Number of records written so far.
+  alignas(8) std::atomic<uint64_t> head;
+  //! CLOCK_REALTIME of the creation in ns, tells the rings of one name apart.
+  uint64_t epoch;
+  //! Set by the writer when it stops writing.
+  std::atomic<uint32_t> closed;
+  char padding[28];
+};
+static_assert(sizeof(ShmRingHeader) == 64, "ShmRingHeader layout");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs lock-free atomics");
+
+//! One record of the ring.
+struct ShmRecord
+{
+  //! 2*n+2 when record n is complete, odd while it is written.
+  std::atomic<uint64_t> seq;
+  //! Number of the sweep.
+  uint32_t sweep;
+  //! Index of the point in the sweep. For SHM_SWEEP_END, the number of points.
+  uint32_t index;
+  //! SHM_SWEEP_END or 0.
+  uint32_t flags;
+  uint32_t reserved;
+  //! Frequency in Hz.
+  double frequency;
+  //! Real part of the measured admittance (raw DFT value).
+  double re;
+  //! Imaginary part of the measured admittance (raw DFT value).
+  double im;
+};
+static_assert(sizeof(ShmRecord) == 48, "ShmRecord layout");
+
+//! Size of the shared memory object of a ring.
+inline size_t shm_ring_size(uint32_t capacity)
+{
+  return sizeof(ShmRingHeader) + capacity*sizeof(ShmRecord);
+}
+
+//! Writer side of the ring. Only one may exist per ring.
+class ShmRingWriter
+{
+public:
+  ShmRingWriter() = default;
+  ShmRingWriter(const ShmRingWriter&) = delete;
+  ShmRingWriter& operator=(const ShmRingWriter&) = delete;
+
+  ~ShmRingWriter()
+  {
+    close();
+  }
+
+  //! Create the shared memory object.
+  /*!
+    \param name Name of the object, starting with '/', e.g. "/ad5933".
+    \param capacity Number of records, rounded up to a power of two.
+    \return 0 on success, -1 on failure with errno set.
+
+    An object left under the name, e.g. by a writer that crashed, is removed
+    first. Readers still attached to it see stale().
+  */
+  int create(const std::string &name, uint32_t capacity = 1 << 16)
+  {
+    close();
+    uint32_t cap = 1;
+    while (cap < capacity)
+      {
+	cap <<= 1;
+      }
+    // Never reinitialize an object in place: a reader attached to it would
+    // find head behind its cursor and wait forever.
+    if (shm_unlink(name.c_str()) == -1 && errno != ENOENT)
+      {
+	return -1;
+      }
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    size = shm_ring_size(cap);
+    if (ftruncate(fd, size) == -1)
+      {
+	int saved = errno;
+	::close(fd);
+	shm_unlink(name.c_str());
+	errno = saved;
+	return -1;
+      }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+      {
+	int saved = errno;
+	shm_unlink(name.c_str());
+	errno = saved;
+	return -1;
+      }
+    this->name = name;
+    header = static_cast<ShmRingHeader*>(mem);
+    records = reinterpret_cast<ShmRecord*>(header + 1);
+    mask = cap - 1;
+    head = 0;
+    header->magic.store(0, std::memory_order_relaxed);
+    header->version = SHM_RING_VERSION;
+    header->record_size = sizeof(ShmRecord);
+    header->capacity = cap;
+    header->head.store(0, std::memory_order_relaxed);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->epoch = static_cast<uint64_t>(now.tv_sec)*1000000000u + now.tv_nsec;
+    header->closed.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < cap; i++)
+      {
+	records[i].seq.store(0, std::memory_order_relaxed);
+      }
+    // Readers check the magic number last, so it goes in last.
+    header->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+    return 0;
+  }
+
+  //! Mark the ring closed, unmap and remove the shared memory object.
+  void close()
+  {
+    if (header)
+      {
+	header->closed.store(1, std::memory_order_release);
+	munmap(header, size);
+	shm_unlink(name.c_str());
+	header = nullptr;
+      }
+  }
+
+  //! Publish one record. Never blocks.
+  void publish(uint32_t sweep, uint32_t index, uint32_t flags, double frequency, double re, double im)
+  {
+    ShmRecord &r = records[head & mask];
+    r.seq.store(2*head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    r.sweep = sweep;
+    r.index = index;
+    r.flags = flags;
+    r.reserved = 0;
+    r.frequency = frequency;
+    r.re = re;
+    r.im = im;
+    r.seq.store(2*head + 2, std::memory_order_release);
+    head++;
+    header->head.store(head, std::memory_order_release);
+  }
+
+  //! Publish a measured point.
+  template <typename T>
+  void publish_point(uint32_t sweep, uint32_t index, T frequency, const std::complex<T> &z)
+  {
+    publish(sweep, index, 0, frequency, z.real(), z.imag());
+  }
+
+  //! Publish the end of a sweep.
+  void publish_sweep_end(uint32_t sweep, uint32_t points)
+  {
+    publish(sweep, points, SHM_SWEEP_END, 0, 0, 0);
+  }
+
+  bool is_open() const
+  {
+    return header != nullptr;
+  }
+
+private:
+  std::string name;
+  ShmRingHeader *header = nullptr;
+  ShmRecord *records = nullptr;
+  size_t size = 0;
+  uint64_t mask = 0;
+  uint64_t head = 0;
+};
+
+//! Reader side of the ring. Any number may be attached.
+/*! Records are read in place, without copies or system calls:
+  \code
+  while (const ShmRecord *r = reader.peek())
+    {
+      use(*r);
+      if (!reader.consume())
+        {
+          // r was overwritten while it was used, discard what use() did.
+        }
+    }
+  \endcode
+  A reader that falls more than a ring behind skips to the oldest record
+  still available; the skipped records are counted in lost.
+
+  peek() cannot tell a quiet writer from a dead one. A reader that has seen
+  no records for a while checks stale() and attaches again if it is set. */
+class ShmRingReader
+{
+public:
+  ShmRingReader() = default;
+  ShmRingReader(const ShmRingReader&) = delete;
+  ShmRingReader& operator=(const ShmRingReader&) = delete;
+
+  ~ShmRingReader()
+  {
+    detach();
+  }
+
+  //! Attach to a ring.
+  /*!
+    \param name Name of the shared memory object.
+    \param from_start Start at the oldest record instead of the next new one.
+    \return 0 on success, -1 on failure with errno set. EPROTO means the
+    object is not a ring or has another layout.
+  */
+  int attach(const std::string &name, bool from_start = false)
+  {
+    detach();
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(ShmRingHeader)))
+      {
+	::close(fd);
+	errno = EPROTO;
+	return -1;
+      }
+    size = st.st_size;
+    device = st.st_dev;
+    inode = st.st_ino;
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+      {
+	return -1;
+      }
+    header = static_cast<const ShmRingHeader*>(mem);
+    if (header->magic.load(std::memory_order_acquire) != SHM_RING_MAGIC || header->version != SHM_RING_VERSION
+	|| header->record_size != sizeof(ShmRecord) || size < shm_ring_size(header->capacity))
+      {
+	detach();
+	errno = EPROTO;
+	return -1;
+      }
+    this->name = name;
+    records = reinterpret_cast<const ShmRecord*>(header + 1);
+    capacity = header->capacity;
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    cursor = from_start && head > capacity ? head - capacity : (from_start ? 0 : head);
+    return 0;
+  }
+
+  void detach()
+  {
+    if (header)
+      {
+	munmap(const_cast<ShmRingHeader*>(header), size);
+	header = nullptr;
+      }
+  }
+
+  //! Whether the writer closed the ring or a new ring replaced it.
+  /*! No new record will come in either case, attach() again to follow the
+    writer. This opens the object, call it when peek() has been returning
+    nullptr for a while rather than on every poll. */
+  bool stale() const
+  {
+    if (header->closed.load(std::memory_order_acquire))
+      {
+	return true;
+      }
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1)
+      {
+	// Removed, and not created again yet.
+	return true;
+      }
+    struct stat st;
+    bool replaced = fstat(fd, &st) == -1 || st.st_dev != device || st.st_ino != inode;
+    ::close(fd);
+    return replaced;
+  }
+
+  //! Creation time of the ring attached to, see ShmRingHeader::epoch.
+  uint64_t epoch() const
+  {
+    return header->epoch;
+  }
+
+  //! The next record, or nullptr if there is none yet.
+  const ShmRecord *peek()
+  {
+    for (;;)
+      {
+	uint64_t head = header->head.load(std::memory_order_acquire);
+	if (cursor >= head)
+	  {
+	    return nullptr;
+	  }
+	if (head - cursor > capacity)
+	  {
+	    lost += head - capacity - cursor;
+	    cursor = head - capacity;
+	  }
+	const ShmRecord &r = records[cursor & (capacity - 1)];
+	if (r.seq.load(std::memory_order_acquire) == 2*cursor + 2)
+	  {
+	    return &r;
+	  }
+	// Overwritten between the head load and now. Catch up and retry.
+	lost++;
+	cursor++;
+      }
+  }
+
+  //! Move past the record returned by peek().
+  /*! \return true if the record was intact while it was read, false if the
+    writer overwrote it in the meantime. */
+  bool consume()
+  {
+    const ShmRecord &r = records[cursor & (capacity - 1)];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    bool intact = r.seq.load(std::memory_order_relaxed) == 2*cursor + 2;
+    if (!intact)
+      {
+	lost++;
+      }
+    cursor++;
+    return intact;
+  }
+
+  //! Records skipped or torn because the reader was too slow.
+  uint64_t lost = 0;
+
+private:
+  std::string name;
+  dev_t device = 0;
+  ino_t inode = 0;
+  const ShmRingHeader *header = nullptr;
+  const ShmRecord *records = nullptr;
+  size_t size = 0;
+  uint64_t capacity = 0;
+  uint64_t cursor = 0;
+};
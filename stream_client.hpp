@@ -0,0 +1,142 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+#include "stream_protocol.hpp"
+
+//! Client of the live data stream published by StreamServer.
+class StreamClient
+{
+public:
+  StreamClient() = default;
+  StreamClient(const StreamClient&) = delete;
+  StreamClient& operator=(const StreamClient&) = delete;
+
+  ~StreamClient()
+  {
+    close();
+  }
+
+  //! Connect to a Unix domain socket.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int connect_unix(const std::string &path)
+  {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      {
+	errno = ENAMETOOLONG;
+	return -1;
+      }
+    strcpy(addr.sun_path, path.c_str());
+    return open(AF_UNIX, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+
+  //! Connect to a TCP port of the loopback interface.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int connect_tcp(uint16_t port)
+  {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return open(AF_INET, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+
+  //! Wait for the next frame.
+  /*! \param frame The received frame.
+    \return 0 on success, -1 if the connection was closed or the stream is
+    corrupt. */
+  int next(Frame &frame)
+  {
+    if (read_fully(&frame.header, sizeof(frame.header)) == -1)
+      {
+	return -1;
+      }
+    if (frame.header.magic != STREAM_MAGIC || frame.header.length > sizeof(PointPayload))
+      {
+	errno = EPROTO;
+	return -1;
+      }
+    if (read_fully(&frame.point, frame.header.length) == -1)
+      {
+	return -1;
+      }
+    if (received && frame.header.seq != last_seq + 1)
+      {
+	lost_frames += frame.header.seq - last_seq - 1;
+      }
+    last_seq = frame.header.seq;
+    received++;
+    return 0;
+  }
+
+  void close()
+  {
+    if (fd != -1)
+      {
+	::close(fd);
+	fd = -1;
+      }
+  }
+
+  //! Frames received.
+  uint64_t received = 0;
+  //! Frames missing between the ones received, from the sequence numbers.
+  uint64_t lost_frames = 0;
+
+private:
+  int open(int family, sockaddr *addr, socklen_t len)
+  {
+    close();
+    fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    if (connect(fd, addr, len) == -1)
+      {
+	int saved = errno;
+	close();
+	errno = saved;
+	return -1;
+      }
+    return 0;
+  }
+
+  int read_fully(void *buf, size_t n)
+  {
+    char *p = static_cast<char*>(buf);
+    while (n > 0)
+      {
+	ssize_t r = recv(fd, p, n, 0);
+	if (r == 0)
+	  {
+	    return -1;
+	  }
+	if (r == -1)
+	  {
+	    if (errno == EINTR)
+	      {
+		continue;
+	      }
+	    return -1;
+	  }
+	p += r;
+	n -= r;
+      }
+    return 0;
+  }
+
+  int fd = -1;
+  uint64_t last_seq = 0;
+};
@@ -0,0 +1,92 @@
+/*! \file */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+//Binary framing of the live data stream. Every frame is a FrameHeader followed
+//by a payload of header.length bytes. Fields are in host byte order, since the
+//stream only goes to local clients.
+
+//! Magic number at the start of every frame ("A5S1").
+const uint32_t STREAM_MAGIC = 0x31533541;
+
+//! Frame types of the live data stream.
+enum class FrameType : uint16_t
+{
+  POINT = 1,     /*!< One measured point, payload PointPayload. */
+  SWEEP_END = 2  /*!< A sweep finished, payload SweepEndPayload. */
+};
+
+//! Header of every frame.
+struct FrameHeader
+{
+  uint32_t magic;
+  //! A FrameType.
+  uint16_t type;
+  //! Length of the payload in bytes.
+  uint16_t length;
+  //! Sequence number of the frame, increasing by one for every frame sent.
+  uint64_t seq;
+};
+static_assert(sizeof(FrameHeader) == 16, "FrameHeader layout");
+
+//! Payload of a POINT frame.
+struct PointPayload
+{
+  //! Number of the sweep the point belongs to.
+  uint32_t sweep;
+  //! Index of the point in the sweep.
+  uint32_t index;
+  //! Frequency in Hz.
+  double frequency;
+  //! Real part of the measured admittance (raw DFT value).
+  double re;
+  //! Imaginary part of the measured admittance (raw DFT value).
+  double im;
+};
+static_assert(sizeof(PointPayload) == 32, "PointPayload layout");
+
+//! Payload of a SWEEP_END frame.
+struct SweepEndPayload
+{
+  //! Number of the sweep that finished.
+  uint32_t sweep;
+  //! Number of points in the sweep.
+  uint32_t points;
+};
+static_assert(sizeof(SweepEndPayload) == 8, "SweepEndPayload layout");
+
+//! Largest frame on the wire.
+const size_t STREAM_MAX_FRAME = sizeof(FrameHeader) + sizeof(PointPayload);
+
+//! A decoded frame.
+struct Frame
+{
+  FrameHeader header;
+  union
+  {
+    PointPayload point;
+    SweepEndPayload end;
+  };
+};
+
+//!Encode a frame.
+/*!
+\param buf Buffer of at least STREAM_MAX_FRAME bytes.
+\param type Frame type.
+\param seq Sequence number.
+\param payload The payload.
+\param length Size of the payload.
+\return The size of the encoded frame.
+*/
+inline size_t encode_frame(char *buf, FrameType type, uint64_t seq, const void *payload, uint16_t length)
+{
+  FrameHeader h;
+  h.magic = STREAM_MAGIC;
+  h.type = static_cast<uint16_t>(type);
+  h.length = length;
+  h.seq = seq;
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), payload, length);
+  return sizeof(h) + length;
+}
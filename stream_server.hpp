@@ -0,0 +1,350 @@
+/*! \file */
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "ad5933.hpp"
+#include "stream_protocol.hpp"
+
+//! Publishes live sweep data to local subscribers.
+/*! Subscribers connect over a Unix domain socket, a loopback TCP port, or
+  both. Every measured point and every finished sweep is sent as a frame, see
+  stream_protocol.hpp. Publishing never blocks the acquisition: frames are sent
+  without waiting, whatever the socket does not take is queued per subscriber,
+  and a subscriber whose queue grows past max_pending is disconnected. */
+class StreamServer
+{
+public:
+  //! Bytes queued for one subscriber before it is dropped.
+  size_t max_pending = 1 << 20;
+
+  StreamServer() = default;
+  StreamServer(const StreamServer&) = delete;
+  StreamServer& operator=(const StreamServer&) = delete;
+
+  ~StreamServer()
+  {
+    stop();
+  }
+
+  //! Listen on a Unix domain socket.
+  /*! \param path Filesystem path of the socket. An existing file is replaced.
+    \return 0 on success, -1 on failure with errno set. */
+  int listen_unix(const std::string &path)
+  {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      {
+	errno = ENAMETOOLONG;
+	return -1;
+      }
+    strcpy(addr.sun_path, path.c_str());
+    unlink(path.c_str());
+    unix_path = path;
+    return open_listener(AF_UNIX, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+
+  //! Listen on a TCP port of the loopback interface.
+  /*! \param port The port, 0 for any free port (see tcp_port()).
+    \return 0 on success, -1 on failure with errno set. */
+  int listen_tcp(uint16_t port)
+  {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return open_listener(AF_INET, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+
+  //! The TCP port actually bound, 0 if not listening on TCP.
+  uint16_t tcp_port() const
+  {
+    return bound_port;
+  }
+
+  //! Start accepting subscribers.
+  /*! \return 0 on success, -1 on failure with errno set. */
+  int start()
+  {
+    if (pipe(wake_pipe) == -1)
+      {
+	return -1;
+      }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    running.store(true);
+    worker = std::thread(&StreamServer::run, this);
+    return 0;
+  }
+
+  //! Disconnect everybody and stop listening.
+  void stop()
+  {
+    if (running.exchange(false))
+      {
+	wake();
+	worker.join();
+	::close(wake_pipe[0]);
+	::close(wake_pipe[1]);
+      }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &s: subscribers)
+      {
+	::close(s.fd);
+      }
+    subscribers.clear();
+    for (int fd: listeners)
+      {
+	::close(fd);
+      }
+    listeners.clear();
+    if (!unix_path.empty())
+      {
+	unlink(unix_path.c_str());
+	unix_path.clear();
+      }
+  }
+
+  //! Publish one point.
+  void publish_point(uint32_t sweep, uint32_t index, real_t frequency, const complex_t &z)
+  {
+    PointPayload p;
+    p.sweep = sweep;
+    p.index = index;
+    p.frequency = frequency;
+    p.re = z.real();
+    p.im = z.imag();
+    publish(FrameType::POINT, &p, sizeof(p));
+  }
+
+  //! Publish the end of a sweep.
+  void publish_sweep_end(uint32_t sweep, uint32_t points)
+  {
+    SweepEndPayload p;
+    p.sweep = sweep;
+    p.points = points;
+    publish(FrameType::SWEEP_END, &p, sizeof(p));
+  }
+
+  //! Callback for sweep_frequency() that publishes every point.
+  PointCallback publisher(uint32_t sweep)
+  {
+    return [this, sweep](uint32_t index, real_t f, const complex_t &z) {
+      publish_point(sweep, index, f, z);
+    };
+  }
+
+  //! Number of connected subscribers.
+  size_t subscriber_count()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return subscribers.size();
+  }
+
+  //! Number of subscribers dropped for being too slow.
+  uint64_t dropped() const
+  {
+    return dropped_count.load();
+  }
+
+private:
+  struct Subscriber
+  {
+    int fd;
+    //! Bytes not yet accepted by the socket.
+    std::string pending;
+  };
+
+  int open_listener(int family, sockaddr *addr, socklen_t len)
+  {
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      {
+	return -1;
+      }
+    int one = 1;
+    if (family == AF_INET)
+      {
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      }
+    if (bind(fd, addr, len) == -1 || listen(fd, 16) == -1)
+      {
+	int saved = errno;
+	::close(fd);
+	errno = saved;
+	return -1;
+      }
+    if (family == AF_INET)
+      {
+	sockaddr_in bound;
+	socklen_t blen = sizeof(bound);
+	getsockname(fd, reinterpret_cast<sockaddr*>(&bound), &blen);
+	bound_port = ntohs(bound.sin_port);
+      }
+    std::lock_guard<std::mutex> lock(mutex);
+    listeners.push_back(fd);
+    return 0;
+  }
+
+  void publish(FrameType type, const void *payload, uint16_t length)
+  {
+    char buf[STREAM_MAX_FRAME];
+    std::lock_guard<std::mutex> lock(mutex);
+    if (subscribers.empty())
+      {
+	return;
+      }
+    size_t n = encode_frame(buf, type, seq++, payload, length);
+    bool backlog = false;
+    for (size_t i = 0; i < subscribers.size(); )
+      {
+	auto &s = subscribers[i];
+	if (s.pending.empty())
+	  {
+	    ssize_t sent = send(s.fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+	      {
+		drop(i);
+		continue;
+	      }
+	    if (sent < static_cast<ssize_t>(n))
+	      {
+		s.pending.append(buf + std::max<ssize_t>(sent, 0), buf + n);
+	      }
+	  }
+	else
+	  {
+	    s.pending.append(buf, n);
+	  }
+	if (s.pending.size() > max_pending)
+	  {
+	    dropped_count++;
+	    drop(i);
+	    continue;
+	  }
+	backlog |= !s.pending.empty();
+	i++;
+      }
+    if (backlog)
+      {
+	wake();
+      }
+  }
+
+  //! Close a subscriber. Call with the mutex held.
+  void drop(size_t i)
+  {
+    ::close(subscribers[i].fd);
+    subscribers[i] = std::move(subscribers.back());
+    subscribers.pop_back();
+  }
+
+  void wake()
+  {
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) == -1)
+      {
+	// The pipe is full, so the server is awake anyway.
+      }
+  }
+
+  //! Accept subscribers, flush queued frames and detect hangups.
+  void run()
+  {
+    std::vector<pollfd> fds;
+    while (running.load())
+      {
+	fds.clear();
+	fds.push_back(pollfd{wake_pipe[0], POLLIN, 0});
+	{
+	  std::lock_guard<std::mutex> lock(mutex);
+	  for (int fd: listeners)
+	    {
+	      fds.push_back(pollfd{fd, POLLIN, 0});
+	    }
+	  for (const auto &s: subscribers)
+	    {
+	      fds.push_back(pollfd{s.fd, static_cast<short>(POLLIN | (s.pending.empty() ? 0 : POLLOUT)), 0});
+	    }
+	}
+	if (poll(fds.data(), fds.size(), 1000) <= 0)
+	  {
+	    continue;
+	  }
+	char drain[64];
+	while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+	  ;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const auto &p: fds)
+	  {
+	    if (!(p.revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) || p.fd == wake_pipe[0])
+	      {
+		continue;
+	      }
+	    if (std::find(listeners.begin(), listeners.end(), p.fd) != listeners.end())
+	      {
+		int fd = accept4(p.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd != -1)
+		  {
+		    subscribers.push_back(Subscriber{fd, std::string()});
+		  }
+		continue;
+	      }
+	    auto it = std::find_if(subscribers.begin(), subscribers.end(),
+				   [&](const Subscriber &s) { return s.fd == p.fd; });
+	    if (it == subscribers.end())
+	      {
+		continue;
+	      }
+	    size_t i = it - subscribers.begin();
+	    if (p.revents & (POLLIN | POLLHUP | POLLERR))
+	      {
+		// Subscribers never send anything, so this is a hangup.
+		ssize_t r = recv(p.fd, drain, sizeof(drain), MSG_DONTWAIT);
+		if (r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+		  {
+		    drop(i);
+		    continue;
+		  }
+	      }
+	    if ((p.revents & POLLOUT) && !it->pending.empty())
+	      {
+		ssize_t sent = send(p.fd, it->pending.data(), it->pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent > 0)
+		  {
+		    it->pending.erase(0, sent);
+		  }
+		else if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+		  {
+		    drop(i);
+		  }
+	      }
+	  }
+      }
+  }
+
+  std::mutex mutex;
+  std::vector<int> listeners;
+  std::vector<Subscriber> subscribers;
+  std::string unix_path;
+  uint16_t bound_port = 0;
+  uint64_t seq = 0;
+  std::atomic<uint64_t> dropped_count{0};
+  std::atomic<bool> running{false};
+  int wake_pipe[2] = {-1, -1};
+  std::thread worker;
+};
@@ -0,0 +1,198 @@
+/*! \file */
+#pragma once
+#include <chrono>
+#include <thread>
+
+#include "ad5933.hpp"
+
+//! Waits between the mode commands of SweepPlan::apply().
+struct SweepPlanOptions
+{
+  //! After the standby command, when one is needed.
+  std::chrono::microseconds standby_delay{500000};
+  //! After the initialize with start frequency command, for the load to
+  //! settle at the start frequency.
+  std::chrono::microseconds init_delay{500000};
+  //! Time the whole of run() may take, 0 for sweep_budget() of the plan.
+  //! The measurements are bounded by sweep_budget() in any case.
+  std::chrono::nanoseconds budget{0};
+};
+
+//! A sweep configuration compiled to register contents.
+/*! The frequency codes, the settling and control bits and the frequencies of
+  the points are worked out once. apply() compares the bytes with
+  AD5933::shadow and writes only those the device does not have, so a plan
+  that is applied again, or one that shares registers with the last, costs
+  little more than the mode commands. Those are reduced as well: standby is
+  only entered when the device comes from another mode or the excitation
+  changes, and there is no wait after the start command, since the
+  measurement loop polls the status anyway. */
+class SweepPlan
+{
+public:
+  //! Compile a configuration.
+  /*!
+    \param config The sweep configuration.
+    \param h The device, for its internal clock frequency.
+  */
+  SweepPlan(const SweepConfig &config, const AD5933 *h)
+    : planned(config)
+  {
+    clock = config.clock == Clk::EXT ? config.ext_clk : h->int_clk;
+    start_code = frequency_code(config.start, clock);
+    inc_code = frequency_code(config.step, clock);
+    analog = config.voltage == Voltage::OUTPUT_1Vpp ? OUTPUT_1Vpp :
+      config.voltage == Voltage::OUTPUT_200mVpp ? OUTPUT_200mVpp :
+      config.voltage == Voltage::OUTPUT_400mVpp ? OUTPUT_400mVpp : OUTPUT_2Vpp;
+    analog |= config.gain == Gain::PGA1x ? PGA_GAIN1x : PGA_GAIN5x;
+    uint8_t multiplier = config.multiplier == SettlingMultiplier::MUL_4x ? SETTLING_MUL_4x :
+      config.multiplier == SettlingMultiplier::MUL_2x ? SETTLING_MUL_2x : 0;
+    const uint8_t values[] = {
+      uint8_t(start_code >> 16), uint8_t(start_code >> 8), uint8_t(start_code),
+      uint8_t(inc_code >> 16), uint8_t(inc_code >> 8), uint8_t(inc_code),
+      uint8_t(config.steps >> 8), uint8_t(config.steps),
+      uint8_t(((config.settling_cycles >> 8) & 0x01) | multiplier), uint8_t(config.settling_cycles)};
+    for (uint8_t i = 0; i < sizeof(values); i++)
+      {
+	registers[i] = std::make_pair(uint8_t(FREQ_23_16 + i), values[i]);
+      }
+    const real_t hz_per_code = (clock/4) / (1<<27);
+    points.reserve(config.steps + 1);
+    for (uint32_t i = 0; i <= config.steps; i++)
+      {
+	points.push_back((start_code + static_cast<uint64_t>(i)*inc_code)*hz_per_code);
+      }
+  }
+
+  const SweepConfig& config() const
+  {
+    return planned;
+  }
+
+  //! Start frequency code.
+  uint32_t start() const
+  {
+    return start_code;
+  }
+
+  //! Frequency increment code.
+  uint32_t inc() const
+  {
+    return inc_code;
+  }
+
+  //! Clock source frequency.
+  long double clk() const
+  {
+    return clock;
+  }
+
+  //! Frequencies of the points, as acquire_sweep() reports them.
+  const std::vector<real_t>& frequencies() const
+  {
+    return points;
+  }
+
+  //! Program the device and start the sweep.
+  /*!
+    \param h Handle to the device object.
+    \param options Waits between the mode commands.
+    \return The number of register writes, or a libusb_error code. The
+    first measurement is pending when this succeeds, as after prepare_sweep().
+  */
+  int apply(AD5933 *h, const SweepPlanOptions &options = SweepPlanOptions()) const
+  {
+    int writes = 0;
+    if (planned.clock == Clk::EXT)
+      {
+	h->ext_clk = planned.ext_clk;
+      }
+    h->clk = clock;
+    h->ctrl_reg1 = planned.clock == Clk::EXT ? (h->ctrl_reg1 | CLK_EXT) : (h->ctrl_reg1 & ~CLK_EXT);
+    int err = write_changed(h, h->ctrl_reg1, CTRL_LSB, writes);
+    for (const auto &r: registers)
+      {
+	if (err < 0)
+	  {
+	    return err;
+	  }
+	err = write_changed(h, r.second, r.first, writes);
+      }
+    if (err < 0)
+      {
+	return err;
+      }
+
+    const int16_t ctrl = h->shadow[0];
+    const uint8_t mode = ctrl & 0xF0;
+    const bool sweeping = ctrl >= 0 && (mode == SB_MODE || mode == INIT_START_FREQ || mode == START_FREQ_SWEEP
+					|| mode == INC_FREQ || mode == REPEAT_FREQ);
+    h->ctrl_reg2 = (h->ctrl_reg2 & ~(VOLTAGE_MASK | PGA_MASK)) | analog;
+    if (!sweeping || (ctrl & (VOLTAGE_MASK | PGA_MASK)) != analog)
+      {
+	if ((err = h->set_mode(SB_MODE)) < 0)
+	  {
+	    return err;
+	  }
+	writes++;
+	AD5933_TRACE("sleep");
+	std::this_thread::sleep_for(options.standby_delay);
+      }
+    if ((err = h->set_mode(INIT_START_FREQ)) < 0)
+      {
+	return err;
+      }
+    {
+      AD5933_TRACE("sleep");
+      std::this_thread::sleep_for(options.init_delay);
+    }
+    if ((err = h->set_mode(START_FREQ_SWEEP)) < 0)
+      {
+	return err;
+      }
+    return writes + 2;
+  }
+
+  //! Apply the plan and measure the sweep.
+  /*!
+    \param h Handle to the device object.
+    \param on_point Optional callback, invoked for every point as soon as it is measured.
+    \param options Waits between the mode commands.
+    \return The points of sweep_frequency(); none if programming failed,
+    AD5933::error tells. Bounded by options.budget like acquire_sweep().
+  */
+  template <typename Real = real_t>
+  std::vector<std::pair<Real, std::complex<Real>>>
+  run(AD5933 *h, const typename non_deduced<BasicPointCallback<Real>>::type &on_point = nullptr,
+      const SweepPlanOptions &options = SweepPlanOptions()) const
+  {
+    DeadlineScope deadline(h, options.budget.count() ? options.budget : sweep_budget(planned, h->int_clk),
+			   "SweepPlan::run");
+    if (apply(h, options) < 0)
+      {
+	return {};
+      }
+    return acquire_sweep<Real>(start_code, inc_code, planned.steps, h, on_point);
+  }
+
+private:
+  static int write_changed(AD5933 *h, uint8_t value, uint8_t reg, int &writes)
+  {
+    if (h->shadow[reg - CTRL_MSB] == value)
+      {
+	return 0;
+      }
+    writes++;
+    return h->write_register(value, reg);
+  }
+
+  SweepConfig planned;
+  long double clock;
+  uint32_t start_code;
+  uint32_t inc_code;
+  //! Voltage and PGA bits of CTRL_MSB.
+  uint8_t analog;
+  //! Address and contents of FREQ_23_16 to SETTLE_LSB.
+  std::pair<uint8_t, uint8_t> registers[SETTLE_LSB - FREQ_23_16 + 1];
+  std::vector<real_t> points;
+};
@@ -0,0 +1,172 @@
+/*! \file */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include "ad5933.hpp"
+#include "lockfree.hpp"
+
+//! One sample of a single-frequency time series.
+struct TimedSample
+{
+  //! steady_clock time at which the sample was found valid, in nanoseconds.
+  int64_t t;
+  //! Contents of the Real data register.
+  int16_t re;
+  //! Contents of the Imaginary data register.
+  int16_t im;
+};
+
+//! Timing of a time-series run.
+struct TimeSeriesStats
+{
+  uint64_t samples = 0;
+  //! Samples lost because the buffer was full.
+  uint64_t dropped = 0;
+  //! Seconds from the first to the last sample.
+  double elapsed = 0;
+  //! Mean time between samples in seconds.
+  double mean_interval = 0;
+  //! Standard deviation of the time between samples in seconds.
+  double jitter = 0;
+  //! Longest time between samples in seconds.
+  double max_interval = 0;
+  //! Status polls per sample.
+  double polls = 0;
+
+  //! Achieved samples per second.
+  double rate() const
+  {
+    return mean_interval > 0 ? 1/mean_interval : 0;
+  }
+};
+
+//! Settings of a time-series run.
+struct TimeSeriesOptions
+{
+  //! Fraction of the expected conversion time slept before the status is
+  //! polled. Polling earlier only adds USB traffic.
+  double poll_delay = 0.8;
+  //! Time the excitation is given to settle before the first sample.
+  std::chrono::microseconds init_settle{500000};
+};
+
+//! Samples the impedance at one frequency as fast as the chip allows.
+/*! The frequency is programmed once. Every sample then costs the repeat
+  frequency command, the status polls and the four data register reads.
+  Register writes are not verified during the run. Samples go to a lock-free
+  ring that another thread drains with try_pop(); the acquisition never
+  waits for it and counts what does not fit as dropped.
+
+  The frequency is config.start; config.steps and config.step are not used. */
+class TimeSeries
+{
+public:
+  //! The sample buffer.
+  SPSCRing<TimedSample> buffer;
+
+  TimeSeries(const SweepConfig &config, AD5933 *h, size_t capacity = 1 << 16,
+	     const TimeSeriesOptions &options = TimeSeriesOptions())
+    : buffer(capacity), config(config), h(h), options(options)
+  {
+  }
+
+  //! Expected time of one conversion in seconds.
+  /*! The settling cycles at the excitation frequency, followed by the 1024
+    point DFT sampled at a sixteenth of the clock. */
+  double conversion_time() const
+  {
+    int mul = config.multiplier == SettlingMultiplier::MUL_4x ? 4 :
+      config.multiplier == SettlingMultiplier::MUL_2x ? 2 : 1;
+    long double clk = config.clock == Clk::EXT ? config.ext_clk : h->int_clk;
+    return config.settling_cycles*mul/static_cast<double>(config.start) + 1024*16/static_cast<double>(clk);
+  }
+
+  //! Acquire samples.
+  /*!
+    \param samples Number of samples, 0 to run until stop is set.
+    \param stop Checked between samples.
+    \return 0 or a libusb_error code.
+  */
+  int run(uint64_t samples, const std::atomic<bool> *stop = nullptr)
+  {
+    stats = TimeSeriesStats();
+    h->configure(config);
+    uint32_t code = frequency_code(config.start, h->clk);
+    h->set_starting_frequency(code);
+    h->set_frequency_step(0);
+    h->set_step_number(0);
+    h->set_standby();
+    h->initilize_frequency();
+    std::this_thread::sleep_for(options.init_settle);
+
+    bool verify = h->verify_writes;
+    h->verify_writes = false;
+    auto delay = std::chrono::duration<double>(conversion_time()*options.poll_delay);
+    int err = h->set_mode(START_FREQ_SWEEP);
+    uint64_t polls = 0;
+    int64_t last = 0;
+    double mean = 0, m2 = 0;
+    const auto budget = sweep_budget(config.start, 0, h->clk, settling_periods(h));
+    while (err >= 0 && (samples == 0 || stats.samples < samples) && !(stop && stop->load()))
+      {
+	std::this_thread::sleep_for(delay);
+	DeadlineScope deadline(h, budget, "timeseries");
+	uint8_t sreg = 0;
+	do
+	  {
+	    err = h->read_status(sreg);
+	    polls++;
+	  }
+	while (err >= 0 && !(sreg & SREG_IMPED_VALID));
+	if (err < 0)
+	  {
+	    break;
+	  }
+	TimedSample s;
+	s.t = std::chrono::duration_cast<std::chrono::nanoseconds>
+	  (std::chrono::steady_clock::now().time_since_epoch()).count();
+	if ((err = h->read_raw(s.re, s.im)) < 0)
+	  {
+	    break;
+	  }
+	err = h->set_mode(REPEAT_FREQ);
+	if (!buffer.try_push(s))
+	  {
+	    stats.dropped++;
+	  }
+	if (stats.samples > 0)
+	  {
+	    double dt = (s.t - last)*1e-9;
+	    uint64_t n = stats.samples;
+	    double d = dt - mean;
+	    mean += d/n;
+	    m2 += d*(dt - mean);
+	    stats.max_interval = std::max(stats.max_interval, dt);
+	    stats.elapsed += dt;
+	  }
+	last = s.t;
+	stats.samples++;
+      }
+    h->verify_writes = verify;
+    h->set_standby();
+    stats.mean_interval = mean;
+    stats.jitter = stats.samples > 2 ? std::sqrt(m2/(stats.samples - 2)) : 0;
+    stats.polls = stats.samples ? static_cast<double>(polls)/stats.samples : 0;
+    return err < 0 ? err : 0;
+  }
+
+  //! Timing of the last run.
+  const TimeSeriesStats& statistics() const
+  {
+    return stats;
+  }
+
+private:
+  SweepConfig config;
+  AD5933 *h;
+  TimeSeriesOptions options;
+  TimeSeriesStats stats;
+};
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <chrono>
+#include <map>
+
+#include "../daemon_client.hpp"
+
+// Command line client of ad5933d. Lists the boards, queues sweeps and
+// calibrations, or prints the jobs of other clients as they finish.
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-S socket_path] list\n"
+	  "       %s [-S socket_path] [-b board] [-s start] [-i step] [-c steps] [-n sweeps] [-p] [-o path] sweep\n"
+	  "       %s [-S socket_path] [-b board] [-s start] [-i step] [-c steps] -r rcal calibrate\n"
+	  "       %s [-S socket_path] [-b board] [-p] watch\n"
+	  "-p prints every point, -o writes every sweep like write_to_file() to path, where\n"
+	  "{sweep} is replaced by the job number.\n", name, name, name, name);
+}
+
+static void print_end(const JobEnd &e)
+{
+  printf("Job %lu on board %d: %u points, %s, waited %.3f s, ran %.3f s\n", static_cast<unsigned long>(e.job),
+	 e.board, e.points, e.error ? libusb_strerror(libusb_error(e.error)) : "ok", e.wait, e.duration);
+}
+
+int main ( int argc, char **argv )
+{
+  const char *path = "/tmp/ad5933d.sock";
+  const char *output = NULL;
+  int32_t board = 0;
+  SweepConfig config;
+  config.start = 30000;
+  config.step = 1000;
+  config.steps = 50;
+  real_t rcal = 0;
+  int sweeps = 1;
+  bool points = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:b:s:i:c:n:r:po:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'S':
+	  path = optarg;
+	  break;
+	case 'b':
+	  board = atoi(optarg);
+	  break;
+	case 's':
+	  config.start = atof(optarg);
+	  break;
+	case 'i':
+	  config.step = atof(optarg);
+	  break;
+	case 'c':
+	  config.steps = atoi(optarg);
+	  break;
+	case 'n':
+	  sweeps = atoi(optarg);
+	  break;
+	case 'r':
+	  rcal = atof(optarg);
+	  break;
+	case 'p':
+	  points = true;
+	  break;
+	case 'o':
+	  output = optarg;
+	  break;
+	default:
+	  usage(argv[0]);
+	  return 1;
+	}
+    }
+  if (optind != argc - 1)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  const std::string command = argv[optind];
+
+  auto t0 = std::chrono::steady_clock::now();
+  DaemonClient client;
+  if (client.connect_unix(path))
+    {
+      perror(path);
+      return 1;
+    }
+  uint32_t flags = points || output ? RPC_STREAM_POINTS : 0;
+  int err;
+  if (command == "list")
+    {
+      err = client.list(0);
+    }
+  else if (command == "sweep")
+    {
+      err = 0;
+      for (int i = 0; i < sweeps && !err; i++)
+	{
+	  err = client.sweep(i, sweep_request(board, config, flags));
+	}
+    }
+  else if (command == "calibrate")
+    {
+      if (rcal <= 0)
+	{
+	  usage(argv[0]);
+	  return 1;
+	}
+      sweeps = 1;
+      err = client.calibrate(0, sweep_request(board, config, 0, rcal));
+    }
+  else if (command == "watch")
+    {
+      err = client.subscribe(0, board, points ? RPC_STREAM_POINTS : 0);
+    }
+  else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  if (err)
+    {
+      perror(path);
+      return 1;
+    }
+
+  CsvWriterOptions options;
+  if (output)
+    {
+      options.path_template = output;
+    }
+  CsvWriter writer(options);
+  // Points of the sweeps in flight, by job.
+  struct Sweep
+  {
+    std::vector<std::pair<real_t, real_t>> mag, phase;
+    std::vector<std::pair<real_t, complex_t>> adm;
+  };
+  std::map<uint64_t, Sweep> open;
+  int pending = sweeps;
+  int failed = 0;
+  RpcMessage m;
+  while (client.next(m) == 0)
+    {
+      switch (static_cast<RpcType>(m.header.type))
+	{
+	case RpcType::BOARD:
+	  printf("Board %d at %s: %s%s, %u job(s) waiting, attached %u time(s)\n", m.board.number, m.board.location,
+		 m.board.flags & BOARD_ATTACHED ? "attached" : "detached",
+		 m.board.flags & BOARD_CALIBRATED ? ", calibrated" : "", m.board.queued, m.board.attachments);
+	  break;
+	case RpcType::DONE:
+	  printf("Answered in %.1f ms\n",
+		 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	  return 0;
+	case RpcType::ACCEPTED:
+	  if (m.job.job)
+	    {
+	      printf("Job %lu queued after %.1f ms\n", static_cast<unsigned long>(m.job.job),
+		     std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	    }
+	  break;
+	case RpcType::ERROR:
+	  fprintf(stderr, "Request %lu: %s\n", static_cast<unsigned long>(m.header.tag), strerror(m.error.error));
+	  failed++;
+	  if (--pending == 0 || command == "watch")
+	    {
+	      return 1;
+	    }
+	  break;
+	case RpcType::POINT:
+	  {
+	    const ResultPoint &p = m.point;
+	    if (points)
+	      {
+		printf("%lu %u %.1f Hz %.0f %+.0fj %.2f Ohm %.2f deg\n", static_cast<unsigned long>(p.job), p.index,
+		       p.frequency, p.re, p.im, p.magnitude, p.phase);
+	      }
+	    if (output)
+	      {
+		auto &s = open[p.job];
+		s.mag.push_back(std::make_pair(p.frequency, p.magnitude));
+		s.phase.push_back(std::make_pair(p.frequency, p.phase));
+		s.adm.push_back(std::make_pair(p.frequency, complex_t(p.re, p.im)));
+	      }
+	    break;
+	  }
+	case RpcType::JOB_END:
+	  print_end(m.end);
+	  if (output)
+	    {
+	      auto &s = open[m.end.job];
+	      if (writer.write(s.mag, s.phase, s.adm, m.end.job) < 0)
+		{
+		  perror(writer.last_path().c_str());
+		}
+	      open.erase(m.end.job);
+	    }
+	  failed += m.end.error != 0;
+	  if (command != "watch" && --pending == 0)
+	    {
+	      return failed ? 1 : 0;
+	    }
+	  break;
+	default:
+	  break;
+	}
+    }
+  fprintf(stderr, "Connection closed\n");
+  return 1;
+}
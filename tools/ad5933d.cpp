@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <atomic>
+
+#include "../daemon.hpp"
+
+// Keeps every board that is plugged in open, configured and calibrated, and
+// runs the sweeps that clients such as ad5933ctl submit over a Unix domain
+// socket, until SIGINT or SIGTERM.
+
+static std::atomic<bool> stop(false);
+
+int main ( int argc, char **argv )
+{
+  const char *path = "/tmp/ad5933d.sock";
+  HotplugManager manager;
+  AcquisitionDaemon daemon(manager);
+  int opt;
+  while ((opt = getopt(argc, argv, "s:f:q:")) != -1)
+    {
+      switch (opt)
+	{
+	case 's':
+	  path = optarg;
+	  break;
+	case 'f':
+	  manager.firmware = optarg;
+	  break;
+	case 'q':
+	  daemon.max_queued = atoi(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-s socket_path] [-f firmware.hex] [-q jobs_per_client]\n", argv[0]);
+	  return 1;
+	}
+    }
+
+  if (daemon.listen_unix(path) || daemon.start())
+    {
+      perror(path);
+      return 1;
+    }
+  int err = manager.start();
+  if (err)
+    {
+      fprintf(stderr, "%s\n", libusb_strerror(libusb_error(err)));
+      return 1;
+    }
+  signal(SIGINT, [](int) { stop.store(true); });
+  signal(SIGTERM, [](int) { stop.store(true); });
+  printf("Listening on %s\n", path);
+  while (!stop.load())
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  manager.stop();
+  daemon.stop();
+  printf("%lu jobs, %lu clients dropped, %lu operations overdue\n", static_cast<unsigned long>(daemon.jobs_done()),
+	 static_cast<unsigned long>(daemon.dropped()), static_cast<unsigned long>(daemon.watchdog.overdue()));
+  return 0;
+}
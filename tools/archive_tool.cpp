@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include <chrono>
+
+#include "../archive.hpp"
+
+// Records raw sweeps into a compressed archive, extracts them as .csv, or
+// measures the compression ratio and the encode and decode throughput on an
+// existing archive.
+
+static int64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static int record(const char *path, const SweepConfig &config, int sweeps, bool append)
+{
+  ArchiveWriter writer;
+  if (writer.open(path, append) < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  AD5933 analyzer;
+  analyzer.error = 0;
+  analyzer.configure(config);
+  if (analyzer.error)
+    {
+      fprintf(stderr, "Configuring the board failed: %s\n", libusb_strerror(libusb_error(analyzer.error)));
+      return 1;
+    }
+  int skipped = 0;
+  for (int k = 0; k < sweeps; k++)
+    {
+      analyzer.error = 0;
+      RawSweep sweep = sweep_frequency_raw(config.start, config.steps, config.step, &analyzer);
+      if (analyzer.error || sweep.points.size() != config.steps + 1)
+	{
+	  // Not archived: a short sweep would look like a complete one.
+	  fprintf(stderr, "Sweep %d failed after %zu points: %s\n", k, sweep.points.size(),
+		  libusb_strerror(libusb_error(analyzer.error ? analyzer.error : LIBUSB_ERROR_IO)));
+	  skipped++;
+	  continue;
+	}
+      if (writer.append(sweep, now_ns()) < 0)
+	{
+	  perror(path);
+	  return 1;
+	}
+    }
+  uint64_t size = writer.size();
+  if (writer.close() < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  printf("%s: %lu bytes, %d sweep(s) skipped\n", path, static_cast<unsigned long>(size), skipped);
+  return skipped ? 1 : 0;
+}
+
+static void print_sweep(size_t n, int64_t time, const RawSweep &sweep)
+{
+  for (const auto &p: sweep.points)
+    {
+      printf("%zu,%lld,%Lf,%d,%d\n", n, static_cast<long long>(time), sweep.frequency(p.index), p.re, p.im);
+    }
+}
+
+static int extract(const char *path, long index)
+{
+  ArchiveReader reader;
+  if (reader.open(path) < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  RawSweep sweep;
+  int64_t time;
+  printf("Sweep,Time,Frequency,Real,Imaginary\n");
+  if (index >= 0)
+    {
+      if (reader.read(index, sweep, &time) < 0)
+	{
+	  perror(path);
+	  return 1;
+	}
+      print_sweep(index, time, sweep);
+      return 0;
+    }
+  int err;
+  size_t n = 0;
+  while ((err = reader.next(sweep, &time)) > 0)
+    {
+      print_sweep(n++, time, sweep);
+    }
+  if (err < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  return 0;
+}
+
+static int benchmark(const char *path)
+{
+  ArchiveReader reader;
+  if (reader.open(path) < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  std::vector<RawSweep> sweeps;
+  std::vector<int64_t> times;
+  RawSweep sweep;
+  int64_t time;
+  int err;
+  uint64_t points = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  while ((err = reader.next(sweep, &time)) > 0)
+    {
+      points += sweep.points.size();
+      sweeps.push_back(sweep);
+      times.push_back(time);
+    }
+  double decode = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  if (err < 0 || sweeps.empty())
+    {
+      fprintf(stderr, "%s: %s\n", path, err < 0 ? strerror(errno) : "no sweeps");
+      return 1;
+    }
+
+  // Random access, one sweep in the middle.
+  t0 = std::chrono::steady_clock::now();
+  if (reader.read(sweeps.size()/2, sweep) < 0)
+    {
+      perror(path);
+      return 1;
+    }
+  double seek = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  std::string copy = std::string(path) + ".bench";
+  ArchiveWriter writer;
+  t0 = std::chrono::steady_clock::now();
+  if (writer.open(copy.c_str()) < 0)
+    {
+      perror(copy.c_str());
+      return 1;
+    }
+  for (size_t i = 0; i < sweeps.size(); i++)
+    {
+      if (writer.append(sweeps[i], times[i]) < 0)
+	{
+	  perror(copy.c_str());
+	  return 1;
+	}
+    }
+  uint64_t size = writer.size();
+  writer.close();
+  double encode = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  unlink(copy.c_str());
+
+  // What write_to_file() writes for the same points. The gain factor is a
+  // typical one, it only sets the number of digits of the impedance.
+  uint64_t csv = 0;
+  char line[256];
+  for (const auto &s: sweeps)
+    {
+      for (const auto &p: s.points)
+	{
+	  long double mag = std::abs(std::complex<long double>(p.re, p.im));
+	  csv += snprintf(line, sizeof(line), "%Lf,%Lf,%Lf,%Lf,%Lf,%Lf\n", s.frequency(p.index),
+			  mag > 0 ? 1/(mag*1e-9L) : 0, std::arg(std::complex<long double>(p.re, p.im)),
+			  (long double)p.re, (long double)p.im, mag);
+	}
+    }
+  uint64_t raw = points*sizeof(RawPoint);
+  printf("%zu sweeps, %lu points, %lu bytes, %.2f bytes/point\n", sweeps.size(),
+	 static_cast<unsigned long>(points), static_cast<unsigned long>(size), static_cast<double>(size)/points);
+  printf("ratio %.1f against RawPoint (%lu bytes), %.1f against write_to_file() .csv (%lu bytes)\n",
+	 static_cast<double>(raw)/size, static_cast<unsigned long>(raw),
+	 static_cast<double>(csv)/size, static_cast<unsigned long>(csv));
+  printf("encode %.1f Mpoints/s, %.1f MB/s of RawPoint\n", points/encode*1e-6, raw/encode*1e-6);
+  printf("decode %.1f Mpoints/s, %.1f MB/s of RawPoint\n", points/decode*1e-6, raw/decode*1e-6);
+  printf("random access to sweep %zu: %.3f ms\n", sweeps.size()/2, seek*1e3);
+  return 0;
+}
+
+int main ( int argc, char **argv )
+{
+  SweepConfig config;
+  int sweeps = 0;
+  long index = -1;
+  bool append = false, extracting = false, bench = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:as:i:c:xn:b")) != -1)
+    {
+      switch (opt)
+	{
+	case 'r':
+	  sweeps = atoi(optarg);
+	  break;
+	case 'a':
+	  append = true;
+	  break;
+	case 's':
+	  config.start = atof(optarg);
+	  break;
+	case 'i':
+	  config.step = atof(optarg);
+	  break;
+	case 'c':
+	  config.steps = atoi(optarg);
+	  break;
+	case 'x':
+	  extracting = true;
+	  break;
+	case 'n':
+	  index = atol(optarg);
+	  break;
+	case 'b':
+	  bench = true;
+	  break;
+	default:
+	  optind = argc;
+	}
+    }
+  if (optind != argc - 1 || (sweeps > 0) + extracting + bench != 1)
+    {
+      fprintf(stderr, "Usage: %s -r sweeps [-a] [-s start] [-i step] [-c steps] archive\n"
+	      "       %s -x [-n sweep] archive\n"
+	      "       %s -b archive\n", argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  const char *path = argv[optind];
+  if (extracting)
+    {
+      return extract(path, index);
+    }
+  if (bench)
+    {
+      return benchmark(path);
+    }
+  return record(path, config, sweeps, append);
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include <chrono>
+#include <random>
+
+#include "../ad5933.hpp"
+
+// Compares the CSV writer with the fprintf() one it replaced: checks that the
+// files are the same and measures the sweeps and megabytes written per second.
+
+//! write_to_file() as it was, one fprintf() per point.
+static int fprintf_write(const std::vector<std::pair<real_t, real_t>> &mag,
+			 const std::vector<std::pair<real_t, real_t>> &phase,
+			 const std::vector<std::pair<real_t, complex_t>> &adm, const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    {
+      return -1;
+    }
+  fprintf(fp, "%s", CSV_HEADER);
+  for (size_t i = 0; i < mag.size(); ++i)
+    {
+      fprintf(fp, "%Lf,%Lf,%Lf,%Lf,%Lf,%Lf\n",
+	      (long double)mag[i].first, (long double)mag[i].second, (long double)phase[i].second,
+	      (long double)adm[i].second.real(), (long double)adm[i].second.imag(),
+	      (long double)std::abs(adm[i].second));
+    }
+  return fclose(fp);
+}
+
+static std::string slurp(const char *path)
+{
+  std::string text;
+  FILE *fp = fopen(path, "r");
+  char chunk[65536];
+  size_t n;
+  while (fp && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+      text.append(chunk, n);
+    }
+  if (fp)
+    {
+      fclose(fp);
+    }
+  return text;
+}
+
+int main ( int argc, char **argv )
+{
+  int sweeps = 2000;
+  int points = 100;
+  const char *dir = "/tmp";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:d:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  sweeps = atoi(optarg);
+	  break;
+	case 'p':
+	  points = atoi(optarg);
+	  break;
+	case 'd':
+	  dir = optarg;
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-n sweeps] [-p points] [-d directory]\n", argv[0]);
+	  return 1;
+	}
+    }
+
+  // Values like those of a sweep: integer DFT codes, calibrated impedances.
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> code(-32768, 32767);
+  std::vector<std::pair<real_t, real_t>> mag, phase;
+  std::vector<std::pair<real_t, complex_t>> adm;
+  for (int i = 0; i < points; i++)
+    {
+      real_t f = 30000 + 10.5*i;
+      complex_t z(code(rng), code(rng));
+      adm.push_back(std::make_pair(f, z));
+      mag.push_back(std::make_pair(f, 1/(std::abs(z)*1.234e-9)));
+      phase.push_back(std::make_pair(f, std::arg(z)*(180.0/M_PI) - 12.3456789));
+    }
+
+  std::string old_path = std::string(dir) + "/csv_bench_fprintf.csv";
+  std::string new_path = std::string(dir) + "/csv_bench_to_chars.csv";
+  fprintf_write(mag, phase, adm, old_path.c_str());
+  write_to_file(mag, phase, adm, new_path.c_str());
+  std::string expected = slurp(old_path.c_str());
+  if (expected != slurp(new_path.c_str()))
+    {
+      fprintf(stderr, "The files differ\n");
+      return 1;
+    }
+  const double mb = expected.size()*1e-6;
+
+  typedef std::chrono::steady_clock Clock;
+  auto run = [&](const char *name, const std::function<int()> &write)
+    {
+      auto t0 = Clock::now();
+      for (int k = 0; k < sweeps; k++)
+	{
+	  if (write() < 0)
+	    {
+	      perror(name);
+	      exit(1);
+	    }
+	}
+      double s = std::chrono::duration<double>(Clock::now() - t0).count();
+      printf("%-22s %10.0f sweeps/s %8.1f MB/s\n", name, sweeps/s, sweeps*mb/s);
+      return s;
+    };
+  printf("%d sweeps of %d points, %zu bytes each\n", sweeps, points, expected.size());
+  double before = run("fprintf", [&] { return fprintf_write(mag, phase, adm, old_path.c_str()); });
+  double after = run("write_to_file", [&] { return write_to_file(mag, phase, adm, new_path.c_str()); });
+  CsvWriterOptions options;
+  options.path_template = std::string(dir) + "/csv_bench_{sweep}.csv";
+  CsvWriter writer(options);
+  run("CsvWriter", [&] { return writer.write(mag, phase, adm, 0); });
+  options.path_template = std::string(dir) + "/csv_bench_append.csv";
+  options.mode = CsvMode::ROTATE;
+  options.rotate_bytes = 16 << 20;
+  options.rotate_keep = 1;
+  CsvWriter appender(options);
+  unlink(options.path_template.c_str());
+  run("CsvWriter rotate", [&] { return appender.write(mag, phase, adm); });
+  printf("Speedup %.1fx\n", before/after);
+  for (auto p: {old_path, new_path, std::string(dir) + "/csv_bench_0.csv", options.path_template,
+		options.path_template + ".1"})
+    {
+      unlink(p.c_str());
+    }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "../fit.hpp"
+
+// Checks the circuit fit without a board: spectra computed from known
+// parameters must be fitted back to them from a distant start, and initial
+// values the model does not accept must be refused. Exits with 1 if a check
+// fails.
+
+static int failures = 0;
+
+static void check(bool ok, const char *model, const char *what)
+{
+  if (!ok)
+    {
+      printf("FAIL %s: %s\n", model, what);
+      failures++;
+    }
+}
+
+static void check_fit(const char *description, const std::vector<double> &truth, const std::vector<double> &start)
+{
+  CircuitModel model;
+  check(CircuitModel::parse(description, model) == 0, description, "does not parse");
+  if (model.parameters != truth.size())
+    {
+      check(false, description, "wrong number of parameters");
+      return;
+    }
+  // 100 Hz to 100 kHz, logarithmically spaced, like a sweep over all clocks.
+  std::vector<std::pair<double, impedance_t>> data;
+  for (int i = 0; i <= 60; i++)
+    {
+      double f = 100*std::pow(10, i/20.0);
+      data.push_back(std::make_pair(f, model.impedance(2*M_PI*f, truth, nullptr)));
+    }
+  auto result = fit_circuit(model, data, start);
+  check(result.error == 0, description, "error");
+  check(result.converged, description, "did not converge");
+  check(result.chi2 < 1e-12, description, "residuals left");
+  for (size_t k = 0; k < truth.size() && k < result.params.size(); k++)
+    {
+      if (!(std::fabs(result.params[k] - truth[k]) <= 1e-4*std::fabs(truth[k])))
+	{
+	  printf("FAIL %s: parameter %zu is %g instead of %g\n", description, k, result.params[k], truth[k]);
+	  failures++;
+	}
+    }
+}
+
+int main ()
+{
+  check_fit("R-p(R,C)", {100, 1000, 1e-7}, {300, 300, 1e-8});
+  check_fit("R-p(R-W,C)", {50, 800, 2000, 2e-8}, {100, 100, 1000, 1e-7});
+  check_fit("R-p(R,Q)", {100, 1000, 1e-7, 0.85}, {200, 2000, 1e-6, 0.7});
+
+  // The refusals below are expected, do not print them.
+  error_stream = NULL;
+  CircuitModel model;
+  CircuitModel::parse("R-p(R,C)", model);
+  std::vector<std::pair<double, impedance_t>> data = {{1000, impedance_t(100, -10)}};
+  check(fit_circuit(model, data, {100, 1000}).error == EINVAL, "R-p(R,C)", "accepted too few initial values");
+  check(fit_circuit(model, data, {100, 0, 1e-7}).error == EINVAL, "R-p(R,C)", "accepted a zero resistance");
+  check(fit_circuit(model, data, {100, 1000, -1e-7}).error == EINVAL, "R-p(R,C)", "accepted a negative capacitance");
+  check(CircuitModel::parse("R-p(R,", model) == -1, "R-p(R,", "parsed");
+
+  if (failures)
+    {
+      printf("%d check(s) failed\n", failures);
+      return 1;
+    }
+  printf("All fits recovered their circuits\n");
+  return 0;
+}
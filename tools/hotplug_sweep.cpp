@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <atomic>
+#include <future>
+#include <map>
+
+#include "../hotplug.hpp"
+
+// Sweeps every board that is plugged in, over and over, until Ctrl-C. Boards
+// can be plugged in and out meanwhile. With -r the first sweep of a board,
+// with the calibration resistor connected, calibrates it; a board that is
+// plugged back in keeps its calibration.
+
+static std::atomic<bool> stop(false);
+
+//! A sweep in flight on a board.
+struct Pending
+{
+  std::shared_ptr<Board> board;
+  std::future<std::vector<std::pair<real_t, complex_t>>> result;
+};
+
+int main ( int argc, char **argv )
+{
+  SweepConfig config;
+  config.start = 30000;
+  config.step = 1000;
+  config.steps = 50;
+  real_t rcal = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:i:c:r:")) != -1)
+    {
+      switch (opt)
+	{
+	case 's':
+	  config.start = atof(optarg);
+	  break;
+	case 'i':
+	  config.step = atof(optarg);
+	  break;
+	case 'c':
+	  config.steps = atoi(optarg);
+	  break;
+	case 'r':
+	  rcal = atof(optarg);
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-s start] [-i step] [-c steps] [-r rcal]\n", argv[0]);
+	  return 1;
+	}
+    }
+
+  HotplugManager manager;
+  manager.on_attach = [&](const std::shared_ptr<Board> &board)
+    {
+      SweepConfig stored;
+      if (!board->configuration(stored))
+	{
+	  board->set_configuration(config);
+	}
+      printf("Board %d at %s attached, %u time(s)\n", board->number, board->location.c_str(), board->attachments());
+    };
+  manager.on_detach = [](const std::shared_ptr<Board> &board)
+    {
+      printf("Board %d at %s detached\n", board->number, board->location.c_str());
+    };
+  int err = manager.start();
+  if (err)
+    {
+      fprintf(stderr, "%s\n", libusb_strerror(libusb_error(err)));
+      return 1;
+    }
+  signal(SIGINT, [](int) { stop.store(true); });
+
+  std::map<int, Pending> pending;
+  std::map<int, unsigned> sweeps;
+  while (!stop.load())
+    {
+      for (auto &b: manager.boards())
+	{
+	  auto device = b->device();
+	  if (device && !pending.count(b->number))
+	    {
+	      pending[b->number] = Pending{b, device->sweep(config)};
+	    }
+	}
+      for (auto p = pending.begin(); p != pending.end(); )
+	{
+	  if (p->second.result.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready)
+	    {
+	      ++p;
+	      continue;
+	    }
+	  auto &board = p->second.board;
+	  auto adm = p->second.result.get();
+	  std::vector<std::pair<real_t, real_t>> gains, system_phase;
+	  SweepConfig calibrated;
+	  if (adm.size() != config.steps + 1)
+	    {
+	      printf("Board %d: sweep failed after %zu points\n", board->number, adm.size());
+	    }
+	  else if (board->calibration(gains, system_phase, calibrated))
+	    {
+	      real_t sum = 0;
+	      for (const auto &m: calculate_magnitude(adm, gains))
+		{
+		  sum += m.second;
+		}
+	      printf("Board %d: sweep %u, mean |Z| %.1f Ohm\n", board->number, ++sweeps[board->number],
+		     sum/adm.size());
+	    }
+	  else if (rcal > 0)
+	    {
+	      for (const auto &p: adm)
+		{
+		  system_phase.push_back(std::make_pair(p.first, std::arg(p.second)*(180.0/M_PI)));
+		}
+	      board->set_calibration(calibrate_gain(adm, rcal), system_phase, config);
+	      printf("Board %d calibrated\n", board->number);
+	    }
+	  else
+	    {
+	      printf("Board %d: sweep %u, %zu points\n", board->number, ++sweeps[board->number], adm.size());
+	    }
+	  p = pending.erase(p);
+	}
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  for (auto &p: pending)
+    {
+      p.second.result.wait();
+    }
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <memory>
+#include <thread>
+
+#include "../coro.hpp"
+
+// Sweeps every board on the bus, either all on one thread with the coroutine
+// scheduler (default) or with a thread per board (-t), and prints the time,
+// throughput, peak memory and context switches of the run, so that the two
+// can be compared.
+
+struct Job
+{
+  AD5933 *h;
+  uint64_t points = 0;
+  double temperature = 0;
+  // Error that ended the sweeps of the thread mode, or 0.
+  int error = 0;
+};
+
+Task<int> sweep_job(Scheduler &s, Job &job, const SweepConfig &config, int sweeps)
+{
+  for (int k = 0; k < sweeps && !job.h->error; k++)
+    {
+      job.temperature = co_await co_measure_temperature(s, job.h);
+      auto points = co_await co_sweep_frequency<real_t>(s, config.start, config.steps, config.step, job.h);
+      job.points += points.size();
+    }
+  co_return job.h->error;
+}
+
+int main ( int argc, char **argv )
+{
+  SweepConfig config;
+  int sweeps = 1;
+  bool threads = false;
+  long poll_us = 100;
+  const char *trace_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:i:c:p:tT:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  sweeps = atoi(optarg);
+	  break;
+	case 's':
+	  config.start = atof(optarg);
+	  break;
+	case 'i':
+	  config.step = atof(optarg);
+	  break;
+	case 'c':
+	  config.steps = atoi(optarg);
+	  break;
+	case 'p':
+	  poll_us = atol(optarg);
+	  break;
+	case 't':
+	  threads = true;
+	  break;
+	case 'T':
+	  trace_path = optarg;
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-n sweeps] [-s start] [-i step] [-c steps] [-p poll_us] [-t] [-T trace.json]\n", argv[0]);
+	  return 1;
+	}
+    }
+  libusb_context *ctx;
+  if (libusb_init(&ctx))
+    {
+      fprintf(stderr, "Error in initializing libusb library\n");
+      return 1;
+    }
+  log_stream = NULL;
+  int count = count_devices(ctx);
+  if (count <= 0)
+    {
+      fprintf(stderr, "No boards found\n");
+      return 1;
+    }
+  std::vector<std::unique_ptr<AD5933>> boards;
+  std::vector<Job> jobs;
+  for (int i = 0; i < count; i++)
+    {
+      boards.emplace_back(new AD5933(ctx));
+      int err = boards.back()->open(i);
+      if (err)
+	{
+	  fprintf(stderr, "Board %d: %s\n", i, libusb_strerror(libusb_error(err)));
+	  return 1;
+	}
+      boards.back()->configure(config);
+      Job job;
+      job.h = boards.back().get();
+      jobs.push_back(job);
+    }
+
+  auto t0 = std::chrono::steady_clock::now();
+  uint64_t transfers = 0;
+  if (threads)
+    {
+      std::vector<std::thread> pool;
+      for (auto &job: jobs)
+	{
+	  pool.emplace_back([&job, &config, sweeps]()
+	    {
+#ifdef AD5933_TRACING
+	      char name[32];
+	      snprintf(name, sizeof(name), "board %d", job.h->index);
+	      AD5933_TRACE_THREAD(name);
+#endif
+	      for (int k = 0; k < sweeps && !job.error; k++)
+		{
+		  job.error = job.h->read_temperature(job.temperature);
+		  if (!job.error)
+		    {
+		      job.points += sweep_frequency<real_t>(config.start, config.steps, config.step, job.h).size();
+		      job.error = job.h->error;
+		    }
+		}
+	    });
+	}
+      for (size_t i = 0; i < pool.size(); i++)
+	{
+	  pool[i].join();
+	  if (jobs[i].error)
+	    {
+	      fprintf(stderr, "Board %zu: %s\n", i, libusb_strerror(libusb_error(jobs[i].error)));
+	    }
+	}
+    }
+  else
+    {
+      Scheduler s(ctx);
+      s.poll_interval = std::chrono::microseconds(poll_us);
+      std::vector<Task<int>> tasks;
+      for (auto &job: jobs)
+	{
+	  tasks.push_back(sweep_job(s, job, config, sweeps));
+	}
+      for (auto &t: tasks)
+	{
+	  s.spawn(t);
+	}
+      s.run();
+      transfers = s.transfers;
+      for (size_t i = 0; i < tasks.size(); i++)
+	{
+	  if (tasks[i].get())
+	    {
+	      fprintf(stderr, "Board %zu: %s\n", i, libusb_strerror(libusb_error(tasks[i].get())));
+	    }
+	}
+    }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  uint64_t points = 0;
+  for (const auto &job: jobs)
+    {
+      points += job.points;
+    }
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%s: %d boards, %lu points in %.3f s, %.1f points/s\n", threads ? "threads" : "coroutines",
+	 count, static_cast<unsigned long>(points), elapsed, points/elapsed);
+  printf("peak RSS %ld kB, context switches %ld voluntary, %ld involuntary",
+	 usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw);
+  if (!threads)
+    {
+      printf(", %lu transfers", static_cast<unsigned long>(transfers));
+    }
+  printf("\n");
+  if (trace_path && AD5933_TRACE_WRITE(trace_path))
+    {
+      perror(trace_path);
+    }
+  for (auto &b: boards)
+    {
+      b->close();
+    }
+  libusb_exit(ctx);
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+
+#include "../clock_plan.hpp"
+
+// Checks the clock planner without a board: every planned sweep must stay in
+// the range its clock can measure, respect the resolution and the increment
+// limit, and the sweeps must cover the requested range without gaps. The
+// divider ratios are written to a StubGpio. Exits with 1 if a check fails.
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, long double lower, long double upper, long double resolution)
+{
+  if (!ok)
+    {
+      printf("FAIL %Lf-%Lf Hz, resolution %Lf Hz: %s\n", lower, upper, resolution, what);
+      failures++;
+    }
+}
+
+static void check_plan(const ClockPlanner &planner, long double lower, long double upper, long double resolution)
+{
+  auto plan = planner.plan(lower, upper, resolution);
+  check(!plan.empty(), "no plan", lower, upper, resolution);
+  if (plan.empty())
+    {
+      return;
+    }
+  // Tolerance for the rounding of the step.
+  const long double eps = 1e-6 * upper;
+  check(std::fabs(plan.front().config.start - lower) <= eps, "does not start at the lower bound", lower, upper, resolution);
+  const auto &last = plan.back().config;
+  check(std::fabs(last.start + last.steps*last.step - upper) <= eps, "does not end at the upper bound",
+	lower, upper, resolution);
+
+  StubGpio gpio;
+  ClockDivider divider(gpio);
+  long double next = lower;
+  for (const auto &s: plan)
+    {
+      const auto &c = s.config;
+      long double end = c.start + c.steps*c.step;
+      check(c.steps <= planner.max_steps, "too many increments", lower, upper, resolution);
+      check(c.step <= resolution + eps, "step above the resolution", lower, upper, resolution);
+      check(c.start >= lowest_frequency(s.clock.frequency) - eps, "start below the lowest frequency of the clock",
+	    lower, upper, resolution);
+      check(end <= highest_frequency(s.clock.frequency) + eps, "end above the highest frequency of the clock",
+	    lower, upper, resolution);
+      check(end < s.clock.frequency / 32, "end at or above the Nyquist frequency", lower, upper, resolution);
+      check(c.clock == s.clock.source, "config clock differs from the planned clock", lower, upper, resolution);
+      check(c.start - next <= resolution + eps, "gap between sweeps", lower, upper, resolution);
+      check(c.start >= next - eps, "sweeps overlap", lower, upper, resolution);
+      next = end + c.step;
+      if (s.clock.source == Clk::EXT)
+	{
+	  check(planner.has_divider, "external clock without a divider", lower, upper, resolution);
+	  check(c.ext_clk == s.clock.frequency, "ext_clk differs from the clock", lower, upper, resolution);
+	  check(divider.set(s.clock.ratio) == 0, "invalid divider ratio", lower, upper, resolution);
+	  int written = 0;
+	  for (size_t i = 0; i < divider.pins.size(); i++)
+	    {
+	      written |= gpio.levels[divider.pins[i]] << i;
+	    }
+	  check(written == s.clock.ratio, "divider pins do not hold the ratio", lower, upper, resolution);
+	}
+    }
+}
+
+int main ()
+{
+  ClockPlanner planner;
+  planner.has_divider = true;
+  check_plan(planner, 30000, 100000, 100);
+  check_plan(planner, 1000, 100000, 10);
+  check_plan(planner, 200, 5000, 1);
+  check_plan(planner, 200, 100000, 10);
+  check_plan(planner, 100, 100, 1);
+  check_plan(planner, 5000, 6000, 1000);
+
+  // Without the divider only the internal clock is available, which does not
+  // reach below about 1 kHz.
+  ClockPlanner internal;
+  internal.has_divider = false;
+  check_plan(internal, 5000, 100000, 50);
+  check(internal.plan(200, 5000, 1).empty(), "planned below the internal clock without a divider", 200, 5000, 1);
+  for (const auto &o: internal.options())
+    {
+      check(o.source == Clk::INT, "external clock offered without a divider", 0, 0, 0);
+    }
+#ifndef HAVE_WIRINGPI
+  check(!ClockPlanner().has_divider, "divider assumed without wiringPi", 0, 0, 0);
+#endif
+
+  if (failures)
+    {
+      printf("%d check(s) failed\n", failures);
+      return 1;
+    }
+  printf("All clock plans valid\n");
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include "../raw_sweep.hpp"
+
+// Compares the processing functions in float, double and long double on
+// synthetic 16 bit sweeps: the error against long double and the time per
+// sweep of the calibration, magnitude and gain interpolation stages.
+
+//! Synthetic raw sweep of a parallel RC load, as the ADC would report it.
+RawSweep synthetic_sweep(uint32_t points, double r, double c, std::mt19937 &rng)
+{
+  RawSweep raw;
+  raw.clk = 16776000l;
+  raw.start = frequency_code(1000, raw.clk);
+  raw.inc = frequency_code(100000.0/points, raw.clk);
+  std::normal_distribution<double> noise(0, 2);
+  for (uint32_t i = 0; i < points; i++)
+    {
+      double w = 2*M_PI*raw.frequency(i);
+      std::complex<double> y = 1/r + std::complex<double>(0, w*c);
+      y *= 1e8*std::polar(1.0, -0.2);
+      RawPoint p;
+      p.index = i;
+      p.re = std::max(-32768.0, std::min(32767.0, std::round(y.real() + noise(rng))));
+      p.im = std::max(-32768.0, std::min(32767.0, std::round(y.imag() + noise(rng))));
+      raw.points.push_back(p);
+    }
+  return raw;
+}
+
+struct Result
+{
+  double max_error = 0;
+  double ns_per_sweep = 0;
+};
+
+template <typename Real>
+Result run(const std::vector<RawSweep> &cal, const std::vector<RawSweep> &unknown,
+	   const std::vector<std::vector<std::pair<long double, long double>>> &reference, int repeat)
+{
+  Result res;
+  std::vector<std::pair<Real, Real>> mag;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeat; r++)
+    {
+      for (size_t s = 0; s < cal.size(); s++)
+	{
+	  // Calibrate on every other point and interpolate the rest.
+	  auto c = convert_raw<Real>(cal[s]);
+	  std::vector<std::pair<Real, std::complex<Real>>> sparse;
+	  for (size_t i = 0; i < c.size(); i += 2)
+	    {
+	      sparse.push_back(c[i]);
+	    }
+	  auto gains = calc_multigains(c, calibrate_gain(sparse, 10000));
+	  mag = calculate_magnitude(convert_raw<Real>(unknown[s]), gains);
+	  if (r == 0)
+	    {
+	      for (size_t i = 0; i < mag.size(); i++)
+		{
+		  double e = std::abs((mag[i].second - reference[s][i].second)/reference[s][i].second);
+		  res.max_error = std::max(res.max_error, e);
+		}
+	    }
+	}
+    }
+  auto t = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  res.ns_per_sweep = t/(repeat*cal.size());
+  return res;
+}
+
+int main ( int argc, char **argv )
+{
+  int sweeps = argc > 1 ? atoi(argv[1]) : 200;
+  int repeat = argc > 2 ? atoi(argv[2]) : 20;
+  std::mt19937 rng(1);
+  std::vector<RawSweep> cal, unknown;
+  std::vector<std::vector<std::pair<long double, long double>>> reference;
+  for (int s = 0; s < sweeps; s++)
+    {
+      cal.push_back(synthetic_sweep(511, 10000, 1e-10, rng));
+      unknown.push_back(synthetic_sweep(511, 20000 + 100*s, 2e-10, rng));
+    }
+  for (int s = 0; s < sweeps; s++)
+    {
+      auto c = convert_raw<long double>(cal[s]);
+      std::vector<std::pair<long double, std::complex<long double>>> sparse;
+      for (size_t i = 0; i < c.size(); i += 2)
+	{
+	  sparse.push_back(c[i]);
+	}
+      auto gains = calc_multigains(c, calibrate_gain(sparse, 10000));
+      reference.push_back(calculate_magnitude(convert_raw<long double>(unknown[s]), gains));
+    }
+#if defined(__x86_64__)
+  const char *arch = "x86_64";
+#elif defined(__aarch64__)
+  const char *arch = "aarch64";
+#else
+  const char *arch = "other";
+#endif
+  printf("%s, %d sweeps of 511 points, %d repetitions\n", arch, sweeps, repeat);
+  printf("%-12s %14s %14s %8s\n", "precision", "max rel error", "us/sweep", "speedup");
+  auto ld = run<long double>(cal, unknown, reference, repeat);
+  auto d = run<double>(cal, unknown, reference, repeat);
+  auto f = run<float>(cal, unknown, reference, repeat);
+  printf("%-12s %14g %14.2f %8.2f\n", "long double", ld.max_error, ld.ns_per_sweep/1e3, 1.0);
+  printf("%-12s %14g %14.2f %8.2f\n", "double", d.max_error, d.ns_per_sweep/1e3, ld.ns_per_sweep/d.ns_per_sweep);
+  printf("%-12s %14g %14.2f %8.2f\n", "float", f.max_error, f.ns_per_sweep/1e3, ld.ns_per_sweep/f.ns_per_sweep);
+  // The ADC quantization alone is about 1/32768 of full scale.
+  bool ok = d.max_error < 1e-9 && f.max_error < 1e-4;
+  printf("%s\n", ok ? "Accuracy equivalent" : "ACCURACY LOSS");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "../ad5933.hpp"
+#include "../csv_reader.hpp"
+#include "../work_stealing.hpp"
+
+// Recomputes impedance magnitude and phase of sweeps saved by write_to_file()
+// with a new calibration, on all cores. The raw DFT columns of each file are
+// kept; the result goes next to it, or replaces it with -i.
+
+//! State of one worker, on a cache line of its own.
+struct alignas(64) Worker
+{
+  std::vector<std::pair<real_t, complex_t>> adm;
+  uint64_t files = 0;
+  uint64_t failed = 0;
+  uint64_t bytes = 0;
+};
+
+static bool ends_with(const std::string &s, const std::string &suffix)
+{
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+//! Add a file, or the .csv files below a directory that are not results.
+static void collect(const std::string &path, const std::string &suffix, std::vector<std::string> &paths)
+{
+  std::error_code ec;
+  if (!std::filesystem::is_directory(path, ec))
+    {
+      paths.push_back(path);
+      return;
+    }
+  for (const auto &e: std::filesystem::recursive_directory_iterator(path, ec))
+    {
+      std::string name = e.path().string();
+      if (e.is_regular_file() && ends_with(name, ".csv") && (suffix.empty() || !ends_with(name, suffix)))
+	{
+	  paths.push_back(name);
+	}
+    }
+  if (ec)
+    {
+      fprintf(stderr, "%s: %s\n", path.c_str(), ec.message().c_str());
+    }
+}
+
+int main ( int argc, char **argv )
+{
+  const char *calibration = NULL;
+  real_t rcal = 0;
+  unsigned threads = 0;
+  std::string suffix = "_recal.csv";
+  bool in_place = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:j:s:i")) != -1)
+    {
+      switch (opt)
+	{
+	case 'c':
+	  calibration = optarg;
+	  break;
+	case 'r':
+	  rcal = atof(optarg);
+	  break;
+	case 'j':
+	  threads = atoi(optarg);
+	  break;
+	case 's':
+	  suffix = optarg;
+	  break;
+	case 'i':
+	  in_place = true;
+	  break;
+	default:
+	  calibration = NULL;
+	  optind = argc;
+	  break;
+	}
+    }
+  if (calibration == NULL || rcal <= 0 || optind == argc)
+    {
+      fprintf(stderr, "Usage: %s -c calibration.csv -r rcal [-j threads] [-s suffix | -i] file|dir|- ...\n"
+	      "Recomputes magnitude and phase of write_to_file() sweeps from a calibration\n"
+	      "sweep of the resistor rcal. Results go to <name><suffix> (default _recal.csv)\n"
+	      "or, with -i, replace the files. - reads file names from stdin.\n", argv[0]);
+      return 1;
+    }
+
+  std::vector<std::pair<real_t, complex_t>> cal;
+  if (read_sweep_csv(calibration, cal) <= 0)
+    {
+      perror(calibration);
+      return 1;
+    }
+  auto gains = calibrate_gain(cal, rcal);
+  std::vector<std::pair<real_t, real_t>> system_phase;
+  for (const auto &p: cal)
+    {
+      system_phase.push_back(std::make_pair(p.first, std::arg(p.second)*(180.0/M_PI)));
+    }
+
+  std::vector<std::string> paths;
+  for (int i = optind; i < argc; i++)
+    {
+      if (strcmp(argv[i], "-") == 0)
+	{
+	  std::string line;
+	  while (std::getline(std::cin, line))
+	    {
+	      if (!line.empty())
+		{
+		  paths.push_back(line);
+		}
+	    }
+	}
+      else
+	{
+	  collect(argv[i], in_place ? "" : suffix, paths);
+	}
+    }
+
+  WorkStealingPool pool(threads);
+  std::vector<Worker> workers(pool.workers());
+  auto t0 = std::chrono::steady_clock::now();
+  pool.run(paths.size(), [&](size_t index, unsigned w)
+    {
+      Worker &worker = workers[w];
+      const std::string &path = paths[index];
+      MappedFile file;
+      int points = file.open(path.c_str()) < 0 ? -1
+	: parse_sweep_csv(file.data(), file.data() + file.size(), worker.adm);
+      if (points <= 0)
+	{
+	  if (points == 0)
+	    {
+	      errno = EINVAL;
+	    }
+	  fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+	  worker.failed++;
+	  return;
+	}
+      worker.bytes += file.size();
+      file.close();
+      // Sweeps on another grid than the calibration get interpolated gains.
+      const auto &adm = worker.adm;
+      bool same_grid = same_frequencies(adm, gains);
+      auto mag = same_grid ? calculate_magnitude(adm, gains)
+	: calculate_magnitude(adm, calc_multigains(adm, gains));
+      auto system = same_grid ? system_phase : calc_multigains(adm, system_phase);
+      std::vector<std::pair<real_t, real_t>> phase;
+      phase.reserve(adm.size());
+      for (size_t i = 0; i < adm.size(); i++)
+	{
+	  phase.push_back(std::make_pair(adm[i].first, std::arg(adm[i].second)*(180.0/M_PI) - system[i].second));
+	}
+      std::string out = in_place ? path + ".tmp"
+	: (ends_with(path, ".csv") ? path.substr(0, path.size() - 4) : path) + suffix;
+      if (write_to_file(mag, phase, adm, out.c_str()) < 0)
+	{
+	  worker.failed++;
+	  return;
+	}
+      if (in_place && rename(out.c_str(), path.c_str()) < 0)
+	{
+	  fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+	  worker.failed++;
+	  return;
+	}
+      worker.files++;
+    });
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  Worker total;
+  for (const auto &w: workers)
+    {
+      total.files += w.files;
+      total.failed += w.failed;
+      total.bytes += w.bytes;
+    }
+  printf("%lu files, %lu failed, %.3f s on %u threads, %lu steals\n", static_cast<unsigned long>(total.files),
+	 static_cast<unsigned long>(total.failed), seconds, pool.workers(), static_cast<unsigned long>(pool.steals()));
+  if (seconds > 0)
+    {
+      printf("%.0f files/s, %.1f MB/s\n", total.files/seconds, total.bytes/seconds/1e6);
+    }
+  return total.failed ? 1 : 0;
+}
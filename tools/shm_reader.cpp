@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <chrono>
+#include <thread>
+#include "../shm_ring.hpp"
+
+// Example reader of the shared-memory ring of ad5933. Prints every record, or
+// with -q only counts them. Follows the writer when it is restarted.
+int main ( int argc, char **argv )
+{
+  std::string name = "/ad5933";
+  bool quiet = false;
+  bool from_start = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:qa")) != -1)
+    {
+      switch (opt)
+	{
+	case 'n':
+	  name = optarg;
+	  break;
+	case 'q':
+	  quiet = true;
+	  break;
+	case 'a':
+	  from_start = true;
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-n shm_name] [-q] [-a]\n", argv[0]);
+	  return 1;
+	}
+    }
+  ShmRingReader reader;
+  if (reader.attach(name, from_start) == -1)
+    {
+      perror(name.c_str());
+      return 1;
+    }
+  uint64_t points = 0;
+  uint64_t sweeps = 0;
+  unsigned idle = 0;
+  for (;;)
+    {
+      const ShmRecord *r = reader.peek();
+      if (!r)
+	{
+	  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	  // About once a second without records, see if the writer is gone.
+	  if (++idle % 100 == 0 && reader.stale())
+	    {
+	      // A new writer starts from the first record of its ring. Until
+	      // there is one the reader has nothing to read.
+	      while (reader.attach(name, true) == -1)
+		{
+		  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	      fprintf(stderr, "%s: attached to a new ring\n", name.c_str());
+	    }
+	  continue;
+	}
+      idle = 0;
+      bool end = r->flags & SHM_SWEEP_END;
+      if (!quiet)
+	{
+	  if (end)
+	    {
+	      printf("sweep %u done, %u points\n", r->sweep, r->index);
+	    }
+	  else
+	    {
+	      printf("sweep %u point %u: %f Hz %f %f\n", r->sweep, r->index, r->frequency, r->re, r->im);
+	    }
+	}
+      if (!reader.consume())
+	{
+	  fprintf(stderr, "Record overwritten while read\n");
+	  continue;
+	}
+      if (end)
+	{
+	  sweeps++;
+	  if (quiet)
+	    {
+	      printf("%lu sweeps, %lu points, %lu lost\n", (unsigned long)sweeps,
+		     (unsigned long)points, (unsigned long)reader.lost);
+	    }
+	}
+      else
+	{
+	  points++;
+	}
+    }
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "../stream_client.hpp"
+
+// Test client for the live data stream of ad5933. Prints every frame.
+int main ( int argc, char **argv )
+{
+  StreamClient client;
+  int opt;
+  int err = 1;
+  while ((opt = getopt(argc, argv, "u:p:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'u':
+	  err = client.connect_unix(optarg);
+	  break;
+	case 'p':
+	  err = client.connect_tcp(atoi(optarg));
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s -u socket_path | -p tcp_port\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (err)
+    {
+      if (err == -1)
+	{
+	  perror("connect");
+	}
+      else
+	{
+	  fprintf(stderr, "Usage: %s -u socket_path | -p tcp_port\n", argv[0]);
+	}
+      return 1;
+    }
+  Frame f;
+  while (client.next(f) == 0)
+    {
+      if (f.header.type == static_cast<uint16_t>(FrameType::POINT))
+	{
+	  printf("%lu sweep %u point %u: %f Hz %f %f\n", (unsigned long)f.header.seq,
+		 f.point.sweep, f.point.index, f.point.frequency, f.point.re, f.point.im);
+	}
+      else if (f.header.type == static_cast<uint16_t>(FrameType::SWEEP_END))
+	{
+	  printf("%lu sweep %u done, %u points\n", (unsigned long)f.header.seq,
+		 f.end.sweep, f.end.points);
+	}
+    }
+  printf("Connection closed after %lu frames, %lu lost\n",
+	 (unsigned long)client.received, (unsigned long)client.lost_frames);
+  return 0;
+}
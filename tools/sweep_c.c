@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../ad5933_c.h"
+
+/* Example user of the C interface: calibrates with a known resistor, then
+   sweeps the unknown impedance into a caller-provided buffer. */
+int main ( int argc, char **argv )
+{
+  double rcal = argc > 1 ? atof(argv[1]) : 10000;
+  ad5933_device *dev;
+  ad5933_config config;
+  ad5933_point points[512];
+  size_t count, i;
+  double temperature;
+  int err;
+
+  printf("%d device(s)\n", ad5933_count());
+  if ((err = ad5933_open(0, NULL, &dev)) != 0)
+    {
+      fprintf(stderr, "Opening: %s\n", ad5933_strerror(err));
+      return 1;
+    }
+  ad5933_default_config(&config);
+  config.start = 30000;
+  config.steps = 20;
+  config.step = 500;
+  if ((err = ad5933_configure(dev, &config)) != 0
+      || (err = ad5933_temperature(dev, &temperature)) != 0
+      || (err = ad5933_calibrate(dev, rcal)) != 0
+      || (err = ad5933_sweep(dev, points, 512, &count)) != 0)
+    {
+      fprintf(stderr, "%s\n", ad5933_strerror(err));
+      ad5933_close(dev);
+      return 1;
+    }
+  printf("Temperature %f C\n", temperature);
+  for (i = 0; i < count; i++)
+    {
+      printf("%f Hz: %f Ohm, %f deg\n", points[i].frequency, points[i].magnitude, points[i].phase);
+    }
+  ad5933_close(dev);
+  return 0;
+}
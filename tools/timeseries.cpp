@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+#include <thread>
+#include "../timeseries.hpp"
+
+std::atomic<bool> stop(false);
+
+// Samples the impedance at one frequency and writes time, real and imaginary
+// parts to a .csv file. Runs until the sample count is reached or Ctrl-C.
+int main ( int argc, char **argv )
+{
+  SweepConfig config;
+  config.start = 10000;
+  config.settling_cycles = 0;
+  uint64_t samples = 0;
+  const char *path = "timeseries.csv";
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:c:o:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'f':
+	  config.start = atof(optarg);
+	  break;
+	case 'n':
+	  samples = strtoull(optarg, NULL, 10);
+	  break;
+	case 'c':
+	  config.settling_cycles = atoi(optarg);
+	  break;
+	case 'o':
+	  path = optarg;
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s [-f frequency] [-n samples] [-c settling_cycles] [-o file]\n", argv[0]);
+	  return 1;
+	}
+    }
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    {
+      perror(path);
+      return 1;
+    }
+  AD5933 analyzer;
+  TimeSeries series(config, &analyzer);
+  signal(SIGINT, [](int) { stop.store(true); });
+
+  std::atomic<bool> done(false);
+  std::thread writer([&]()
+    {
+      TimedSample s;
+      int64_t t0 = -1;
+      fprintf(fp, "Time,Real,Imaginary\n");
+      for (;;)
+	{
+	  if (!series.buffer.try_pop(s))
+	    {
+	      if (!done.load())
+		{
+		  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		  continue;
+		}
+	      // The acquisition ended: write what it pushed last, then stop.
+	      if (!series.buffer.try_pop(s))
+		{
+		  break;
+		}
+	    }
+	  if (t0 < 0)
+	    {
+	      t0 = s.t;
+	    }
+	  fprintf(fp, "%.9f,%d,%d\n", (s.t - t0)*1e-9, s.re, s.im);
+	}
+    });
+  int err = series.run(samples, &stop);
+  done.store(true);
+  writer.join();
+  fclose(fp);
+  if (err)
+    {
+      fprintf(stderr, "Acquisition failed: %s\n", libusb_strerror(libusb_error(err)));
+    }
+  const auto &st = series.statistics();
+  printf("%lu samples in %f s, %lu dropped\n", static_cast<unsigned long>(st.samples), st.elapsed,
+	 static_cast<unsigned long>(st.dropped));
+  printf("Rate %f samples/s (conversion limit %f), jitter %f ms, max interval %f ms, %f polls/sample\n",
+	 st.rate(), 1/series.conversion_time(), st.jitter*1e3, st.max_interval*1e3, st.polls);
+  return err ? 1 : 0;
+}
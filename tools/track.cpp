@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include "../tracking.hpp"
+
+std::atomic<bool> stop(false);
+
+// Tracks a few frequencies and writes one row per cycle to a .csv file: the
+// time, real and imaginary part at every frequency. Runs until the cycle
+// count is reached or Ctrl-C.
+int main ( int argc, char **argv )
+{
+  SweepConfig config;
+  config.settling_cycles = 0;
+  std::vector<long double> frequencies;
+  TrackingOptions options;
+  options.store = false;
+  uint64_t cycles = 0;
+  const char *path = "tracking.csv";
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:c:s:o:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'f':
+	  for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+	    {
+	      frequencies.push_back(atof(tok));
+	    }
+	  break;
+	case 'n':
+	  cycles = strtoull(optarg, NULL, 10);
+	  break;
+	case 'c':
+	  config.settling_cycles = atoi(optarg);
+	  break;
+	case 's':
+	  options.settle = std::chrono::microseconds(atoi(optarg));
+	  break;
+	case 'o':
+	  path = optarg;
+	  break;
+	default:
+	  fprintf(stderr, "Usage: %s -f f1,f2,... [-n cycles] [-c settling_cycles] [-s settle_us] [-o file]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (frequencies.empty())
+    {
+      fprintf(stderr, "No frequencies given (-f)\n");
+      return 1;
+    }
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    {
+      perror(path);
+      return 1;
+    }
+  AD5933 analyzer;
+  FrequencyTracker tracker(config, frequencies, &analyzer, options);
+  signal(SIGINT, [](int) { stop.store(true); });
+
+  fprintf(fp, "Cycle");
+  for (auto f: frequencies)
+    {
+      fprintf(fp, ",Time %Lf,Real %Lf,Imaginary %Lf", f, f, f);
+    }
+  fprintf(fp, "\n");
+  int64_t t0 = -1;
+  tracker.on_cycle = [&](uint64_t cycle, const std::vector<TimedSample> &samples)
+    {
+      if (t0 < 0)
+	{
+	  t0 = samples[0].t;
+	}
+      fprintf(fp, "%lu", static_cast<unsigned long>(cycle));
+      for (const auto &s: samples)
+	{
+	  fprintf(fp, ",%.9f,%d,%d", (s.t - t0)*1e-9, s.re, s.im);
+	}
+      fprintf(fp, "\n");
+    };
+  int err = tracker.run(cycles, &stop);
+  fclose(fp);
+  if (err)
+    {
+      fprintf(stderr, "Acquisition failed: %s\n", libusb_strerror(libusb_error(err)));
+    }
+  for (const auto &st: tracker.statistics())
+    {
+      printf("%Lf Hz: %lu samples, %f samples/s\n", st.frequency, static_cast<unsigned long>(st.samples), st.rate());
+    }
+  return err ? 1 : 0;
+}
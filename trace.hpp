@@ -0,0 +1,233 @@
+/*! \file
+  Timeline tracing in the Chrome trace event format.
+
+  Built with -DAD5933_TRACING (make TRACE=1), the library records a timed
+  event for the device setup, every register transfer, the status polls,
+  sleeps, points, calibration math and file writes. trace_write() saves them
+  as JSON that Perfetto (ui.perfetto.dev) and chrome://tracing open, one
+  track per thread, so stalls and the overlap between boards show on one
+  timeline.
+
+  Every thread records into its own buffer, which only that thread writes,
+  so recording takes no lock; trace_write() reads the buffers of all threads
+  while they keep recording. A full buffer drops further events.
+
+  Without AD5933_TRACING the macros expand to nothing and their arguments
+  are not evaluated.
+*/
+#pragma once
+
+#ifdef AD5933_TRACING
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//! Events each thread can record.
+const size_t TRACE_BUFFER_EVENTS = 1 << 18;
+//! Tracks from this on belong to boards rather than threads, see trace_event().
+const int TRACE_BOARD_TRACK = 1000;
+
+//! A complete event, one slice on the timeline.
+struct TraceEvent
+{
+  //! String literal.
+  const char *name;
+  //! Name of the argument, a string literal, or NULL if there is none.
+  const char *arg_name;
+  int64_t arg;
+  //! steady_clock time in nanoseconds.
+  int64_t begin;
+  int64_t end;
+  //! Track the event is shown on, 0 for that of the recording thread.
+  int track;
+};
+
+//! The events of one thread.
+struct TraceBuffer
+{
+  std::unique_ptr<TraceEvent[]> events{new TraceEvent[TRACE_BUFFER_EVENTS]};
+  //! Events written. Stored after the event, so readers see complete ones.
+  std::atomic<size_t> count{0};
+  std::atomic<uint64_t> dropped{0};
+  //! Track of the thread.
+  int track;
+  //! Set by trace_thread_name().
+  char name[32] = "";
+
+  void add(const TraceEvent &event)
+  {
+    size_t n = count.load(std::memory_order_relaxed);
+    if (n == TRACE_BUFFER_EVENTS)
+      {
+	dropped.fetch_add(1, std::memory_order_relaxed);
+	return;
+      }
+    events[n] = event;
+    count.store(n + 1, std::memory_order_release);
+  }
+};
+
+//! Buffers of every thread that recorded. They live until the program ends,
+//! so that events outlive their threads.
+struct TraceRegistry
+{
+  std::mutex lock;
+  std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+inline TraceRegistry& trace_registry()
+{
+  static TraceRegistry registry;
+  return registry;
+}
+
+//! The buffer of the calling thread, registered on first use.
+inline TraceBuffer& trace_buffer()
+{
+  thread_local TraceBuffer *buffer = nullptr;
+  if (buffer == nullptr)
+    {
+      auto &r = trace_registry();
+      std::lock_guard<std::mutex> guard(r.lock);
+      r.buffers.emplace_back(new TraceBuffer);
+      buffer = r.buffers.back().get();
+      buffer->track = r.buffers.size();
+    }
+  return *buffer;
+}
+
+//! Time stamp of events.
+inline int64_t trace_now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//! Record an event with explicit times.
+/*! \param track 0 for the track of the calling thread, or TRACE_BOARD_TRACK
+  plus the board index for work of a board that is not tied to one thread,
+  e.g. the asynchronous transfers of coro.hpp. */
+inline void trace_event(const char *name, int64_t begin, int64_t end, int track = 0,
+			const char *arg_name = nullptr, int64_t arg = 0)
+{
+  trace_buffer().add(TraceEvent{name, arg_name, arg, begin, end, track});
+}
+
+//! Name the track of the calling thread.
+inline void trace_thread_name(const char *name)
+{
+  auto &b = trace_buffer();
+  strncpy(b.name, name, sizeof(b.name) - 1);
+}
+
+//! Records the time from its construction to its destruction.
+class TraceScope
+{
+public:
+  explicit TraceScope(const char *name, const char *arg_name = nullptr, int64_t arg = 0)
+    : name(name), arg_name(arg_name), arg(arg), begin(trace_now())
+  {
+  }
+
+  ~TraceScope()
+  {
+    trace_event(name, begin, trace_now(), 0, arg_name, arg);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const char *name;
+  const char *arg_name;
+  int64_t arg;
+  int64_t begin;
+};
+
+//! Write the events recorded so far as Chrome trace JSON.
+/*! \return 0, or -1 with errno set. */
+inline int trace_write(const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    {
+      return -1;
+    }
+  auto &r = trace_registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  uint64_t dropped = 0;
+  std::vector<bool> boards;
+  const char *sep = "";
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (const auto &b: r.buffers)
+    {
+      size_t n = b->count.load(std::memory_order_acquire);
+      dropped += b->dropped.load(std::memory_order_relaxed);
+      if (b->name[0])
+	{
+	  fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		  sep, b->track, b->name);
+	  sep = ",\n";
+	}
+      for (size_t i = 0; i < n; i++)
+	{
+	  const TraceEvent &e = b->events[i];
+	  int track = e.track ? e.track : b->track;
+	  if (track >= TRACE_BOARD_TRACK)
+	    {
+	      size_t board = track - TRACE_BOARD_TRACK;
+	      if (boards.size() <= board)
+		{
+		  boards.resize(board + 1);
+		}
+	      boards[board] = true;
+	    }
+	  fprintf(fp, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+		  sep, e.name, track, e.begin*1e-3, (e.end - e.begin)*1e-3);
+	  if (e.arg_name)
+	    {
+	      fprintf(fp, ",\"args\":{\"%s\":%lld}", e.arg_name, static_cast<long long>(e.arg));
+	    }
+	  fprintf(fp, "}");
+	  sep = ",\n";
+	}
+    }
+  for (size_t i = 0; i < boards.size(); i++)
+    {
+      if (boards[i])
+	{
+	  fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"board %zu\"}}",
+		  sep, static_cast<int>(TRACE_BOARD_TRACK + i), i);
+	  sep = ",\n";
+	}
+    }
+  fprintf(fp, "\n],\"otherData\":{\"dropped\":%llu}}\n", static_cast<unsigned long long>(dropped));
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+#define AD5933_TRACE_CONCAT2(a, b) a##b
+#define AD5933_TRACE_CONCAT(a, b) AD5933_TRACE_CONCAT2(a, b)
+//! Record the rest of the enclosing scope as an event.
+#define AD5933_TRACE(name) TraceScope AD5933_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+//! Same, with one integer argument shown with the event.
+#define AD5933_TRACE_ARG(name, arg_name, arg) \
+  TraceScope AD5933_TRACE_CONCAT(trace_scope_, __LINE__)(name, arg_name, arg)
+//! Name the track of the calling thread.
+#define AD5933_TRACE_THREAD(name) trace_thread_name(name)
+//! Save the trace, see trace_write().
+#define AD5933_TRACE_WRITE(path) trace_write(path)
+
+#else
+
+#define AD5933_TRACE(name) ((void)0)
+#define AD5933_TRACE_ARG(name, arg_name, arg) ((void)0)
+#define AD5933_TRACE_THREAD(name) ((void)0)
+#define AD5933_TRACE_WRITE(path) 0
+
+#endif
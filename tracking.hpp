@@ -0,0 +1,188 @@
+/*! \file */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+#include "timeseries.hpp"
+
+//! Settings of a tracking run.
+struct TrackingOptions
+{
+  //! Time the excitation is given to settle after moving to a frequency,
+  //! before the conversion is started. The settling cycles of the
+  //! configuration come on top of it.
+  std::chrono::microseconds settle{1000};
+  //! Keep the samples in FrequencyTracker::series.
+  bool store = true;
+};
+
+//! Timing of one tracked frequency.
+struct TrackingStats
+{
+  long double frequency = 0;
+  uint64_t samples = 0;
+  //! Seconds from the first to the last sample.
+  double elapsed = 0;
+
+  //! Effective samples per second at this frequency.
+  double rate() const
+  {
+    return elapsed > 0 && samples > 1 ? (samples - 1)/elapsed : 0;
+  }
+};
+
+//! Tracks a few frequencies over time.
+/*! Cycles through the frequency set, measuring one point at each. Moving to
+  the next frequency writes only the bytes of the start frequency register
+  that differ from what the register holds, then goes through standby,
+  initialize and start as the data sheet requires. No other register is
+  touched after the first cycle, and register writes are not verified.
+
+  Every cycle yields one sample per frequency, so series[k][n] is the n-th
+  sample of frequency k and samples with the same n belong together. */
+class FrequencyTracker
+{
+public:
+  //! Called after every cycle with its samples, one per frequency.
+  std::function<void(uint64_t cycle, const std::vector<TimedSample> &samples)> on_cycle;
+  //! Samples per frequency, if TrackingOptions::store is set.
+  std::vector<std::vector<TimedSample>> series;
+
+  //! Prepare a tracker.
+  /*!
+    \param config Analog settings. The frequencies of the configuration are not used.
+    \param frequencies The frequencies to track, in Hz.
+    \param h Handle to the device object.
+    \param options Settling and storage.
+  */
+  FrequencyTracker(const SweepConfig &config, const std::vector<long double> &frequencies, AD5933 *h,
+		   const TrackingOptions &options = TrackingOptions())
+    : config(config), frequencies(frequencies), h(h), options(options)
+  {
+  }
+
+  //! Run cycles.
+  /*!
+    \param cycles Number of cycles, 0 to run until stop is set.
+    \param stop Checked between cycles.
+    \return 0 or a libusb_error code.
+  */
+  int run(uint64_t cycles, const std::atomic<bool> *stop = nullptr)
+  {
+    h->configure(config);
+    std::vector<uint32_t> codes;
+    for (auto f: frequencies)
+      {
+	codes.push_back(frequency_code(f, h->clk));
+      }
+    series.assign(frequencies.size(), std::vector<TimedSample>());
+    stats.assign(frequencies.size(), TrackingStats());
+    for (size_t k = 0; k < frequencies.size(); k++)
+      {
+	stats[k].frequency = codes[k] * ((h->clk/4) / (1<<27));
+      }
+    h->set_frequency_step(0);
+    h->set_step_number(0);
+    h->set_starting_frequency(0);
+    current = 0;
+
+    bool verify = h->verify_writes;
+    h->verify_writes = false;
+    std::vector<TimedSample> cycle_samples(frequencies.size());
+    std::vector<int64_t> first(frequencies.size());
+    int err = 0;
+    uint64_t cycle = 0;
+    while (err >= 0 && !codes.empty() && (cycles == 0 || cycle < cycles) && !(stop && stop->load()))
+      {
+	for (size_t k = 0; k < codes.size() && err >= 0; k++)
+	  {
+	    err = measure_at(codes[k], cycle_samples[k]);
+	  }
+	if (err < 0)
+	  {
+	    break;
+	  }
+	for (size_t k = 0; k < codes.size(); k++)
+	  {
+	    auto &st = stats[k];
+	    if (st.samples == 0)
+	      {
+		first[k] = cycle_samples[k].t;
+	      }
+	    st.samples++;
+	    st.elapsed = (cycle_samples[k].t - first[k])*1e-9;
+	    if (options.store)
+	      {
+		series[k].push_back(cycle_samples[k]);
+	      }
+	  }
+	if (on_cycle)
+	  {
+	    on_cycle(cycle, cycle_samples);
+	  }
+	cycle++;
+      }
+    h->verify_writes = verify;
+    h->set_standby();
+    return err < 0 ? err : 0;
+  }
+
+  //! Timing per frequency of the last run.
+  const std::vector<TrackingStats>& statistics() const
+  {
+    return stats;
+  }
+
+private:
+  //! Move to a frequency and measure one point there.
+  int measure_at(uint32_t code, TimedSample &s)
+  {
+    const uint8_t regs[3] = {FREQ_23_16, FREQ_15_8, FREQ_7_0};
+    DeadlineScope deadline(h, sweep_budget(code*((h->clk/4) / (1<<27)), 0, h->clk, settling_periods(h)), "tracking");
+    int err;
+    for (int i = 0; i < 3; i++)
+      {
+	int shift = 16 - 8*i;
+	uint8_t byte = (code >> shift) & 0xff;
+	if (byte != ((current >> shift) & 0xff) && (err = h->write_register(byte, regs[i])) < 0)
+	  {
+	    return err;
+	  }
+      }
+    current = code;
+    if ((err = h->set_mode(SB_MODE)) < 0 || (err = h->set_mode(INIT_START_FREQ)) < 0)
+      {
+	return err;
+      }
+    std::this_thread::sleep_for(options.settle);
+    if ((err = h->set_mode(START_FREQ_SWEEP)) < 0)
+      {
+	return err;
+      }
+    uint8_t sreg = 0;
+    do
+      {
+	err = h->read_status(sreg);
+      }
+    while (err >= 0 && !(sreg & SREG_IMPED_VALID));
+    if (err < 0)
+      {
+	return err;
+      }
+    s.t = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+    return h->read_raw(s.re, s.im);
+  }
+
+  SweepConfig config;
+  std::vector<long double> frequencies;
+  AD5933 *h;
+  TrackingOptions options;
+  std::vector<TrackingStats> stats;
+  //! Contents of the start frequency register.
+  uint32_t current = 0;
+};
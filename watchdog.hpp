@@ -0,0 +1,148 @@
+/*! \file
+  Supervision of the deadlines of device operations.
+
+  Sweeps and temperature measurements run under a DeadlineScope, and every
+  register transfer ends by the deadline, so an operation on a board that
+  stops answering fails with LIBUSB_ERROR_TIMEOUT instead of hanging. An
+  operation that is still running well after its deadline is stuck
+  elsewhere: in a callback, a sleep, or a transfer that ignores its timeout.
+  A Watchdog thread looks for those, reports them and aborts them, so that
+  they and the operations they are part of fail at their next transfer.
+*/
+#pragma once
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ad5933.hpp"
+
+//! An operation the Watchdog found overdue.
+struct OverdueReport
+{
+  //! AD5933::index of the board.
+  int index;
+  //! Name the operation was given in its DeadlineScope.
+  const char *operation;
+  //! Time past the deadline when it was found.
+  std::chrono::nanoseconds overdue;
+};
+
+//! Thread that reports and aborts operations overrunning their deadline.
+class Watchdog
+{
+public:
+  //! Called on the watchdog thread for every overdue operation, after it
+  //! was aborted. Must not call watch() or unwatch().
+  std::function<void(const OverdueReport&)> on_overdue;
+  //! Time past the deadline before an operation counts as overdue.
+  std::chrono::nanoseconds grace = std::chrono::seconds(1);
+
+  //! \param period Time between the checks of the devices.
+  explicit Watchdog(std::chrono::milliseconds period = std::chrono::milliseconds(100))
+    : period(period)
+  {
+  }
+
+  ~Watchdog()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (worker.joinable())
+      {
+	worker.join();
+      }
+  }
+
+  Watchdog(const Watchdog&) = delete;
+  Watchdog& operator=(const Watchdog&) = delete;
+
+  //! Supervise a device. The first call starts the thread, so on_overdue
+  //! and grace are to be set before.
+  void watch(AD5933 *h)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (std::find(devices.begin(), devices.end(), h) == devices.end())
+      {
+	devices.push_back(h);
+      }
+    if (!worker.joinable())
+      {
+	worker = std::thread(&Watchdog::run, this);
+      }
+  }
+
+  //! Stop supervising a device. The watchdog does not touch it once this
+  //! returns, so it can be destroyed.
+  void unwatch(AD5933 *h)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    devices.erase(std::remove(devices.begin(), devices.end(), h), devices.end());
+  }
+
+  //! Operations found overdue so far.
+  uint64_t overdue() const
+  {
+    return count.load();
+  }
+
+private:
+  void run()
+  {
+    AD5933_TRACE_THREAD("watchdog");
+    std::vector<OverdueReport> reports;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!cv.wait_for(lock, period, [this] { return stopping; }))
+      {
+	int64_t now = deadline_now();
+	for (AD5933 *h: devices)
+	  {
+	    int64_t d = h->deadline.load();
+	    // Aborted operations were reported already.
+	    if (d == NO_DEADLINE || d == ABORTED_DEADLINE || now - d < grace.count())
+	      {
+		continue;
+	      }
+	    const char *name = h->operation.load();
+	    if (h->abort_operation(d))
+	      {
+		reports.push_back(OverdueReport{h->index, name ? name : "operation", std::chrono::nanoseconds(now - d)});
+	      }
+	  }
+	if (reports.empty())
+	  {
+	    continue;
+	  }
+	count += reports.size();
+	lock.unlock();
+	for (const auto &r: reports)
+	  {
+	    log_error("Board %d: %s overdue by %.3f s, aborted\n", r.index, r.operation,
+		      std::chrono::duration<double>(r.overdue).count());
+	    if (on_overdue)
+	      {
+		on_overdue(r);
+	      }
+	  }
+	reports.clear();
+	lock.lock();
+      }
+  }
+
+  const std::chrono::milliseconds period;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<AD5933*> devices;
+  bool stopping = false;
+  std::atomic<uint64_t> count{0};
+  std::thread worker;
+};
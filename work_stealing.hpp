@@ -0,0 +1,138 @@
+/*! \file */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//! Runs a loop over indices on several threads with work stealing.
+/*! The indices are split into one contiguous range per worker. A worker
+  takes its indices from the front of its range; when it runs out it
+  steals the back half of the largest range left. Items of very different
+  cost, such as files of different length, thus keep every core busy to the
+  end, while workers that keep up only touch their own range. */
+class WorkStealingPool
+{
+public:
+  //! \param threads Number of workers, 0 for one per core.
+  explicit WorkStealingPool(unsigned threads = 0)
+    : threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+  {
+  }
+
+  //! Call f(index, worker) for every index in [0, count).
+  /*! Returns when all calls returned. worker is in [0, workers()), so it can
+    select per-thread state. f must not throw. */
+  template <typename F>
+  void run(size_t count, F &&f)
+  {
+    unsigned n = std::max<size_t>(1, std::min<size_t>(threads, count));
+    std::unique_ptr<Range[]> ranges(new Range[n]);
+    for (unsigned w = 0; w < n; w++)
+      {
+	ranges[w].begin = count*w/n;
+	ranges[w].end = count*(w + 1)/n;
+      }
+    steal_count.store(0);
+    auto work = [&](unsigned w)
+      {
+	size_t i;
+	while (take(ranges[w], i) || steal(ranges.get(), n, w, i))
+	  {
+	    f(i, w);
+	  }
+      };
+    std::vector<std::thread> workers;
+    for (unsigned w = 1; w < n; w++)
+      {
+	workers.emplace_back(work, w);
+      }
+    work(0);
+    for (auto &t: workers)
+      {
+	t.join();
+      }
+  }
+
+  //! Upper bound of the worker argument of run().
+  unsigned workers() const
+  {
+    return threads;
+  }
+
+  //! Ranges stolen during the last run().
+  uint64_t steals() const
+  {
+    return steal_count.load();
+  }
+
+private:
+  //! The indices left to a worker, on a cache line of its own.
+  struct alignas(64) Range
+  {
+    std::mutex lock;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  static bool take(Range &r, size_t &i)
+  {
+    std::lock_guard<std::mutex> guard(r.lock);
+    if (r.begin == r.end)
+      {
+	return false;
+      }
+    i = r.begin++;
+    return true;
+  }
+
+  //! Move the back half of the largest other range to worker w and take
+  //! its first index.
+  bool steal(Range *ranges, unsigned n, unsigned w, size_t &i)
+  {
+    for (;;)
+      {
+	unsigned victim = n;
+	size_t most = 0;
+	for (unsigned v = 0; v < n; v++)
+	  {
+	    std::lock_guard<std::mutex> guard(ranges[v].lock);
+	    if (v != w && ranges[v].end - ranges[v].begin > most)
+	      {
+		most = ranges[v].end - ranges[v].begin;
+		victim = v;
+	      }
+	  }
+	if (victim == n)
+	  {
+	    return false;
+	  }
+	size_t first, last;
+	{
+	  std::lock_guard<std::mutex> guard(ranges[victim].lock);
+	  Range &r = ranges[victim];
+	  if (r.begin == r.end)
+	    {
+	      // Taken in the meantime, look again.
+	      continue;
+	    }
+	  last = r.end;
+	  // A single index left moves whole.
+	  first = r.end = r.begin + (r.end - r.begin)/2;
+	}
+	// Our range is empty and only we refill it, so thieves that look at
+	// it in between just see no work.
+	std::lock_guard<std::mutex> guard(ranges[w].lock);
+	ranges[w].begin = first + 1;
+	ranges[w].end = last;
+	steal_count.fetch_add(1, std::memory_order_relaxed);
+	i = first;
+	return true;
+      }
+  }
+
+  unsigned threads;
+  std::atomic<uint64_t> steal_count{0};
+};